@@ -0,0 +1,609 @@
+#include "AnimationExporter.h"
+#include "Parallel.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QThread>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    // 15-bit RGB, the resolution of the palette lookup
+    int binOf(QRgb color) { return (qRed(color) >> 3) << 10 | (qGreen(color) >> 3) << 5 | qBlue(color) >> 3; }
+    int channelOf(int bin, int channel) { return (bin >> (10 - 5 * channel)) & 31; }
+
+    struct Palette
+    {
+        QRgb colors[256] = {};
+        std::vector<uchar> lookup; // nearest color of every bin
+
+        uchar index(QRgb color) const { return lookup[binOf(color)]; }
+    };
+
+    // Median cut of the scene's colors into 255 entries, the last one is the
+    // background that fills whatever the transforms uncover
+    Palette medianCut(const QImage &scene, QRgb background)
+    {
+        const QImage rgb = scene.convertToFormat(QImage::Format_RGB32);
+        std::vector<quint32> histogram(1 << 15, 0);
+        for (int y = 0; y < rgb.height(); y++)
+        {
+            const QRgb *line = reinterpret_cast<const QRgb *>(rgb.constScanLine(y));
+            for (int x = 0; x < rgb.width(); x++)
+                histogram[binOf(line[x])]++;
+        }
+
+        struct Entry
+        {
+            int bin;
+            quint32 count;
+        };
+        std::vector<Entry> entries;
+        for (int bin = 0; bin < (int)histogram.size(); bin++)
+        {
+            if (histogram[bin] > 0)
+                entries.push_back({bin, histogram[bin]});
+        }
+
+        struct Box
+        {
+            int begin, end;
+            quint64 count;
+        };
+        std::vector<Box> boxes = {{0, (int)entries.size(), (quint64)rgb.width() * rgb.height()}};
+        while (boxes.size() < 255)
+        {
+            // The most populous box that still holds more than one color
+            int chosen = -1;
+            for (int i = 0; i < (int)boxes.size(); i++)
+            {
+                if (boxes[i].end - boxes[i].begin > 1 && (chosen < 0 || boxes[i].count > boxes[chosen].count))
+                    chosen = i;
+            }
+            if (chosen < 0)
+                break;
+
+            const Box box = boxes[chosen];
+            int low[3] = {31, 31, 31}, high[3] = {0, 0, 0};
+            for (int i = box.begin; i < box.end; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    low[c] = std::min(low[c], channelOf(entries[i].bin, c));
+                    high[c] = std::max(high[c], channelOf(entries[i].bin, c));
+                }
+            }
+            int axis = 0;
+            for (int c = 1; c < 3; c++)
+            {
+                if (high[c] - low[c] > high[axis] - low[axis])
+                    axis = c;
+            }
+            std::sort(entries.begin() + box.begin, entries.begin() + box.end, [axis](const Entry &a, const Entry &b)
+                      { return channelOf(a.bin, axis) < channelOf(b.bin, axis); });
+
+            // At the median pixel, each half keeps at least one color
+            quint64 below = 0;
+            int split = box.begin + 1;
+            for (int i = box.begin; i < box.end - 1; i++)
+            {
+                below += entries[i].count;
+                split = i + 1;
+                if (below * 2 >= box.count)
+                    break;
+            }
+            boxes[chosen] = {box.begin, split, below};
+            boxes.push_back({split, box.end, box.count - below});
+        }
+
+        Palette palette;
+        int size = 0;
+        for (const Box &box : boxes)
+        {
+            quint64 sum[3] = {0, 0, 0};
+            for (int i = box.begin; i < box.end; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                    sum[c] += (quint64)(channelOf(entries[i].bin, c) << 3 | 4) * entries[i].count;
+            }
+            if (box.count > 0)
+                palette.colors[size++] = qRgb(sum[0] / box.count, sum[1] / box.count, sum[2] / box.count);
+        }
+        palette.colors[size++] = background;
+
+        palette.lookup.resize(1 << 15);
+        Parallel::forRows(0, 1 << 15, [&](int first, int last)
+                          {
+            for (int bin = first; bin < last; bin++)
+            {
+                const int r = channelOf(bin, 0) << 3 | 4, g = channelOf(bin, 1) << 3 | 4, b = channelOf(bin, 2) << 3 | 4;
+                int nearest = 0, best = INT_MAX;
+                for (int i = 0; i < size; i++)
+                {
+                    const int dr = qRed(palette.colors[i]) - r, dg = qGreen(palette.colors[i]) - g, db = qBlue(palette.colors[i]) - b;
+                    const int distance = dr * dr + dg * dg + db * db;
+                    if (distance < best)
+                    {
+                        best = distance;
+                        nearest = i;
+                    }
+                }
+                palette.lookup[bin] = (uchar)nearest;
+            } }, 1024);
+        return palette;
+    }
+
+    void appendWord(QByteArray &out, int value)
+    {
+        out.append((char)(value & 0xff));
+        out.append((char)(value >> 8));
+    }
+
+    // Screen descriptor, global palette and the extension that loops the animation
+    QByteArray gifHeader(QSize size, const Palette &palette)
+    {
+        QByteArray out("GIF89a");
+        appendWord(out, size.width());
+        appendWord(out, size.height());
+        out.append((char)0xf7); // global color table of 256 entries, 8 bits per channel
+        out.append((char)0);    // background color index
+        out.append((char)0);    // square pixels
+        for (QRgb color : palette.colors)
+        {
+            out.append((char)qRed(color));
+            out.append((char)qGreen(color));
+            out.append((char)qBlue(color));
+        }
+        out.append("\x21\xff\x0bNETSCAPE2.0\x03\x01", 16);
+        appendWord(out, 0); // forever
+        out.append((char)0);
+        return out;
+    }
+
+    // Codes packed from the least significant bit up, in sub-blocks of at most 255 bytes
+    class CodeWriter
+    {
+    public:
+        explicit CodeWriter(QByteArray &out) : out(out) {}
+
+        void write(int code, int size)
+        {
+            buffer |= (quint32)code << bits;
+            bits += size;
+            while (bits >= 8)
+            {
+                block[length++] = (char)(buffer & 0xff);
+                buffer >>= 8;
+                bits -= 8;
+                if (length == 255)
+                    flush();
+            }
+        }
+        void finish()
+        {
+            if (bits > 0)
+                block[length++] = (char)buffer;
+            flush();
+            out.append((char)0);
+        }
+
+    private:
+        QByteArray &out;
+        quint32 buffer = 0;
+        int bits = 0;
+        char block[255];
+        int length = 0;
+
+        void flush()
+        {
+            if (length == 0)
+                return;
+            out.append((char)length);
+            out.append(block, length);
+            length = 0;
+        }
+    };
+
+    // LZW over 8-bit indices with variable code sizes up to 12 bits, the
+    // dictionary starts over once it holds 4096 codes
+    void compress(const uchar *indices, qint64 count, QByteArray &out)
+    {
+        const int clear = 256, end = 257;
+        out.append((char)8);
+        CodeWriter writer(out);
+        // Code of the string of code followed by an index at code * 256 + index, 0 for none yet.
+        // A reset zeroes only the entries set since the last one.
+        std::vector<quint16> children((size_t)4096 * 256, 0);
+        std::vector<quint32> set;
+        set.reserve(4096);
+        int code_size = 9, last_code = end;
+        // The decoder adds a code for every code it reads, wider codes follow once it needs them
+        auto added = [&]()
+        {
+            if (++last_code >= (1 << code_size))
+                code_size++;
+        };
+        writer.write(clear, code_size);
+
+        int current = -1;
+        for (qint64 i = 0; i < count; i++)
+        {
+            const uchar next = indices[i];
+            if (current < 0)
+            {
+                current = next;
+                continue;
+            }
+            quint16 &child = children[(size_t)current * 256 + next];
+            if (child != 0)
+            {
+                current = child;
+                continue;
+            }
+            writer.write(current, code_size);
+            child = (quint16)(last_code + 1);
+            set.push_back((quint32)(&child - children.data()));
+            added();
+            if (last_code == 4095)
+            {
+                writer.write(clear, code_size);
+                for (quint32 index : set)
+                    children[index] = 0;
+                set.clear();
+                code_size = 9;
+                last_code = end;
+            }
+            current = next;
+        }
+        if (current >= 0)
+        {
+            writer.write(current, code_size);
+            // The trailing codes are read at the width the last data code left the decoder at
+            if (last_code < 4095)
+                added();
+        }
+        writer.write(clear, code_size);
+        writer.write(end, 9);
+        writer.finish();
+    }
+
+    // Graphics control, image descriptor and compressed indices of one frame
+    QByteArray gifFrame(const QImage &frame, const Palette &palette, int delay, std::vector<uchar> &indices)
+    {
+        const QImage rgb = frame.convertToFormat(QImage::Format_RGB32);
+        indices.resize((size_t)rgb.width() * rgb.height());
+        for (int y = 0; y < rgb.height(); y++)
+        {
+            const QRgb *line = reinterpret_cast<const QRgb *>(rgb.constScanLine(y));
+            uchar *out = indices.data() + (size_t)y * rgb.width();
+            for (int x = 0; x < rgb.width(); x++)
+                out[x] = palette.index(line[x]);
+        }
+
+        QByteArray out("\x21\xf9\x04\x00", 4);
+        appendWord(out, delay);
+        out.append((char)0); // no transparent index
+        out.append((char)0);
+        out.append((char)0x2c);
+        appendWord(out, 0);
+        appendWord(out, 0);
+        appendWord(out, rgb.width());
+        appendWord(out, rgb.height());
+        out.append((char)0); // no local palette, not interlaced
+        compress(indices.data(), (qint64)indices.size(), out);
+        return out;
+    }
+
+    // In hundredths of a second, rounded so the delays add up to the frame rate.
+    // Browsers slow down delays under 2, so none is shorter.
+    int frameDelay(int frame, double frame_rate)
+    {
+        return std::max(2, qRound(100 * (frame + 1) / frame_rate) - qRound(100 * frame / frame_rate));
+    }
+}
+
+bool AnimationExporter::parseKeyframes(const QString &text, QVector<Keyframe> &keyframes, QString &error)
+{
+    static const QRegularExpression separators("[\\s,;]+");
+    keyframes.clear();
+    for (const QString &line : text.split('\n', Qt::SkipEmptyParts))
+    {
+        const QStringList values = line.split(separators, Qt::SkipEmptyParts);
+        if (values.isEmpty() || values[0].startsWith('#'))
+            continue;
+        if (values.size() > 7)
+        {
+            error = QString("Too many values in \"%1\".").arg(line.trimmed());
+            return false;
+        }
+        double fields[7] = {0, 0, 1, 1, 0, 0, 0};
+        for (int i = 0; i < values.size(); i++)
+        {
+            bool ok;
+            fields[i] = values[i].toDouble(&ok);
+            if (!ok)
+            {
+                error = QString("\"%1\" is not a number.").arg(values[i]);
+                return false;
+            }
+        }
+
+        Keyframe key;
+        key.frame = (int)fields[0];
+        if (key.frame < 0 || key.frame != fields[0])
+        {
+            error = QString("\"%1\" is not a frame number.").arg(values[0]);
+            return false;
+        }
+        key.angle = fields[1];
+        key.scaleX = fields[2];
+        key.scaleY = fields[3];
+        key.shear = fields[4];
+        key.translation = QPointF(fields[5], fields[6]);
+        keyframes.append(key);
+    }
+    if (keyframes.isEmpty())
+    {
+        error = "There are no keyframes.";
+        return false;
+    }
+    return true;
+}
+
+QTransform AnimationExporter::transformAt(const QVector<Keyframe> &keyframes, int frame, QSize size)
+{
+    Keyframe at;
+    if (!keyframes.isEmpty())
+    {
+        const Keyframe *before = nullptr, *after = nullptr;
+        for (const Keyframe &key : keyframes)
+        {
+            if (key.frame <= frame && (!before || key.frame > before->frame))
+                before = &key;
+            if (key.frame >= frame && (!after || key.frame < after->frame))
+                after = &key;
+        }
+        if (!before)
+            before = after;
+        if (!after)
+            after = before;
+        const double t = after->frame == before->frame ? 0 : (double)(frame - before->frame) / (after->frame - before->frame);
+        auto lerp = [t](double from, double to)
+        { return from + (to - from) * t; };
+        at.angle = lerp(before->angle, after->angle);
+        at.scaleX = lerp(before->scaleX, after->scaleX);
+        at.scaleY = lerp(before->scaleY, after->scaleY);
+        at.shear = lerp(before->shear, after->shear);
+        at.translation = QPointF(lerp(before->translation.x(), after->translation.x()), lerp(before->translation.y(), after->translation.y()));
+    }
+
+    const QPointF center(size.width() / 2., size.height() / 2.);
+    return QTransform::fromTranslate(-center.x(), -center.y()) * QTransform::fromScale(at.scaleX, at.scaleY) *
+           QTransform(1, 0, at.shear, 1, 0, 0) * QTransform().rotate(at.angle) *
+           QTransform::fromTranslate(center.x() + at.translation.x(), center.y() + at.translation.y());
+}
+
+bool AnimationExporter::isGif(const QString &file_name)
+{
+    return file_name.endsWith(".gif", Qt::CaseInsensitive);
+}
+
+QString AnimationExporter::frameFileName(const QString &pattern, int frame, int frames)
+{
+    static const QRegularExpression hashes("#+"), conversion("%0?(\\d*)d");
+    QRegularExpressionMatch match = hashes.match(pattern);
+    if (match.hasMatch())
+        return pattern.left(match.capturedStart()) + QString("%1").arg(frame, match.capturedLength(), 10, QChar('0')) + pattern.mid(match.capturedEnd());
+    match = conversion.match(pattern);
+    if (match.hasMatch())
+        return pattern.left(match.capturedStart()) + QString("%1").arg(frame, match.captured(1).toInt(), 10, QChar('0')) + pattern.mid(match.capturedEnd());
+
+    // Wide enough for the last frame, so the files sort in order
+    const int width = std::max(4, (int)QString::number(std::max(frames - 1, 0)).size());
+    const QFileInfo info(pattern);
+    return info.path() + "/" + info.completeBaseName() + "_" + QString("%1").arg(frame, width, 10, QChar('0')) + "." + info.suffix();
+}
+
+bool AnimationExporter::run(const QImage &scene, const QVector<Keyframe> &keyframes, const Options &options, const QString &file_name,
+                            const Progress &progress)
+{
+    error.clear();
+    if (scene.isNull() || options.frames < 1)
+    {
+        error = "There is nothing to export.";
+        return false;
+    }
+    if (!ImageTransform::isSupported(scene.format()))
+    {
+        error = "The canvas format cannot be transformed.";
+        return false;
+    }
+
+    const bool gif = isGif(file_name);
+    QFile file(file_name);
+    Palette palette;
+    if (gif)
+    {
+        if (scene.width() > 0xffff || scene.height() > 0xffff)
+        {
+            error = "The canvas is too large for a GIF.";
+            return false;
+        }
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            error = file.errorString();
+            return false;
+        }
+        palette = medianCut(scene, options.background.rgb());
+        file.write(gifHeader(scene.size(), palette));
+    }
+
+    const int threads = Parallel::threadCount();
+    const int render_workers = options.renderWorkers > 0 ? options.renderWorkers : std::max(1, threads / 2);
+    const int encode_workers = options.encodeWorkers > 0 ? options.encodeWorkers : std::max(1, threads - render_workers);
+    const int in_flight = options.inFlight > 0 ? options.inFlight : 2 * (render_workers + encode_workers);
+
+    // Frames move from next to rendered to encoded and are then written, pending
+    // counts those taken but not written yet
+    std::mutex mutex;
+    std::condition_variable changed;
+    int next = 0, pending = 0, rendering = render_workers;
+    bool stop = false;
+    QString failure;
+    std::deque<std::pair<int, QImage>> rendered;
+    std::map<int, QByteArray> encoded;
+
+    // Called with the mutex held
+    auto fail = [&](const QString &message)
+    {
+        if (failure.isEmpty())
+            failure = message;
+        stop = true;
+        changed.notify_all();
+    };
+
+    auto render = [&]()
+    {
+        for (;;)
+        {
+            int frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]()
+                             { return stop || next >= options.frames || pending < in_flight; });
+                if (stop || next >= options.frames)
+                    break;
+                frame = next++;
+                pending++;
+            }
+            QImage image = ImageTransform::transformed(scene, transformAt(keyframes, frame, scene.size()), scene.rect(), options.filter, options.background);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (image.isNull())
+            {
+                fail(QString("Frame %1 cannot be rendered, its transform is not invertible.").arg(frame));
+                break;
+            }
+            rendered.emplace_back(frame, std::move(image));
+            changed.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        rendering--;
+        changed.notify_all();
+    };
+
+    auto encode = [&]()
+    {
+        std::vector<uchar> indices;
+        for (;;)
+        {
+            std::pair<int, QImage> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]()
+                             { return stop || !rendered.empty() || rendering == 0; });
+                if (stop || rendered.empty())
+                    break;
+                job = std::move(rendered.front());
+                rendered.pop_front();
+            }
+            QByteArray block;
+            QString frame_name;
+            bool saved = true;
+            if (gif)
+            {
+                block = gifFrame(job.second, palette, frameDelay(job.first, options.frameRate), indices);
+            }
+            else
+            {
+                frame_name = frameFileName(file_name, job.first, options.frames);
+                saved = job.second.save(frame_name, "PNG");
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!saved)
+            {
+                fail(QString("Unable to write %1.").arg(frame_name));
+                break;
+            }
+            encoded.emplace(job.first, std::move(block));
+            changed.notify_all();
+        }
+    };
+
+    std::vector<QThread *> workers;
+    for (int i = 0; i < render_workers; i++)
+        workers.push_back(QThread::create(render));
+    for (int i = 0; i < encode_workers; i++)
+        workers.push_back(QThread::create(encode));
+    for (QThread *worker : workers)
+        worker->start();
+
+    // Frames are written in order on the calling thread, which also reports progress
+    int written = 0;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (written < options.frames && !stop)
+        {
+            changed.wait_for(lock, std::chrono::milliseconds(100), [&]()
+                             { return stop || (!encoded.empty() && encoded.begin()->first == written); });
+            while (!stop && !encoded.empty() && encoded.begin()->first == written)
+            {
+                const QByteArray block = std::move(encoded.begin()->second);
+                encoded.erase(encoded.begin());
+                lock.unlock();
+                const bool ok = !gif || file.write(block) == block.size();
+                lock.lock();
+                if (!ok)
+                {
+                    fail(file.errorString());
+                    break;
+                }
+                written++;
+                pending--;
+                changed.notify_all();
+            }
+            if (progress && !stop)
+            {
+                lock.unlock();
+                const bool go_on = progress(written, options.frames);
+                lock.lock();
+                if (!go_on)
+                    fail("The export was cancelled.");
+            }
+        }
+        stop = true;
+        changed.notify_all();
+    }
+    for (QThread *worker : workers)
+    {
+        worker->wait();
+        delete worker;
+    }
+
+    if (gif)
+    {
+        file.write(";", 1);
+        if (failure.isEmpty() && !file.flush())
+            failure = file.errorString();
+        file.close();
+        // A cut off animation is of no use
+        if (!failure.isEmpty())
+            file.remove();
+    }
+    if (!failure.isEmpty())
+    {
+        error = failure;
+        return false;
+    }
+    return true;
+}
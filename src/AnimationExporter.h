@@ -0,0 +1,63 @@
+#pragma once
+#include <QColor>
+#include <QImage>
+#include <QPointF>
+#include <QString>
+#include <QTransform>
+#include <QVector>
+
+#include <functional>
+
+#include "ImageTransform.h"
+
+// Renders a keyframed transform of the scene into a numbered PNG sequence or an
+// animated GIF, without the GUI.
+// Render workers warp the scene for a frame each and queue it for the encode
+// workers. At most inFlight frames are rendered but not yet written, so memory
+// stays bounded whatever the length. GIF frames share one palette, median cut
+// from the scene, are LZW-compressed concurrently and written in order.
+class AnimationExporter
+{
+public:
+    struct Keyframe
+    {
+        int frame = 0;
+        double angle = 0; // degrees, clockwise
+        double scaleX = 1, scaleY = 1;
+        double shear = 0; // horizontal, x += shear * y
+        QPointF translation;
+    };
+
+    struct Options
+    {
+        int frames = 1;
+        double frameRate = 24;
+        ImageTransform::Filter filter = ImageTransform::Bilinear;
+        QColor background = Qt::white;
+        // 0 splits the ideal thread count between them
+        int renderWorkers = 0, encodeWorkers = 0;
+        // 0 allows two frames per worker
+        int inFlight = 0;
+    };
+
+    // progress(frames_written, frames) may return false to cancel the export
+    typedef std::function<bool(int, int)> Progress;
+
+    // "frame angle scale_x scale_y shear dx dy" per line, fields left off keep their defaults
+    static bool parseKeyframes(const QString &text, QVector<Keyframe> &keyframes, QString &error);
+    // Interpolated linearly between keyframes, held before the first and after the
+    // last, and applied about the center of an image of size
+    static QTransform transformAt(const QVector<Keyframe> &keyframes, int frame, QSize size);
+
+    // A file name ending in .gif is an animation, others a pattern with #### or %04d
+    // for the frame number, or numbered before the extension
+    static bool isGif(const QString &file_name);
+    static QString frameFileName(const QString &pattern, int frame, int frames);
+
+    bool run(const QImage &scene, const QVector<Keyframe> &keyframes, const Options &options, const QString &file_name,
+             const Progress &progress = Progress());
+    QString errorString() const { return error; }
+
+private:
+    QString error;
+};
@@ -0,0 +1,311 @@
+#include "Clipper.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Clip region
+void Clipper::setPlanes(int count)
+{
+    planes.resize(count);
+    stages.resize(count);
+    output.reserve(2 * count + 8);
+}
+void Clipper::setRect(const QRect &rect)
+{
+    rectangular = true;
+    region = rect.normalized();
+
+    setPlanes(4);
+    planes[0] = {1, 0, -(qint64)region.left()};
+    planes[1] = {0, 1, -(qint64)region.top()};
+    planes[2] = {-1, 0, region.right()};
+    planes[3] = {0, -1, region.bottom()};
+}
+void Clipper::setConvexPolygon(const QVector<QPoint> &polygon)
+{
+    int n = polygon.size();
+    if (n > 1 && polygon[0] == polygon[n - 1])
+        n--;
+
+    if (n < 3)
+    {
+        QRect box;
+        for (int i = 0; i < n; i++)
+            box |= QRect(polygon[i], polygon[i]);
+        setRect(box);
+        return;
+    }
+
+    qint64 area = 0;
+    int x_min = polygon[0].x(), x_max = x_min, y_min = polygon[0].y(), y_max = y_min;
+    for (int i = 0; i < n; i++)
+    {
+        QPoint a = polygon[i], b = polygon[(i + 1) % n];
+        area += (qint64)a.x() * b.y() - (qint64)b.x() * a.y();
+        x_min = std::min(x_min, a.x());
+        x_max = std::max(x_max, a.x());
+        y_min = std::min(y_min, a.y());
+        y_max = std::max(y_max, a.y());
+    }
+    int orientation = area >= 0 ? 1 : -1;
+
+    rectangular = false;
+    region = QRect(QPoint(x_min, y_min), QPoint(x_max, y_max));
+
+    setPlanes(n);
+    for (int i = 0; i < n; i++)
+    {
+        QPoint a = polygon[i], b = polygon[(i + 1) % n];
+        qint64 pa = -(qint64)(b.y() - a.y()) * orientation;
+        qint64 pb = (qint64)(b.x() - a.x()) * orientation;
+        planes[i] = {pa, pb, -(pa * a.x() + pb * a.y())};
+    }
+}
+
+// Classification
+bool Clipper::isInside(int x, int y) const
+{
+    if (outcode(x, y) != Inside)
+        return false;
+    if (rectangular)
+        return true;
+
+    QPoint point(x, y);
+    for (const HalfPlane &plane : planes)
+    {
+        if (plane.eval(point) < 0)
+            return false;
+    }
+    return true;
+}
+void Clipper::outcodes(const int *x, const int *y, int count, unsigned char *codes) const
+{
+    const int left = region.left(), right = region.right(), top = region.top(), bottom = region.bottom();
+    for (int i = 0; i < count; i++)
+    {
+        codes[i] = (unsigned char)((x[i] < left) * Left | (x[i] > right) * Right |
+                                   (y[i] < top) * Top | (y[i] > bottom) * Bottom);
+    }
+}
+bool Clipper::rejects(const QVector<QPoint> &points) const
+{
+    unsigned char code_and = Left | Right | Top | Bottom;
+    for (const QPoint &point : points)
+    {
+        code_and &= outcode(point);
+        if (code_and == Inside)
+            return false;
+    }
+    return true;
+}
+
+// Lines
+bool Clipper::clipLine(QPoint &start, QPoint &end) const
+{
+    unsigned char c_start = outcode(start), c_end = outcode(end);
+
+    // Trivial reject
+    if (c_start & c_end)
+        return false;
+
+    // Trivial accept
+    if (rectangular && (c_start | c_end) == Inside)
+        return true;
+
+    if (!guardBand.isEmpty() && guardBand.contains(start) && guardBand.contains(end))
+        return true;
+
+    return rectangular ? liangBarsky(start, end) : cyrusBeck(start, end);
+}
+
+bool Clipper::clipSpan(int y, int &x_start, int &x_end) const
+{
+    if (!guardBand.isEmpty() && guardBand.contains(QPoint(x_start, y)) && guardBand.contains(QPoint(x_end - 1, y)))
+        return x_start < x_end;
+
+    if (y < region.top() || y > region.bottom())
+        return false;
+    x_start = std::max(x_start, region.left());
+    x_end = std::min(x_end, region.right() + 1);
+
+    if (!rectangular)
+    {
+        for (const HalfPlane &plane : planes)
+        {
+            // a * x >= -(b * y + c)
+            qint64 rest = plane.b * y + plane.c;
+            if (plane.a > 0)
+                x_start = std::max(x_start, (int)std::ceil((double)-rest / plane.a));
+            else if (plane.a < 0)
+                x_end = std::min(x_end, (int)std::floor((double)rest / -plane.a) + 1);
+            else if (rest < 0)
+                return false;
+        }
+    }
+    return x_start < x_end;
+}
+
+// Liang-Barsky
+bool Clipper::liangBarsky(QPoint &start, QPoint &end) const
+{
+    int dx = end.x() - start.x();
+    int dy = end.y() - start.y();
+
+    const int p[4] = {-dx, dx, -dy, dy};
+    const int q[4] = {start.x() - region.left(), region.right() - start.x(),
+                      start.y() - region.top(), region.bottom() - start.y()};
+
+    double t0 = 0, t1 = 1;
+    for (int i = 0; i < 4; i++)
+    {
+        if (p[i] == 0)
+        {
+            if (q[i] < 0)
+                return false;
+            continue;
+        }
+        double r = (double)q[i] / p[i];
+        if (p[i] < 0)
+            t0 = std::max(t0, r);
+        else
+            t1 = std::min(t1, r);
+
+        if (t0 > t1)
+            return false;
+    }
+
+    QPoint origin = start;
+    if (t1 < 1)
+        end = QPoint(qRound(origin.x() + t1 * dx), qRound(origin.y() + t1 * dy));
+    if (t0 > 0)
+        start = QPoint(qRound(origin.x() + t0 * dx), qRound(origin.y() + t0 * dy));
+    return true;
+}
+
+// Cyrus-Beck
+bool Clipper::cyrusBeck(QPoint &start, QPoint &end) const
+{
+    double t0 = 0, t1 = 1;
+    for (const HalfPlane &plane : planes)
+    {
+        qint64 s = plane.eval(start), e = plane.eval(end);
+        if (s < 0 && e < 0)
+            return false;
+        if (s < 0)
+            t0 = std::max(t0, (double)s / (s - e));
+        else if (e < 0)
+            t1 = std::min(t1, (double)s / (s - e));
+
+        if (t0 > t1)
+            return false;
+    }
+
+    QPoint origin = start, d = end - start;
+    if (t1 < 1)
+        end = QPoint(qRound(origin.x() + t1 * d.x()), qRound(origin.y() + t1 * d.y()));
+    if (t0 > 0)
+        start = QPoint(qRound(origin.x() + t0 * d.x()), qRound(origin.y() + t0 * d.y()));
+    return true;
+}
+
+// Sutherland-Hodgman, pipelined: every vertex runs through all edges in one pass
+QPoint Clipper::intersection(QPoint s, QPoint p, qint64 sValue, qint64 pValue)
+{
+    double t = (double)sValue / (sValue - pValue);
+    return QPoint(qRound(s.x() + t * (p.x() - s.x())), qRound(s.y() + t * (p.y() - s.y())));
+}
+void Clipper::pushVertex(int stage, QPoint point)
+{
+    if (stage == stages.size())
+    {
+        if (output.isEmpty() || output.last() != point)
+            output.push_back(point);
+        return;
+    }
+
+    Stage &st = stages[stage];
+    qint64 value = planes[stage].eval(point);
+
+    if (!st.started)
+    {
+        st.first = point;
+        st.started = true;
+    }
+    else if ((st.previousValue >= 0) != (value >= 0))
+    {
+        pushVertex(stage + 1, intersection(st.previous, point, st.previousValue, value));
+    }
+
+    if (value >= 0)
+        pushVertex(stage + 1, point);
+
+    st.previous = point;
+    st.previousValue = value;
+}
+void Clipper::closeStage(int stage)
+{
+    Stage &st = stages[stage];
+    if (!st.started)
+        return;
+
+    qint64 value = planes[stage].eval(st.first);
+    if ((st.previousValue >= 0) != (value >= 0))
+        pushVertex(stage + 1, intersection(st.previous, st.first, st.previousValue, value));
+}
+const QVector<QPoint> &Clipper::clipPolygon(const QVector<QPoint> &polygon)
+{
+    output.clear();
+
+    int n = polygon.size();
+    if (n > 1 && polygon[0] == polygon[n - 1])
+        n--;
+    if (n < 3)
+        return empty;
+
+    // Trivial accept and reject on outcodes
+    unsigned char code_and = Left | Right | Top | Bottom, code_or = Inside;
+    int x_min = polygon[0].x(), x_max = x_min, y_min = polygon[0].y(), y_max = y_min;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned char code = outcode(polygon[i]);
+        code_and &= code;
+        code_or |= code;
+        x_min = std::min(x_min, polygon[i].x());
+        x_max = std::max(x_max, polygon[i].x());
+        y_min = std::min(y_min, polygon[i].y());
+        y_max = std::max(y_max, polygon[i].y());
+    }
+    if (code_and != Inside)
+        return empty;
+    if (insideGuardBand(QRect(QPoint(x_min, y_min), QPoint(x_max, y_max))))
+        return polygon;
+    if (code_or == Inside)
+    {
+        if (rectangular)
+            return polygon;
+
+        int i = 0;
+        while (i < n && isInside(polygon[i]))
+            i++;
+        if (i == n)
+            return polygon;
+    }
+
+    for (Stage &st : stages)
+        st.started = false;
+
+    for (int i = 0; i < n; i++)
+        pushVertex(0, polygon[i]);
+    for (int i = 0; i < stages.size(); i++)
+        closeStage(i);
+
+    if (output.size() > 1 && output.first() == output.last())
+        output.removeLast();
+    if (output.size() < 3)
+    {
+        output.clear();
+        return output;
+    }
+    output.push_back(output[0]);
+    return output;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <QPoint>
+#include <QRect>
+#include <QVector>
+
+// Clipping against a rectangle or a convex polygon.
+// Rectangles use integer outcodes and Liang-Barsky, convex polygons use
+// Cyrus-Beck on precomputed half-planes. Polygons are clipped by a pipelined
+// Sutherland-Hodgman in a single pass over the input into a reusable buffer.
+class Clipper
+{
+public:
+    enum Outcode : unsigned char
+    {
+        Inside = 0,
+        Left = 1,
+        Right = 2,
+        Top = 4,
+        Bottom = 8
+    };
+
+    Clipper() { setRect(QRect(0, 0, 1, 1)); }
+
+    // Clip region
+    void setRect(const QRect &rect);
+    void setConvexPolygon(const QVector<QPoint> &polygon);
+    bool isRectangular() const { return rectangular; }
+    const QRect &bounds() const { return region; }
+
+    // Guard band: primitives that leave the clip region but stay inside the
+    // guard band are not clipped at all. An empty rect disables the mode.
+    void setGuardBand(const QRect &guard) { guardBand = guard; }
+    const QRect &getGuardBand() const { return guardBand; }
+    bool insideGuardBand(const QRect &box) const { return !guardBand.isEmpty() && guardBand.contains(box); }
+
+    // Classification
+    unsigned char outcode(int x, int y) const
+    {
+        unsigned char code = Inside;
+        if (x < region.left())
+            code |= Left;
+        else if (x > region.right())
+            code |= Right;
+        if (y < region.top())
+            code |= Top;
+        else if (y > region.bottom())
+            code |= Bottom;
+        return code;
+    }
+    unsigned char outcode(QPoint point) const { return outcode(point.x(), point.y()); }
+    // Outcodes of count points against the bounds, from separate x and y arrays.
+    // The loop has no branches, so it vectorizes across the batch.
+    void outcodes(const int *x, const int *y, int count, unsigned char *codes) const;
+    bool isInside(int x, int y) const;
+    bool isInside(QPoint point) const { return isInside(point.x(), point.y()); }
+    bool rejects(const QVector<QPoint> &points) const;
+
+    // Lines, returns false when the whole segment is outside
+    bool clipLine(QPoint &start, QPoint &end) const;
+
+    // Horizontal span [x_start, x_end) on row y, returns false when nothing is left
+    bool clipSpan(int y, int &x_start, int &x_end) const;
+
+    // Polygons are closed (last point == first point), as everywhere in ViewerWidget.
+    // The returned reference is either the input itself (nothing to clip) or the
+    // internal buffer, which stays valid until the next call.
+    const QVector<QPoint> &clipPolygon(const QVector<QPoint> &polygon);
+
+private:
+    // a * x + b * y + c >= 0 for points inside
+    struct HalfPlane
+    {
+        qint64 a, b, c;
+        qint64 eval(QPoint p) const { return a * p.x() + b * p.y() + c; }
+    };
+
+    // Per-edge state of the Sutherland-Hodgman pipeline
+    struct Stage
+    {
+        QPoint first;
+        QPoint previous;
+        qint64 previousValue;
+        bool started;
+    };
+
+    bool rectangular = true;
+    QRect region;
+    QRect guardBand;
+    QVector<HalfPlane> planes;
+    QVector<Stage> stages;
+    QVector<QPoint> output;
+    QVector<QPoint> empty;
+
+    void setPlanes(int count);
+    bool liangBarsky(QPoint &start, QPoint &end) const;
+    bool cyrusBeck(QPoint &start, QPoint &end) const;
+    void pushVertex(int stage, QPoint point);
+    void closeStage(int stage);
+    static QPoint intersection(QPoint s, QPoint p, qint64 sValue, qint64 pValue);
+};
@@ -0,0 +1,386 @@
+#include "ColorAdjust.h"
+#include "Parallel.h"
+#include "PixelFormat.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+//// Chain ////
+
+ColorAdjust &ColorAdjust::add(std::function<double(double)> map, int channels)
+{
+    steps.push_back({map, channels, false});
+    return *this;
+}
+
+ColorAdjust &ColorAdjust::levels(int in_black, int in_white, double gamma, int out_black, int out_white, int channels)
+{
+    double black = in_black / 255., range = std::max(in_white - in_black, 1) / 255.;
+    double low = out_black / 255., span = (out_white - out_black) / 255.;
+    double exponent = gamma > 0 ? 1 / gamma : 1;
+    return add([=](double x)
+               { return low + span * std::pow(std::min(std::max((x - black) / range, 0.), 1.), exponent); },
+               channels);
+}
+
+ColorAdjust &ColorAdjust::curve(const QVector<QPointF> &points, int channels)
+{
+    // Monotone cubic (Fritsch-Carlson) through the control points, given in 0..255
+    QVector<QPointF> p = points;
+    std::sort(p.begin(), p.end(), [](QPointF a, QPointF b)
+              { return a.x() < b.x(); });
+    for (int i = 1; i < p.size(); i++)
+    {
+        if (p[i].x() <= p[i - 1].x())
+            p.remove(i--);
+    }
+    if (p.isEmpty())
+        return *this;
+
+    int n = p.size();
+    QVector<double> x(n), y(n), m(n), d(std::max(n - 1, 1));
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = p[i].x() / 255.;
+        y[i] = p[i].y() / 255.;
+    }
+    for (int i = 0; i < n - 1; i++)
+        d[i] = (y[i + 1] - y[i]) / (x[i + 1] - x[i]);
+
+    if (n > 1)
+    {
+        m[0] = d[0];
+        m[n - 1] = d[n - 2];
+        for (int i = 1; i < n - 1; i++)
+            m[i] = d[i - 1] * d[i] <= 0 ? 0 : (d[i - 1] + d[i]) / 2;
+        for (int i = 0; i < n - 1; i++)
+        {
+            if (d[i] == 0)
+            {
+                m[i] = m[i + 1] = 0;
+                continue;
+            }
+            double a = m[i] / d[i], b = m[i + 1] / d[i], s = a * a + b * b;
+            if (s > 9)
+            {
+                double t = 3 / std::sqrt(s);
+                m[i] = t * a * d[i];
+                m[i + 1] = t * b * d[i];
+            }
+        }
+    }
+
+    return add([=](double v)
+               {
+        if (v <= x[0])
+            return y[0];
+        if (v >= x[n - 1])
+            return y[n - 1];
+
+        int k = (int)(std::upper_bound(x.begin(), x.end(), v) - x.begin()) - 1;
+        double h = x[k + 1] - x[k], t = (v - x[k]) / h, t2 = t * t, t3 = t2 * t;
+        return (2 * t3 - 3 * t2 + 1) * y[k] + (t3 - 2 * t2 + t) * h * m[k] + (-2 * t3 + 3 * t2) * y[k + 1] + (t3 - t2) * h * m[k + 1]; },
+               channels);
+}
+
+ColorAdjust &ColorAdjust::brightnessContrast(int brightness, int contrast)
+{
+    // brightness and contrast in -100..100
+    double offset = std::min(std::max(brightness, -100), 100) / 200.;
+    double factor = std::tan((std::min(std::max(contrast, -100), 99) + 100) / 200. * M_PI / 2);
+    return add([=](double x)
+               { return (x - 0.5) * factor + 0.5 + offset; });
+}
+
+ColorAdjust &ColorAdjust::gamma(double value)
+{
+    double exponent = value > 0 ? 1 / value : 1;
+    return add([=](double x)
+               { return std::pow(x, exponent); });
+}
+
+ColorAdjust &ColorAdjust::invert()
+{
+    return add([](double x)
+               { return 1 - x; });
+}
+
+ColorAdjust &ColorAdjust::grayscale()
+{
+    steps.push_back({nullptr, RGB, true});
+    return *this;
+}
+
+ColorAdjust &ColorAdjust::threshold(int level)
+{
+    double edge = level / 255.;
+    grayscale();
+    return add([=](double x)
+               { return x >= edge ? 1. : 0.; });
+}
+
+//// Tables ////
+
+namespace
+{
+    // One table per channel for a run of steps, with at most one luminance mix
+    template <class T>
+    struct Tables
+    {
+        std::vector<T> before[3], after[3], gray_image;
+        bool mix = false;
+    };
+
+    template <class T>
+    std::vector<T> compose(const std::function<double(double)> *maps, const int *channels, int count, int channel, int size)
+    {
+        std::vector<T> table(size);
+        for (int v = 0; v < size; v++)
+        {
+            double x = (double)v / (size - 1);
+            for (int i = 0; i < count; i++)
+            {
+                if (channels[i] & channel)
+                    x = std::min(std::max(maps[i](x), 0.), 1.);
+            }
+            table[v] = (T)(x * (size - 1) + 0.5);
+        }
+        return table;
+    }
+
+    template <class T>
+    inline T luminance(T r, T g, T b) { return (T)(((quint32)r * 11 + (quint32)g * 16 + (quint32)b * 5) / 32); }
+}
+
+template <class T>
+void ColorAdjust::applyTables(const QImage &src, QImage &dst) const
+{
+    PixelFormat::Layout layout;
+    PixelFormat::layoutOf(src.format(), layout);
+    const int size = sizeof(T) == 1 ? 256 : 65536;
+    const int bits[3] = {Red, Green, Blue};
+
+    // Split the chain into runs that need one pass each. A second luminance mix
+    // is free unless a single-channel step came between the two.
+    QVector<QVector<Step>> runs(1);
+    bool mixed = false, split_channels = false;
+    for (const Step &step : steps)
+    {
+        if (step.gray)
+        {
+            if (mixed && !split_channels)
+                continue;
+            if (mixed)
+            {
+                runs.push_back({});
+                split_channels = false;
+            }
+            mixed = true;
+        }
+        else if (mixed && step.channels != RGB)
+        {
+            split_channels = true;
+        }
+        runs.last().push_back(step);
+    }
+
+    const uchar *src_bits = src.constBits();
+    const qsizetype src_stride = src.bytesPerLine();
+    uchar *dst_bits = dst.bits();
+    const qsizetype dst_stride = dst.bytesPerLine();
+    const int width = src.width();
+
+    for (int r = 0; r < runs.size(); r++)
+    {
+        const QVector<Step> &run = runs[r];
+        std::vector<std::function<double(double)>> maps;
+        std::vector<int> channels;
+        int gray_at = -1;
+        for (const Step &step : run)
+        {
+            if (step.gray)
+            {
+                gray_at = (int)maps.size();
+                continue;
+            }
+            maps.push_back(step.map);
+            channels.push_back(step.channels);
+        }
+        int count = (int)maps.size(), split = gray_at < 0 ? count : gray_at;
+
+        Tables<T> tables;
+        tables.mix = gray_at >= 0;
+        for (int c = 0; c < 3; c++)
+        {
+            tables.before[c] = compose<T>(maps.data(), channels.data(), split, bits[c], size);
+            if (tables.mix)
+                tables.after[c] = compose<T>(maps.data() + split, channels.data() + split, count - split, bits[c], size);
+        }
+        // Gray images only take the steps meant for all channels
+        std::vector<int> all(count);
+        for (int i = 0; i < count; i++)
+            all[i] = channels[i] == RGB ? RGB : 0;
+        tables.gray_image = compose<T>(maps.data(), all.data(), count, RGB, size);
+
+        // Later runs continue from the result of the previous one
+        const uchar *in_bits = r == 0 ? src_bits : dst_bits;
+        const qsizetype in_stride = r == 0 ? src_stride : dst_stride;
+
+        Parallel::forRows(0, src.height(), [&](int y0, int y1)
+                          {
+            const T *before_r = tables.before[0].data(), *before_g = tables.before[1].data(), *before_b = tables.before[2].data();
+            const T *after_r = tables.mix ? tables.after[0].data() : nullptr;
+            const T *after_g = tables.mix ? tables.after[1].data() : nullptr;
+            const T *after_b = tables.mix ? tables.after[2].data() : nullptr;
+            const int ch = layout.channels, R = layout.red, G = layout.green, B = layout.blue, A = layout.alpha;
+
+            for (int y = y0; y < y1; y++)
+            {
+                const T *in = reinterpret_cast<const T *>(in_bits + y * in_stride);
+                T *out = reinterpret_cast<T *>(dst_bits + y * dst_stride);
+
+                if (ch == 1)
+                {
+                    const T *table = tables.gray_image.data();
+                    for (int x = 0; x < width; x++)
+                        out[x] = table[in[x]];
+                    continue;
+                }
+
+                if (layout.premultiplied)
+                {
+                    const QRgb *in_px = reinterpret_cast<const QRgb *>(in);
+                    QRgb *out_px = reinterpret_cast<QRgb *>(out);
+                    for (int x = 0; x < width; x++)
+                    {
+                        QRgb px = qUnpremultiply(in_px[x]);
+                        T cr = before_r[qRed(px)], cg = before_g[qGreen(px)], cb = before_b[qBlue(px)];
+                        if (tables.mix)
+                        {
+                            T l = luminance(cr, cg, cb);
+                            cr = after_r[l], cg = after_g[l], cb = after_b[l];
+                        }
+                        out_px[x] = qPremultiply(qRgba(cr, cg, cb, qAlpha(px)));
+                    }
+                    continue;
+                }
+
+                for (int x = 0; x < width; x++)
+                {
+                    const T *p = in + x * ch;
+                    T *q = out + x * ch;
+                    T cr = before_r[p[R]], cg = before_g[p[G]], cb = before_b[p[B]];
+                    if (tables.mix)
+                    {
+                        T l = luminance(cr, cg, cb);
+                        cr = after_r[l], cg = after_g[l], cb = after_b[l];
+                    }
+                    q[R] = cr;
+                    q[G] = cg;
+                    q[B] = cb;
+                    if (A >= 0)
+                        q[A] = p[A];
+                }
+            } });
+    }
+}
+
+bool ColorAdjust::apply(const QImage &src, QImage &dst) const
+{
+    PixelFormat::Layout layout;
+    if (!PixelFormat::layoutOf(src.format(), layout) || src.isNull())
+        return false;
+    if (dst.size() != src.size() || dst.format() != src.format())
+        return false;
+
+    if (steps.isEmpty())
+    {
+        if (&src != &dst)
+        {
+            for (int y = 0; y < src.height(); y++)
+                std::copy(src.constScanLine(y), src.constScanLine(y) + src.bytesPerLine(), dst.scanLine(y));
+        }
+        return true;
+    }
+
+    if (layout.wide)
+        applyTables<quint16>(src, dst);
+    else
+        applyTables<uchar>(src, dst);
+    return true;
+}
+
+//// Histogram ////
+
+Histogram Histogram::compute(const QImage &img, bool over_white)
+{
+    Histogram result;
+    result.red.fill(0, 256);
+    result.green.fill(0, 256);
+    result.blue.fill(0, 256);
+    result.luma.fill(0, 256);
+
+    PixelFormat::Layout layout;
+    if (!PixelFormat::layoutOf(img.format(), layout) || img.isNull())
+        return result;
+
+    const uchar *bits = img.constBits();
+    const qsizetype stride = img.bytesPerLine();
+    const int width = img.width();
+    std::mutex merge;
+
+    // Every stripe fills its own bins, they are merged once at the end
+    Parallel::forRows(0, img.height(), [&](int y0, int y1)
+                      {
+        std::vector<quint64> bins(4 * 256, 0);
+        quint64 *red = bins.data(), *green = red + 256, *blue = green + 256, *luma = blue + 256;
+        const int ch = layout.channels, R = layout.red, G = layout.green, B = layout.blue;
+
+        for (int y = y0; y < y1; y++)
+        {
+            const uchar *line = bits + y * stride;
+            for (int x = 0; x < width; x++)
+            {
+                int r, g, b;
+                if (layout.wide)
+                {
+                    const quint16 *p = reinterpret_cast<const quint16 *>(line) + x * ch;
+                    r = p[R] >> 8, g = p[G] >> 8, b = p[B] >> 8;
+                }
+                else if (layout.premultiplied && over_white)
+                {
+                    const QRgb px = reinterpret_cast<const QRgb *>(line)[x];
+                    const int rest = 255 - qAlpha(px);
+                    r = qRed(px) + rest, g = qGreen(px) + rest, b = qBlue(px) + rest;
+                }
+                else if (layout.premultiplied)
+                {
+                    QRgb px = qUnpremultiply(reinterpret_cast<const QRgb *>(line)[x]);
+                    r = qRed(px), g = qGreen(px), b = qBlue(px);
+                }
+                else
+                {
+                    const uchar *p = line + x * ch;
+                    r = p[R], g = p[G], b = p[B];
+                }
+                red[r]++;
+                green[g]++;
+                blue[b]++;
+                luma[luminance<uchar>(r, g, b)]++;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(merge);
+        for (int i = 0; i < 256; i++)
+        {
+            result.red[i] += red[i];
+            result.green[i] += green[i];
+            result.blue[i] += blue[i];
+            result.luma[i] += luma[i];
+        } });
+
+    result.pixels = (quint64)img.width() * img.height();
+    return result;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <QImage>
+#include <QPointF>
+#include <QVector>
+
+#include <functional>
+
+// Chain of tone adjustments collapsed into lookup tables.
+// Every step is a curve on [0, 1]; apply() composes the whole chain into one
+// table per channel (256 entries, 65536 for 16-bit images) and maps the image
+// in a single multithreaded pass, however long the chain is.
+class ColorAdjust
+{
+public:
+    enum Channel
+    {
+        Red = 1,
+        Green = 2,
+        Blue = 4,
+        RGB = Red | Green | Blue
+    };
+
+    ColorAdjust &levels(int in_black, int in_white, double gamma = 1., int out_black = 0, int out_white = 255, int channels = RGB);
+    ColorAdjust &curve(const QVector<QPointF> &points, int channels = RGB);
+    ColorAdjust &brightnessContrast(int brightness, int contrast);
+    ColorAdjust &gamma(double value);
+    ColorAdjust &invert();
+    ColorAdjust &grayscale();
+    ColorAdjust &threshold(int level);
+
+    void clear() { steps.clear(); }
+    bool isEmpty() const { return steps.isEmpty(); }
+
+    // src and dst must have the same size and format, they may be the same image
+    bool apply(const QImage &src, QImage &dst) const;
+    bool apply(QImage &img) const { return apply(img, img); }
+
+private:
+    struct Step
+    {
+        std::function<double(double)> map;
+        int channels;
+        bool gray; // mixes the channels to luminance instead of mapping them
+    };
+    QVector<Step> steps;
+
+    ColorAdjust &add(std::function<double(double)> map, int channels = RGB);
+    template <class T>
+    void applyTables(const QImage &src, QImage &dst) const;
+};
+
+// Per-channel histogram, 256 bins (16-bit images are binned by their high byte)
+struct Histogram
+{
+    QVector<quint64> red, green, blue, luma;
+    quint64 pixels = 0;
+
+    // over_white counts premultiplied pixels over white, as a paper layer shows them
+    static Histogram compute(const QImage &img, bool over_white = false);
+};
@@ -0,0 +1,136 @@
+#include "ColorAdjustDialog.h"
+
+ColorAdjustDialog::ColorAdjustDialog(ViewerWidget *viewer, QWidget *parent)
+    : QDialog(parent), vW(viewer), original(viewer->getImage()->copy())
+{
+    setWindowTitle("Adjust colors");
+
+    brightness = new QSlider(Qt::Horizontal);
+    brightness->setRange(-100, 100);
+    contrast = new QSlider(Qt::Horizontal);
+    contrast->setRange(-100, 100);
+    gamma = new QDoubleSpinBox();
+    gamma->setRange(0.1, 5);
+    gamma->setSingleStep(0.1);
+    levels_black = new QSpinBox();
+    levels_black->setRange(0, 254);
+    levels_white = new QSpinBox();
+    levels_white->setRange(1, 255);
+    curve = new QLineEdit();
+    curve->setPlaceholderText("x,y x,y ... (0-255)");
+    invert = new QCheckBox("Invert");
+    grayscale = new QCheckBox("Grayscale");
+    threshold_enabled = new QCheckBox("Threshold");
+    threshold = new QSpinBox();
+    threshold->setRange(0, 255);
+    timing = new QLabel();
+
+    QHBoxLayout *levels_row = new QHBoxLayout();
+    levels_row->addWidget(levels_black);
+    levels_row->addWidget(levels_white);
+    QHBoxLayout *threshold_row = new QHBoxLayout();
+    threshold_row->addWidget(threshold_enabled);
+    threshold_row->addWidget(threshold);
+
+    QDialogButtonBox *buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel | QDialogButtonBox::Reset);
+
+    QFormLayout *form = new QFormLayout(this);
+    form->addRow("Levels:", levels_row);
+    form->addRow("Curve:", curve);
+    form->addRow("Brightness:", brightness);
+    form->addRow("Contrast:", contrast);
+    form->addRow("Gamma:", gamma);
+    form->addRow(invert);
+    form->addRow(grayscale);
+    form->addRow(threshold_row);
+    form->addRow(timing);
+    form->addRow(buttons);
+
+    resetControls();
+
+    // Coalesce bursts of slider events into one pass
+    previewTimer.setSingleShot(true);
+    previewTimer.setInterval(0);
+    connect(&previewTimer, &QTimer::timeout, this, &ColorAdjustDialog::preview);
+
+    for (QSlider *slider : {brightness, contrast})
+        connect(slider, &QSlider::valueChanged, &previewTimer, qOverload<>(&QTimer::start));
+    for (QSpinBox *spinbox : {levels_black, levels_white, threshold})
+        connect(spinbox, &QSpinBox::valueChanged, &previewTimer, qOverload<>(&QTimer::start));
+    for (QCheckBox *checkbox : {invert, grayscale, threshold_enabled})
+        connect(checkbox, &QCheckBox::toggled, &previewTimer, qOverload<>(&QTimer::start));
+    connect(gamma, &QDoubleSpinBox::valueChanged, &previewTimer, qOverload<>(&QTimer::start));
+    connect(curve, &QLineEdit::editingFinished, &previewTimer, qOverload<>(&QTimer::start));
+
+    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, this, &ColorAdjustDialog::reject);
+    connect(buttons->button(QDialogButtonBox::Reset), &QPushButton::clicked, this, [this]()
+            { resetControls(); previewTimer.start(); });
+}
+
+void ColorAdjustDialog::resetControls()
+{
+    brightness->setValue(0);
+    contrast->setValue(0);
+    gamma->setValue(1);
+    levels_black->setValue(0);
+    levels_white->setValue(255);
+    curve->clear();
+    invert->setChecked(false);
+    grayscale->setChecked(false);
+    threshold_enabled->setChecked(false);
+    threshold->setValue(128);
+}
+
+ColorAdjust ColorAdjustDialog::chain()
+{
+    ColorAdjust adjust;
+
+    if (levels_black->value() != 0 || levels_white->value() != 255)
+        adjust.levels(levels_black->value(), levels_white->value());
+
+    QVector<QPointF> points;
+    for (const QString &pair : curve->text().split(' ', Qt::SkipEmptyParts))
+    {
+        QStringList xy = pair.split(',');
+        if (xy.size() == 2)
+            points.push_back(QPointF(xy[0].toDouble(), xy[1].toDouble()));
+    }
+    if (points.size() >= 2)
+        adjust.curve(points);
+
+    if (brightness->value() != 0 || contrast->value() != 0)
+        adjust.brightnessContrast(brightness->value(), contrast->value());
+    if (gamma->value() != 1)
+        adjust.gamma(gamma->value());
+    if (invert->isChecked())
+        adjust.invert();
+    if (grayscale->isChecked())
+        adjust.grayscale();
+    if (threshold_enabled->isChecked())
+        adjust.threshold(threshold->value());
+
+    return adjust;
+}
+
+// Slots
+void ColorAdjustDialog::preview()
+{
+    QElapsedTimer timer;
+    timer.start();
+    ViewerWidget::ImageWrite write(vW);
+    chain().apply(original, *vW->getImage());
+    timing->setText(QString("Preview: %1 ms").arg(timer.elapsed()));
+    vW->imageChanged();
+    emit previewed();
+}
+void ColorAdjustDialog::reject()
+{
+    {
+        ViewerWidget::ImageWrite write(vW);
+        ColorAdjust().apply(original, *vW->getImage());
+        vW->imageChanged();
+    }
+    emit previewed();
+    QDialog::reject();
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <QtWidgets>
+
+#include "ColorAdjust.h"
+#include "ViewerWidget.h"
+
+// Live color adjustment of the canvas.
+// Every change rebuilds the chain and maps the untouched original into the
+// canvas in one pass; Cancel puts the original back.
+class ColorAdjustDialog : public QDialog
+{
+    Q_OBJECT
+private:
+    ViewerWidget *vW;
+    QImage original;
+    QTimer previewTimer;
+
+    QSlider *brightness;
+    QSlider *contrast;
+    QDoubleSpinBox *gamma;
+    QSpinBox *levels_black;
+    QSpinBox *levels_white;
+    QLineEdit *curve;
+    QCheckBox *invert;
+    QCheckBox *grayscale;
+    QCheckBox *threshold_enabled;
+    QSpinBox *threshold;
+    QLabel *timing;
+
+    ColorAdjust chain();
+    void resetControls();
+
+public:
+    ColorAdjustDialog(ViewerWidget *viewer, QWidget *parent = Q_NULLPTR);
+
+signals:
+    void previewed();
+
+public slots:
+    void preview();
+    void reject() Q_DECL_OVERRIDE;
+};
@@ -0,0 +1,93 @@
+#include "CompareWidget.h"
+
+CompareWidget::CompareWidget(QWidget *parent)
+    : QWidget(parent)
+{
+    setAttribute(Qt::WA_StaticContents);
+}
+
+bool CompareWidget::setImages(const QImage &left_image, const QImage &right_image)
+{
+    ImageCompare::Metrics metrics;
+    if (!ImageCompare::compare(left_image, right_image, metrics))
+    {
+        left = right = difference = QImage();
+        resizeToView();
+        return false;
+    }
+    left = left_image;
+    right = right_image;
+    difference = QImage();
+    comparison = metrics;
+    split = left.width() / 2;
+    resizeToView();
+    return true;
+}
+
+void CompareWidget::setView(View new_view)
+{
+    view = new_view;
+    resizeToView();
+}
+
+void CompareWidget::setGain(double new_gain)
+{
+    gain = new_gain;
+    difference = QImage();
+    if (view == Difference)
+        update();
+}
+
+void CompareWidget::resizeToView()
+{
+    QSize size = left.size();
+    if (view == SideBySide && !left.isNull())
+        size.setWidth(2 * left.width() + gap);
+    resize(size);
+    setMinimumSize(size);
+    setMaximumSize(size);
+    update();
+}
+
+// Slots
+void CompareWidget::paintEvent(QPaintEvent *event)
+{
+    if (left.isNull())
+        return;
+
+    QPainter painter(this);
+    switch (view)
+    {
+    case SideBySide:
+        painter.drawImage(0, 0, left);
+        painter.fillRect(left.width(), 0, gap, height(), palette().color(QPalette::Dark));
+        painter.drawImage(left.width() + gap, 0, right);
+        break;
+    case Split:
+        painter.drawImage(QRect(0, 0, split, left.height()), left, QRect(0, 0, split, left.height()));
+        painter.drawImage(QRect(split, 0, left.width() - split, left.height()), right, QRect(split, 0, left.width() - split, left.height()));
+        painter.setPen(QPen(Qt::white, 1, Qt::DashLine));
+        painter.drawLine(split, 0, split, left.height());
+        break;
+    case Difference:
+        if (difference.isNull())
+            difference = ImageCompare::differenceMap(left, right, gain);
+        painter.drawImage(0, 0, difference);
+        break;
+    }
+}
+
+void CompareWidget::mousePressEvent(QMouseEvent *event)
+{
+    mouseMoveEvent(event);
+}
+
+void CompareWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    if (view != Split || !(event->buttons() & Qt::LeftButton) || left.isNull())
+        return;
+    const int column = std::min(std::max(event->pos().x(), 0), left.width());
+    // Only the columns between the old and new line change
+    update(QRect(std::min(split, column) - 1, 0, std::abs(column - split) + 3, left.height()));
+    split = column;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <QtWidgets>
+
+#include "ImageCompare.h"
+
+// Shows two images of the same size for comparison: next to each other, split
+// by a line that follows the mouse while a button is held, or as a heat map of
+// their difference. The metrics are computed once when the images are set.
+class CompareWidget : public QWidget
+{
+    Q_OBJECT
+public:
+    enum View
+    {
+        SideBySide,
+        Split,
+        Difference
+    };
+
+private:
+    QImage left, right;
+    QImage difference; // made on first use, it depends on the gain
+    double gain = 8;
+    View view = Split;
+    int split = 0; // image column where the right image starts
+    ImageCompare::Metrics comparison;
+
+    static const int gap = 8;
+    void resizeToView();
+
+public:
+    CompareWidget(QWidget *parent = Q_NULLPTR);
+
+    // False when the images cannot be compared, the widget then shows nothing
+    bool setImages(const QImage &left_image, const QImage &right_image);
+    const ImageCompare::Metrics &getMetrics() { return comparison; }
+
+    void setView(View new_view);
+    View getView() { return view; }
+    void setGain(double new_gain);
+
+public slots:
+    void paintEvent(QPaintEvent *event) Q_DECL_OVERRIDE;
+    void mousePressEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
+    void mouseMoveEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
+};
@@ -0,0 +1,190 @@
+#pragma once
+#include "Clipper.h"
+#include "PixelFormat.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Scanline seed fill with an explicit stack of spans.
+// A stack entry is a filled span whose neighbouring row still has to be
+// scanned, so memory grows with the boundary of the region, not its area.
+// Runs are written with Writer::span, the region ends at the clip region.
+namespace FloodFill
+{
+    struct Stats
+    {
+        qint64 pixels = 0;
+        qint64 spans = 0;
+        size_t peakStack = 0;
+        QRect bounds; // of the filled pixels, empty when nothing was filled
+    };
+
+    // All channels within tolerance (0-255, scaled for 16-bit formats) of the seed pixel
+    template <class Pixel>
+    class ColorMatch
+    {
+    public:
+        typedef std::conditional_t<sizeof(Pixel) == 2 || sizeof(Pixel) == 8, quint16, uchar> Channel;
+        static constexpr int channels = sizeof(Pixel) / sizeof(Channel);
+
+        ColorMatch(const Pixel &seed, int tolerance)
+            : tolerance(sizeof(Channel) == 1 ? tolerance : tolerance * 257)
+        {
+            std::memcpy(target, &seed, sizeof(Pixel));
+        }
+
+        bool operator()(const Pixel &pixel) const
+        {
+            const Channel *c = reinterpret_cast<const Channel *>(&pixel);
+            for (int i = 0; i < channels; i++)
+            {
+                if (std::abs((int)c[i] - (int)target[i]) > tolerance)
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        Channel target[channels];
+        int tolerance;
+    };
+
+    // Filled runs per row. Only kept when the fill color itself matches,
+    // otherwise the image already tells filled pixels apart.
+    class FilledSpans
+    {
+    public:
+        void add(int y, int x_start, int x_end) { spans[{y, x_start}] = x_end; }
+
+        // End of the filled run containing x, or x itself
+        int skip(int y, int x) const
+        {
+            auto it = spans.upper_bound({y, x});
+            if (it == spans.begin())
+                return x;
+            --it;
+            return it->first.first == y && it->second > x ? it->second : x;
+        }
+        // Start of the first filled run right of x, at most limit
+        int nextStart(int y, int x, int limit) const
+        {
+            auto it = spans.upper_bound({y, x});
+            return it != spans.end() && it->first.first == y ? std::min(it->first.second, limit) : limit;
+        }
+        // End of the last filled run left of x, at least limit
+        int previousEnd(int y, int x, int limit) const
+        {
+            auto it = spans.lower_bound({y, x});
+            if (it == spans.begin())
+                return limit;
+            --it;
+            return it->first.first == y ? std::max(it->second, limit) : limit;
+        }
+
+    private:
+        std::map<std::pair<int, int>, int> spans;
+    };
+
+    template <class Format>
+    Stats fill(const PixelFormat::Writer<Format> &writer, const Clipper &clipper, QPoint seed, int tolerance, bool eight_connected)
+    {
+        typedef typename Format::Pixel Pixel;
+
+        // [x_left, x_right] is filled on row y - dy, row y is scanned next to it
+        struct Segment
+        {
+            int y, x_left, x_right, dy;
+        };
+
+        Stats stats;
+        const QRect &bounds = clipper.bounds();
+        int lo, hi;
+        auto limits = [&](int y)
+        {
+            lo = bounds.left();
+            hi = bounds.right() + 1;
+            return clipper.clipSpan(y, lo, hi);
+        };
+        if (!limits(seed.y()) || seed.x() < lo || seed.x() >= hi)
+            return stats;
+
+        const ColorMatch<Pixel> match(writer.row(seed.y())[seed.x()], tolerance);
+        const bool record = match(writer.value());
+        const int reach = eight_connected ? 1 : 0;
+        FilledSpans filled;
+        std::vector<Segment> stack;
+
+        auto push = [&](int y, int x_left, int x_right, int dy)
+        {
+            if (y < bounds.top() || y > bounds.bottom())
+                return;
+            stack.push_back({y, x_left, x_right, dy});
+            stats.peakStack = std::max(stats.peakStack, stack.size());
+        };
+
+        // Grows the run of matching pixels through x and fills it, returns [start, end)
+        auto fillRun = [&](int y, int x)
+        {
+            const Pixel *line = writer.row(y);
+            const int left_limit = record ? filled.previousEnd(y, x, lo) : lo;
+            const int right_limit = record ? filled.nextStart(y, x, hi) : hi;
+            int run_start = x, run_end = x + 1;
+            while (run_start > left_limit && match(line[run_start - 1]))
+                run_start--;
+            while (run_end < right_limit && match(line[run_end]))
+                run_end++;
+
+            writer.span(y, run_start, run_end);
+            if (record)
+                filled.add(y, run_start, run_end);
+            stats.pixels += run_end - run_start;
+            stats.spans++;
+            stats.bounds |= QRect(run_start, y, run_end - run_start, 1);
+            return std::make_pair(run_start, run_end);
+        };
+
+        if (!match(writer.row(seed.y())[seed.x()]))
+            return stats;
+        std::pair<int, int> run = fillRun(seed.y(), seed.x());
+        push(seed.y() + 1, run.first, run.second - 1, 1);
+        push(seed.y() - 1, run.first, run.second - 1, -1);
+
+        while (!stack.empty())
+        {
+            const Segment segment = stack.back();
+            stack.pop_back();
+            if (!limits(segment.y))
+                continue;
+
+            const Pixel *line = writer.row(segment.y);
+            const int end = std::min(segment.x_right + reach, hi - 1);
+            int x = std::max(segment.x_left - reach, lo);
+            while (x <= end)
+            {
+                if (record)
+                    x = filled.skip(segment.y, x);
+                if (x > end)
+                    break;
+                if (!match(line[x]))
+                {
+                    x++;
+                    continue;
+                }
+
+                run = fillRun(segment.y, x);
+                push(segment.y + segment.dy, run.first, run.second - 1, segment.dy);
+                // Parts sticking out past the parent span can leak back around a corner
+                if (run.first < segment.x_left)
+                    push(segment.y - segment.dy, run.first, segment.x_left - 1, -segment.dy);
+                if (run.second - 1 > segment.x_right)
+                    push(segment.y - segment.dy, segment.x_right + 1, run.second - 1, -segment.dy);
+                x = run.second + 1;
+            }
+        }
+        return stats;
+    }
+}
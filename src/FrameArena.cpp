@@ -0,0 +1,93 @@
+#include "FrameArena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#ifdef IMAGEVIEWER_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<qint64> allocationCount{0};
+}
+
+// Counting replacements of the global allocation functions. The array and
+// nothrow forms of the standard library forward to these.
+void *operator new(std::size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+qint64 FrameArena::heapAllocations()
+{
+    return allocationCount.load(std::memory_order_relaxed);
+}
+#else
+qint64 FrameArena::heapAllocations()
+{
+    return -1;
+}
+#endif
+
+void FrameArena::reset()
+{
+    current = 0;
+    offset = 0;
+    usedBytes = 0;
+    peakBytes = 0;
+    heapBlocks = 0;
+}
+
+size_t FrameArena::capacity() const
+{
+    size_t total = 0;
+    for (const Block &block : blocks)
+        total += block.size;
+    return total;
+}
+
+void *FrameArena::allocateBytes(size_t bytes, size_t alignment)
+{
+    for (;;)
+    {
+        if (current < blocks.size())
+        {
+            Block &block = blocks[current];
+            const uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+            const size_t start = ((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+            if (start + bytes <= block.size)
+            {
+                usedBytes += start + bytes - offset;
+                peakBytes = std::max(peakBytes, usedBytes);
+                offset = start + bytes;
+                return block.data.get() + start;
+            }
+            // Blocks past the current one are free, a block too small for this is replaced
+            current++;
+            offset = 0;
+            if (current < blocks.size() && blocks[current].size >= bytes + alignment)
+                continue;
+        }
+
+        const size_t size = std::max(blockSize, bytes + alignment);
+        heapBlocks++;
+        Block block{std::unique_ptr<char[]>(new char[size]), size};
+        if (current < blocks.size())
+            blocks[current] = std::move(block);
+        else
+            blocks.push_back(std::move(block));
+    }
+}
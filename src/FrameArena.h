@@ -0,0 +1,105 @@
+#pragma once
+#include <QtGlobal>
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Scratch memory for drawing.
+// Allocation bumps an offset through blocks that are kept for the next frame,
+// a Scope hands back everything allocated while it was alive, so once the arena
+// has grown to the working set of a frame redraws do not touch the heap.
+// Nothing is destroyed, only trivially destructible types can live here.
+class FrameArena
+{
+public:
+    explicit FrameArena(size_t block_size = 64 * 1024) : blockSize(block_size) {}
+
+    // Uninitialized room for count objects
+    template <class T>
+    T *allocate(size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena memory is released without destructors");
+        return static_cast<T *>(allocateBytes(count * sizeof(T), alignof(T)));
+    }
+
+    // Releases what was allocated since its construction, innermost scope first
+    class Scope
+    {
+    public:
+        explicit Scope(FrameArena &arena) : arena(arena), block(arena.current), offset(arena.offset), used(arena.usedBytes) {}
+        ~Scope()
+        {
+            arena.current = block;
+            arena.offset = offset;
+            arena.usedBytes = used;
+        }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        FrameArena &arena;
+        size_t block, offset, used;
+    };
+
+    // Releases everything and starts counting the peak and growth again, keeps the blocks
+    void reset();
+    size_t used() const { return usedBytes; }
+    size_t peak() const { return peakBytes; }
+    size_t capacity() const;
+    // Blocks taken from the heap since the last reset, 0 once the arena fits a frame
+    int blocksAdded() const { return heapBlocks; }
+
+    // Calls of the global operator new in the process so far, -1 unless built
+    // with IMAGEVIEWER_COUNT_ALLOCATIONS. Qt containers allocate with malloc
+    // directly and are not part of it.
+    static qint64 heapAllocations();
+
+private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t blockSize;
+    size_t current = 0, offset = 0;
+    size_t usedBytes = 0, peakBytes = 0;
+    int heapBlocks = 0;
+
+    void *allocateBytes(size_t bytes, size_t alignment);
+};
+
+// Array of fixed capacity in arena memory, for scratch whose bound is known up front
+template <class T>
+class ArenaArray
+{
+public:
+    ArenaArray(FrameArena &arena, int capacity) : items(arena.allocate<T>(capacity)), limit(capacity) {}
+
+    int size() const { return count; }
+    bool isEmpty() const { return count == 0; }
+    T *begin() { return items; }
+    T *end() { return items + count; }
+    const T *begin() const { return items; }
+    const T *end() const { return items + count; }
+    T &operator[](int i) { return items[i]; }
+    const T &operator[](int i) const { return items[i]; }
+
+    void push_back(const T &value)
+    {
+        Q_ASSERT(count < limit);
+        items[count++] = value;
+    }
+    void resize(int size)
+    {
+        Q_ASSERT(size <= limit);
+        count = size;
+    }
+
+private:
+    T *items;
+    int count = 0;
+    int limit;
+};
@@ -0,0 +1,259 @@
+#include "GalleryLoader.h"
+#include "PixelFormat.h"
+#include "SequencePlayer.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace
+{
+    // Full images kept on either side of the one shown
+    const int prefetchReach = 2;
+}
+
+GalleryLoader::GalleryLoader(int thumbnail_size) : size(thumbnail_size)
+{
+    pool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+}
+
+GalleryLoader::~GalleryLoader()
+{
+    close();
+}
+
+void GalleryLoader::setCacheDirectory(const QString &directory)
+{
+    cacheDirectory = directory;
+    if (!directory.isEmpty())
+        QDir().mkpath(directory);
+}
+
+bool GalleryLoader::open(const QString &folder)
+{
+    close();
+    QMutexLocker locker(&mutex);
+    // Image files in numeric order, as a sequence is played
+    files = SequencePlayer::listFrames(folder);
+    thumbnails.assign(files.size(), Missing);
+    return !files.isEmpty();
+}
+
+void GalleryLoader::close()
+{
+    {
+        QMutexLocker locker(&mutex);
+        generation++;
+        pending.clear();
+    }
+    // At most one decode per thread is still running
+    pool.waitForDone();
+
+    QMutexLocker locker(&mutex);
+    files.clear();
+    thumbnails.clear();
+    images.clear();
+    decoding.clear();
+    prefetchCenter = -1;
+}
+
+//// Thumbnails ////
+
+void GalleryLoader::requestThumbnails(int first, int last)
+{
+    QMutexLocker locker(&mutex);
+    first = std::max(first, 0);
+    last = std::min(last, (int)files.size() - 1);
+    if (first > last)
+        return;
+
+    for (int index : pending)
+        thumbnails[index] = Missing;
+    pending.clear();
+
+    auto request = [&](int index)
+    {
+        if (index >= 0 && index < files.size() && thumbnails[index] == Missing)
+        {
+            thumbnails[index] = Pending;
+            pending.push_back(index);
+        }
+    };
+    for (int index = first; index <= last; index++)
+        request(index);
+    // Then outwards, where the next scroll is likely to go
+    const int page = last - first + 1;
+    for (int distance = 1; distance <= page; distance++)
+    {
+        request(last + distance);
+        request(first - distance);
+    }
+
+    const int folder = generation;
+    for (; workers < pool.maxThreadCount() && workers < (int)pending.size(); workers++)
+        pool.start([this, folder]()
+                   { decodeThumbnails(folder); });
+}
+
+void GalleryLoader::decodeThumbnails(int folder)
+{
+    int index;
+    QString file_name;
+    {
+        QMutexLocker locker(&mutex);
+        if (folder != generation || pending.empty())
+        {
+            workers--;
+            return;
+        }
+        index = pending.front();
+        pending.pop_front();
+        thumbnails[index] = Taken;
+        file_name = files[index];
+    }
+
+    const QImage thumbnail = loadThumbnail(file_name, size, cacheDirectory);
+    if (!thumbnail.isNull())
+        QMetaObject::invokeMethod(
+            &context, [this, folder, index, thumbnail]()
+            {
+                if (folder == generation && receiver)
+                    receiver(index, thumbnail); },
+            Qt::QueuedConnection);
+
+    // One thumbnail per task, a prefetch of a full image queued meanwhile goes first
+    QMutexLocker locker(&mutex);
+    if (folder == generation && !pending.empty())
+        pool.start([this, folder]()
+                   { decodeThumbnails(folder); });
+    else
+        workers--;
+}
+
+QImage GalleryLoader::loadThumbnail(const QString &file_name, int size, const QString &cache_directory)
+{
+    QString cache_file;
+    if (!cache_directory.isEmpty())
+    {
+        // An edited file gets a new entry, the stale one is never looked up again
+        const QFileInfo info(file_name);
+        const QString key = QString("%1\n%2\n%3\n%4")
+                                .arg(info.absoluteFilePath())
+                                .arg(info.lastModified().toMSecsSinceEpoch())
+                                .arg(info.size())
+                                .arg(size);
+        cache_file = cache_directory + "/" + QString::fromLatin1(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex()) + ".png";
+        QImage cached(cache_file, "PNG");
+        if (!cached.isNull())
+            return cached;
+    }
+
+    // Readers that can, JPEG above all, decode straight at the smaller size
+    QImageReader reader(file_name);
+    reader.setAutoTransform(true);
+    const QSize full = reader.size();
+    if (full.isValid() && (full.width() > size || full.height() > size))
+        reader.setScaledSize(full.scaled(size, size, Qt::KeepAspectRatio));
+    QImage thumbnail = reader.read();
+    if (thumbnail.isNull())
+        return thumbnail;
+    if (thumbnail.width() > size || thumbnail.height() > size)
+        thumbnail = thumbnail.scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+    if (!cache_file.isEmpty())
+    {
+        // Written aside and renamed, a reader never finds half a file
+        QSaveFile file(cache_file);
+        if (file.open(QIODevice::WriteOnly) && thumbnail.save(&file, "PNG"))
+            file.commit();
+    }
+    return thumbnail;
+}
+
+//// Full images ////
+
+QImage GalleryLoader::readImage(const QString &file_name)
+{
+    QImageReader reader(file_name);
+    reader.setAutoTransform(true);
+    QImage image = reader.read();
+    const QImage::Format format = PixelFormat::drawableFormat(image);
+    if (!image.isNull() && image.format() != format)
+        image = image.convertToFormat(format);
+    return image;
+}
+
+QImage GalleryLoader::image(int index)
+{
+    QString file_name;
+    {
+        QMutexLocker locker(&mutex);
+        if (index < 0 || index >= files.size())
+            return QImage();
+        // Waiting for a decode under way beats starting a second one
+        while (decoding.contains(index))
+            prefetched.wait(&mutex);
+        if (images.contains(index))
+            return images.take(index);
+        file_name = files[index];
+    }
+    return readImage(file_name);
+}
+
+void GalleryLoader::prefetch(int index)
+{
+    QMutexLocker locker(&mutex);
+    prefetchCenter = index;
+    for (auto it = images.begin(); it != images.end();)
+    {
+        if (std::abs(it.key() - index) > prefetchReach)
+            it = images.erase(it);
+        else
+            ++it;
+    }
+
+    const int folder = generation;
+    // Forward first, it is the usual direction of browsing
+    for (int distance = 1; distance <= prefetchReach; distance++)
+    {
+        for (int neighbour : {index + distance, index - distance})
+        {
+            if (neighbour < 0 || neighbour >= files.size() || images.contains(neighbour) || decoding.contains(neighbour))
+                continue;
+            decoding.insert(neighbour);
+            const QString file_name = files[neighbour];
+            // Ahead of the thumbnails, the next image is what the user waits for
+            pool.start([this, folder, neighbour, file_name]()
+                       { decodeImage(folder, neighbour, file_name); },
+                       1);
+        }
+    }
+}
+
+void GalleryLoader::decodeImage(int folder, int index, QString file_name)
+{
+    {
+        QMutexLocker locker(&mutex);
+        const bool wanted = folder == generation && std::abs(index - prefetchCenter) <= prefetchReach;
+        if (!wanted)
+        {
+            decoding.remove(index);
+            prefetched.wakeAll();
+            return;
+        }
+    }
+
+    const QImage image = readImage(file_name);
+
+    QMutexLocker locker(&mutex);
+    decoding.remove(index);
+    if (folder == generation && std::abs(index - prefetchCenter) <= prefetchReach && !image.isNull())
+        images.insert(index, image);
+    prefetched.wakeAll();
+}
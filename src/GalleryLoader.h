@@ -0,0 +1,76 @@
+#pragma once
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+// Thumbnails and full images of the pictures in a folder, decoded off the GUI thread.
+// Thumbnails are decoded at reduced scale, the rows on screen first, and kept on
+// disk keyed by path, modification time and file size, so a folder seen before
+// shows without decoding. Full images next to the one shown are decoded ahead.
+class GalleryLoader
+{
+public:
+    explicit GalleryLoader(int thumbnail_size = 96);
+    ~GalleryLoader();
+
+    bool open(const QString &folder);
+    void close();
+    int count() const { return files.size(); }
+    QString fileName(int index) const { return files.value(index); }
+    int thumbnailSize() const { return size; }
+    // An empty directory turns the disk cache off
+    void setCacheDirectory(const QString &directory);
+
+    // Receives each thumbnail on the GUI thread
+    void setReceiver(const std::function<void(int index, QImage thumbnail)> &function) { receiver = function; }
+    // Rows first to last are on screen. They are decoded first, then a screen
+    // either side of them, requests for rows scrolled away are dropped.
+    void requestThumbnails(int first, int last);
+
+    // The full image in a drawable format, taken from the prefetched ones when it is there
+    QImage image(int index);
+    // Decodes the images around index in the background
+    void prefetch(int index);
+
+    // Reads the thumbnail from cache_directory, or decodes it and stores it there
+    static QImage loadThumbnail(const QString &file_name, int size, const QString &cache_directory);
+
+private:
+    enum ThumbnailState : char
+    {
+        Missing,
+        Pending,
+        Taken
+    };
+
+    const int size;
+    QString cacheDirectory;
+    QStringList files;
+    std::function<void(int, QImage)> receiver;
+
+    QMutex mutex;
+    QWaitCondition prefetched;
+    QThreadPool pool;
+    QObject context; // lives on the GUI thread, results are delivered through its queue
+    int generation = 0; // bumped by close(), work for an earlier folder is dropped
+    std::vector<ThumbnailState> thumbnails;
+    std::deque<int> pending;
+    int workers = 0;
+
+    int prefetchCenter = -1;
+    QHash<int, QImage> images;
+    QSet<int> decoding;
+
+    void decodeThumbnails(int folder);
+    void decodeImage(int folder, int index, QString file_name);
+    static QImage readImage(const QString &file_name);
+};
@@ -0,0 +1,114 @@
+#include "GlyphAtlas.h"
+
+#include <QFontMetrics>
+#include <QPainter>
+
+#include <algorithm>
+#include <cstring>
+
+int GlyphAtlas::face(const QFont &font)
+{
+    // In pixels, so the metrics and the rasterized glyphs agree whatever the device
+    QFont sized(font);
+    if (sized.pixelSize() <= 0)
+        sized.setPixelSize(std::max(qRound(font.pointSizeF() * 96 / 72), 1));
+
+    const QString key = sized.key();
+    for (int i = 0; i < (int)faces.size(); i++)
+    {
+        if (faces[i].key == key)
+            return i;
+    }
+    Face created;
+    created.font = sized;
+    created.key = key;
+    faces.push_back(std::move(created));
+    return (int)faces.size() - 1;
+}
+
+int GlyphAtlas::glyphCount() const
+{
+    int count = 0;
+    for (const Face &face : faces)
+        count += (int)face.glyphs.size();
+    return count;
+}
+
+GlyphAtlas::Run GlyphAtlas::layout(int face_index, const QString &text)
+{
+    Face &face = faces[face_index];
+    Run run;
+    run.face = face_index;
+    int pen = 0;
+    for (uint code_point : text.toUcs4())
+    {
+        Glyph placed = glyph(face, code_point);
+        placed.offset.rx() += pen;
+        pen += placed.advance;
+        if (placed.source.isEmpty())
+            continue;
+        run.glyphs.append(placed);
+        run.bounds |= QRect(placed.offset, placed.source.size());
+    }
+    return run;
+}
+
+const GlyphAtlas::Glyph &GlyphAtlas::glyph(Face &face, uint code_point)
+{
+    auto found = face.glyphs.find(code_point);
+    if (found != face.glyphs.end())
+        return found->second;
+
+    const QString text = QString::fromUcs4(reinterpret_cast<const char32_t *>(&code_point), 1);
+    const QFontMetrics metrics(face.font);
+    Glyph created;
+    created.advance = metrics.horizontalAdvance(text);
+    // Antialiased edges may reach a pixel past the bounding box
+    const QRect bounds = metrics.boundingRect(text).adjusted(-1, -1, 1, 1);
+    created.offset = bounds.topLeft();
+    // Blank glyphs only advance the pen
+    if (!text.trimmed().isEmpty() && !bounds.isEmpty() && bounds.width() <= atlasWidth)
+    {
+        QImage bitmap(bounds.size(), QImage::Format_Alpha8);
+        bitmap.fill(0);
+        {
+            QPainter painter(&bitmap);
+            painter.setFont(face.font);
+            painter.setPen(Qt::black);
+            painter.drawText(-bounds.left(), -bounds.top(), text);
+        }
+        const QPoint at = place(face, bounds.size());
+        for (int y = 0; y < bounds.height(); y++)
+            std::memcpy(face.atlas.scanLine(at.y() + y) + at.x(), bitmap.constScanLine(y), bounds.width());
+        created.source = QRect(at, bounds.size());
+    }
+    return face.glyphs.emplace(code_point, created).first->second;
+}
+
+QPoint GlyphAtlas::place(Face &face, QSize size)
+{
+    if (face.shelfX + size.width() > atlasWidth)
+    {
+        face.shelfY += face.shelfHeight;
+        face.shelfX = 0;
+        face.shelfHeight = 0;
+    }
+    const QPoint at(face.shelfX, face.shelfY);
+    face.shelfX += size.width();
+    face.shelfHeight = std::max(face.shelfHeight, size.height());
+
+    // Doubling the height keeps the rectangles handed out so far where they are
+    const int needed = face.shelfY + face.shelfHeight;
+    if (needed > face.atlas.height())
+    {
+        int height = std::max(face.atlas.height(), 64);
+        while (height < needed)
+            height *= 2;
+        QImage grown(atlasWidth, height, QImage::Format_Alpha8);
+        grown.fill(0);
+        for (int y = 0; y < face.atlas.height(); y++)
+            std::memcpy(grown.scanLine(y), face.atlas.constScanLine(y), atlasWidth);
+        face.atlas = grown;
+    }
+    return at;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <QFont>
+#include <QImage>
+#include <QPoint>
+#include <QRect>
+#include <QString>
+#include <QVector>
+
+#include <unordered_map>
+#include <vector>
+
+// Alpha coverage of text glyphs, rasterized once per font and size.
+// Every face packs its glyphs into shelves of one Alpha8 atlas that only ever
+// grows downwards, so atlas rectangles stay valid once handed out. Labels are
+// laid out once into runs of glyph rectangles and offsets, drawing one blits
+// the coverage under the label's color without touching a font again.
+class GlyphAtlas
+{
+public:
+    static const int atlasWidth = 512;
+
+    // A glyph's coverage at source in the atlas, drawn with its top left at the pen + offset
+    struct Glyph
+    {
+        QRect source;
+        QPoint offset;
+        int advance;
+    };
+
+    // A laid out label, offsets are from its anchor on the baseline
+    struct Run
+    {
+        int face = -1;
+        QVector<Glyph> glyphs;
+        QRect bounds; // of the coverage, relative to the anchor
+    };
+
+    // Faces are found by family, pixel size, weight and style
+    int face(const QFont &font);
+    Run layout(int face, const QString &text);
+    const QImage &coverage(int face) const { return faces[face].atlas; }
+
+    int faceCount() const { return (int)faces.size(); }
+    int glyphCount() const;
+    void clear() { faces.clear(); }
+
+private:
+    struct Face
+    {
+        QFont font;
+        QString key;
+        QImage atlas;
+        std::unordered_map<uint, Glyph> glyphs;
+        // Shelf being filled, glyphs go left to right and a full shelf starts the next one below
+        int shelfX = 0, shelfY = 0, shelfHeight = 0;
+    };
+    std::vector<Face> faces;
+
+    const Glyph &glyph(Face &face, uint code_point);
+    QPoint place(Face &face, QSize size);
+};
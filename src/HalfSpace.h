@@ -0,0 +1,127 @@
+#pragma once
+#include <QPoint>
+#include <QRect>
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+
+// Half-space (edge function) triangle coverage over 8x8 pixel blocks.
+// The corners of a block are tested against the three edge functions: blocks
+// outside one edge are skipped, blocks inside all three are taken whole and
+// only blocks crossed by an edge are tested per pixel, one row of eight lanes
+// at a time. Pixel centers are sampled with the top-left rule, so triangles
+// sharing an edge neither overlap nor leave gaps.
+namespace HalfSpace
+{
+    static constexpr int blockSize = 8;
+
+    // Calls span(y, x_start, x_end) once per covered row inside bounds, top to bottom
+    template <class SpanFunction>
+    void triangle(QPoint a, QPoint b, QPoint c, const QRect &bounds, SpanFunction &&span)
+    {
+        // Twice the edge function at the center of pixel (x, y), inside when >= 0
+        struct Edge
+        {
+            qint64 dx, dy, c;
+            qint64 at(int x, int y) const { return dx * x + dy * y + c; }
+        };
+
+        const qint64 area = (qint64)(b.x() - a.x()) * (c.y() - a.y()) - (qint64)(b.y() - a.y()) * (c.x() - a.x());
+        if (area == 0)
+            return;
+        if (area < 0)
+            std::swap(b, c);
+
+        Edge edges[3];
+        const QPoint vertices[3] = {a, b, c};
+        for (int i = 0; i < 3; i++)
+        {
+            const QPoint from = vertices[i], d = vertices[(i + 1) % 3] - from;
+            const bool top_left = d.y() < 0 || (d.y() == 0 && d.x() > 0);
+            edges[i].dx = -2 * (qint64)d.y();
+            edges[i].dy = 2 * (qint64)d.x();
+            edges[i].c = (qint64)d.x() * (1 - 2 * (qint64)from.y()) - (qint64)d.y() * (1 - 2 * (qint64)from.x()) - (top_left ? 0 : 1);
+        }
+
+        const int x0 = std::max(std::min({a.x(), b.x(), c.x()}), bounds.left());
+        const int x1 = std::min(std::max({a.x(), b.x(), c.x()}) - 1, bounds.right());
+        const int y0 = std::max(std::min({a.y(), b.y(), c.y()}), bounds.top());
+        const int y1 = std::min(std::max({a.y(), b.y(), c.y()}) - 1, bounds.bottom());
+        if (x0 > x1 || y0 > y1)
+            return;
+
+        // Coverage of a row of blocks, the triangle is convex so each row is one run
+        int run_start[blockSize], run_end[blockSize];
+        for (int by = y0; by <= y1; by += blockSize)
+        {
+            const int rows = std::min(blockSize, y1 - by + 1);
+            std::fill(run_start, run_start + rows, INT_MAX);
+            std::fill(run_end, run_end + rows, INT_MIN);
+
+            bool covered = false;
+            for (int bx = x0; bx <= x1; bx += blockSize)
+            {
+                const int columns = std::min(blockSize, x1 - bx + 1);
+                const int right = bx + columns - 1, bottom = by + rows - 1;
+
+                bool inside = true, outside = false;
+                for (const Edge &edge : edges)
+                {
+                    const qint64 corners[4] = {edge.at(bx, by), edge.at(right, by), edge.at(bx, bottom), edge.at(right, bottom)};
+                    if (*std::max_element(corners, corners + 4) < 0)
+                    {
+                        outside = true;
+                        break;
+                    }
+                    if (*std::min_element(corners, corners + 4) < 0)
+                        inside = false;
+                }
+
+                if (outside)
+                {
+                    // Past the covered blocks, nothing further right can be covered
+                    if (covered)
+                        break;
+                    continue;
+                }
+                if (inside)
+                {
+                    for (int r = 0; r < rows; r++)
+                    {
+                        run_start[r] = std::min(run_start[r], bx);
+                        run_end[r] = bx + columns;
+                    }
+                    covered = true;
+                    continue;
+                }
+
+                for (int r = 0; r < rows; r++)
+                {
+                    const qint64 e0 = edges[0].at(bx, by + r), e1 = edges[1].at(bx, by + r), e2 = edges[2].at(bx, by + r);
+                    unsigned mask = 0;
+                    for (int i = 0; i < blockSize; i++)
+                        mask |= (unsigned)((e0 + i * edges[0].dx >= 0) & (e1 + i * edges[1].dx >= 0) & (e2 + i * edges[2].dx >= 0)) << i;
+                    mask &= (1u << columns) - 1;
+                    if (!mask)
+                        continue;
+
+                    int first = 0, last = columns - 1;
+                    while (!(mask >> first & 1))
+                        first++;
+                    while (!(mask >> last & 1))
+                        last--;
+                    run_start[r] = std::min(run_start[r], bx + first);
+                    run_end[r] = bx + last + 1;
+                    covered = true;
+                }
+            }
+
+            for (int r = 0; r < rows; r++)
+            {
+                if (run_start[r] < run_end[r])
+                    span(by + r, run_start[r], run_end[r]);
+            }
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#include "HistogramWidget.h"
+
+HistogramWidget::HistogramWidget(QWidget *parent)
+    : QWidget(parent)
+{
+    setMinimumHeight(100);
+}
+
+void HistogramWidget::setHistogram(const Histogram &new_histogram)
+{
+    histogram = new_histogram;
+    update();
+}
+
+// Slots
+void HistogramWidget::paintEvent(QPaintEvent *event)
+{
+    QPainter painter(this);
+    painter.fillRect(rect(), QColor(40, 40, 40));
+
+    if (histogram.pixels == 0 || histogram.luma.size() != 256)
+        return;
+
+    // Scale to the highest bin, ignoring pure black and white which often dominate
+    quint64 peak = 1;
+    for (int i = 1; i < 255; i++)
+        peak = std::max({peak, histogram.red[i], histogram.green[i], histogram.blue[i], histogram.luma[i]});
+
+    const double w = width() / 256., h = height();
+    auto bar = [&](quint64 count)
+    { return h * std::min(1., (double)count / peak); };
+
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(170, 170, 170));
+    for (int i = 0; i < 256; i++)
+    {
+        double top = bar(histogram.luma[i]);
+        painter.drawRect(QRectF(i * w, h - top, w, top));
+    }
+
+    const QVector<quint64> *channels[3] = {&histogram.red, &histogram.green, &histogram.blue};
+    const QColor colors[3] = {QColor(230, 60, 60), QColor(60, 200, 60), QColor(70, 110, 240)};
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setBrush(Qt::NoBrush);
+    for (int c = 0; c < 3; c++)
+    {
+        QPolygonF line;
+        for (int i = 0; i < 256; i++)
+            line << QPointF((i + 0.5) * w, h - bar((*channels[c])[i]));
+        painter.setPen(colors[c]);
+        painter.drawPolyline(line);
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <QtWidgets>
+
+#include "ColorAdjust.h"
+
+class HistogramWidget : public QWidget
+{
+    Q_OBJECT
+private:
+    Histogram histogram;
+
+public:
+    HistogramWidget(QWidget *parent = Q_NULLPTR);
+
+    void setHistogram(const Histogram &new_histogram);
+    const Histogram &getHistogram() { return histogram; }
+
+    QSize sizeHint() const Q_DECL_OVERRIDE { return QSize(256, 100); }
+
+public slots:
+    void paintEvent(QPaintEvent *event) Q_DECL_OVERRIDE;
+};
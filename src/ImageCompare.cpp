@@ -0,0 +1,366 @@
+#include "ImageCompare.h"
+#include "Parallel.h"
+#include "PixelFormat.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+    using PixelFormat::Layout;
+    using PixelFormat::layoutOf;
+
+    struct Plane
+    {
+        const uchar *bits;
+        qsizetype stride;
+
+        explicit Plane(const QImage &img) : bits(img.constBits()), stride(img.bytesPerLine()) {}
+
+        template <class T>
+        const T *row(int y) const { return reinterpret_cast<const T *>(bits + y * stride); }
+    };
+
+    // Both images converted to one drawable format, copies only where the formats differ
+    bool commonFormat(const QImage &a, const QImage &b, QImage &common_a, QImage &common_b, Layout &layout)
+    {
+        if (a.isNull() || b.isNull() || a.size() != b.size())
+            return false;
+
+        const QImage::Format format_a = PixelFormat::drawableFormat(a), format_b = PixelFormat::drawableFormat(b);
+        Layout layout_a, layout_b;
+        if (!layoutOf(format_a, layout_a) || !layoutOf(format_b, layout_b))
+            return false;
+
+        QImage::Format format;
+        if (format_a == format_b && !layout_a.premultiplied)
+            format = format_a;
+        else if (layout_a.wide || layout_b.wide)
+            format = QImage::Format_RGBA64;
+        else
+            format = a.hasAlphaChannel() || b.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+
+        common_a = a.format() == format ? a : a.convertToFormat(format);
+        common_b = b.format() == format ? b : b.convertToFormat(format);
+        return layoutOf(format, layout) && !common_a.isNull() && !common_b.isNull();
+    }
+
+    // Calls function with a null pointer of the channel type and the channel count as a constant
+    template <class Function>
+    void dispatchChannels(const Layout &layout, Function &&function)
+    {
+        auto channels = [&](auto type)
+        {
+            switch (layout.channels)
+            {
+            case 1:
+                function(type, std::integral_constant<int, 1>());
+                break;
+            case 3:
+                function(type, std::integral_constant<int, 3>());
+                break;
+            default:
+                function(type, std::integral_constant<int, 4>());
+                break;
+            }
+        };
+        if (layout.wide)
+            channels((const quint16 *)nullptr);
+        else
+            channels((const uchar *)nullptr);
+    }
+
+    //// Per-channel errors ////
+
+    struct Totals
+    {
+        quint64 squares[4] = {};
+        quint32 max[4] = {};
+        qint64 different = 0;
+    };
+
+    // Exact integer sums, a 16-bit difference squared still fits 32 bits
+    template <class T, int Channels>
+    void errorRows(const Plane &a, const Plane &b, int width, int y0, int y1, Totals &totals)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            const T *pa = a.row<T>(y), *pb = b.row<T>(y);
+            for (int x = 0; x < width; x++)
+            {
+                quint32 any = 0;
+                for (int c = 0; c < Channels; c++)
+                {
+                    const quint32 d = std::abs((int)pa[x * Channels + c] - (int)pb[x * Channels + c]);
+                    totals.squares[c] += d * d;
+                    totals.max[c] = std::max(totals.max[c], d);
+                    any |= d;
+                }
+                totals.different += any != 0;
+            }
+        }
+    }
+
+    //// SSIM ////
+
+    // 8x8 windows stepped by 4 pixels, built from sums over 4x4 blocks, as x264 does
+    const int blockSize = 4;
+
+    struct BlockRow
+    {
+        std::vector<float> sumA, sumB, sumSquares, sumProducts;
+
+        explicit BlockRow(int blocks) : sumA(blocks), sumB(blocks), sumSquares(blocks), sumProducts(blocks) {}
+    };
+
+    // Luma on the 0-255 scale
+    template <class T, int Channels>
+    void lumaRow(const T *in, const Layout &layout, int width, float *out)
+    {
+        const float scale = sizeof(T) == 1 ? 1.f : 1.f / 257;
+        if (Channels == 1)
+        {
+            for (int x = 0; x < width; x++)
+                out[x] = in[x] * scale;
+            return;
+        }
+        const int R = layout.red, G = layout.green, B = layout.blue;
+        for (int x = 0; x < width; x++)
+            out[x] = (0.299f * in[x * Channels + R] + 0.587f * in[x * Channels + G] + 0.114f * in[x * Channels + B]) * scale;
+    }
+
+    template <class T, int Channels>
+    void blockSums(const Plane &a, const Plane &b, const Layout &layout, int block_y, BlockRow &sums, float *luma_a, float *luma_b)
+    {
+        const int blocks = (int)sums.sumA.size(), width = blocks * blockSize;
+        std::fill(sums.sumA.begin(), sums.sumA.end(), 0.f);
+        std::fill(sums.sumB.begin(), sums.sumB.end(), 0.f);
+        std::fill(sums.sumSquares.begin(), sums.sumSquares.end(), 0.f);
+        std::fill(sums.sumProducts.begin(), sums.sumProducts.end(), 0.f);
+        for (int y = block_y * blockSize; y < (block_y + 1) * blockSize; y++)
+        {
+            lumaRow<T, Channels>(a.row<T>(y), layout, width, luma_a);
+            lumaRow<T, Channels>(b.row<T>(y), layout, width, luma_b);
+            for (int block = 0; block < blocks; block++)
+            {
+                for (int i = 0; i < blockSize; i++)
+                {
+                    const float va = luma_a[block * blockSize + i], vb = luma_b[block * blockSize + i];
+                    sums.sumA[block] += va;
+                    sums.sumB[block] += vb;
+                    sums.sumSquares[block] += va * va + vb * vb;
+                    sums.sumProducts[block] += va * vb;
+                }
+            }
+        }
+    }
+
+    // Sum of SSIM over the windows whose top rows of blocks are [first, last)
+    template <class T, int Channels>
+    double ssimRows(const Plane &a, const Plane &b, const Layout &layout, int blocks, int first, int last)
+    {
+        const double N = 4 * blockSize * blockSize;
+        const double C1 = (0.01 * 255) * (0.01 * 255) * N * N, C2 = (0.03 * 255) * (0.03 * 255) * N * (N - 1);
+
+        std::vector<float> luma_a(blocks * blockSize), luma_b(blocks * blockSize);
+        BlockRow above(blocks), below(blocks);
+        blockSums<T, Channels>(a, b, layout, first, above, luma_a.data(), luma_b.data());
+
+        double total = 0;
+        for (int block_y = first; block_y < last; block_y++)
+        {
+            blockSums<T, Channels>(a, b, layout, block_y + 1, below, luma_a.data(), luma_b.data());
+            for (int block = 0; block + 1 < blocks; block++)
+            {
+                // The variances are small differences of large sums, so double from here
+                const double s1 = (double)above.sumA[block] + above.sumA[block + 1] + below.sumA[block] + below.sumA[block + 1];
+                const double s2 = (double)above.sumB[block] + above.sumB[block + 1] + below.sumB[block] + below.sumB[block + 1];
+                const double ss = (double)above.sumSquares[block] + above.sumSquares[block + 1] + below.sumSquares[block] + below.sumSquares[block + 1];
+                const double s12 = (double)above.sumProducts[block] + above.sumProducts[block + 1] + below.sumProducts[block] + below.sumProducts[block + 1];
+                total += (2 * s1 * s2 + C1) * (2 * (N * s12 - s1 * s2) + C2) /
+                         ((s1 * s1 + s2 * s2 + C1) * (N * ss - s1 * s1 - s2 * s2 + C2));
+            }
+            std::swap(above, below);
+        }
+        return total;
+    }
+
+    // Black through blue, red and yellow to white
+    QRgb heat(int value)
+    {
+        static const QRgb stops[] = {qRgb(0, 0, 0), qRgb(32, 0, 160), qRgb(220, 20, 40), qRgb(255, 210, 0), qRgb(255, 255, 255)};
+        const double position = value / 255.0 * 4;
+        const int stop = std::min((int)position, 3);
+        const double t = position - stop;
+        const QRgb from = stops[stop], to = stops[stop + 1];
+        return qRgb(qRed(from) + (qRed(to) - qRed(from)) * t,
+                    qGreen(from) + (qGreen(to) - qGreen(from)) * t,
+                    qBlue(from) + (qBlue(to) - qBlue(from)) * t);
+    }
+}
+
+namespace ImageCompare
+{
+    bool compare(const QImage &a, const QImage &b, Metrics &metrics)
+    {
+        QImage common_a, common_b;
+        Layout layout;
+        if (!commonFormat(a, b, common_a, common_b, layout))
+            return false;
+
+        metrics = Metrics();
+        const Plane plane_a(common_a), plane_b(common_b);
+        const int width = common_a.width(), height = common_a.height();
+        metrics.pixels = (qint64)width * height;
+        metrics.peak = layout.wide ? 65535 : 255;
+
+        // Lanes of the interleaved pixel, in the order the metrics are named
+        int lanes[4];
+        if (layout.channels == 1)
+        {
+            metrics.channels = 1;
+            metrics.names[0] = "Gray";
+            lanes[0] = 0;
+        }
+        else
+        {
+            metrics.channels = common_a.hasAlphaChannel() ? 4 : 3;
+            const QString names[4] = {"R", "G", "B", "A"};
+            const int layout_lanes[4] = {layout.red, layout.green, layout.blue, layout.alpha};
+            for (int c = 0; c < metrics.channels; c++)
+            {
+                metrics.names[c] = names[c];
+                lanes[c] = layout_lanes[c];
+            }
+        }
+
+        Totals totals;
+        std::mutex merge;
+        dispatchChannels(layout, [&](auto type, auto channels)
+                         {
+            using T = std::remove_const_t<std::remove_pointer_t<decltype(type)>>;
+            Parallel::forRows(0, height, [&](int y0, int y1)
+                              {
+                Totals stripe;
+                errorRows<T, decltype(channels)::value>(plane_a, plane_b, width, y0, y1, stripe);
+
+                std::lock_guard<std::mutex> lock(merge);
+                for (int c = 0; c < 4; c++)
+                {
+                    totals.squares[c] += stripe.squares[c];
+                    totals.max[c] = std::max(totals.max[c], stripe.max[c]);
+                }
+                totals.different += stripe.different; }); });
+
+        const double infinity = std::numeric_limits<double>::infinity();
+        quint64 squares = 0;
+        for (int c = 0; c < metrics.channels; c++)
+        {
+            const int lane = lanes[c];
+            squares += totals.squares[lane];
+            metrics.maxError[c] = totals.max[lane];
+            metrics.mse[c] = (double)totals.squares[lane] / metrics.pixels;
+            metrics.psnr[c] = metrics.mse[c] > 0 ? 10 * std::log10(metrics.peak * metrics.peak / metrics.mse[c]) : infinity;
+        }
+        const double mse = (double)squares / metrics.pixels / metrics.channels;
+        metrics.psnrAll = mse > 0 ? 10 * std::log10(metrics.peak * metrics.peak / mse) : infinity;
+        metrics.differentPixels = totals.different;
+
+        const int blocks_x = width / blockSize, blocks_y = height / blockSize;
+        if (blocks_x < 2 || blocks_y < 2)
+        {
+            // Not one whole window, identical images still score 1
+            metrics.ssim = totals.different == 0 ? 1 : std::numeric_limits<double>::quiet_NaN();
+            return true;
+        }
+
+        double ssim = 0;
+        dispatchChannels(layout, [&](auto type, auto channels)
+                         {
+            using T = std::remove_const_t<std::remove_pointer_t<decltype(type)>>;
+            // Rows of windows, each stripe sums the row of blocks above its first one again
+            Parallel::forRows(0, blocks_y - 1, [&](int first, int last)
+                              {
+                const double stripe = ssimRows<T, decltype(channels)::value>(plane_a, plane_b, layout, blocks_x, first, last);
+                std::lock_guard<std::mutex> lock(merge);
+                ssim += stripe; }, 4); });
+        metrics.ssim = ssim / ((double)(blocks_x - 1) * (blocks_y - 1));
+        return true;
+    }
+
+    QImage differenceMap(const QImage &a, const QImage &b, double gain)
+    {
+        QImage common_a, common_b;
+        Layout layout;
+        if (!commonFormat(a, b, common_a, common_b, layout))
+            return QImage();
+
+        QRgb colors[256];
+        for (int i = 0; i < 256; i++)
+            colors[i] = heat(i);
+
+        QImage map(common_a.size(), QImage::Format_RGB32);
+        const Plane plane_a(common_a), plane_b(common_b);
+        uchar *out = map.bits();
+        const qsizetype out_stride = map.bytesPerLine();
+        const int width = map.width();
+        const float scale = (float)gain / (layout.wide ? 257 : 1);
+
+        dispatchChannels(layout, [&](auto type, auto channels)
+                         {
+            using T = std::remove_const_t<std::remove_pointer_t<decltype(type)>>;
+            const int ch = decltype(channels)::value;
+            Parallel::forRows(0, map.height(), [&](int y0, int y1)
+                              {
+                std::vector<quint32> largest(width);
+                for (int y = y0; y < y1; y++)
+                {
+                    const T *pa = plane_a.row<T>(y), *pb = plane_b.row<T>(y);
+                    for (int x = 0; x < width; x++)
+                    {
+                        quint32 d = 0;
+                        for (int c = 0; c < ch; c++)
+                            d = std::max<quint32>(d, std::abs((int)pa[x * ch + c] - (int)pb[x * ch + c]));
+                        largest[x] = d;
+                    }
+                    QRgb *line = reinterpret_cast<QRgb *>(out + y * out_stride);
+                    for (int x = 0; x < width; x++)
+                        line[x] = colors[std::min((int)(largest[x] * scale + 0.5f), 255)];
+                } }); });
+        return map;
+    }
+
+    QString report(const Metrics &metrics)
+    {
+        auto decibels = [](double psnr)
+        {
+            return std::isinf(psnr) ? QString("inf") : QString::number(psnr, 'f', 2);
+        };
+
+        QString text = QString("%1 %2 %3 %4\n")
+                           .arg("channel", -8)
+                           .arg("max err", 9)
+                           .arg("MSE", 12)
+                           .arg("PSNR dB", 9);
+        for (int c = 0; c < metrics.channels; c++)
+        {
+            text += QString("%1 %2 %3 %4\n")
+                        .arg(metrics.names[c], -8)
+                        .arg(metrics.maxError[c], 9, 'f', 0)
+                        .arg(metrics.mse[c], 12, 'f', 4)
+                        .arg(decibels(metrics.psnr[c]), 9);
+        }
+        text += QString("%1 %2\n").arg("all", -8).arg(decibels(metrics.psnrAll), 32);
+        text += QString("SSIM %1\n").arg(std::isnan(metrics.ssim) ? QString("n/a") : QString::number(metrics.ssim, 'f', 6));
+        text += QString("Different pixels %1 of %2 (%3%)\n")
+                    .arg(metrics.differentPixels)
+                    .arg(metrics.pixels)
+                    .arg(metrics.pixels > 0 ? 100.0 * metrics.differentPixels / metrics.pixels : 0.0, 0, 'f', 4);
+        return text;
+    }
+}
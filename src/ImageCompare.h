@@ -0,0 +1,33 @@
+#pragma once
+#include <QImage>
+#include <QString>
+
+// Error metrics between two images of the same size, for checking renders
+// against golden images.
+// Rows are striped across the thread pool and the per-pixel loops are
+// templated on the channel type and count, so they vectorize. Images of
+// different formats are compared in a common one, 16-bit if either is.
+namespace ImageCompare
+{
+    struct Metrics
+    {
+        int channels = 0;         // 1 for gray, 3 for RGB, 4 with alpha
+        QString names[4];         // channel names in the order of the arrays below
+        double peak = 255;        // largest channel value, 65535 for 16-bit images
+        double maxError[4] = {};
+        double mse[4] = {};
+        double psnr[4] = {};      // dB, infinite for identical channels
+        double psnrAll = 0;       // over all channels together
+        double ssim = 1;          // mean over 8x8 windows of the luma, stepped by 4 pixels
+        qint64 differentPixels = 0;
+        qint64 pixels = 0;
+    };
+
+    // False when the images are null, differ in size or cannot be converted
+    bool compare(const QImage &a, const QImage &b, Metrics &metrics);
+
+    // Largest channel difference of every pixel times gain, through a heat color map
+    QImage differenceMap(const QImage &a, const QImage &b, double gain = 1);
+
+    QString report(const Metrics &metrics);
+}
@@ -0,0 +1,623 @@
+#include "ImageFilter.h"
+#include "Parallel.h"
+#include "PixelFormat.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    using PixelFormat::Layout;
+    using PixelFormat::layoutOf;
+
+    // Rows of an image, taken once so worker threads never call into QImage
+    struct Raster
+    {
+        uchar *bits;
+        qsizetype stride;
+        int width;
+        int height;
+        Layout layout;
+
+        Raster(QImage &img, const Layout &layout)
+            : bits(img.bits()), stride(img.bytesPerLine()), width(img.width()), height(img.height()), layout(layout) {}
+
+        template <class T>
+        T *row(int y) const { return reinterpret_cast<T *>(bits + y * stride); }
+        int length() const { return width * layout.channels; }
+        int clampY(int y) const { return std::min(std::max(y, 0), height - 1); }
+    };
+
+    template <class T>
+    constexpr float channelMax() { return sizeof(T) == 1 ? 255.f : 65535.f; }
+
+    // Row converted to float with pad edge pixels repeated on both sides
+    template <class T>
+    void loadPadded(const T *in, float *padded, int width, int channels, int pad)
+    {
+        const int length = width * channels;
+        float *body = padded + pad * channels;
+        for (int x = 0; x < pad; x++)
+        {
+            for (int c = 0; c < channels; c++)
+            {
+                padded[x * channels + c] = in[c];
+                body[length + x * channels + c] = in[length - channels + c];
+            }
+        }
+        for (int i = 0; i < length; i++)
+            body[i] = in[i];
+    }
+
+    // Overwrites the alpha entries of acc with the original alpha
+    template <class T>
+    void keepAlpha(float *acc, const T *original, const Raster &raster)
+    {
+        const int channels = raster.layout.channels, alpha = raster.layout.alpha;
+        if (alpha < 0)
+            return;
+        for (int x = 0; x < raster.width; x++)
+            acc[x * channels + alpha] = original[x * channels + alpha];
+    }
+
+    template <class T>
+    void storeRow(T *out, const float *acc, int length)
+    {
+        const float max = channelMax<T>();
+        for (int i = 0; i < length; i++)
+            out[i] = (T)std::min(std::max(acc[i] + 0.5f, 0.f), max);
+    }
+
+    void copyRows(const Raster &dst, const Raster &src)
+    {
+        const size_t bytes = (size_t)src.length() * (src.layout.wide ? 2 : 1);
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            for (int y = y0; y < y1; y++)
+                std::memcpy(dst.bits + y * dst.stride, src.bits + y * src.stride, bytes); });
+    }
+
+    //// Separable convolution ////
+
+    template <class T>
+    void horizontalPass(const Raster &src, const Raster &dst, const std::vector<float> &weights)
+    {
+        const int radius = (int)weights.size() / 2, channels = src.layout.channels, length = src.length();
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            std::vector<float> padded((size_t)(src.width + 2 * radius) * channels), acc(length);
+            for (int y = y0; y < y1; y++)
+            {
+                loadPadded(src.row<T>(y), padded.data(), src.width, channels, radius);
+                std::fill(acc.begin(), acc.end(), 0.f);
+                for (size_t k = 0; k < weights.size(); k++)
+                {
+                    const float w = weights[k];
+                    const float *p = padded.data() + k * channels;
+                    float *a = acc.data();
+                    for (int i = 0; i < length; i++)
+                        a[i] += w * p[i];
+                }
+                storeRow(dst.row<T>(y), acc.data(), length);
+            } });
+    }
+
+    template <class T>
+    void verticalPass(const Raster &src, const Raster &dst, const std::vector<float> &weights)
+    {
+        const int radius = (int)weights.size() / 2, length = src.length();
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            std::vector<float> acc(length);
+            for (int y = y0; y < y1; y++)
+            {
+                std::fill(acc.begin(), acc.end(), 0.f);
+                for (int k = -radius; k <= radius; k++)
+                {
+                    const float w = weights[k + radius];
+                    const T *in = src.row<T>(src.clampY(y + k));
+                    float *a = acc.data();
+                    for (int i = 0; i < length; i++)
+                        a[i] += w * in[i];
+                }
+                keepAlpha(acc.data(), dst.row<T>(y), dst);
+                storeRow(dst.row<T>(y), acc.data(), length);
+            } });
+    }
+
+    template <class T>
+    void separable(QImage &img, const Layout &layout, const std::vector<float> &weights)
+    {
+        QImage tmp(img.size(), img.format());
+        Raster raster(img, layout), scratch(tmp, layout);
+        horizontalPass<T>(raster, scratch, weights);
+        verticalPass<T>(scratch, raster, weights);
+    }
+
+    //// Box filter with running sums ////
+
+    // Pixels past the ends repeat the end pixels. The first window counts the
+    // repeats instead of reading them, so no step grows with the radius.
+    template <class T>
+    void boxHorizontal(const Raster &src, const Raster &dst, int radius)
+    {
+        const int channels = src.layout.channels, length = src.length(), width = src.width;
+        const int inside = std::min(radius, width - 1);
+        const float scale = 1.f / (2 * radius + 1);
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            std::vector<float> acc(length);
+            float sum[4];
+            for (int y = y0; y < y1; y++)
+            {
+                const T *in = src.row<T>(y), *last = in + length - channels;
+                for (int c = 0; c < channels; c++)
+                {
+                    sum[c] = (float)radius * in[c] + (float)(radius - inside) * last[c];
+                    for (int x = 0; x <= inside; x++)
+                        sum[c] += in[x * channels + c];
+                }
+                for (int x = 0; x < width; x++)
+                {
+                    const T *leaving = in + std::max(x - radius, 0) * channels;
+                    const T *entering = in + std::min(x + radius + 1, width - 1) * channels;
+                    for (int c = 0; c < channels; c++)
+                    {
+                        acc[x * channels + c] = sum[c] * scale;
+                        sum[c] += (float)entering[c] - (float)leaving[c];
+                    }
+                }
+                storeRow(dst.row<T>(y), acc.data(), length);
+            } });
+    }
+
+    // Threads take slices of columns down the whole image rather than stripes
+    // of rows, so the first window is summed once per slice and never from more
+    // rows than the image has
+    template <class T>
+    void boxVertical(const Raster &src, const Raster &dst, int radius)
+    {
+        const int channels = src.layout.channels, alpha = src.layout.alpha, length = src.length(), height = src.height;
+        const int slice = 256 * channels, inside = std::min(radius, height - 1);
+        const float scale = 1.f / (2 * radius + 1);
+        Parallel::forRows(0, (length + slice - 1) / slice, [&](int s0, int s1)
+                          {
+            std::vector<float> sum(slice), acc(slice);
+            for (int s = s0; s < s1; s++)
+            {
+                const int start = s * slice, count = std::min(slice, length - start);
+                const T *first = src.row<T>(0) + start, *last = src.row<T>(height - 1) + start;
+                for (int i = 0; i < count; i++)
+                    sum[i] = (float)radius * first[i] + (float)(radius - inside) * last[i];
+                for (int y = 0; y <= inside; y++)
+                {
+                    const T *in = src.row<T>(y) + start;
+                    for (int i = 0; i < count; i++)
+                        sum[i] += in[i];
+                }
+                for (int y = 0; y < height; y++)
+                {
+                    T *out = dst.row<T>(y) + start;
+                    float *s = sum.data(), *a = acc.data();
+                    for (int i = 0; i < count; i++)
+                        a[i] = s[i] * scale;
+                    if (alpha >= 0)
+                    {
+                        for (int i = alpha; i < count; i += channels)
+                            a[i] = out[i];
+                    }
+                    storeRow(out, a, count);
+
+                    const T *leaving = src.row<T>(std::max(y - radius, 0)) + start;
+                    const T *entering = src.row<T>(std::min(y + radius + 1, height - 1)) + start;
+                    for (int i = 0; i < count; i++)
+                        s[i] += (float)entering[i] - (float)leaving[i];
+                }
+            } }, 1);
+    }
+
+    template <class T>
+    void boxPasses(QImage &img, const Layout &layout, const std::vector<int> &radii)
+    {
+        QImage tmp(img.size(), img.format());
+        Raster raster(img, layout), scratch(tmp, layout);
+        for (int radius : radii)
+        {
+            if (radius < 1)
+                continue;
+            boxHorizontal<T>(raster, scratch, radius);
+            boxVertical<T>(scratch, raster, radius);
+        }
+    }
+
+    // Box radii whose cascade approximates a gaussian of the given sigma
+    std::vector<int> gaussianBoxRadii(double sigma, int passes)
+    {
+        double w_ideal = std::sqrt(12 * sigma * sigma / passes + 1);
+        int wl = (int)std::floor(w_ideal);
+        if (wl % 2 == 0)
+            wl--;
+        int wu = wl + 2;
+
+        double m_ideal = (12 * sigma * sigma - passes * wl * wl - 4 * passes * wl - 3 * passes) / (-4. * wl - 4);
+        int m = (int)std::round(m_ideal);
+
+        std::vector<int> radii;
+        for (int i = 0; i < passes; i++)
+            radii.push_back(((i < m ? wl : wu) - 1) / 2);
+        return radii;
+    }
+
+    std::vector<float> gaussianWeights(double sigma)
+    {
+        int radius = std::max(1, (int)std::ceil(3 * sigma));
+        std::vector<float> weights(2 * radius + 1);
+        double sum = 0;
+        for (int k = -radius; k <= radius; k++)
+        {
+            weights[k + radius] = (float)std::exp(-(k * k) / (2 * sigma * sigma));
+            sum += weights[k + radius];
+        }
+        for (float &w : weights)
+            w = (float)(w / sum);
+        return weights;
+    }
+
+    //// General kernels ////
+
+    template <class T>
+    void convolve2D(QImage &img, const Layout &layout, const QVector<float> &kernel, int kw, int kh, float scale, float bias)
+    {
+        QImage out(img.size(), img.format());
+        Raster src(img, layout), dst(out, layout);
+        const int rx = kw / 2, ry = kh / 2, channels = layout.channels, length = src.length();
+
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            std::vector<float> padded((size_t)(src.width + 2 * rx) * channels), acc(length);
+            for (int y = y0; y < y1; y++)
+            {
+                std::fill(acc.begin(), acc.end(), bias);
+                for (int ky = 0; ky < kh; ky++)
+                {
+                    loadPadded(src.row<T>(src.clampY(y + ky - ry)), padded.data(), src.width, channels, rx);
+                    for (int kx = 0; kx < kw; kx++)
+                    {
+                        const float w = kernel[ky * kw + kx] * scale;
+                        if (w == 0)
+                            continue;
+                        const float *p = padded.data() + kx * channels;
+                        float *a = acc.data();
+                        for (int i = 0; i < length; i++)
+                            a[i] += w * p[i];
+                    }
+                }
+                keepAlpha(acc.data(), src.row<T>(y), src);
+                storeRow(dst.row<T>(y), acc.data(), length);
+            } });
+
+        copyRows(src, dst);
+    }
+
+    template <class T>
+    void sobel(QImage &img, const Layout &layout)
+    {
+        QImage out(img.size(), img.format());
+        Raster src(img, layout), dst(out, layout);
+        const int channels = layout.channels, length = src.length(), padded_length = length + 2 * channels;
+
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            std::vector<float> above(padded_length), center(padded_length), below(padded_length), acc(length);
+            for (int y = y0; y < y1; y++)
+            {
+                loadPadded(src.row<T>(src.clampY(y - 1)), above.data(), src.width, channels, 1);
+                loadPadded(src.row<T>(y), center.data(), src.width, channels, 1);
+                loadPadded(src.row<T>(src.clampY(y + 1)), below.data(), src.width, channels, 1);
+
+                const float *a = above.data(), *b = center.data(), *c = below.data();
+                const int r = 2 * channels, m = channels;
+                for (int i = 0; i < length; i++)
+                {
+                    float gx = (a[i + r] - a[i]) + 2 * (b[i + r] - b[i]) + (c[i + r] - c[i]);
+                    float gy = (c[i] + 2 * c[i + m] + c[i + r]) - (a[i] + 2 * a[i + m] + a[i + r]);
+                    acc[i] = gx * gx + gy * gy;
+                }
+                for (int i = 0; i < length; i++)
+                    acc[i] = std::sqrt(acc[i]);
+
+                keepAlpha(acc.data(), src.row<T>(y), src);
+                storeRow(dst.row<T>(y), acc.data(), length);
+            } });
+
+        copyRows(src, dst);
+    }
+
+    template <class T>
+    void unsharp(QImage &img, const Layout &layout, const QImage &blurred, float amount, float threshold)
+    {
+        Raster dst(img, layout);
+        const uchar *blurred_bits = blurred.constBits();
+        const qsizetype blurred_stride = blurred.bytesPerLine();
+        const int length = dst.length();
+
+        Parallel::forRows(0, dst.height, [&](int y0, int y1)
+                          {
+            std::vector<float> acc(length);
+            for (int y = y0; y < y1; y++)
+            {
+                const T *s = dst.row<T>(y);
+                const T *b = reinterpret_cast<const T *>(blurred_bits + y * blurred_stride);
+                for (int i = 0; i < length; i++)
+                {
+                    float d = (float)s[i] - (float)b[i];
+                    acc[i] = std::abs(d) >= threshold ? s[i] + amount * d : s[i];
+                }
+                keepAlpha(acc.data(), s, dst);
+                storeRow(dst.row<T>(y), acc.data(), length);
+            } });
+    }
+
+    //// Median ////
+
+    // Huang's sliding histogram, 8-bit channels
+    void median8(const Raster &src, const Raster &dst, int radius)
+    {
+        const int channels = src.layout.channels, window = 2 * radius + 1;
+        const int half = window * window / 2;
+
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            std::vector<const uchar *> rows(window);
+            int hist[256];
+            for (int y = y0; y < y1; y++)
+            {
+                for (int k = 0; k < window; k++)
+                    rows[k] = src.row<uchar>(src.clampY(y + k - radius));
+                uchar *out = dst.row<uchar>(y);
+
+                for (int c = 0; c < channels; c++)
+                {
+                    if (c == src.layout.alpha)
+                    {
+                        const uchar *in = src.row<uchar>(y);
+                        for (int x = 0; x < src.width; x++)
+                            out[x * channels + c] = in[x * channels + c];
+                        continue;
+                    }
+
+                    std::fill(hist, hist + 256, 0);
+                    for (int k = 0; k < window; k++)
+                        for (int dx = -radius; dx <= radius; dx++)
+                            hist[rows[k][std::min(std::max(dx, 0), src.width - 1) * channels + c]]++;
+
+                    int m = 0, below = 0;
+                    while (below + hist[m] <= half)
+                        below += hist[m++];
+                    out[c] = m;
+
+                    for (int x = 1; x < src.width; x++)
+                    {
+                        const int leaving = std::max(x - radius - 1, 0) * channels + c;
+                        const int entering = std::min(x + radius, src.width - 1) * channels + c;
+                        for (int k = 0; k < window; k++)
+                        {
+                            int v = rows[k][leaving];
+                            hist[v]--;
+                            if (v < m)
+                                below--;
+                            v = rows[k][entering];
+                            hist[v]++;
+                            if (v < m)
+                                below++;
+                        }
+                        while (below > half)
+                            below -= hist[--m];
+                        while (below + hist[m] <= half)
+                            below += hist[m++];
+                        out[x * channels + c] = m;
+                    }
+                }
+            } });
+    }
+
+    // Selection in the window, 16-bit channels
+    void median16(const Raster &src, const Raster &dst, int radius)
+    {
+        const int channels = src.layout.channels, window = 2 * radius + 1;
+
+        Parallel::forRows(0, src.height, [&](int y0, int y1)
+                          {
+            std::vector<const quint16 *> rows(window);
+            std::vector<quint16> values(window * window);
+            for (int y = y0; y < y1; y++)
+            {
+                for (int k = 0; k < window; k++)
+                    rows[k] = src.row<quint16>(src.clampY(y + k - radius));
+                quint16 *out = dst.row<quint16>(y);
+
+                for (int x = 0; x < src.width; x++)
+                {
+                    for (int c = 0; c < channels; c++)
+                    {
+                        if (c == src.layout.alpha)
+                        {
+                            out[x * channels + c] = rows[radius][x * channels + c];
+                            continue;
+                        }
+                        int n = 0;
+                        for (int k = 0; k < window; k++)
+                            for (int dx = -radius; dx <= radius; dx++)
+                                values[n++] = rows[k][std::min(std::max(x + dx, 0), src.width - 1) * channels + c];
+                        std::nth_element(values.begin(), values.begin() + n / 2, values.begin() + n);
+                        out[x * channels + c] = values[n / 2];
+                    }
+                }
+            } });
+    }
+}
+
+namespace ImageFilter
+{
+    bool isSupported(QImage::Format format)
+    {
+        Layout layout;
+        return layoutOf(format, layout);
+    }
+
+    bool convolve(QImage &img, const QVector<float> &kernel, int width, int height, float divisor, float bias)
+    {
+        Layout layout;
+        if (!layoutOf(img.format(), layout) || img.isNull())
+            return false;
+        if (width < 1 || height < 1 || width % 2 == 0 || height % 2 == 0 || kernel.size() != width * height)
+            return false;
+
+        if (divisor == 0)
+        {
+            for (float w : kernel)
+                divisor += w;
+            if (divisor == 0)
+                divisor = 1;
+        }
+
+        // Non-negative rank-one kernels (box, gaussian, ...) take the separable path
+        int pivot_index = 0;
+        bool non_negative = true;
+        for (int i = 0; i < kernel.size(); i++)
+        {
+            if (std::abs(kernel[i]) > std::abs(kernel[pivot_index]))
+                pivot_index = i;
+            non_negative = non_negative && kernel[i] >= 0;
+        }
+        const float pivot = kernel[pivot_index];
+        const int pivot_x = pivot_index % width, pivot_y = pivot_index / width;
+
+        std::vector<float> row(width), column(height);
+        bool separable_kernel = non_negative && pivot != 0;
+        for (int y = 0; separable_kernel && y < height; y++)
+        {
+            column[y] = kernel[y * width + pivot_x] / pivot;
+            for (int x = 0; x < width; x++)
+            {
+                row[x] = kernel[pivot_y * width + x];
+                if (std::abs(kernel[y * width + x] - column[y] * row[x]) > 1e-6f * std::abs(pivot))
+                    separable_kernel = false;
+            }
+        }
+
+        if (separable_kernel && bias == 0)
+        {
+            for (float &w : row)
+                w /= divisor;
+            QImage tmp(img.size(), img.format());
+            Raster raster(img, layout), scratch(tmp, layout);
+            if (layout.wide)
+            {
+                horizontalPass<quint16>(raster, scratch, row);
+                verticalPass<quint16>(scratch, raster, column);
+            }
+            else
+            {
+                horizontalPass<uchar>(raster, scratch, row);
+                verticalPass<uchar>(scratch, raster, column);
+            }
+            return true;
+        }
+
+        if (layout.wide)
+            convolve2D<quint16>(img, layout, kernel, width, height, 1 / divisor, bias);
+        else
+            convolve2D<uchar>(img, layout, kernel, width, height, 1 / divisor, bias);
+        return true;
+    }
+
+    bool gaussianBlur(QImage &img, double sigma)
+    {
+        Layout layout;
+        if (!layoutOf(img.format(), layout) || img.isNull())
+            return false;
+        if (sigma <= 0)
+            return true;
+
+        // Past this sigma three box passes are cheaper than the direct kernel
+        if (sigma >= 6)
+        {
+            std::vector<int> radii = gaussianBoxRadii(sigma, 3);
+            if (layout.wide)
+                boxPasses<quint16>(img, layout, radii);
+            else
+                boxPasses<uchar>(img, layout, radii);
+            return true;
+        }
+
+        std::vector<float> weights = gaussianWeights(sigma);
+        if (layout.wide)
+            separable<quint16>(img, layout, weights);
+        else
+            separable<uchar>(img, layout, weights);
+        return true;
+    }
+
+    bool boxBlur(QImage &img, int radius)
+    {
+        Layout layout;
+        if (!layoutOf(img.format(), layout) || img.isNull())
+            return false;
+
+        if (layout.wide)
+            boxPasses<quint16>(img, layout, {radius});
+        else
+            boxPasses<uchar>(img, layout, {radius});
+        return true;
+    }
+
+    bool unsharpMask(QImage &img, double sigma, double amount, int threshold)
+    {
+        Layout layout;
+        if (!layoutOf(img.format(), layout) || img.isNull())
+            return false;
+
+        QImage blurred = img.copy();
+        gaussianBlur(blurred, sigma);
+
+        if (layout.wide)
+            unsharp<quint16>(img, layout, blurred, (float)amount, threshold * 257.f);
+        else
+            unsharp<uchar>(img, layout, blurred, (float)amount, (float)threshold);
+        return true;
+    }
+
+    bool sobel(QImage &img)
+    {
+        Layout layout;
+        if (!layoutOf(img.format(), layout) || img.isNull())
+            return false;
+
+        if (layout.wide)
+            ::sobel<quint16>(img, layout);
+        else
+            ::sobel<uchar>(img, layout);
+        return true;
+    }
+
+    bool median(QImage &img, int radius)
+    {
+        Layout layout;
+        if (!layoutOf(img.format(), layout) || img.isNull())
+            return false;
+        if (radius < 1)
+            return true;
+
+        QImage out(img.size(), img.format());
+        Raster src(img, layout), dst(out, layout);
+        if (layout.wide)
+            median16(src, dst, radius);
+        else
+            median8(src, dst, radius);
+        copyRows(src, dst);
+        return true;
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <QImage>
+#include <QVector>
+
+// Raster filters working in place on the canvas image.
+// Rows are striped across the thread pool and every inner loop runs over a
+// whole row of float accumulators, so it vectorizes. The alpha channel is
+// kept as it was. Functions return false for formats without a rasterizer.
+namespace ImageFilter
+{
+    bool isSupported(QImage::Format format);
+
+    // Arbitrary kernel, row-major, width * height values with odd sizes.
+    // A divisor of 0 divides by the kernel sum (or 1 when the sum is 0).
+    bool convolve(QImage &img, const QVector<float> &kernel, int width, int height, float divisor = 0, float bias = 0);
+
+    // Separable kernel for small sigma, three box passes for large sigma.
+    // Box passes cost the same whatever the radius.
+    bool gaussianBlur(QImage &img, double sigma);
+    bool boxBlur(QImage &img, int radius);
+
+    bool unsharpMask(QImage &img, double sigma, double amount, int threshold = 0);
+    bool sobel(QImage &img);
+    bool median(QImage &img, int radius);
+}
@@ -0,0 +1,469 @@
+#include "ImageTransform.h"
+#include "Parallel.h"
+#include "PixelFormat.h"
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+    using ImageTransform::Filter;
+    using PixelFormat::Layout;
+    using PixelFormat::layoutOf;
+
+    //// Kernels ////
+
+    int kernelRadius(Filter filter)
+    {
+        switch (filter)
+        {
+        case ImageTransform::Bicubic:
+            return 2;
+        case ImageTransform::Lanczos:
+            return 3;
+        default:
+            return 1;
+        }
+    }
+
+    double sinc(double x)
+    {
+        if (x == 0)
+            return 1;
+        x *= M_PI;
+        return std::sin(x) / x;
+    }
+
+    double kernel(Filter filter, double x)
+    {
+        x = std::abs(x);
+        switch (filter)
+        {
+        case ImageTransform::Nearest:
+            return x < 0.5 ? 1 : 0;
+        case ImageTransform::Bilinear:
+            return x < 1 ? 1 - x : 0;
+        case ImageTransform::Bicubic:
+            // Catmull-Rom
+            if (x < 1)
+                return (1.5 * x - 2.5) * x * x + 1;
+            if (x < 2)
+                return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+            return 0;
+        default:
+            return x < 3 ? sinc(x) * sinc(x / 3) : 0;
+        }
+    }
+
+    template <class T>
+    constexpr float channelMax() { return sizeof(T) == 1 ? 255.f : 65535.f; }
+
+    // Calls function(T *, std::integral_constant<int, channels>) for the layout
+    template <class Function>
+    void byChannels(const Layout &layout, Function &&function)
+    {
+        if (layout.wide)
+        {
+            if (layout.channels == 1)
+                function((quint16 *)nullptr, std::integral_constant<int, 1>());
+            else
+                function((quint16 *)nullptr, std::integral_constant<int, 4>());
+        }
+        else if (layout.channels == 1)
+            function((uchar *)nullptr, std::integral_constant<int, 1>());
+        else if (layout.channels == 3)
+            function((uchar *)nullptr, std::integral_constant<int, 3>());
+        else
+            function((uchar *)nullptr, std::integral_constant<int, 4>());
+    }
+
+    // Alpha formats are resampled premultiplied, so transparent pixels do not bleed their color
+    QImage::Format workingFormat(QImage::Format format)
+    {
+        switch (format)
+        {
+        case QImage::Format_ARGB32:
+            return QImage::Format_ARGB32_Premultiplied;
+        case QImage::Format_RGBA64:
+            return QImage::Format_RGBA64_Premultiplied;
+        default:
+            return format;
+        }
+    }
+
+    // Rounds and clamps a row, premultiplied colors are kept below their alpha
+    template <class T, int Channels>
+    void storeRow(T *out, float *acc, int width, int alpha, bool premultiplied)
+    {
+        const float max = channelMax<T>();
+        if (premultiplied && alpha >= 0)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                float *p = acc + x * Channels;
+                const float a = std::min(std::max(p[alpha], 0.f), max);
+                for (int c = 0; c < Channels; c++)
+                    p[c] = std::min(p[c], a);
+            }
+        }
+        for (int i = 0; i < width * Channels; i++)
+            out[i] = (T)std::min(std::max(acc[i] + 0.5f, 0.f), max);
+    }
+
+    //// Resize ////
+
+    // Contributions of source pixels to every destination pixel along one axis.
+    // Each destination pixel reads taps consecutive source pixels from its start.
+    struct Weights
+    {
+        int taps = 1;
+        std::vector<int> start;
+        std::vector<float> values;
+    };
+
+    Weights resampleWeights(int src_size, int dst_size, Filter filter)
+    {
+        Weights weights;
+        const double scale = (double)src_size / dst_size;
+        weights.start.resize(dst_size);
+
+        if (filter == ImageTransform::Nearest)
+        {
+            weights.values.assign(dst_size, 1.f);
+            for (int i = 0; i < dst_size; i++)
+                weights.start[i] = std::min((int)((i + 0.5) * scale), src_size - 1);
+            return weights;
+        }
+
+        // Downscaling stretches the kernel over the source pixels one destination pixel covers
+        const double stretch = std::max(scale, 1.), radius = kernelRadius(filter) * stretch;
+        weights.taps = std::min((int)(2 * radius) + 2, src_size);
+        weights.values.assign((size_t)dst_size * weights.taps, 0.f);
+
+        std::vector<double> taps(weights.taps);
+        for (int i = 0; i < dst_size; i++)
+        {
+            const double center = (i + 0.5) * scale - 0.5;
+            const int first = (int)std::ceil(center - radius), last = (int)std::floor(center + radius);
+            const int start = std::min(std::max(first, 0), src_size - weights.taps);
+
+            std::fill(taps.begin(), taps.end(), 0.);
+            double sum = 0;
+            for (int s = first; s <= last; s++)
+            {
+                const double w = kernel(filter, (s - center) / stretch);
+                // Pixels past the edge repeat the edge pixel
+                taps[std::min(std::max(s, 0), src_size - 1) - start] += w;
+                sum += w;
+            }
+
+            weights.start[i] = start;
+            float *values = weights.values.data() + (size_t)i * weights.taps;
+            for (int k = 0; k < weights.taps; k++)
+                values[k] = (float)(sum != 0 ? taps[k] / sum : 0);
+        }
+        return weights;
+    }
+
+    // The source row is converted to float once, every source pixel feeds several taps
+    template <class T, int Channels>
+    void resampleRow(const T *in, float *converted, float *out, const Weights &weights, int src_width, int width)
+    {
+        for (int i = 0; i < src_width * Channels; i++)
+            converted[i] = in[i];
+
+        const int taps = weights.taps;
+        for (int x = 0; x < width; x++)
+        {
+            const float *p = converted + weights.start[x] * Channels;
+            const float *w = weights.values.data() + (size_t)x * taps;
+            float acc[Channels] = {};
+            for (int k = 0; k < taps; k++)
+            {
+                for (int c = 0; c < Channels; c++)
+                    acc[c] += w[k] * p[k * Channels + c];
+            }
+            for (int c = 0; c < Channels; c++)
+                out[x * Channels + c] = acc[c];
+        }
+    }
+
+    template <class T, int Channels>
+    void resize(const QImage &src, QImage &dst, Filter filter, int alpha, bool premultiplied)
+    {
+        const Weights horizontal = resampleWeights(src.width(), dst.width(), filter);
+        const Weights vertical = resampleWeights(src.height(), dst.height(), filter);
+        const uchar *src_bits = src.constBits();
+        const qsizetype src_stride = src.bytesPerLine();
+        uchar *dst_bits = dst.bits();
+        const qsizetype dst_stride = dst.bytesPerLine();
+        const int width = dst.width(), length = width * Channels, taps = vertical.taps;
+
+        // Every stripe resamples the source rows it needs once, into a ring of taps rows
+        Parallel::forRows(0, dst.height(), [&](int y0, int y1)
+                          {
+            std::vector<float> ring((size_t)taps * length), acc(length), converted((size_t)src.width() * Channels);
+            int next = vertical.start[y0];
+            for (int y = y0; y < y1; y++)
+            {
+                const int start = vertical.start[y];
+                for (next = std::max(next, start); next < start + taps; next++)
+                {
+                    const T *in = reinterpret_cast<const T *>(src_bits + next * src_stride);
+                    resampleRow<T, Channels>(in, converted.data(), ring.data() + (size_t)(next % taps) * length, horizontal, src.width(), width);
+                }
+
+                std::fill(acc.begin(), acc.end(), 0.f);
+                const float *w = vertical.values.data() + (size_t)y * taps;
+                for (int k = 0; k < taps; k++)
+                {
+                    if (w[k] == 0)
+                        continue;
+                    const float wk = w[k];
+                    const float *in = ring.data() + (size_t)((start + k) % taps) * length;
+                    float *a = acc.data();
+                    for (int i = 0; i < length; i++)
+                        a[i] += wk * in[i];
+                }
+                storeRow<T, Channels>(reinterpret_cast<T *>(dst_bits + y * dst_stride), acc.data(), width, alpha, premultiplied);
+            } }, 64);
+    }
+
+    //// Affine warp ////
+
+    // Kernel weights for subpixel phases, taps source pixels per phase and axis
+    struct PhaseTable
+    {
+        static const int phases = 64;
+        int taps;
+        std::vector<float> values;
+    };
+
+    PhaseTable phaseTable(Filter filter)
+    {
+        PhaseTable table;
+        const int radius = kernelRadius(filter);
+        table.taps = 2 * radius;
+        table.values.assign((size_t)(PhaseTable::phases + 1) * table.taps, 0.f);
+
+        for (int p = 0; p <= PhaseTable::phases; p++)
+        {
+            float *values = table.values.data() + p * table.taps;
+            if (filter == ImageTransform::Nearest)
+            {
+                values[p < PhaseTable::phases / 2 ? 0 : 1] = 1;
+                continue;
+            }
+            const double offset = (double)p / PhaseTable::phases;
+            double sum = 0;
+            for (int k = 0; k < table.taps; k++)
+                sum += kernel(filter, offset + radius - 1 - k);
+            for (int k = 0; k < table.taps; k++)
+                values[k] = (float)(kernel(filter, offset + radius - 1 - k) / sum);
+        }
+        return table;
+    }
+
+    template <class T, int Channels>
+    void warp(const QImage &src, QImage &dst, const QTransform &inverse, const PhaseTable &table,
+              const float *background, int alpha, bool premultiplied)
+    {
+        const uchar *src_bits = src.constBits();
+        const qsizetype src_stride = src.bytesPerLine();
+        uchar *dst_bits = dst.bits();
+        const qsizetype dst_stride = dst.bytesPerLine();
+        const int src_width = src.width(), src_height = src.height(), width = dst.width();
+        const int taps = table.taps, reach = taps / 2 - 1;
+
+        Parallel::forRows(0, dst.height(), [&](int y0, int y1)
+                          {
+            std::vector<float> acc((size_t)width * Channels);
+            for (int y = y0; y < y1; y++)
+            {
+                // Source position of the first pixel center, in pixel-center coordinates
+                double u = inverse.m11() * 0.5 + inverse.m21() * (y + 0.5) + inverse.dx() - 0.5;
+                double v = inverse.m12() * 0.5 + inverse.m22() * (y + 0.5) + inverse.dy() - 0.5;
+
+                for (int x = 0; x < width; x++, u += inverse.m11(), v += inverse.m12())
+                {
+                    float *out = acc.data() + x * Channels;
+                    int ix = (int)std::floor(u), iy = (int)std::floor(v);
+                    int px = (int)((u - ix) * PhaseTable::phases + 0.5), py = (int)((v - iy) * PhaseTable::phases + 0.5);
+                    ix -= reach;
+                    iy -= reach;
+
+                    if (ix >= src_width || iy >= src_height || ix + taps <= 0 || iy + taps <= 0)
+                    {
+                        std::copy(background, background + Channels, out);
+                        continue;
+                    }
+
+                    const float *wx = table.values.data() + px * taps, *wy = table.values.data() + py * taps;
+                    float sum[Channels] = {};
+                    if (ix >= 0 && iy >= 0 && ix + taps <= src_width && iy + taps <= src_height)
+                    {
+                        for (int ky = 0; ky < taps; ky++)
+                        {
+                            const T *line = reinterpret_cast<const T *>(src_bits + (iy + ky) * src_stride) + ix * Channels;
+                            float row[Channels] = {};
+                            for (int kx = 0; kx < taps; kx++)
+                            {
+                                for (int c = 0; c < Channels; c++)
+                                    row[c] += wx[kx] * line[kx * Channels + c];
+                            }
+                            for (int c = 0; c < Channels; c++)
+                                sum[c] += wy[ky] * row[c];
+                        }
+                    }
+                    else
+                    {
+                        // Taps past the edge read the background, which antialiases the border
+                        for (int ky = 0; ky < taps; ky++)
+                        {
+                            const int sy = iy + ky;
+                            const T *line = sy >= 0 && sy < src_height ? reinterpret_cast<const T *>(src_bits + sy * src_stride) : nullptr;
+                            for (int kx = 0; kx < taps; kx++)
+                            {
+                                const float w = wy[ky] * wx[kx];
+                                const int sx = ix + kx;
+                                if (w == 0)
+                                    continue;
+                                if (line && sx >= 0 && sx < src_width)
+                                {
+                                    for (int c = 0; c < Channels; c++)
+                                        sum[c] += w * line[sx * Channels + c];
+                                }
+                                else
+                                {
+                                    for (int c = 0; c < Channels; c++)
+                                        sum[c] += w * background[c];
+                                }
+                            }
+                        }
+                    }
+                    std::copy(sum, sum + Channels, out);
+                }
+                storeRow<T, Channels>(reinterpret_cast<T *>(dst_bits + y * dst_stride), acc.data(), width, alpha, premultiplied);
+            } });
+    }
+
+    // Background color as channel values of the working format
+    template <class T, int Channels>
+    void backgroundChannels(const QColor &color, QImage::Format format, int alpha, bool premultiply, float *channels)
+    {
+        QImage pixel(1, 1, format);
+        PixelFormat::dispatch(format, [&](auto pixel_format)
+                              { PixelFormat::Writer<decltype(pixel_format)>(pixel, color).plot(0, 0); });
+        const T *p = reinterpret_cast<const T *>(pixel.constBits());
+        for (int c = 0; c < Channels; c++)
+            channels[c] = p[c];
+        if (premultiply && alpha >= 0)
+        {
+            for (int c = 0; c < Channels; c++)
+            {
+                if (c != alpha)
+                    channels[c] *= channels[alpha] / channelMax<T>();
+            }
+        }
+    }
+}
+
+bool ImageTransform::isSupported(QImage::Format format)
+{
+    Layout layout;
+    return layoutOf(format, layout);
+}
+
+QImage ImageTransform::resized(const QImage &src, QSize size, Filter filter)
+{
+    Layout layout;
+    if (src.isNull() || size.isEmpty() || !layoutOf(src.format(), layout))
+        return QImage();
+
+    const QImage::Format working = workingFormat(src.format());
+    const QImage in = working == src.format() ? src : src.convertToFormat(working);
+    const bool premultiplied = layout.premultiplied || working != src.format();
+
+    QImage out(size, working);
+    byChannels(layout, [&](auto type, auto channels)
+               { resize<std::remove_pointer_t<decltype(type)>, decltype(channels)::value>(in, out, filter, layout.alpha, premultiplied); });
+    if (working != src.format())
+        out.convertTo(src.format());
+    return out;
+}
+
+QImage ImageTransform::transformed(const QImage &src, const QTransform &transform, Filter filter, const QColor &background)
+{
+    // Bounds of the transformed image, with some slack for rounding at the corners
+    const QRectF mapped = transform.mapRect(QRectF(src.rect()));
+    const int left = (int)std::floor(mapped.left() + 1e-6), top = (int)std::floor(mapped.top() + 1e-6);
+    const int right = (int)std::ceil(mapped.right() - 1e-6), bottom = (int)std::ceil(mapped.bottom() - 1e-6);
+    if (right <= left || bottom <= top)
+        return QImage();
+    return transformed(src, transform, QRect(left, top, right - left, bottom - top), filter, background);
+}
+
+QImage ImageTransform::transformed(const QImage &src, const QTransform &transform, const QRect &target, Filter filter, const QColor &background)
+{
+    Layout layout;
+    if (src.isNull() || target.isEmpty() || !layoutOf(src.format(), layout))
+        return QImage();
+
+    bool invertible;
+    const QTransform inverse = (transform * QTransform::fromTranslate(-target.left(), -target.top())).inverted(&invertible);
+    if (!invertible)
+        return QImage();
+
+    const QImage::Format working = workingFormat(src.format());
+    const QImage in = working == src.format() ? src : src.convertToFormat(working);
+    const bool premultiplied = layout.premultiplied || working != src.format();
+    const PhaseTable table = phaseTable(filter);
+
+    QImage out(target.size(), working);
+    byChannels(layout, [&](auto type, auto channels)
+               {
+        typedef std::remove_pointer_t<decltype(type)> T;
+        float fill[4];
+        backgroundChannels<T, decltype(channels)::value>(background, src.format(), layout.alpha, working != src.format(), fill);
+        warp<T, decltype(channels)::value>(in, out, inverse, table, fill, layout.alpha, premultiplied); });
+    if (working != src.format())
+        out.convertTo(src.format());
+    return out;
+}
+
+bool ImageTransform::flip(QImage &img, bool horizontal, bool vertical)
+{
+    Layout layout;
+    if (img.isNull() || !layoutOf(img.format(), layout))
+        return false;
+
+    uchar *bits = img.bits();
+    const qsizetype stride = img.bytesPerLine();
+    const int width = img.width(), height = img.height();
+    const int bytes = layout.channels * (layout.wide ? 2 : 1);
+
+    if (vertical)
+    {
+        Parallel::forRows(0, height / 2, [&](int y0, int y1)
+                          {
+            for (int y = y0; y < y1; y++)
+            {
+                uchar *line = bits + y * stride;
+                std::swap_ranges(line, line + (size_t)width * bytes, bits + (height - 1 - y) * stride);
+            } });
+    }
+    if (horizontal)
+    {
+        Parallel::forRows(0, height, [&](int y0, int y1)
+                          {
+            for (int y = y0; y < y1; y++)
+            {
+                uchar *line = bits + y * stride;
+                for (int a = 0, b = width - 1; a < b; a++, b--)
+                    std::swap_ranges(line + a * bytes, line + (a + 1) * bytes, line + b * bytes);
+            } });
+    }
+    return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <QColor>
+#include <QImage>
+#include <QTransform>
+
+// Resampling of the raster itself, as opposed to the vector objects.
+// Resize walks precomputed separable weight tables, one per axis, over row
+// stripes on the thread pool; the affine warp looks its weights up in a table
+// of kernel phases. Alpha images are resampled premultiplied. Functions return
+// a null image (or false) for formats without a rasterizer.
+namespace ImageTransform
+{
+    enum Filter
+    {
+        Nearest,
+        Bilinear,
+        Bicubic,
+        Lanczos
+    };
+
+    bool isSupported(QImage::Format format);
+
+    // Downscaling widens the kernel to the source footprint, so it does not alias
+    QImage resized(const QImage &src, QSize size, Filter filter);
+
+    // Output covers the whole transformed image, uncovered pixels get the background
+    QImage transformed(const QImage &src, const QTransform &transform, Filter filter, const QColor &background = Qt::white);
+    // Output is the target rectangle of the transformed plane, such as the frames of an animation
+    QImage transformed(const QImage &src, const QTransform &transform, const QRect &target, Filter filter, const QColor &background = Qt::white);
+
+    // In place, the image keeps its buffer
+    bool flip(QImage &img, bool horizontal, bool vertical);
+}
@@ -6,6 +6,9 @@ ImageViewer::ImageViewer(QWidget *parent)
 	ui->setupUi(this);
 	vW = new ViewerWidget(QSize(500, 500));
 	ui->scrollArea->setWidget(vW);
+	compareWidget = new CompareWidget(this);
+	compareWidget->hide();
+	ui->compare_metrics->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
 
 	ui->scrollArea->setBackgroundRole(QPalette::Dark);
 	ui->scrollArea->setWidgetResizable(true);
@@ -18,6 +21,47 @@ ImageViewer::ImageViewer(QWidget *parent)
 	QColor default_color = Qt::blue;
 	QString style_sheet = QString("background-color: #%1;").arg(default_color.rgba(), 0, 16);
 	ui->pushButtonSetColor->setStyleSheet(style_sheet);
+	ui->pushButtonFillEndColor->setStyleSheet(QString("background-color: #%1;").arg(vW->getFillEndColor().rgba(), 0, 16));
+
+	// Recomputed once the canvas settles, not on every stroke
+	histogramTimer.setSingleShot(true);
+	histogramTimer.setInterval(100);
+	connect(&histogramTimer, &QTimer::timeout, this, &ImageViewer::updateHistogram);
+	// Reported once the edit that resized the canvas is done
+	connect(vW, &ViewerWidget::sessionLost, this, [this](QString error)
+			{
+		QString session = settings.value("session_file", "").toString();
+		settings.remove("session_file");
+		showSessionOpen();
+		msgBox.setText(QString("The canvas session %1 was closed, the file keeps its last saved state. %2").arg(session).arg(error));
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec(); }, Qt::QueuedConnection);
+	scheduleHistogram();
+	refreshLayers();
+	player.setPresenter([this](int frame, QImage image)
+						{ showFrame(frame, std::move(image)); });
+
+	gallery.setCacheDirectory(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/thumbnails");
+	gallery.setReceiver([this](int index, QImage thumbnail)
+						{
+		if (QListWidgetItem *item = ui->gallery_list->item(index))
+			item->setIcon(QIcon(QPixmap::fromImage(thumbnail))); });
+	connect(ui->gallery_list->verticalScrollBar(), &QScrollBar::valueChanged, this, &ImageViewer::requestVisibleThumbnails);
+	ui->gallery_list->viewport()->installEventFilter(this);
+	ui->gallery_dock->hide();
+
+	QFont label_font;
+	label_font.setPixelSize(16);
+	label_font.fromString(settings.value("label_font", label_font.toString()).toString());
+	vW->setLabelFont(label_font);
+
+	// A session still open when the last run ended, by exit or by crash
+	QString session = settings.value("session_file", "").toString();
+	if (!session.isEmpty() && QFile::exists(session) && !openSession(session))
+	{
+		settings.remove("session_file");
+		ui->statusBar->showMessage(QString("Unable to reopen the session %1. %2").arg(session).arg(vW->getSessionCanvas().errorString()));
+	}
 }
 
 // Event filters
@@ -27,6 +71,10 @@ bool ImageViewer::eventFilter(QObject *obj, QEvent *event)
 	{
 		return ViewerWidgetEventFilter(obj, event);
 	}
+	if (obj == ui->gallery_list->viewport() && event->type() == QEvent::Resize)
+	{
+		requestVisibleThumbnails();
+	}
 	return false;
 }
 
@@ -39,14 +87,17 @@ bool ImageViewer::ViewerWidgetEventFilter(QObject *obj, QEvent *event)
 	{
 		return false;
 	}
+	InputRecorder::Scope recorded(recorder, event);
 
 	if (event->type() == QEvent::MouseButtonPress)
 	{
 		ViewerWidgetMouseButtonPress(w, event);
+		scheduleHistogram();
 	}
 	else if (event->type() == QEvent::MouseButtonRelease)
 	{
 		ViewerWidgetMouseButtonRelease(w, event);
+		scheduleHistogram();
 	}
 	else if (event->type() == QEvent::MouseMove)
 	{
@@ -63,6 +114,7 @@ bool ImageViewer::ViewerWidgetEventFilter(QObject *obj, QEvent *event)
 	else if (event->type() == QEvent::Wheel)
 	{
 		ViewerWidgetWheel(w, event);
+		scheduleHistogram();
 	}
 
 	return QObject::eventFilter(obj, event);
@@ -88,8 +140,6 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 				{
 					w->setLineBegin(e->pos());
 					w->setDrawLineActivated(true);
-					w->setPixel(e->pos().x(), e->pos().y(), w->getGlobalColor());
-					w->update();
 				}
 			}
 			else if (ui->object_type_combobox->currentIndex() == 1)
@@ -124,7 +174,6 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 				if (w->getDrawHermitActivated())
 				{
 					w->addHermitPoint(e->pos(), QPoint(0, 150));
-					w->drawHermit();
 					setHermitBox(true);
 				}
 				else
@@ -132,21 +181,23 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 					w->clearHermitData();
 					w->addHermitPoint(e->pos(), QPoint(0, 150));
 					w->setDrawHermitActivated(true);
+					w->clear();
+					w->drawAll();
 				}
 			}
 			else if (ui->object_type_combobox->currentIndex() == 4)
 			{
 				if (w->getDrawBezierActivated())
 				{
-					w->clear();
 					w->addBezierPoint(e->pos());
-					w->drawBezier();
 				}
 				else
 				{
 					w->clearBezierPoints();
 					w->addBezierPoint(e->pos());
 					w->setDrawBezierActivated(true);
+					w->clear();
+					w->drawAll();
 				}
 			}
 			else if (ui->object_type_combobox->currentIndex() == 5)
@@ -154,15 +205,39 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 				if (w->getDrawCoonsActivated())
 				{
 					w->addCoonsPoint(e->pos());
-					w->drawCoons();
 				}
 				else
 				{
 					w->clearCoonsPoints();
 					w->addCoonsPoint(e->pos());
 					w->setDrawCoonsActivated(true);
+					w->clear();
+					w->drawAll();
+				}
+			}
+			else if (ui->object_type_combobox->currentIndex() == 6)
+			{
+				QElapsedTimer timer;
+				timer.start();
+				FloodFill::Stats stats = w->floodFill(e->pos(), w->getGlobalColor(), ui->fill_tolerance->value(), ui->fill_eight_connected->isChecked());
+				ui->statusBar->showMessage(QString("Fill: %1 px in %2 spans, %3 ms").arg(stats.pixels).arg(stats.spans).arg(timer.elapsed()));
+			}
+			else if (ui->object_type_combobox->currentIndex() == 7)
+			{
+				bool ok;
+				QString text = QInputDialog::getText(this, "Text", "Label:", QLineEdit::Normal, "", &ok);
+				if (ok && !text.isEmpty())
+				{
+					w->addLabel(e->pos(), text, w->getGlobalColor());
+					ui->statusBar->showMessage(QString("%1 labels, %2 glyphs in the atlas").arg(w->getLabelCount()).arg(w->getGlyphAtlas().glyphCount()));
 				}
 			}
+			else if (ui->object_type_combobox->currentIndex() == 8)
+			{
+				regionStart = e->pos();
+				regionDragging = true;
+				showRegionStatistics(e->pos());
+			}
 		}
 		else if (e->button() == Qt::RightButton)
 		{
@@ -170,8 +245,6 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 			{
 				if (w->getDrawPolygonActivated())
 				{
-					w->clear();
-					w->drawAll();
 					w->endPolygonDraw();
 					ui->draw_button->setChecked(false);
 				}
@@ -180,9 +253,8 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 			{
 				if (w->getDrawHermitActivated())
 				{
-					w->clear();
-					w->drawAll();
 					w->setDrawHermitActivated(false);
+					w->drawHermit();
 					ui->draw_button->setChecked(false);
 					setHermitBox(true);
 				}
@@ -191,9 +263,8 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 			{
 				if (w->getDrawBezierActivated())
 				{
-					w->clear();
-					w->drawAll();
 					w->setDrawBezierActivated(false);
+					w->drawBezier();
 					ui->draw_button->setChecked(false);
 				}
 			}
@@ -201,13 +272,14 @@ void ImageViewer::ViewerWidgetMouseButtonPress(ViewerWidget *w, QEvent *event)
 			{
 				if (w->getDrawCoonsActivated())
 				{
-					w->clear();
-					w->drawAll();
 					w->setDrawCoonsActivated(false);
+					w->drawCoons();
 					ui->draw_button->setChecked(false);
 				}
 			}
 		}
+		// Finished objects are in the image now, the rest follows the cursor
+		w->updatePreview();
 		return;
 	}
 	if (e->button() == Qt::LeftButton)
@@ -219,6 +291,12 @@ void ImageViewer::ViewerWidgetMouseButtonRelease(ViewerWidget *w, QEvent *event)
 {
 	QMouseEvent *e = static_cast<QMouseEvent *>(event);
 
+	if (regionDragging && e->button() == Qt::LeftButton)
+	{
+		showRegionStatistics(e->pos());
+		regionDragging = false;
+		return;
+	}
 	if (ui->draw_button->isChecked())
 		return;
 
@@ -231,11 +309,32 @@ void ImageViewer::ViewerWidgetMouseMove(ViewerWidget *w, QEvent *event)
 {
 	QMouseEvent *e = static_cast<QMouseEvent *>(event);
 
+	if (ui->draw_button->isChecked())
+		w->setPreviewCursor(e->pos());
+	if (regionDragging)
+		showRegionStatistics(e->pos());
+
 	if (vW->getIsTranslating())
+	{
 		vW->translateObjects(e->pos());
+		showFrameStats();
+	}
+}
+void ImageViewer::showRegionStatistics(QPoint end)
+{
+	QElapsedTimer timer;
+	timer.start();
+	SummedArea::Region region = vW->regionStatistics(QRect(regionStart, end).normalized());
+	ui->statusBar->showMessage(QString("Region: %1 px, mean %2, variance %3, coverage %4%, %5 us")
+								   .arg(region.pixels)
+								   .arg(region.mean, 0, 'f', 1)
+								   .arg(region.variance, 0, 'f', 1)
+								   .arg(region.coverage * 100, 0, 'f', 1)
+								   .arg(timer.nsecsElapsed() / 1000));
 }
 void ImageViewer::ViewerWidgetLeave(ViewerWidget *w, QEvent *event)
 {
+	w->hidePreviewCursor();
 }
 void ImageViewer::ViewerWidgetEnter(ViewerWidget *w, QEvent *event)
 {
@@ -251,6 +350,7 @@ void ImageViewer::ViewerWidgetWheel(ViewerWidget *w, QEvent *event)
 	{
 		vW->scaleObjects(0.9, 0.9);
 	}
+	showFrameStats();
 }
 
 // ImageViewer Events
@@ -270,26 +370,247 @@ void ImageViewer::closeEvent(QCloseEvent *event)
 bool ImageViewer::openImage(QString filename)
 {
 	QImage loadedImg(filename);
-	if (!loadedImg.isNull())
+	return showImage(loadedImg);
+}
+bool ImageViewer::showImage(const QImage &image)
+{
+	if (image.isNull())
 	{
-		return vW->setImage(loadedImg);
+		return false;
 	}
-	return false;
+	closeSequence();
+	endComparison();
+	bool loaded = vW->setImage(image);
+	showCanvasShared();
+	refreshLayers();
+	scheduleHistogram();
+	return loaded;
 }
 bool ImageViewer::saveImage(QString filename)
 {
 	QFileInfo fi(filename);
 	QString extension = fi.completeSuffix();
 
-	QImage *img = vW->getImage();
-	return img->save(filename, extension.toStdString().c_str());
+	return vW->flattenedImage().save(filename, extension.toStdString().c_str());
+}
+
+// Gallery
+bool ImageViewer::openFolder(QString folder)
+{
+	QListWidget *list = ui->gallery_list;
+	QSignalBlocker blocker(list);
+	list->clear();
+	if (!gallery.open(folder))
+	{
+		return false;
+	}
+
+	// Blank icons hold the grid in place until the thumbnails come
+	QPixmap placeholder(gallery.thumbnailSize(), gallery.thumbnailSize());
+	placeholder.fill(Qt::transparent);
+	const QIcon icon(placeholder);
+	list->setUpdatesEnabled(false);
+	for (int i = 0; i < gallery.count(); i++)
+	{
+		list->addItem(new QListWidgetItem(icon, QFileInfo(gallery.fileName(i)).fileName()));
+	}
+	list->setUpdatesEnabled(true);
+	ui->gallery_dock->show();
+	// After the list has laid the items out
+	QTimer::singleShot(0, this, &ImageViewer::requestVisibleThumbnails);
+	return true;
+}
+void ImageViewer::requestVisibleThumbnails()
+{
+	QListWidget *list = ui->gallery_list;
+	if (list->count() == 0 || !list->isVisible())
+	{
+		return;
+	}
+
+	// Items are laid out in order, so their rectangles only move down the list
+	auto firstItem = [list](std::function<bool(const QRect &)> reached)
+	{
+		int low = 0, high = list->count();
+		while (low < high)
+		{
+			int middle = (low + high) / 2;
+			if (reached(list->visualItemRect(list->item(middle))))
+				high = middle;
+			else
+				low = middle + 1;
+		}
+		return low;
+	};
+	const int height = list->viewport()->height();
+	const int first = firstItem([](const QRect &rect)
+								{ return rect.bottom() >= 0; });
+	const int last = firstItem([height](const QRect &rect)
+							   { return rect.top() > height; }) - 1;
+	gallery.requestThumbnails(first, last);
+}
+void ImageViewer::stepGallery(int step)
+{
+	QListWidget *list = ui->gallery_list;
+	if (list->count() == 0)
+	{
+		return;
+	}
+	int row = std::min(std::max(list->currentRow() + step, 0), list->count() - 1);
+	list->setCurrentRow(row);
+	list->scrollToItem(list->item(row));
+}
+
+// Comparison
+bool ImageViewer::compareWith(QString filename)
+{
+	QImage reference(filename);
+	if (reference.isNull() || !compareWidget->setImages(vW->flattenedImage(), reference))
+	{
+		return false;
+	}
+	compareWidget->setGain(ui->compare_gain->value());
+	compareWidget->setView((CompareWidget::View)ui->compare_view_combobox->currentIndex());
+	ui->compare_metrics->setText(ImageCompare::report(compareWidget->getMetrics()));
+	ui->compare_box->setEnabled(true);
+	setCompareShown(true);
+	return true;
+}
+void ImageViewer::setCompareShown(bool shown)
+{
+	QWidget *showing = shown ? (QWidget *)compareWidget : vW;
+	if (ui->scrollArea->widget() == showing)
+	{
+		return;
+	}
+	// Taken back first, setWidget() would delete the widget it replaces
+	QWidget *hidden = ui->scrollArea->takeWidget();
+	hidden->setParent(this);
+	hidden->hide();
+	ui->scrollArea->setWidget(showing);
+	showing->show();
+}
+void ImageViewer::endComparison()
+{
+	setCompareShown(false);
+	compareWidget->setImages(QImage(), QImage());
+	ui->compare_metrics->clear();
+	ui->compare_box->setEnabled(false);
+}
+
+// Image sequences
+bool ImageViewer::openSequence(QString source)
+{
+	closeSequence();
+	if (!player.open(source))
+	{
+		return false;
+	}
+	QSignalBlocker blocker(ui->playback_slider);
+	ui->playback_slider->setRange(0, player.frameCount() - 1);
+	ui->playback_slider->setValue(0);
+	player.setFrameRate(ui->playback_fps->value());
+	ui->playback_box->setEnabled(true);
+	showPlaybackStatus();
+	return true;
+}
+void ImageViewer::closeSequence()
+{
+	player.close();
+	QSignalBlocker blocker(ui->playback_play_button);
+	ui->playback_play_button->setChecked(false);
+	ui->playback_box->setEnabled(false);
+	ui->playback_status->clear();
+}
+void ImageViewer::showFrame(int frame, QImage image)
+{
+	const bool resized = image.size() != vW->getImage()->size();
+	vW->showFrame(std::move(image));
+	if (resized)
+	{
+		showCanvasShared();
+		refreshLayers();
+	}
+
+	QSignalBlocker blocker(ui->playback_slider);
+	ui->playback_slider->setValue(frame);
+	showPlaybackStatus();
+	if (!player.isPlaying())
+	{
+		scheduleHistogram();
+	}
+	else if (frame == player.frameCount() - 1)
+	{
+		ui->playback_play_button->setChecked(false);
+	}
+}
+void ImageViewer::showPlaybackStatus()
+{
+	const SequencePlayer::Stats stats = player.stats();
+	ui->playback_status->setText(QString("Frame %1/%2\n%3 shown, %4 dropped\nDecode %5 fps, %6 ms/frame")
+									 .arg(player.currentFrame() + 1)
+									 .arg(player.frameCount())
+									 .arg(stats.presented)
+									 .arg(stats.dropped)
+									 .arg(stats.decodeFps, 0, 'f', 1)
+									 .arg(stats.decodeMs, 0, 'f', 1));
+}
+
+// Layers
+void ImageViewer::refreshLayers()
+{
+	const LayerStack &layers = vW->getLayers();
+	QSignalBlocker blocker(ui->layer_list);
+	ui->layer_list->clear();
+	for (int i = layers.count() - 1; i >= 0; i--)
+	{
+		QListWidgetItem *item = new QListWidgetItem(layers.layer(i).name, ui->layer_list);
+		item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+		item->setCheckState(layers.layer(i).visible ? Qt::Checked : Qt::Unchecked);
+	}
+	ui->layer_list->setCurrentRow(layers.count() - 1 - vW->getActiveLayer());
+	ui->layer_remove_button->setEnabled(layers.count() > 1);
+	showLayerProperties();
+}
+void ImageViewer::showLayerProperties()
+{
+	const LayerStack::Layer &layer = vW->getLayers().layer(vW->getActiveLayer());
+	QSignalBlocker opacity(ui->layer_opacity);
+	QSignalBlocker blend(ui->layer_blend_combobox);
+	ui->layer_opacity->setValue(qRound(layer.opacity * 100));
+	ui->layer_blend_combobox->setCurrentIndex(layer.blend);
+}
+void ImageViewer::on_layer_add_button_clicked()
+{
+	vW->addLayer(QString("Layer %1").arg(vW->getLayers().count()));
+	refreshLayers();
+	scheduleHistogram();
+}
+void ImageViewer::on_layer_remove_button_clicked()
+{
+	vW->removeLayer(vW->getActiveLayer());
+	refreshLayers();
+	scheduleHistogram();
+}
+void ImageViewer::on_layer_list_currentRowChanged(int row)
+{
+	if (row < 0)
+		return;
+	vW->setActiveLayer(vW->getLayers().count() - 1 - row);
+	showLayerProperties();
+	scheduleHistogram();
+}
+void ImageViewer::on_layer_list_itemChanged(QListWidgetItem *item)
+{
+	int index = vW->getLayers().count() - 1 - ui->layer_list->row(item);
+	vW->setLayerVisible(index, item->checkState() == Qt::Checked);
 }
 
 // Hermit Functions
 void ImageViewer::setHermitBox(bool state, int n)
 {
 	ui->hermit_box->setEnabled(state);
-	QVector<QVector<QPoint>> hermitData = vW->getHermitData();
+	const QVector<QVector<QPoint>> &hermitData = vW->getHermitData();
 	if (hermitData.size() == 0)
 		return;
 
@@ -322,6 +643,7 @@ void ImageViewer::on_direction_spinbox_valueChanged(int new_direction)
 				ui->length_spinbox->value() * sin(new_direction * M_PI / 180)));
 		vW->clear();
 		vW->drawAll();
+		vW->updatePreview();
 	}
 }
 void ImageViewer::on_length_spinbox_valueChanged(int new_length)
@@ -334,6 +656,7 @@ void ImageViewer::on_length_spinbox_valueChanged(int new_length)
 				new_length * sin(ui->direction_spinbox->value() * M_PI / 180)));
 		vW->clear();
 		vW->drawAll();
+		vW->updatePreview();
 	}
 }
 
@@ -359,6 +682,156 @@ void ImageViewer::on_actionOpen_triggered()
 		msgBox.exec();
 	}
 }
+void ImageViewer::on_actionOpen_sequence_triggered()
+{
+	QString folder = settings.value("folder_img_load_path", "").toString();
+
+	QString fileFilter = "Image data (*.bmp *.gif *.jpg *.jpeg *.png *.pbm *.pgm *.ppm .*xbm .* xpm);;All files (*)";
+	QString fileName = QFileDialog::getOpenFileName(this, "Open any frame of a numbered sequence", folder, fileFilter);
+	if (fileName.isEmpty())
+	{
+		return;
+	}
+
+	QFileInfo fi(fileName);
+	settings.setValue("folder_img_load_path", fi.absoluteDir().absolutePath());
+
+	if (!openSequence(fileName))
+	{
+		msgBox.setText("Unable to open the image sequence.");
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+	}
+}
+void ImageViewer::on_actionOpen_folder_triggered()
+{
+	QString folder = settings.value("folder_img_load_path", "").toString();
+	folder = QFileDialog::getExistingDirectory(this, "Open folder", folder);
+	if (folder.isEmpty())
+	{
+		return;
+	}
+
+	settings.setValue("folder_img_load_path", folder);
+
+	if (!openFolder(folder))
+	{
+		msgBox.setText("The folder holds no images.");
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+	}
+}
+void ImageViewer::on_actionCompare_with_triggered()
+{
+	QString folder = settings.value("folder_img_load_path", "").toString();
+
+	QString fileFilter = "Image data (*.bmp *.gif *.jpg *.jpeg *.png *.pbm *.pgm *.ppm .*xbm .* xpm);;All files (*)";
+	QString fileName = QFileDialog::getOpenFileName(this, "Compare with image", folder, fileFilter);
+	if (fileName.isEmpty())
+	{
+		return;
+	}
+
+	if (!compareWith(fileName))
+	{
+		msgBox.setText("Unable to compare, the images must be readable and of the same size.");
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+	}
+}
+void ImageViewer::on_actionImport_polylines_triggered()
+{
+	QString folder = settings.value("folder_polyline_path", "").toString();
+
+	QString fileFilter = "Polylines (*.csv *.txt *.xy);;All files (*)";
+	QString fileName = QFileDialog::getOpenFileName(this, "Import polylines", folder, fileFilter);
+	if (fileName.isEmpty())
+	{
+		return;
+	}
+
+	QFileInfo fi(fileName);
+	settings.setValue("folder_polyline_path", fi.absoluteDir().absolutePath());
+
+	// Progress in permille, file sizes overflow an int
+	QProgressDialog progress("Importing polylines...", "Cancel", 0, 1000, this);
+	progress.setWindowModality(Qt::WindowModal);
+	progress.setMinimumDuration(500);
+	QString error;
+	bool imported = vW->importPolylines(fileName, error, [&progress](qint64 done, qint64 total)
+										{
+		progress.setValue(total > 0 ? done * 1000 / total : 0);
+		return !progress.wasCanceled(); });
+	progress.reset();
+
+	if (!imported)
+	{
+		msgBox.setText("Unable to import polylines: " + error);
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+	const PolylineSet &polylines = vW->getPolylines();
+	ui->statusBar->showMessage(QString("Imported %1 polylines with %2 vertices, %3 levels of detail").arg(polylines.polylineCount()).arg(polylines.vertexCount()).arg(polylines.levelCount()));
+}
+void ImageViewer::on_actionExport_animation_triggered()
+{
+	bool ok;
+	QString text = QInputDialog::getMultiLineText(this, "Export animation", "Keyframes, one per line as\nframe angle scale_x scale_y shear dx dy:",
+												  settings.value("animation_keyframes", "0 0 1 1 0 0 0\n47 360 1 1 0 0 0").toString(), &ok);
+	if (!ok)
+		return;
+
+	QVector<AnimationExporter::Keyframe> keyframes;
+	QString error;
+	if (!AnimationExporter::parseKeyframes(text, keyframes, error))
+	{
+		msgBox.setText("Unable to read the keyframes: " + error);
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+	settings.setValue("animation_keyframes", text);
+
+	int last_keyframe = 0;
+	for (const AnimationExporter::Keyframe &key : keyframes)
+		last_keyframe = std::max(last_keyframe, key.frame);
+	AnimationExporter::Options options;
+	options.frames = QInputDialog::getInt(this, "Export animation", "Frames:", last_keyframe + 1, 1, 100000, 1, &ok);
+	if (!ok)
+		return;
+	options.frameRate = QInputDialog::getDouble(this, "Export animation", "Frames per second:", 24, 0.1, 100, 1, &ok);
+	if (!ok)
+		return;
+
+	QString folder = settings.value("folder_animation_path", "").toString();
+	QString fileName = QFileDialog::getSaveFileName(this, "Export animation", folder, "Animated GIF (*.gif);;Numbered PNG files (*.png)");
+	if (fileName.isEmpty())
+		return;
+	QFileInfo fi(fileName);
+	settings.setValue("folder_animation_path", fi.absoluteDir().absolutePath());
+
+	QProgressDialog progress("Exporting frames...", "Cancel", 0, options.frames, this);
+	progress.setWindowModality(Qt::WindowModal);
+	progress.setMinimumDuration(500);
+	QElapsedTimer timer;
+	timer.start();
+	AnimationExporter exporter;
+	bool exported = exporter.run(vW->flattenedImage(), keyframes, options, fileName, [&progress](int written, int frames)
+								 {
+		progress.setValue(written);
+		return !progress.wasCanceled(); });
+	progress.reset();
+
+	if (!exported)
+	{
+		msgBox.setText("Unable to export the animation: " + exporter.errorString());
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+	ui->statusBar->showMessage(QString("Exported %1 frames in %2 ms").arg(options.frames).arg(timer.elapsed()));
+}
 void ImageViewer::on_actionSave_as_triggered()
 {
 	QString folder = settings.value("folder_img_save_path", "").toString();
@@ -386,11 +859,414 @@ void ImageViewer::on_actionSave_as_triggered()
 void ImageViewer::on_actionClear_triggered()
 {
 	vW->clear();
+	scheduleHistogram();
+}
+void ImageViewer::on_actionLabel_font_triggered()
+{
+	bool ok;
+	QFont font = QFontDialog::getFont(&ok, vW->getLabelFont(), this, "Label font");
+	if (!ok)
+		return;
+	vW->setLabelFont(font);
+	settings.setValue("label_font", font.toString());
+}
+void ImageViewer::combinePolygon(PolygonBoolean::Operation operation)
+{
+	if (!vW->combinePolygon(operation))
+	{
+		ui->statusBar->showMessage("Finish a polygon first");
+		return;
+	}
+	ui->statusBar->showMessage(QString("Shape of %1 contours").arg(vW->getShape().size()));
+	scheduleHistogram();
 }
 void ImageViewer::on_actionExit_triggered()
 {
 	this->close();
 }
+void ImageViewer::on_actionRecord_input_toggled(bool checked)
+{
+	if (checked)
+	{
+		// The color buttons open dialogs, which a replay could not get past
+		recorder.start(ui->dockWidget, {"pushButtonSetColor", "pushButtonFillEndColor"});
+		ui->statusBar->showMessage("Recording input");
+		return;
+	}
+	recorder.stop();
+
+	QString folder = settings.value("folder_input_record_path", "").toString();
+	QString fileName = QFileDialog::getSaveFileName(this, "Save input recording", folder, "Input recording (*.rec)");
+	if (fileName.isEmpty())
+	{
+		return;
+	}
+	QFileInfo fi(fileName);
+	settings.setValue("folder_input_record_path", fi.absoluteDir().absolutePath());
+	if (!recorder.save(fileName))
+	{
+		msgBox.setText(QString("Unable to save input recording %1.").arg(fileName));
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+	}
+}
+void ImageViewer::on_actionReplay_input_triggered()
+{
+	QString folder = settings.value("folder_input_record_path", "").toString();
+	QString fileName = QFileDialog::getOpenFileName(this, "Replay input recording", folder, "Input recording (*.rec)");
+	if (fileName.isEmpty())
+	{
+		return;
+	}
+	bool original_timing = QMessageBox::question(this, "Replay input", "Keep the recorded timing? Otherwise the events are replayed as fast as possible.", QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes;
+
+	QString report;
+	if (!replayInput(fileName, original_timing, report))
+	{
+		msgBox.setText(QString("Unable to read input recording %1.").arg(fileName));
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+	msgBox.setText("Replay finished, latencies per event are in the details.");
+	msgBox.setDetailedText(report);
+	msgBox.setIcon(QMessageBox::Information);
+	msgBox.exec();
+	msgBox.setDetailedText(QString());
+}
+void ImageViewer::on_gallery_list_currentRowChanged(int row)
+{
+	if (row < 0)
+	{
+		return;
+	}
+	if (showImage(gallery.image(row)))
+	{
+		ui->statusBar->showMessage(QString("%1 (%2/%3)").arg(gallery.fileName(row)).arg(row + 1).arg(gallery.count()));
+	}
+	else
+	{
+		ui->statusBar->showMessage(QString("Unable to open %1").arg(gallery.fileName(row)));
+	}
+	gallery.prefetch(row);
+}
+void ImageViewer::on_playback_play_button_toggled(bool checked)
+{
+	ui->playback_play_button->setText(checked ? "Pause" : "Play");
+	if (checked)
+	{
+		player.play();
+	}
+	else
+	{
+		player.pause();
+		scheduleHistogram();
+	}
+}
+void ImageViewer::on_actionShare_canvas_toggled(bool checked)
+{
+	if (!checked)
+	{
+		vW->unshareCanvas();
+		ui->statusBar->showMessage("Canvas no longer shared");
+		return;
+	}
+
+	bool ok = false;
+	QString key = QInputDialog::getText(this, "Share canvas", "Shared memory key:", QLineEdit::Normal, settings.value("shared_canvas_key", "ImageViewer").toString(), &ok);
+	if (!ok || key.isEmpty() || !shareCanvas(key))
+	{
+		showCanvasShared();
+		if (ok && !key.isEmpty())
+		{
+			msgBox.setText(QString("Unable to share the canvas as %1. %2").arg(key).arg(vW->getSharedCanvas().errorString()));
+			msgBox.setIcon(QMessageBox::Warning);
+			msgBox.exec();
+		}
+	}
+}
+bool ImageViewer::shareCanvas(QString key)
+{
+	bool shared = vW->shareCanvas(key);
+	showCanvasShared();
+	if (shared)
+	{
+		settings.remove("session_file");
+		showSessionOpen();
+		settings.setValue("shared_canvas_key", key);
+		refreshLayers();
+		scheduleHistogram();
+		ui->statusBar->showMessage(QString("Canvas shared as %1").arg(key));
+	}
+	return shared;
+}
+void ImageViewer::on_actionSession_file_toggled(bool checked)
+{
+	if (!checked)
+	{
+		vW->closeSession();
+		settings.remove("session_file");
+		ui->statusBar->showMessage("Canvas session closed, the file is kept");
+		return;
+	}
+
+	// An existing session file is reopened, not overwritten
+	QString defaultFile = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/canvas.ivsession";
+	QString fileName = QFileDialog::getSaveFileName(this, "Session file", settings.value("last_session_file", defaultFile).toString(), "Canvas session (*.ivsession)", nullptr, QFileDialog::DontConfirmOverwrite);
+	if (fileName.isEmpty() || !openSession(fileName))
+	{
+		showSessionOpen();
+		if (!fileName.isEmpty())
+		{
+			msgBox.setText(QString("Unable to open the session %1. %2").arg(fileName).arg(vW->getSessionCanvas().errorString()));
+			msgBox.setIcon(QMessageBox::Warning);
+			msgBox.exec();
+		}
+	}
+}
+bool ImageViewer::openSession(QString filename)
+{
+	QDir().mkpath(QFileInfo(filename).absolutePath());
+	bool reopened = QFile::exists(filename);
+	bool opened = vW->openSession(filename);
+	showCanvasShared();
+	showSessionOpen();
+	if (opened)
+	{
+		settings.setValue("session_file", filename);
+		settings.setValue("last_session_file", filename);
+		refreshLayers();
+		scheduleHistogram();
+		ui->statusBar->showMessage(QString(reopened ? "Canvas session %1 reopened" : "Canvas session in %1").arg(filename));
+	}
+	return opened;
+}
+bool ImageViewer::replayInput(QString filename, bool original_timing, QString &report)
+{
+	InputRecorder player;
+	if (!player.load(filename))
+	{
+		return false;
+	}
+	report = InputRecorder::report(player.replay(vW, ui->dockWidget, original_timing));
+	return true;
+}
+
+// Image filters
+void ImageViewer::applyFilter(QString name, std::function<bool(QImage &)> filter, QString error)
+{
+	QElapsedTimer timer;
+	timer.start();
+	vW->settlePaper();
+	bool applied;
+	{
+		ViewerWidget::ImageWrite write(vW);
+		applied = filter(*vW->getImage());
+		if (applied)
+		{
+			vW->imageChanged();
+		}
+	}
+	if (!applied)
+	{
+		msgBox.setText(error);
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+	showCanvasShared();
+	ui->statusBar->showMessage(QString("%1: %2 ms").arg(name).arg(timer.elapsed()));
+	scheduleHistogram();
+}
+
+void ImageViewer::on_actionGaussian_blur_triggered()
+{
+	bool ok;
+	double sigma = QInputDialog::getDouble(this, "Gaussian blur", "Sigma:", 2, 0.1, 500, 1, &ok);
+	if (ok)
+		applyFilter("Gaussian blur", [=](QImage &img)
+					{ return ImageFilter::gaussianBlur(img, sigma); });
+}
+void ImageViewer::on_actionBox_blur_triggered()
+{
+	bool ok;
+	int radius = QInputDialog::getInt(this, "Box blur", "Radius:", 5, 1, 5000, 1, &ok);
+	if (ok)
+		applyFilter("Box blur", [=](QImage &img)
+					{ return ImageFilter::boxBlur(img, radius); });
+}
+void ImageViewer::on_actionUnsharp_mask_triggered()
+{
+	bool ok;
+	double sigma = QInputDialog::getDouble(this, "Unsharp mask", "Sigma:", 2, 0.1, 100, 1, &ok);
+	if (!ok)
+		return;
+	double amount = QInputDialog::getDouble(this, "Unsharp mask", "Amount:", 1, 0, 10, 2, &ok);
+	if (!ok)
+		return;
+	int threshold = QInputDialog::getInt(this, "Unsharp mask", "Threshold:", 0, 0, 255, 1, &ok);
+	if (ok)
+		applyFilter("Unsharp mask", [=](QImage &img)
+					{ return ImageFilter::unsharpMask(img, sigma, amount, threshold); });
+}
+void ImageViewer::on_actionEdge_detect_triggered()
+{
+	applyFilter("Sobel", [](QImage &img)
+				{ return ImageFilter::sobel(img); });
+}
+void ImageViewer::on_actionMedian_triggered()
+{
+	bool ok;
+	int radius = QInputDialog::getInt(this, "Median", "Radius:", 1, 1, 50, 1, &ok);
+	if (ok)
+		applyFilter("Median", [=](QImage &img)
+					{ return ImageFilter::median(img, radius); });
+}
+void ImageViewer::on_actionConvolution_triggered()
+{
+	bool ok;
+	QString text = QInputDialog::getMultiLineText(this, "Custom kernel", "Kernel rows (odd width and height):", "0 -1 0\n-1 5 -1\n0 -1 0", &ok);
+	if (!ok)
+		return;
+
+	QVector<float> kernel;
+	int width = 0, height = 0;
+	for (const QString &line : text.split('\n', Qt::SkipEmptyParts))
+	{
+		QStringList values = line.split(QRegularExpression("[\\s,;]+"), Qt::SkipEmptyParts);
+		if (values.isEmpty())
+			continue;
+		if (width != 0 && values.size() != width)
+			width = -1;
+		if (width == -1)
+			break;
+		width = values.size();
+		for (const QString &value : values)
+			kernel.push_back(value.toFloat());
+		height++;
+	}
+
+	if (width < 1 || width % 2 == 0 || height % 2 == 0)
+	{
+		msgBox.setText("Kernel must be rectangular with odd width and height.");
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+	applyFilter("Convolution", [=](QImage &img)
+				{ return ImageFilter::convolve(img, kernel, width, height); });
+}
+void ImageViewer::on_actionAdjust_colors_triggered()
+{
+	if (!PixelFormat::isSupported(vW->getImage()->format()))
+	{
+		msgBox.setText("Color adjustment is not supported for this image format.");
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+
+	vW->settlePaper();
+	ColorAdjustDialog dialog(vW, this);
+	connect(&dialog, &ColorAdjustDialog::previewed, this, &ImageViewer::scheduleHistogram);
+	dialog.exec();
+	scheduleHistogram();
+}
+
+// Raster transforms
+bool ImageViewer::execTransformDialog(QDialog &dialog, QString title, QVector<QPair<QString, QWidget *>> fields, ImageTransform::Filter &filter)
+{
+	dialog.setWindowTitle(title);
+	QFormLayout *form = new QFormLayout(&dialog);
+	for (const QPair<QString, QWidget *> &field : fields)
+	{
+		form->addRow(field.first, field.second);
+	}
+
+	QComboBox *filters = new QComboBox(&dialog);
+	filters->addItems({"Nearest", "Bilinear", "Bicubic", "Lanczos"});
+	filters->setCurrentIndex(settings.value("transform_filter", ImageTransform::Bicubic).toInt());
+	form->addRow("Filter:", filters);
+
+	QDialogButtonBox *buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, &dialog);
+	connect(buttons, &QDialogButtonBox::accepted, &dialog, &QDialog::accept);
+	connect(buttons, &QDialogButtonBox::rejected, &dialog, &QDialog::reject);
+	form->addRow(buttons);
+
+	if (dialog.exec() != QDialog::Accepted)
+	{
+		return false;
+	}
+	filter = (ImageTransform::Filter)filters->currentIndex();
+	settings.setValue("transform_filter", filter);
+	return true;
+}
+void ImageViewer::on_actionResize_triggered()
+{
+	QDialog dialog(this);
+	QSpinBox *width = new QSpinBox(&dialog);
+	QSpinBox *height = new QSpinBox(&dialog);
+	width->setRange(1, 65535);
+	height->setRange(1, 65535);
+	width->setValue(vW->getImage()->width());
+	height->setValue(vW->getImage()->height());
+
+	ImageTransform::Filter filter;
+	if (!execTransformDialog(dialog, "Resize", {{"Width:", width}, {"Height:", height}}, filter))
+	{
+		return;
+	}
+	// Not through applyFilter, which marks every pixel changed, a blank canvas stays blank
+	QElapsedTimer timer;
+	timer.start();
+	if (!vW->changeSize(width->value(), height->value(), filter))
+	{
+		msgBox.setText("Resize failed: the size is empty, the format is not supported or the image is too large.");
+		msgBox.setIcon(QMessageBox::Warning);
+		msgBox.exec();
+		return;
+	}
+	showCanvasShared();
+	ui->statusBar->showMessage(QString("Resize: %1 ms").arg(timer.elapsed()));
+	scheduleHistogram();
+}
+void ImageViewer::on_actionRotate_triggered()
+{
+	QDialog dialog(this);
+	QDoubleSpinBox *angle = new QDoubleSpinBox(&dialog);
+	angle->setRange(-360, 360);
+	angle->setSuffix(" deg");
+
+	ImageTransform::Filter filter;
+	if (!execTransformDialog(dialog, "Rotate", {{"Angle (clockwise):", angle}}, filter))
+	{
+		return;
+	}
+	QTransform transform;
+	transform.rotate(angle->value());
+	applyTransform("Rotate", [=]()
+				   { return vW->transformImage(transform, filter); });
+}
+void ImageViewer::on_actionShear_triggered()
+{
+	QDialog dialog(this);
+	QDoubleSpinBox *horizontal = new QDoubleSpinBox(&dialog);
+	QDoubleSpinBox *vertical = new QDoubleSpinBox(&dialog);
+	horizontal->setRange(-5, 5);
+	vertical->setRange(-5, 5);
+	horizontal->setSingleStep(0.1);
+	vertical->setSingleStep(0.1);
+
+	ImageTransform::Filter filter;
+	if (!execTransformDialog(dialog, "Shear", {{"Horizontal:", horizontal}, {"Vertical:", vertical}}, filter))
+	{
+		return;
+	}
+	QTransform transform;
+	transform.shear(horizontal->value(), vertical->value());
+	applyTransform("Shear", [=]()
+				   { return vW->transformImage(transform, filter); });
+}
 
 void ImageViewer::on_pushButtonSetColor_clicked()
 {
@@ -402,3 +1278,32 @@ void ImageViewer::on_pushButtonSetColor_clicked()
 		vW->setGlobalColor(newColor);
 	}
 }
+void ImageViewer::on_pushButtonFillEndColor_clicked()
+{
+	QColor newColor = QColorDialog::getColor(vW->getFillEndColor(), this);
+	if (newColor.isValid())
+	{
+		QString style_sheet = QString("background-color: #%1;").arg(newColor.rgba(), 0, 16);
+		ui->pushButtonFillEndColor->setStyleSheet(style_sheet);
+		vW->setFillStyle(vW->getFillType(), newColor, fillTexture);
+	}
+}
+void ImageViewer::on_fill_source_combobox_currentIndexChanged(int index)
+{
+	PaintSource::Type type = (PaintSource::Type)index;
+	if (type == PaintSource::Texture)
+	{
+		QString folder = settings.value("folder_img_load_path", "").toString();
+		QString fileFilter = "Image data (*.bmp *.gif *.jpg *.jpeg *.png *.pbm *.pgm *.ppm .*xbm .* xpm);;All files (*)";
+		QString fileName = QFileDialog::getOpenFileName(this, "Load texture", folder, fileFilter);
+		QImage texture = fileName.isEmpty() ? QImage() : QImage(fileName);
+		if (texture.isNull())
+		{
+			// Back to solid, which calls this slot again
+			ui->fill_source_combobox->setCurrentIndex(PaintSource::Solid);
+			return;
+		}
+		fillTexture = texture;
+	}
+	vW->setFillStyle(type, vW->getFillEndColor(), fillTexture);
+}
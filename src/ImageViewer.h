@@ -4,6 +4,16 @@
 #include <QtWidgets>
 #include "ui_ImageViewer.h"
 #include "ViewerWidget.h"
+#include "ImageFilter.h"
+#include "ColorAdjust.h"
+#include "ColorAdjustDialog.h"
+#include "InputRecorder.h"
+#include "SequencePlayer.h"
+#include "GalleryLoader.h"
+#include "CompareWidget.h"
+#include "AnimationExporter.h"
+
+#include <functional>
 
 class ImageViewer : public QMainWindow
 {
@@ -12,12 +22,30 @@ class ImageViewer : public QMainWindow
 public:
 	ImageViewer(QWidget *parent = Q_NULLPTR);
 
+	// Replays an input recording, report lists the latencies per kind of event
+	bool replayInput(QString filename, bool original_timing, QString &report);
+	// Puts the background layer into shared memory under key
+	bool shareCanvas(QString key);
+	// Keeps the background layer in a memory-mapped session file, reopened on the next start
+	bool openSession(QString filename);
+	// Compares the flattened canvas with the image in filename, shown in place of the canvas
+	bool compareWith(QString filename);
+
 private:
 	Ui::ImageViewerClass *ui;
 	ViewerWidget *vW;
+	CompareWidget *compareWidget;
 
 	QSettings settings;
 	QMessageBox msgBox;
+	QTimer histogramTimer;
+	QImage fillTexture;
+	InputRecorder recorder;
+	SequencePlayer player;
+	GalleryLoader gallery;
+	// Region statistics follow the rectangle dragged from regionStart
+	QPoint regionStart;
+	bool regionDragging = false;
 
 	// Event filters
 	bool eventFilter(QObject *obj, QEvent *event);
@@ -36,24 +64,134 @@ private:
 
 	// Image functions
 	bool openImage(QString filename);
+	bool showImage(const QImage &image);
 	bool saveImage(QString filename);
 
+	// Loads and size changes end the sharing
+	void showCanvasShared() { QSignalBlocker blocker(ui->actionShare_canvas); ui->actionShare_canvas->setChecked(vW->isCanvasShared()); }
+	// Sharing the canvas ends the session
+	void showSessionOpen() { QSignalBlocker blocker(ui->actionSession_file); ui->actionSession_file->setChecked(vW->isSessionOpen()); }
+
+	// Comparison, the scroll area holds either the canvas or the comparison
+	void setCompareShown(bool shown);
+	void endComparison();
+
+	// Image sequences
+	bool openSequence(QString source);
+	void closeSequence();
+	void showFrame(int frame, QImage image);
+	void showPlaybackStatus();
+
+	// Gallery, thumbnails are requested for the items on screen
+	bool openFolder(QString folder);
+	void requestVisibleThumbnails();
+	void stepGallery(int step);
+
+	// Layers, the list shows the top layer first
+	void refreshLayers();
+	void showLayerProperties();
+
 	// Hermit functions
 	void setHermitBox(bool state, int n = -1);
 
+	// Region statistics, every readout is a few lookups in the canvas's integral image
+	void showRegionStatistics(QPoint end);
+
+	// Image filters, error is shown when filter returns false
+	void applyFilter(QString name, std::function<bool(QImage &)> filter, QString error = "Filter is not supported for this image format.");
+	void applyTransform(QString name, std::function<bool()> transform)
+	{
+		applyFilter(name, [=](QImage &)
+					{ return transform(); }, QString("%1 failed: the canvas is empty, its format is not supported or the result is too large.").arg(name));
+	}
+
+	// Shapes, the finished polygon is combined into the shape
+	void combinePolygon(PolygonBoolean::Operation operation);
+
+	// Raster transforms
+	bool execTransformDialog(QDialog &dialog, QString title, QVector<QPair<QString, QWidget *>> fields, ImageTransform::Filter &filter);
+
+	// Redraw instrumentation, the steady state goal is an arena that no longer grows.
+	// Heap allocations are only counted in IMAGEVIEWER_COUNT_ALLOCATIONS builds.
+	void showFrameStats()
+	{
+		const ViewerWidget::FrameStats &stats = vW->getFrameStats();
+		QString message = QString("Redraw: %1 arena blocks added, %2 KiB scratch").arg(stats.arenaBlocks).arg(stats.scratchBytes / 1024.0, 0, 'f', 1);
+		if (stats.allocations >= 0)
+			message += QString(", %1 allocations").arg(stats.allocations);
+		if (!vW->getPolylines().isEmpty())
+			message += QString(", polylines at level %1 of %2").arg(vW->getPolylineLevel() + 1).arg(vW->getPolylines().levelCount());
+		const double area = std::max((double)vW->getImage()->width() * vW->getImage()->height(), 1.);
+		message += QString(", overdraw %1x").arg(stats.paintedPixels / area, 0, 'f', 2);
+		if (stats.occludedTiles > 0)
+			message += QString(", %1 occluded tiles culled %2 objects and %3 px").arg(stats.occludedTiles).arg(stats.culledObjects).arg(stats.culledPixels);
+		ui->statusBar->showMessage(message);
+	}
+
+	// Histogram
+	void scheduleHistogram() { histogramTimer.start(); }
+	void updateHistogram() { ui->histogram_widget->setHistogram(Histogram::compute(*vW->getImage(), vW->getLayers().layer(vW->getActiveLayer()).paper)); }
+
 private slots:
 	void on_actionOpen_triggered();
+	void on_actionOpen_sequence_triggered();
+	void on_actionOpen_folder_triggered();
+	void on_actionCompare_with_triggered();
+	void on_actionImport_polylines_triggered();
+	void on_actionPrevious_image_triggered() { stepGallery(-1); }
+	void on_actionNext_image_triggered() { stepGallery(1); }
 	void on_actionSave_as_triggered();
+	void on_actionExport_animation_triggered();
 	void on_actionClear_triggered();
 	void on_actionExit_triggered();
+	void on_actionRecord_input_toggled(bool checked);
+	void on_actionReplay_input_triggered();
+	void on_actionShare_canvas_toggled(bool checked);
+	void on_actionSession_file_toggled(bool checked);
+
+	// Image filter slots
+	void on_actionGaussian_blur_triggered();
+	void on_actionBox_blur_triggered();
+	void on_actionUnsharp_mask_triggered();
+	void on_actionEdge_detect_triggered();
+	void on_actionMedian_triggered();
+	void on_actionConvolution_triggered();
+	void on_actionAdjust_colors_triggered();
+
+	void on_actionLabel_font_triggered();
+
+	// Shape slots
+	void on_actionUnion_with_polygon_triggered() { combinePolygon(PolygonBoolean::Union); }
+	void on_actionIntersect_with_polygon_triggered() { combinePolygon(PolygonBoolean::Intersection); }
+	void on_actionSubtract_polygon_triggered() { combinePolygon(PolygonBoolean::Difference); }
+	void on_actionXor_with_polygon_triggered() { combinePolygon(PolygonBoolean::Xor); }
+
+	// Raster transform slots
+	void on_actionResize_triggered();
+	void on_actionRotate_triggered();
+	void on_actionShear_triggered();
+	void on_actionFlip_horizontal_triggered()
+	{
+		applyTransform("Flip", [=]()
+					   { return vW->flipImage(true, false); });
+	}
+	void on_actionFlip_vertical_triggered()
+	{
+		applyTransform("Flip", [=]()
+					   { return vW->flipImage(false, true); });
+	}
 
 	// Tools slots
 	void on_pushButtonSetColor_clicked();
+	void on_pushButtonFillEndColor_clicked();
+	void on_fill_source_combobox_currentIndexChanged(int index);
+	void on_fill_half_space_toggled(bool checked) { vW->setHalfSpaceFill(checked); }
 	void on_clear_button_clicked()
 	{
 		vW->clear();
 		vW->delete_objects();
 		setHermitBox(false);
+		scheduleHistogram();
 	}
 
 	void on_rotate_button_clicked() { vW->rotateObjects(ui->rotate_angle->value(), true, (bool)ui->rotate_direction->currentIndex()); }
@@ -61,6 +199,27 @@ private slots:
 	void on_shear_button_clicked() { vW->shearObjects(ui->shear_factor->value()); }
 	void on_symmetry_button_clicked() { vW->symmetryPolygon(ui->symmetry_edge_index->value()); }
 
+	// Gallery slots
+	void on_gallery_list_currentRowChanged(int row);
+
+	// Compare slots
+	void on_compare_view_combobox_currentIndexChanged(int index) { compareWidget->setView((CompareWidget::View)index); }
+	void on_compare_gain_valueChanged(double gain) { compareWidget->setGain(gain); }
+	void on_compare_close_button_clicked() { endComparison(); }
+
+	// Playback slots
+	void on_playback_play_button_toggled(bool checked);
+	void on_playback_slider_valueChanged(int value) { player.seek(value); }
+	void on_playback_fps_valueChanged(double fps) { player.setFrameRate(fps); }
+
+	// Layer slots
+	void on_layer_add_button_clicked();
+	void on_layer_remove_button_clicked();
+	void on_layer_list_currentRowChanged(int row);
+	void on_layer_list_itemChanged(QListWidgetItem *item);
+	void on_layer_opacity_valueChanged(int value) { vW->setLayerOpacity(vW->getActiveLayer(), value / 100.); }
+	void on_layer_blend_combobox_currentIndexChanged(int index) { vW->setLayerBlend(vW->getActiveLayer(), (LayerStack::Blend)index); }
+
 	// Hermit Slots
 	void on_n_spinbox_valueChanged(int n)
 	{
@@ -0,0 +1,365 @@
+#include "InputRecorder.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    const QPair<QEvent::Type, const char *> eventNames[] = {
+        {QEvent::MouseButtonPress, "press"},
+        {QEvent::MouseButtonRelease, "release"},
+        {QEvent::MouseButtonDblClick, "doubleclick"},
+        {QEvent::MouseMove, "move"},
+        {QEvent::Wheel, "wheel"},
+        {QEvent::Enter, "enter"},
+        {QEvent::Leave, "leave"}};
+}
+
+QString InputRecorder::eventName(QEvent::Type type)
+{
+    for (const auto &name : eventNames)
+    {
+        if (name.first == type)
+            return name.second;
+    }
+    return QString();
+}
+
+//// Recording ////
+
+void InputRecorder::start(QWidget *tools, const QStringList &excluded)
+{
+    stop();
+    entries.clear();
+    clock.start();
+    recording = true;
+
+    for (QWidget *widget : tools->findChildren<QWidget *>())
+    {
+        const QString name = widget->objectName();
+        if (name.isEmpty() || name.startsWith("qt_") || excluded.contains(name))
+            continue;
+
+        if (QSpinBox *spin = qobject_cast<QSpinBox *>(widget))
+            connections << QObject::connect(spin, QOverload<int>::of(&QSpinBox::valueChanged), [=](int value)
+                                            { recordTool(spin, QString::number(value)); });
+        else if (QDoubleSpinBox *spin = qobject_cast<QDoubleSpinBox *>(widget))
+            connections << QObject::connect(spin, QOverload<double>::of(&QDoubleSpinBox::valueChanged), [=](double value)
+                                            { recordTool(spin, QString::number(value, 'g', 17)); });
+        else if (QComboBox *combo = qobject_cast<QComboBox *>(widget))
+            connections << QObject::connect(combo, QOverload<int>::of(&QComboBox::currentIndexChanged), [=](int index)
+                                            { recordTool(combo, QString::number(index)); });
+        else if (QAbstractSlider *slider = qobject_cast<QAbstractSlider *>(widget))
+            connections << QObject::connect(slider, &QAbstractSlider::valueChanged, [=](int value)
+                                            { recordTool(slider, QString::number(value)); });
+        else if (QAbstractButton *button = qobject_cast<QAbstractButton *>(widget))
+        {
+            if (button->isCheckable())
+                connections << QObject::connect(button, &QAbstractButton::toggled, [=](bool checked)
+                                                { recordTool(button, checked ? "1" : "0"); });
+            else
+                connections << QObject::connect(button, &QAbstractButton::clicked, [=]()
+                                                { recordTool(button, "click"); });
+        }
+        else
+            continue;
+
+        const QString value = toolValue(widget);
+        if (!value.isEmpty())
+            recordTool(widget, value, true);
+    }
+}
+
+void InputRecorder::stop()
+{
+    for (const QMetaObject::Connection &connection : connections)
+        QObject::disconnect(connection);
+    connections.clear();
+    recording = false;
+}
+
+bool InputRecorder::save(const QString &file_name) const
+{
+    QFile file(file_name);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+        return false;
+
+    QTextStream out(&file);
+    out << "# ImageViewer input recording\n";
+    for (const Entry &entry : entries)
+    {
+        out << entry.time;
+        if (entry.type == QEvent::None)
+            out << (entry.state ? " state " : " tool ") << entry.tool << ' ' << entry.value << '\n';
+        else
+            out << " event " << eventName(entry.type) << ' ' << entry.position.x() << ' ' << entry.position.y() << ' '
+                << entry.button << ' ' << entry.buttons << ' ' << entry.modifiers << ' '
+                << entry.angleDelta.x() << ' ' << entry.angleDelta.y() << '\n';
+    }
+    return file.error() == QFile::NoError;
+}
+
+InputRecorder::Scope::Scope(InputRecorder &recorder, QEvent *event) : recorder(recorder)
+{
+    if (recorder.recording)
+        recorder.record(event);
+    recorder.handling++;
+}
+
+void InputRecorder::record(QEvent *event)
+{
+    Entry entry;
+    entry.time = clock.nsecsElapsed();
+    entry.type = event->type();
+
+    switch (entry.type)
+    {
+    case QEvent::MouseButtonPress:
+    case QEvent::MouseButtonRelease:
+    case QEvent::MouseButtonDblClick:
+    case QEvent::MouseMove:
+    {
+        QMouseEvent *e = static_cast<QMouseEvent *>(event);
+        entry.position = e->position();
+        entry.button = e->button();
+        entry.buttons = e->buttons();
+        entry.modifiers = e->modifiers();
+        break;
+    }
+    case QEvent::Wheel:
+    {
+        QWheelEvent *e = static_cast<QWheelEvent *>(event);
+        entry.position = e->position();
+        entry.angleDelta = e->angleDelta();
+        entry.buttons = e->buttons();
+        entry.modifiers = e->modifiers();
+        break;
+    }
+    case QEvent::Enter:
+        entry.position = static_cast<QEnterEvent *>(event)->position();
+        break;
+    case QEvent::Leave:
+        break;
+    default:
+        return;
+    }
+    entries.push_back(entry);
+}
+
+void InputRecorder::recordTool(QWidget *widget, const QString &value, bool state)
+{
+    // Slots setting other tools, or viewer events setting them, are not the user
+    if (!state && (handling > 0 || !(widget->hasFocus() || widget->underMouse())))
+        return;
+
+    Entry entry;
+    entry.time = state ? 0 : clock.nsecsElapsed();
+    entry.tool = widget->objectName();
+    entry.value = value;
+    entry.state = state;
+    entries.push_back(entry);
+}
+
+QString InputRecorder::toolValue(QWidget *widget)
+{
+    if (QSpinBox *spin = qobject_cast<QSpinBox *>(widget))
+        return QString::number(spin->value());
+    if (QDoubleSpinBox *spin = qobject_cast<QDoubleSpinBox *>(widget))
+        return QString::number(spin->value(), 'g', 17);
+    if (QComboBox *combo = qobject_cast<QComboBox *>(widget))
+        return QString::number(combo->currentIndex());
+    if (QAbstractSlider *slider = qobject_cast<QAbstractSlider *>(widget))
+        return QString::number(slider->value());
+    if (QAbstractButton *button = qobject_cast<QAbstractButton *>(widget))
+        return button->isCheckable() ? QString(button->isChecked() ? "1" : "0") : QString();
+    return QString();
+}
+
+void InputRecorder::setToolValue(QWidget *widget, const QString &value)
+{
+    if (QSpinBox *spin = qobject_cast<QSpinBox *>(widget))
+        spin->setValue(value.toInt());
+    else if (QDoubleSpinBox *spin = qobject_cast<QDoubleSpinBox *>(widget))
+        spin->setValue(value.toDouble());
+    else if (QComboBox *combo = qobject_cast<QComboBox *>(widget))
+        combo->setCurrentIndex(value.toInt());
+    else if (QAbstractSlider *slider = qobject_cast<QAbstractSlider *>(widget))
+        slider->setValue(value.toInt());
+    else if (QAbstractButton *button = qobject_cast<QAbstractButton *>(widget))
+    {
+        if (button->isCheckable())
+            button->setChecked(value == "1");
+        else
+            button->click();
+    }
+}
+
+//// Replay ////
+
+bool InputRecorder::load(const QString &file_name)
+{
+    QFile file(file_name);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QVector<Entry> loaded;
+    QTextStream in(&file);
+    while (!in.atEnd())
+    {
+        const QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        const QStringList fields = line.split(' ', Qt::SkipEmptyParts);
+        Entry entry;
+        bool ok = fields.size() >= 4;
+        if (ok)
+            entry.time = fields[0].toLongLong(&ok);
+        if (ok && (fields[1] == "tool" || fields[1] == "state"))
+        {
+            entry.tool = fields[2];
+            entry.value = fields[3];
+            entry.state = fields[1] == "state";
+        }
+        else if (ok && fields[1] == "event" && fields.size() == 10)
+        {
+            for (const auto &name : eventNames)
+            {
+                if (fields[2] == name.second)
+                    entry.type = name.first;
+            }
+            entry.position = QPointF(fields[3].toDouble(), fields[4].toDouble());
+            entry.button = fields[5].toInt();
+            entry.buttons = fields[6].toInt();
+            entry.modifiers = fields[7].toInt();
+            entry.angleDelta = QPoint(fields[8].toInt(), fields[9].toInt());
+            ok = entry.type != QEvent::None;
+        }
+        else
+            ok = false;
+
+        if (!ok)
+            return false;
+        loaded.push_back(entry);
+    }
+    entries = loaded;
+    return true;
+}
+
+void InputRecorder::dispatch(QWidget *viewer, const Entry &entry)
+{
+    const QPointF global = viewer->mapToGlobal(entry.position);
+    const Qt::MouseButtons buttons(entry.buttons);
+    const Qt::KeyboardModifiers modifiers(entry.modifiers);
+
+    switch (entry.type)
+    {
+    case QEvent::Wheel:
+    {
+        QWheelEvent event(entry.position, global, QPoint(), entry.angleDelta, buttons, modifiers, Qt::NoScrollPhase, false);
+        QCoreApplication::sendEvent(viewer, &event);
+        break;
+    }
+    case QEvent::Enter:
+    {
+        QEnterEvent event(entry.position, entry.position, global);
+        QCoreApplication::sendEvent(viewer, &event);
+        break;
+    }
+    case QEvent::Leave:
+    {
+        QEvent event(QEvent::Leave);
+        QCoreApplication::sendEvent(viewer, &event);
+        break;
+    }
+    default:
+    {
+        QMouseEvent event(entry.type, entry.position, global, (Qt::MouseButton)entry.button, buttons, modifiers);
+        QCoreApplication::sendEvent(viewer, &event);
+        break;
+    }
+    }
+}
+
+QVector<InputRecorder::Latency> InputRecorder::replay(QWidget *viewer, QWidget *tools, bool original_timing)
+{
+    QStringList names;
+    QHash<QString, QVector<double>> samples;
+
+    QElapsedTimer replayClock;
+    replayClock.start();
+    for (const Entry &entry : entries)
+    {
+        QWidget *tool = entry.type == QEvent::None ? tools->findChild<QWidget *>(entry.tool) : nullptr;
+        if (entry.state)
+        {
+            if (tool)
+                setToolValue(tool, entry.value);
+            continue;
+        }
+        if (entry.type == QEvent::None && !tool)
+            continue;
+
+        // The event loop keeps running through the pauses, as it would for the user
+        for (qint64 wait; original_timing && (wait = entry.time - replayClock.nsecsElapsed()) > 0;)
+        {
+            QCoreApplication::processEvents();
+            QThread::usleep(std::min<qint64>(wait / 1000, 1000));
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        if (tool)
+            setToolValue(tool, entry.value);
+        else
+            dispatch(viewer, entry);
+        // Posted work of the event, including the repaint of what it changed
+        QCoreApplication::processEvents();
+        const double elapsed = timer.nsecsElapsed() / 1e6;
+
+        const QString name = tool ? entry.tool : eventName(entry.type);
+        if (!samples.contains(name))
+            names << name;
+        samples[name].push_back(elapsed);
+    }
+
+    QVector<Latency> latencies;
+    for (const QString &name : names)
+    {
+        QVector<double> &times = samples[name];
+        std::sort(times.begin(), times.end());
+        Latency latency;
+        latency.name = name;
+        latency.count = times.size();
+        for (double time : times)
+            latency.mean += time;
+        latency.mean /= times.size();
+        latency.median = times[times.size() / 2];
+        latency.p95 = times[std::max(0, (int)std::ceil(0.95 * times.size()) - 1)];
+        latency.max = times.last();
+        latencies.push_back(latency);
+    }
+    return latencies;
+}
+
+QString InputRecorder::report(const QVector<Latency> &latencies)
+{
+    QString text = QString("%1 %2 %3 %4 %5 %6\n")
+                       .arg("event", -20)
+                       .arg("count", 7)
+                       .arg("mean ms", 9)
+                       .arg("median", 9)
+                       .arg("p95", 9)
+                       .arg("max", 9);
+    for (const Latency &latency : latencies)
+    {
+        text += QString("%1 %2 %3 %4 %5 %6\n")
+                    .arg(latency.name, -20)
+                    .arg(latency.count, 7)
+                    .arg(latency.mean, 9, 'f', 3)
+                    .arg(latency.median, 9, 'f', 3)
+                    .arg(latency.p95, 9, 'f', 3)
+                    .arg(latency.max, 9, 'f', 3);
+    }
+    return text;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <QtWidgets>
+
+// Records the input reaching the viewer and the tool widgets into a timestamped
+// file and plays it back, measuring how long each event takes to handle.
+// Tool widgets are spin boxes, combo boxes, sliders and buttons found by object
+// name. Only changes the user makes count, changes the slots make in response
+// are reproduced by the replay itself.
+class InputRecorder
+{
+public:
+    struct Entry
+    {
+        qint64 time = 0;                  // nanoseconds since the recording started
+        QEvent::Type type = QEvent::None; // None for a tool widget change
+        QPointF position;
+        int button = 0, buttons = 0, modifiers = 0;
+        QPoint angleDelta;
+        QString tool; // object name of the tool widget
+        QString value;
+        bool state = false; // part of the initial tool state, not timed
+    };
+
+    // Latencies of one kind of event in milliseconds
+    struct Latency
+    {
+        QString name;
+        int count = 0;
+        double mean = 0, median = 0, p95 = 0, max = 0;
+    };
+
+    // Starts with a snapshot of the tool widgets under tools, except those in
+    // excluded, whose clicks would open dialogs
+    void start(QWidget *tools, const QStringList &excluded = QStringList());
+    void stop();
+    bool save(const QString &file_name) const;
+    bool isRecording() const { return recording; }
+
+    // Records a viewer event, tool changes while it lives are the event's consequences
+    class Scope
+    {
+    public:
+        Scope(InputRecorder &recorder, QEvent *event);
+        ~Scope() { recorder.handling--; }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        InputRecorder &recorder;
+    };
+
+    // Feeds a recording to viewer and tools, with the recorded pauses or as fast as
+    // possible. A latency covers handling the event and the repaint it causes.
+    bool load(const QString &file_name);
+    QVector<Latency> replay(QWidget *viewer, QWidget *tools, bool original_timing);
+    static QString report(const QVector<Latency> &latencies);
+
+private:
+    QVector<Entry> entries;
+    QVector<QMetaObject::Connection> connections;
+    QElapsedTimer clock;
+    bool recording = false;
+    int handling = 0;
+
+    void record(QEvent *event);
+    void recordTool(QWidget *widget, const QString &value, bool state = false);
+    static QString toolValue(QWidget *widget);
+    static void setToolValue(QWidget *widget, const QString &value);
+    static QString eventName(QEvent::Type type);
+    static void dispatch(QWidget *viewer, const Entry &entry);
+};
@@ -0,0 +1,451 @@
+#include "LayerStack.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    struct Mapping
+    {
+        void *bits;
+        size_t bytes;
+    };
+
+    // Zeroed rows in an anonymous mapping of their own. The system hands out
+    // such memory zero filled and backs a page only once it is written, so a
+    // transparent layer costs address space, not memory, until it is drawn on.
+    QImage zeroedImage(QSize size, QImage::Format format)
+    {
+        const qsizetype bytes_per_line = ((qsizetype)QImage::toPixelFormat(format).bitsPerPixel() * size.width() + 31) / 32 * 4;
+        Mapping *mapping = new Mapping{nullptr, (size_t)bytes_per_line * size.height()};
+#ifdef Q_OS_WIN
+        mapping->bits = VirtualAlloc(nullptr, mapping->bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+        mapping->bits = mmap(nullptr, mapping->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping->bits == MAP_FAILED)
+            mapping->bits = nullptr;
+#endif
+        if (!mapping->bits || mapping->bytes == 0)
+        {
+            delete mapping;
+            return QImage();
+        }
+        return QImage(static_cast<uchar *>(mapping->bits), size.width(), size.height(), bytes_per_line, format, [](void *info)
+                      {
+            Mapping *mapping = static_cast<Mapping *>(info);
+#ifdef Q_OS_WIN
+            VirtualFree(mapping->bits, 0, MEM_RELEASE);
+#else
+            munmap(mapping->bits, mapping->bytes);
+#endif
+            delete mapping; }, mapping);
+    }
+
+    QImage paperImage(QSize size)
+    {
+        return zeroedImage(size, QImage::Format_ARGB32_Premultiplied);
+    }
+}
+
+QPainter::CompositionMode LayerStack::compositionMode(Blend blend)
+{
+    switch (blend)
+    {
+    case Multiply:
+        return QPainter::CompositionMode_Multiply;
+    case Screen:
+        return QPainter::CompositionMode_Screen;
+    case Overlay:
+        return QPainter::CompositionMode_Overlay;
+    case Darken:
+        return QPainter::CompositionMode_Darken;
+    case Lighten:
+        return QPainter::CompositionMode_Lighten;
+    case Difference:
+        return QPainter::CompositionMode_Difference;
+    case Add:
+        return QPainter::CompositionMode_Plus;
+    default:
+        return QPainter::CompositionMode_SourceOver;
+    }
+}
+
+void LayerStack::reset(const QImage &background)
+{
+    setBounds(background.size());
+    layers.clear();
+    auto layer = std::make_unique<Layer>();
+    layer->name = "Background";
+    layer->image = background;
+    layer->painted = background.rect();
+    layer->drawn.assign(columns * rows, 1);
+    layers.push_back(std::move(layer));
+}
+
+void LayerStack::reset(QSize size)
+{
+    reset(paperImage(size));
+    Layer &background = *layers[0];
+    background.paper = true;
+    background.painted = QRect();
+    std::fill(background.drawn.begin(), background.drawn.end(), 0);
+}
+
+bool LayerStack::isBlank() const
+{
+    for (const auto &layer : layers)
+    {
+        if (std::find(layer->drawn.begin(), layer->drawn.end(), 1) != layer->drawn.end())
+            return false;
+    }
+    return true;
+}
+
+bool LayerStack::resizeBlank(QSize size)
+{
+    if (!isBlank() || size.isEmpty())
+        return false;
+    setBounds(size);
+    for (int i = 0; i < count(); i++)
+    {
+        Layer &layer = *layers[i];
+        layer.image = i == 0 ? paperImage(size) : zeroedImage(size, layer.image.format());
+        layer.paper = i == 0 || layer.paper;
+        layer.painted = QRect();
+        layer.drawn.assign(columns * rows, 0);
+    }
+    return true;
+}
+
+void LayerStack::setBounds(QSize size)
+{
+    bounds = QRect(QPoint(0, 0), size);
+    columns = (bounds.width() + tileSize - 1) / tileSize;
+    rows = (bounds.height() + tileSize - 1) / tileSize;
+    tiles.assign(columns * rows, QImage());
+    stale.assign(columns * rows, 1);
+
+    if (paperTile.isNull())
+    {
+        paperTile = QImage(tileSize, tileSize, QImage::Format_ARGB32_Premultiplied);
+        paperTile.fill(Qt::white);
+        clearTile = QImage(tileSize, tileSize, QImage::Format_ARGB32_Premultiplied);
+        clearTile.fill(Qt::transparent);
+    }
+}
+
+int LayerStack::insertLayer(int index, const QString &name)
+{
+    auto layer = std::make_unique<Layer>();
+    layer->name = name;
+    layer->image = zeroedImage(bounds.size(), QImage::Format_ARGB32_Premultiplied);
+    layer->drawn.assign(columns * rows, 0);
+    index = std::min(std::max(index + 1, 0), count());
+    layers.insert(layers.begin() + index, std::move(layer));
+    return index;
+}
+
+void LayerStack::removeLayer(int index)
+{
+    if (count() <= 1)
+        return;
+    invalidate(layers[index]->painted);
+    layers.erase(layers.begin() + index);
+}
+
+bool LayerStack::setImage(int index, const QImage &image)
+{
+    if (image.size() != bounds.size())
+        return false;
+    layers[index]->image = image;
+    layers[index]->paper = false;
+    layers[index]->painted = bounds;
+    layers[index]->drawn.assign(columns * rows, 1);
+    if (layers[index]->visible)
+        invalidate(bounds);
+    return true;
+}
+
+void LayerStack::setVisible(int index, bool visible)
+{
+    if (layers[index]->visible == visible)
+        return;
+    layers[index]->visible = visible;
+    invalidate(layers[index]->painted);
+}
+
+void LayerStack::setOpacity(int index, double opacity)
+{
+    if (layers[index]->opacity == opacity)
+        return;
+    layers[index]->opacity = opacity;
+    if (layers[index]->visible)
+        invalidate(layers[index]->painted);
+}
+
+void LayerStack::setBlend(int index, Blend blend)
+{
+    if (layers[index]->blend == blend)
+        return;
+    layers[index]->blend = blend;
+    if (layers[index]->visible)
+        invalidate(layers[index]->painted);
+}
+
+void LayerStack::changed(int index, const QRect &area)
+{
+    const QRect clipped = area & bounds;
+    if (clipped.isEmpty())
+        return;
+    Layer &layer = *layers[index];
+    layer.painted |= clipped;
+    for (int row = clipped.top() / tileSize; row <= clipped.bottom() / tileSize; row++)
+    {
+        for (int column = clipped.left() / tileSize; column <= clipped.right() / tileSize; column++)
+            layer.drawn[row * columns + column] = 1;
+    }
+    if (layer.visible)
+        invalidate(clipped);
+}
+
+std::vector<QRect> LayerStack::clear(int index)
+{
+    Layer &layer = *layers[index];
+    std::vector<int> drawn;
+    for (int tile = 0; tile < (int)layer.drawn.size(); tile++)
+    {
+        if (layer.drawn[tile])
+            drawn.push_back(tile);
+    }
+
+    // White and transparent are all ones and all zeros in every drawable format
+    const bool white = index == 0 && !layer.paper;
+    const int value = white ? 0xff : 0;
+    uchar *bits = layer.image.bits();
+    const qsizetype stride = layer.image.bytesPerLine();
+    const int pixel_bytes = layer.image.depth() / 8;
+    Parallel::forRows(
+        0, (int)drawn.size(), [&](int first, int last)
+        {
+            for (int i = first; i < last; i++)
+            {
+                const QRect rect = tileRect(drawn[i]);
+                for (int y = rect.top(); y <= rect.bottom(); y++)
+                    std::memset(bits + y * stride + (qsizetype)rect.left() * pixel_bytes, value, (size_t)rect.width() * pixel_bytes);
+            } },
+        4);
+
+    if (layer.visible)
+    {
+        for (int tile : drawn)
+            stale[tile] = 1;
+    }
+    std::fill(layer.drawn.begin(), layer.drawn.end(), 0);
+    layer.painted = white ? bounds : QRect();
+
+    std::vector<QRect> refilled;
+    refilled.reserve(drawn.size());
+    for (int tile : drawn)
+        refilled.push_back(tileRect(tile));
+    return refilled;
+}
+
+void LayerStack::settlePaper(int index)
+{
+    Layer &layer = *layers[index];
+    if (!layer.paper)
+        return;
+
+    // Premultiplied, white adds what the alpha leaves over to every channel
+    uchar *bits = layer.image.bits();
+    const qsizetype stride = layer.image.bytesPerLine();
+    const int width = layer.image.width();
+    Parallel::forRows(0, layer.image.height(), [&](int first, int last)
+                      {
+        for (int y = first; y < last; y++)
+        {
+            QRgb *line = reinterpret_cast<QRgb *>(bits + y * stride);
+            for (int x = 0; x < width; x++)
+                line[x] += (255 - qAlpha(line[x])) * 0x01010101u;
+        } });
+
+    layer.paper = false;
+    layer.painted = bounds;
+    layer.drawn.assign(columns * rows, 1);
+    if (layer.visible)
+        invalidate(bounds);
+}
+
+bool LayerStack::map(const std::function<QImage(const QImage &)> &function)
+{
+    std::vector<QImage> results;
+    for (const auto &layer : layers)
+    {
+        results.push_back(function(layer->image));
+        if (results.back().isNull() || results.back().size() != results.front().size())
+            return false;
+    }
+
+    // Layer properties survive, the tiles follow the new size
+    std::vector<std::unique_ptr<Layer>> kept = std::move(layers);
+    reset(results[0]);
+    layers = std::move(kept);
+    for (int i = 0; i < count(); i++)
+    {
+        layers[i]->image = results[i];
+        layers[i]->painted = i == 0 && !layers[i]->paper ? bounds : layers[i]->painted.isEmpty() ? QRect() : bounds;
+        layers[i]->drawn.assign(columns * rows, 1);
+    }
+    return true;
+}
+
+QRect LayerStack::tileRect(int tile) const
+{
+    return QRect((tile % columns) * tileSize, (tile / columns) * tileSize, tileSize, tileSize) & bounds;
+}
+
+const QImage *LayerStack::solidTile(int tile) const
+{
+    // Blank layers above the background leave it as it is, whatever their blend
+    const Layer &bottom = *layers[0];
+    const bool paper = bottom.visible && bottom.opacity > 0;
+    if (paper && (bottom.opacity < 1 || bottom.drawn[tile]))
+        return nullptr;
+    for (int i = 1; i < count(); i++)
+    {
+        const Layer &layer = *layers[i];
+        if (layer.visible && layer.opacity > 0 && layer.drawn[tile])
+            return nullptr;
+    }
+    return paper ? &paperTile : &clearTile;
+}
+
+void LayerStack::invalidate(const QRect &area)
+{
+    const QRect clipped = area & bounds;
+    if (clipped.isEmpty())
+        return;
+    for (int row = clipped.top() / tileSize; row <= clipped.bottom() / tileSize; row++)
+    {
+        for (int column = clipped.left() / tileSize; column <= clipped.right() / tileSize; column++)
+            stale[row * columns + column] = 1;
+    }
+}
+
+void LayerStack::compose(const QRect &area)
+{
+    const QRect clipped = area & bounds;
+    if (clipped.isEmpty())
+        return;
+
+    std::vector<int> pending;
+    for (int row = clipped.top() / tileSize; row <= clipped.bottom() / tileSize; row++)
+    {
+        for (int column = clipped.left() / tileSize; column <= clipped.right() / tileSize; column++)
+        {
+            if (stale[row * columns + column])
+                pending.push_back(row * columns + column);
+        }
+    }
+
+    // Every tile is its own image, so the workers never share a paint device
+    QImage *tile_images = tiles.data();
+    Parallel::forRows(
+        0, (int)pending.size(), [&](int first, int last)
+        {
+            for (int i = first; i < last; i++)
+            {
+                const QRect rect = tileRect(pending[i]);
+                QImage &tile = tile_images[pending[i]];
+                if (const QImage *solid = solidTile(pending[i]))
+                {
+                    tile = *solid;
+                    continue;
+                }
+                if (tile.size() != rect.size() || !tile.isDetached())
+                    tile = QImage(rect.size(), QImage::Format_ARGB32_Premultiplied);
+                tile.fill(Qt::transparent);
+
+                QPainter painter(&tile);
+                bool bottom = true;
+                for (const auto &layer : layers)
+                {
+                    if (!layer->visible || layer->opacity <= 0 || (!layer->paper && !layer->painted.intersects(rect)))
+                        continue;
+                    if (layer->paper && bottom && layer->opacity == 1)
+                    {
+                        // Over nothing, every blend mode lays the paper and the pixels as they are
+                        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+                        painter.setOpacity(1);
+                        painter.fillRect(QRect(QPoint(0, 0), rect.size()), Qt::white);
+                        if (layer->painted.intersects(rect))
+                            painter.drawImage(QPoint(0, 0), layer->image, rect);
+                        bottom = false;
+                        continue;
+                    }
+                    if (layer->paper)
+                    {
+                        // The paper is part of the layer, blended and faded with its pixels
+                        QImage laid(rect.size(), QImage::Format_ARGB32_Premultiplied);
+                        laid.fill(Qt::white);
+                        QPainter(&laid).drawImage(QPoint(0, 0), layer->image, rect);
+                        painter.setCompositionMode(compositionMode(layer->blend));
+                        painter.setOpacity(layer->opacity);
+                        painter.drawImage(QPoint(0, 0), laid);
+                        bottom = false;
+                        continue;
+                    }
+                    painter.setCompositionMode(compositionMode(layer->blend));
+                    painter.setOpacity(layer->opacity);
+                    painter.drawImage(QPoint(0, 0), layer->image, rect);
+                    bottom = false;
+                }
+            } },
+        1);
+
+    for (int tile : pending)
+        stale[tile] = 0;
+}
+
+void LayerStack::paint(QPainter &painter, const QRect &area)
+{
+    compose(area);
+
+    const QRect clipped = area & bounds;
+    if (clipped.isEmpty())
+        return;
+    for (int row = clipped.top() / tileSize; row <= clipped.bottom() / tileSize; row++)
+    {
+        for (int column = clipped.left() / tileSize; column <= clipped.right() / tileSize; column++)
+        {
+            // Shared solid tiles are full size, edge tiles draw only their part
+            const QRect rect = tileRect(row * columns + column);
+            painter.drawImage(rect.topLeft(), tiles[row * columns + column], QRect(QPoint(0, 0), rect.size()));
+        }
+    }
+}
+
+QImage LayerStack::flattened()
+{
+    const Layer &bottom = *layers[0];
+    if (count() == 1 && bottom.visible && bottom.opacity == 1 && !bottom.paper)
+        return bottom.image;
+
+    compose(bounds);
+    QImage result(bounds.size(), QImage::Format_ARGB32_Premultiplied);
+    result.fill(Qt::transparent);
+    QPainter painter(&result);
+    for (int tile = 0; tile < (int)tiles.size(); tile++)
+    {
+        const QRect rect = tileRect(tile);
+        painter.drawImage(rect.topLeft(), tiles[tile], QRect(QPoint(0, 0), rect.size()));
+    }
+    return result;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <QImage>
+#include <QPainter>
+#include <QRect>
+#include <QString>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Raster layers of the document and their composite.
+// The composite is cached in tiles. Edits and layer property changes mark the
+// tiles they reach as stale, and painting recomposes only the stale tiles it
+// needs, in parallel on the thread pool. All layers share one size.
+//
+// Every layer also remembers the tiles drawn on since it was last blank. clear()
+// refills only those tiles and composite tiles no layer has drawn on share one
+// solid image. A blank document is white paper under a transparent background:
+// the compositor lays the paper per tile, and blank layers live in anonymous
+// memory mapped from the system, whose pages stay unbacked until written.
+// Clearing scales with the tiles drawn on. Memory scales with the pages drawn
+// on, and pages follow the rows of the image, not the tiles: a 4 KiB page holds
+// 1024 pixels of one row. Horizontal strokes are cheap, but a 1 px vertical
+// stroke across a 30000 px canvas backs a page in every row, about 117 MiB,
+// where 128 x 128 tiles would take about 15 MiB.
+class LayerStack
+{
+public:
+    enum Blend
+    {
+        Normal,
+        Multiply,
+        Screen,
+        Overlay,
+        Darken,
+        Lighten,
+        Difference,
+        Add
+    };
+    static QPainter::CompositionMode compositionMode(Blend blend);
+
+    struct Layer
+    {
+        QString name;
+        QImage image;
+        double opacity = 1;
+        bool visible = true;
+        Blend blend = Normal;
+        QRect painted; // everything outside is transparent
+        std::vector<char> drawn; // per tile, changed since the layer was last blank
+        bool paper = false; // white shows through the transparent pixels
+    };
+    static const int tileSize = 128;
+
+    // Replaces all layers with a single background layer
+    void reset(const QImage &background);
+    // A single blank background layer of size, transparent over white paper
+    void reset(QSize size);
+    // Nothing has been drawn on any layer since it was blank
+    bool isBlank() const;
+    // Blank layers of another size, properties kept, false unless isBlank()
+    bool resizeBlank(QSize size);
+
+    int count() const { return (int)layers.size(); }
+    QSize size() const { return bounds.size(); }
+    const Layer &layer(int index) const { return *layers[index]; }
+    QImage &image(int index) { return layers[index]->image; }
+
+    // Layers are numbered bottom up, a new one is transparent and goes above index
+    int insertLayer(int index, const QString &name);
+    void removeLayer(int index);
+    void setName(int index, const QString &name) { layers[index]->name = name; }
+    // Swaps the pixels of a layer for another image of the same size
+    bool setImage(int index, const QImage &image);
+    void setVisible(int index, bool visible);
+    void setOpacity(int index, double opacity);
+    void setBlend(int index, Blend blend);
+
+    // The pixels of layer index changed inside area
+    void changed(int index, const QRect &area);
+    // The bottom layer turns white, the others transparent. Returns the tiles it
+    // refilled, those drawn on since the layer was last blank.
+    std::vector<QRect> clear(int index);
+    // Lays the paper under a layer into its pixels, for operations that read or
+    // rewrite every pixel as it is shown. Backs the whole layer.
+    void settlePaper(int index);
+    // Replaces every image by function(image), all of them or none when one comes back null
+    bool map(const std::function<QImage(const QImage &)> &function);
+
+    // Draws the composite over area, recomposing its stale tiles first
+    void paint(QPainter &painter, const QRect &area);
+    // The whole composite, a single plain layer is returned in its own format
+    QImage flattened();
+
+private:
+    std::vector<std::unique_ptr<Layer>> layers;
+    QRect bounds;
+    int columns = 0, rows = 0;
+    std::vector<QImage> tiles;
+    std::vector<char> stale;
+    QImage paperTile, clearTile; // shared by the composite tiles nothing was drawn on
+
+    void setBounds(QSize size);
+    const QImage *solidTile(int tile) const;
+    void invalidate(const QRect &area);
+    void compose(const QRect &area);
+    QRect tileRect(int tile) const;
+};
@@ -0,0 +1,109 @@
+#include "OcclusionMask.h"
+
+void OcclusionMask::reset(const QRect &bounds)
+{
+    region = bounds;
+    tilesX = (bounds.width() + tileSize - 1) / tileSize;
+    tilesY = (bounds.height() + tileSize - 1) / tileSize;
+    blocksX = (tilesX + blockSize - 1) / blockSize;
+    const int blocks_y = (tilesY + blockSize - 1) / blockSize;
+    fullTiles = 0;
+    if (bounds.isEmpty())
+    {
+        tilesX = tilesY = blocksX = 0;
+        return;
+    }
+
+    // Pixels of the edge tiles past the bounds are never drawn, they start out covered
+    const int columns = bounds.width() - (tilesX - 1) * tileSize, last_rows = bounds.height() - (tilesY - 1) * tileSize;
+    const quint32 outside = columns == tileSize ? 0 : ~((1u << columns) - 1);
+    rows.assign((size_t)tilesX * tilesY * tileSize, 0);
+    filledRows.assign((size_t)tilesX * tilesY, 0);
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            const int tile = ty * tilesX + tx;
+            quint32 *tile_rows = rows.data() + (size_t)tile * tileSize;
+            if (tx == tilesX - 1)
+                std::fill(tile_rows, tile_rows + tileSize, outside);
+            if (ty == tilesY - 1)
+            {
+                std::fill(tile_rows + last_rows, tile_rows + tileSize, ~0u);
+                filledRows[tile] = tileSize - last_rows;
+            }
+        }
+    }
+    tileDepth.assign((size_t)tilesX * tilesY, -1);
+    blockFull.assign((size_t)blocksX * blocks_y, 0);
+    blockDepth.assign((size_t)blocksX * blocks_y, -1);
+    blockTiles.assign((size_t)blocksX * blocks_y, 0);
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+            blockTiles[(ty / blockSize) * blocksX + tx / blockSize]++;
+    }
+}
+
+void OcclusionMask::cover(int y, int x_start, int x_end, int depth)
+{
+    if (y < region.top() || y > region.bottom())
+        return;
+    x_start = std::max(x_start, region.left()) - region.left();
+    x_end = std::min(x_end, region.right() + 1) - region.left();
+    const int ty = (y - region.top()) / tileSize, row = (y - region.top()) % tileSize;
+    for (int tx = x_start / tileSize; x_start < x_end; tx++)
+    {
+        const int from = x_start - tx * tileSize, to = std::min(x_end - tx * tileSize, tileSize);
+        x_start = (tx + 1) * tileSize;
+
+        const int tile = ty * tilesX + tx;
+        quint32 &bits = rows[(size_t)tile * tileSize + row];
+        if (bits == ~0u)
+            continue;
+        bits |= to - from == tileSize ? ~0u : ((1u << (to - from)) - 1) << from;
+        if (bits == ~0u && ++filledRows[tile] == tileSize)
+            fill(tile, depth);
+    }
+}
+
+void OcclusionMask::fill(int tile, int depth)
+{
+    // Objects come front to back, the first to complete a tile is the nearest one
+    // behind which the union of objects in front covers it
+    tileDepth[tile] = depth;
+    fullTiles++;
+    const int block = (tile / tilesX / blockSize) * blocksX + tile % tilesX / blockSize;
+    if (blockFull[block]++ == 0 || depth < blockDepth[block])
+        blockDepth[block] = depth;
+}
+
+bool OcclusionMask::hides(const QRect &bounds, int depth) const
+{
+    const QRect r = bounds.normalized() & region;
+    if (isEmpty() || r.isEmpty())
+        return false;
+
+    const int tx0 = (r.left() - region.left()) / tileSize, tx1 = (r.right() - region.left()) / tileSize;
+    const int ty0 = (r.top() - region.top()) / tileSize, ty1 = (r.bottom() - region.top()) / tileSize;
+    for (int by = ty0 / blockSize; by <= ty1 / blockSize; by++)
+    {
+        for (int bx = tx0 / blockSize; bx <= tx1 / blockSize; bx++)
+        {
+            const int block = by * blocksX + bx;
+            if (blockFull[block] == blockTiles[block] && blockDepth[block] > depth)
+                continue;
+            if (blockFull[block] == 0)
+                return false;
+            for (int ty = std::max(ty0, by * blockSize); ty <= std::min(ty1, by * blockSize + blockSize - 1); ty++)
+            {
+                for (int tx = std::max(tx0, bx * blockSize); tx <= std::min(tx1, bx * blockSize + blockSize - 1); tx++)
+                {
+                    if (tileDepth[ty * tilesX + tx] <= depth)
+                        return false;
+                }
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <QRect>
+
+#include <algorithm>
+#include <vector>
+
+// Canvas tiles painted over by filled objects, for culling what lies under them.
+// Objects are covered front to back, their spans set one bit per pixel in the
+// rows of 32 x 32 tiles. A tile that fills up keeps the depth of the object
+// that completed it and hides everything drawn at smaller depths. Blocks of
+// 8 x 8 tiles keep the smallest depth of their tiles once all are full, so
+// large bounds are tested a block at a time.
+class OcclusionMask
+{
+public:
+    static const int tileSize = 32;
+    static const int blockSize = 8; // tiles per block side
+
+    // Forgets all coverage, tiles are laid from the top left of bounds
+    void reset(const QRect &bounds);
+    void clear() { fullTiles = 0; }
+
+    // [x_start, x_end) on row y is painted by an object at depth
+    void cover(int y, int x_start, int x_end, int depth);
+
+    bool isEmpty() const { return fullTiles == 0; }
+    int tileCount() const { return fullTiles; }
+
+    // Whether every tile under bounds is painted over in front of depth
+    bool hides(const QRect &bounds, int depth) const;
+
+    // Calls function(from, to) for the runs of [x_start, x_end) on row y that are
+    // not hidden at depth, returns their total length
+    template <class Function>
+    int visibleSpans(int y, int x_start, int x_end, int depth, Function &&function) const
+    {
+        if (isEmpty() || y < region.top() || y > region.bottom())
+        {
+            function(x_start, x_end);
+            return x_end - x_start;
+        }
+        const int *depths = tileDepth.data() + (size_t)((y - region.top()) / tileSize) * tilesX;
+        int visible = 0, run = x_start;
+        for (int x = x_start; x < x_end;)
+        {
+            int next = x_end;
+            bool hidden = false;
+            if (x < region.left())
+            {
+                next = std::min(x_end, region.left());
+            }
+            else if (x <= region.right())
+            {
+                const int tx = (x - region.left()) / tileSize;
+                next = std::min(x_end, std::min(region.right() + 1, region.left() + (tx + 1) * tileSize));
+                hidden = depths[tx] > depth;
+            }
+            if (hidden)
+            {
+                if (run < x)
+                {
+                    function(run, x);
+                    visible += x - run;
+                }
+                run = next;
+            }
+            x = next;
+        }
+        if (run < x_end)
+        {
+            function(run, x_end);
+            visible += x_end - run;
+        }
+        return visible;
+    }
+
+private:
+    QRect region;
+    int tilesX = 0, tilesY = 0, blocksX = 0;
+    int fullTiles = 0;
+    std::vector<quint32> rows;              // tileSize per tile, bits set where painted
+    std::vector<unsigned char> filledRows;  // per tile
+    std::vector<int> tileDepth;             // per tile, -1 while not full
+    std::vector<int> blockFull, blockTiles; // per block, full tiles and all tiles
+    std::vector<int> blockDepth;            // per block, smallest depth of its full tiles
+
+    void fill(int tile, int depth);
+};
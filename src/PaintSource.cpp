@@ -0,0 +1,130 @@
+#include "PaintSource.h"
+
+#include <array>
+
+void PaintSource::setStops(const QGradientStops &stops)
+{
+    // Sorted stops are used as they are, without a copy
+    auto before = [](const QGradientStop &a, const QGradientStop &b)
+    { return a.first < b.first; };
+    QGradientStops sorted = stops;
+    if (!std::is_sorted(stops.cbegin(), stops.cend(), before))
+        std::stable_sort(sorted.begin(), sorted.end(), before);
+    if (sorted.isEmpty())
+        sorted.push_back(QGradientStop(0, solid));
+
+    // Channels are interpolated straight, between the two stops around each entry
+    int next = 0;
+    for (int i = 0; i < rampSize; i++)
+    {
+        const double position = (double)i / (rampSize - 1);
+        while (next < sorted.size() && sorted[next].first < position)
+            next++;
+
+        if (next == 0 || next == sorted.size())
+        {
+            ramp[i] = sorted[next == 0 ? 0 : next - 1].second.rgba();
+            continue;
+        }
+
+        const QGradientStop &a = sorted[next - 1], &b = sorted[next];
+        const double t = b.first > a.first ? (position - a.first) / (b.first - a.first) : 1;
+        auto mix = [t](int from, int to)
+        { return (int)(from + (to - from) * t + 0.5); };
+        ramp[i] = qRgba(mix(a.second.red(), b.second.red()), mix(a.second.green(), b.second.green()),
+                        mix(a.second.blue(), b.second.blue()), mix(a.second.alpha(), b.second.alpha()));
+    }
+}
+
+PaintSource PaintSource::linear(QPointF start, QPointF end, const QGradientStops &stops)
+{
+    PaintSource source;
+    source.kind = LinearGradient;
+    source.origin = start;
+    const QPointF direction = end - start;
+    const double length2 = direction.x() * direction.x() + direction.y() * direction.y();
+    source.axis = length2 > 0 ? QPointF(direction.x() / length2, direction.y() / length2) : QPointF(0, 0);
+    source.setStops(stops);
+    return source;
+}
+
+PaintSource PaintSource::radial(QPointF center, double radius, const QGradientStops &stops)
+{
+    PaintSource source;
+    source.kind = RadialGradient;
+    source.origin = center;
+    source.scale = radius > 0 ? 1 / radius : 0;
+    source.setStops(stops);
+    return source;
+}
+
+PaintSource PaintSource::conic(QPointF center, double angle, const QGradientStops &stops)
+{
+    PaintSource source;
+    source.kind = ConicGradient;
+    source.origin = center;
+    source.scale = angle * M_PI / 180;
+    source.setStops(stops);
+    return source;
+}
+
+// Affine map of the unit triangle onto the first non-degenerate vertex triple 0, j, k
+bool PaintSource::frame(const QPoint *points, int count, int &j, int &k, QTransform &canvas)
+{
+    for (j = 1; j < count - 1; j++)
+    {
+        for (k = j + 1; k < count; k++)
+        {
+            const QPointF e1 = points[j] - points[0], e2 = points[k] - points[0];
+            if (e1.x() * e2.y() - e1.y() * e2.x() == 0)
+                continue;
+
+            canvas = QTransform(e1.x(), e1.y(), e2.x(), e2.y(), points[0].x(), points[0].y());
+            return true;
+        }
+    }
+    return false;
+}
+
+PaintSource PaintSource::texture(const QImage &image, const QPoint *points, const QPointF *uvs, int count)
+{
+    PaintSource source;
+    int j, k;
+    QTransform canvas;
+    if (image.isNull() || !frame(points, count, j, k, canvas))
+        return source;
+
+    const QPointF t1 = uvs[j] - uvs[0], t2 = uvs[k] - uvs[0];
+    const QTransform uv(t1.x(), t1.y(), t2.x(), t2.y(), uvs[0].x(), uvs[0].y());
+
+    source.kind = Texture;
+    source.image = image;
+    source.uvMap = canvas.inverted() * uv * QTransform::fromScale(image.width(), image.height());
+    return source;
+}
+
+PaintSource PaintSource::gouraud(const QPoint *points, const QColor *colors, int count)
+{
+    PaintSource source;
+    int j, k;
+    QTransform canvas;
+    if (!frame(points, count, j, k, canvas))
+        return count > 0 ? PaintSource(colors[0]) : source;
+
+    // Channel = c0 + s * (cj - c0) + t * (ck - c0), with (s, t) the position in the frame
+    const QTransform inverse = canvas.inverted();
+    auto channels = [](const QColor &color)
+    { return std::array<double, 4>{(double)color.red(), (double)color.green(), (double)color.blue(), (double)color.alpha()}; };
+    const std::array<double, 4> c0 = channels(colors[0]), cj = channels(colors[j]), ck = channels(colors[k]);
+
+    source.kind = Gouraud;
+    source.solid = colors[0];
+    for (int i = 0; i < 4; i++)
+    {
+        const double d1 = cj[i] - c0[i], d2 = ck[i] - c0[i];
+        source.shade[i].dx = inverse.m11() * d1 + inverse.m12() * d2;
+        source.shade[i].dy = inverse.m21() * d1 + inverse.m22() * d2;
+        source.shade[i].c = c0[i] + inverse.dx() * d1 + inverse.dy() * d2;
+    }
+    return source;
+}
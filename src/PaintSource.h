@@ -0,0 +1,201 @@
+#pragma once
+#include <QColor>
+#include <QGradient>
+#include <QImage>
+#include <QPointF>
+#include <QTransform>
+#include <QVector>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+// What filled spans are painted with: a solid color, a gradient, a texture or
+// colors interpolated between vertices (Gouraud).
+// Gradients are sampled from a precomputed ramp packed into the canvas format
+// and textures from a copy in the canvas format, so painting a span only steps
+// its parameter along the row and copies pixels.
+class PaintSource
+{
+public:
+    enum Type
+    {
+        Solid,
+        LinearGradient,
+        RadialGradient,
+        ConicGradient,
+        Texture,
+        Gouraud
+    };
+    static const int rampSize = 1024;
+
+    PaintSource(const QColor &color = QColor()) : solid(color) {}
+
+    // Gradients pad past their ends, conic gradients turn counterclockwise from angle (degrees)
+    static PaintSource linear(QPointF start, QPointF end, const QGradientStops &stops);
+    static PaintSource radial(QPointF center, double radius, const QGradientStops &stops);
+    static PaintSource conic(QPointF center, double angle, const QGradientStops &stops);
+
+    // Texture coordinates per vertex, [0, 1] spans the image once and it repeats outside.
+    // The affine mapping comes from the first three non-collinear vertices, so it is
+    // exact for triangles.
+    static PaintSource texture(const QImage &image, const QPoint *points, const QPointF *uvs, int count);
+    static PaintSource texture(const QImage &image, const QVector<QPoint> &points, const QVector<QPointF> &uvs)
+    {
+        return texture(image, points.constData(), uvs.constData(), (int)std::min(points.size(), uvs.size()));
+    }
+
+    // One color per vertex, interpolated linearly over the same affine mapping
+    static PaintSource gouraud(const QPoint *points, const QColor *colors, int count);
+    static PaintSource gouraud(const QVector<QPoint> &points, const QVector<QColor> &colors)
+    {
+        return gouraud(points.constData(), colors.constData(), (int)std::min(points.size(), colors.size()));
+    }
+
+    Type type() const { return kind; }
+    const QColor &color() const { return solid; }
+    const QImage &textureImage() const { return image; }
+
+    // Paints clipped spans into an image of one drawable format
+    template <class Format>
+    class Painter
+    {
+    public:
+        typedef typename Format::Pixel Pixel;
+
+        Painter(QImage &img, const PaintSource &source)
+            : bits(img.bits()), stride(img.bytesPerLine()), source(source)
+        {
+            if (source.kind == Solid)
+            {
+                pixel = Format::pack(source.solid);
+            }
+            else if (source.kind == Texture)
+            {
+                texels = source.image.format() == Format::format ? source.image : source.image.convertToFormat(Format::format);
+            }
+            else if (source.kind != Gouraud)
+            {
+                for (int i = 0; i < rampSize; i++)
+                    lut[i] = Format::pack(QColor::fromRgba(source.ramp[i]));
+            }
+        }
+
+        // [x_start, x_end) on row y, already clipped
+        void span(int y, int x_start, int x_end) const
+        {
+            Pixel *line = reinterpret_cast<Pixel *>(bits + y * stride);
+            const double px = x_start + 0.5, py = y + 0.5;
+
+            switch (source.kind)
+            {
+            case Solid:
+                std::fill(line + x_start, line + x_end, pixel);
+                break;
+            case LinearGradient:
+            {
+                // Projection on the gradient axis, one constant step per pixel
+                const double scale = rampSize - 1;
+                double t = ((px - source.origin.x()) * source.axis.x() + (py - source.origin.y()) * source.axis.y()) * scale;
+                const double step = source.axis.x() * scale;
+                for (int x = x_start; x < x_end; x++, t += step)
+                    line[x] = lut[std::min(std::max((int)t, 0), rampSize - 1)];
+                break;
+            }
+            case RadialGradient:
+            {
+                // Squared distance by forward differences, the square root is all that is left
+                const double dx = px - source.origin.x(), dy = py - source.origin.y();
+                const double scale = (rampSize - 1) * source.scale;
+                double distance2 = dx * dx + dy * dy, step = 2 * dx + 1;
+                for (int x = x_start; x < x_end; x++, distance2 += step, step += 2)
+                    line[x] = lut[std::min((int)(std::sqrt(distance2) * scale), rampSize - 1)];
+                break;
+            }
+            case ConicGradient:
+            {
+                const double dy = source.origin.y() - py, scale = rampSize / (2 * M_PI);
+                double dx = px - source.origin.x();
+                for (int x = x_start; x < x_end; x++, dx++)
+                {
+                    int i = (int)((std::atan2(dy, dx) - source.scale) * scale) % rampSize;
+                    line[x] = lut[i < 0 ? i + rampSize : i];
+                }
+                break;
+            }
+            case Texture:
+            {
+                // Texel position in 16.16 fixed point, stepped by the x derivative of the mapping
+                const qint64 wrap_u = (qint64)texels.width() << 16, wrap_v = (qint64)texels.height() << 16;
+                const QPointF start = source.uvMap.map(QPointF(px, py));
+                const qint64 du = std::llround(source.uvMap.m11() * 65536), dv = std::llround(source.uvMap.m12() * 65536);
+                qint64 u = wrap(std::llround(start.x() * 65536), wrap_u), v = wrap(std::llround(start.y() * 65536), wrap_v);
+                const uchar *texture_bits = texels.constBits();
+                const qsizetype texture_stride = texels.bytesPerLine();
+                for (int x = x_start; x < x_end; x++)
+                {
+                    line[x] = reinterpret_cast<const Pixel *>(texture_bits + (v >> 16) * texture_stride)[u >> 16];
+                    u += du;
+                    v += dv;
+                    if (u < 0 || u >= wrap_u)
+                        u = wrap(u, wrap_u);
+                    if (v < 0 || v >= wrap_v)
+                        v = wrap(v, wrap_v);
+                }
+                break;
+            }
+            case Gouraud:
+            {
+                double channel[4], step[4];
+                for (int i = 0; i < 4; i++)
+                {
+                    channel[i] = source.shade[i].dx * px + source.shade[i].dy * py + source.shade[i].c;
+                    step[i] = source.shade[i].dx;
+                }
+                for (int x = x_start; x < x_end; x++)
+                {
+                    line[x] = Format::pack(QColor(level(channel[0]), level(channel[1]), level(channel[2]), level(channel[3])));
+                    for (int i = 0; i < 4; i++)
+                        channel[i] += step[i];
+                }
+                break;
+            }
+            }
+        }
+
+    private:
+        uchar *bits;
+        qsizetype stride;
+        const PaintSource &source;
+        Pixel pixel;
+        std::array<Pixel, rampSize> lut;
+        QImage texels;
+
+        static int level(double value) { return std::min(std::max((int)(value + 0.5), 0), 255); }
+        static qint64 wrap(qint64 value, qint64 period)
+        {
+            value %= period;
+            return value < 0 ? value + period : value;
+        }
+    };
+
+private:
+    Type kind = Solid;
+    QColor solid;
+    QPointF origin;   // gradient start or center
+    QPointF axis;     // linear: (end - start) / |end - start|^2
+    double scale = 1; // radial: 1 / radius, conic: start angle in radians
+    std::array<QRgb, rampSize> ramp;
+    QImage image;
+    QTransform uvMap; // canvas to texel coordinates
+
+    // Channel value over the canvas, red, green, blue and alpha
+    struct Plane
+    {
+        double dx, dy, c;
+    };
+    Plane shade[4] = {};
+
+    void setStops(const QGradientStops &stops);
+    static bool frame(const QPoint *points, int count, int &j, int &k, QTransform &canvas);
+};
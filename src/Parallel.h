@@ -0,0 +1,68 @@
+#pragma once
+#include <QThread>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+// Row striping on the global thread pool.
+// Stripes are claimed from a shared counter and the calling thread claims them
+// too, so a call always finishes even when every pool thread is busy.
+namespace Parallel
+{
+    inline int threadCount() { return std::max(1, QThread::idealThreadCount()); }
+
+    // Calls function(stripe_begin, stripe_end) for contiguous stripes of [begin, end)
+    template <class Function>
+    void forRows(int begin, int end, Function &&function, int grain = 16)
+    {
+        int rows = end - begin;
+        if (rows <= 0)
+            return;
+
+        int stripes = std::min(threadCount() * 4, (rows + grain - 1) / grain);
+        if (stripes <= 1)
+        {
+            function(begin, end);
+            return;
+        }
+
+        struct State
+        {
+            std::atomic<int> next{0};
+            int done = 0;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto state = std::make_shared<State>();
+
+        auto run = [state, &function, begin, rows, stripes]()
+        {
+            int finished_here = 0;
+            for (int s = state->next++; s < stripes; s = state->next++)
+            {
+                function(begin + (int)((qint64)rows * s / stripes), begin + (int)((qint64)rows * (s + 1) / stripes));
+                finished_here++;
+            }
+            if (finished_here > 0)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->done += finished_here;
+                if (state->done == stripes)
+                    state->finished.notify_all();
+            }
+        };
+
+        int helpers = std::min(threadCount(), stripes) - 1;
+        for (int i = 0; i < helpers; i++)
+            QThreadPool::globalInstance()->start(run);
+        run();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&]()
+                             { return state->done == stripes; });
+    }
+}
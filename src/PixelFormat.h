@@ -0,0 +1,258 @@
+#pragma once
+#include <QImage>
+#include <QColor>
+
+#include <algorithm>
+
+// Pixel format policies for the rasterizers.
+// A policy packs a QColor once into the native pixel of its QImage format,
+// so drawing loops templated on it compile to plain typed stores. blend lays
+// a color over a pixel with opacity alpha (0 to 255), ignoring the color's own
+// alpha, for coverage masks such as glyphs.
+namespace PixelFormat
+{
+    // (from * (255 - alpha) + to * alpha) / 255, rounded
+    inline int mix(int from, int to, int alpha) { return (from * (255 - alpha) + to * alpha + 127) / 255; }
+
+    // Premultiplied top over premultiplied bottom
+    inline QRgb sourceOver(QRgb top, QRgb bottom)
+    {
+        const int rest = 255 - qAlpha(top);
+        return qRgba(qRed(top) + (qRed(bottom) * rest + 127) / 255, qGreen(top) + (qGreen(bottom) * rest + 127) / 255,
+                     qBlue(top) + (qBlue(bottom) * rest + 127) / 255, qAlpha(top) + (qAlpha(bottom) * rest + 127) / 255);
+    }
+
+    struct ARGB32
+    {
+        typedef quint32 Pixel;
+        static constexpr QImage::Format format = QImage::Format_ARGB32;
+        static Pixel pack(const QColor &color) { return color.rgba(); }
+        static Pixel blend(Pixel under, QRgb color, int alpha)
+        {
+            return qUnpremultiply(sourceOver(qPremultiply(qRgba(qRed(color), qGreen(color), qBlue(color), alpha)), qPremultiply(under)));
+        }
+    };
+
+    struct RGB32
+    {
+        typedef quint32 Pixel;
+        static constexpr QImage::Format format = QImage::Format_RGB32;
+        static Pixel pack(const QColor &color) { return color.rgb(); }
+        static Pixel blend(Pixel under, QRgb color, int alpha)
+        {
+            return qRgb(mix(qRed(under), qRed(color), alpha), mix(qGreen(under), qGreen(color), alpha), mix(qBlue(under), qBlue(color), alpha));
+        }
+    };
+
+    struct ARGB32Premultiplied
+    {
+        typedef quint32 Pixel;
+        static constexpr QImage::Format format = QImage::Format_ARGB32_Premultiplied;
+        static Pixel pack(const QColor &color) { return qPremultiply(color.rgba()); }
+        static Pixel blend(Pixel under, QRgb color, int alpha)
+        {
+            return sourceOver(qPremultiply(qRgba(qRed(color), qGreen(color), qBlue(color), alpha)), under);
+        }
+    };
+
+    struct RGB888
+    {
+        struct Pixel
+        {
+            uchar rgb[3];
+        };
+        static constexpr QImage::Format format = QImage::Format_RGB888;
+        static Pixel pack(const QColor &color) { return {{(uchar)color.red(), (uchar)color.green(), (uchar)color.blue()}}; }
+        static Pixel blend(Pixel under, QRgb color, int alpha)
+        {
+            return {{(uchar)mix(under.rgb[0], qRed(color), alpha), (uchar)mix(under.rgb[1], qGreen(color), alpha), (uchar)mix(under.rgb[2], qBlue(color), alpha)}};
+        }
+    };
+
+    struct Grayscale8
+    {
+        typedef uchar Pixel;
+        static constexpr QImage::Format format = QImage::Format_Grayscale8;
+        static Pixel pack(const QColor &color) { return qGray(color.rgb()); }
+        static Pixel blend(Pixel under, QRgb color, int alpha) { return (Pixel)mix(under, qGray(color), alpha); }
+    };
+
+    struct Grayscale16
+    {
+        typedef quint16 Pixel;
+        static constexpr QImage::Format format = QImage::Format_Grayscale16;
+        static Pixel pack(const QColor &color)
+        {
+            QRgba64 c = color.rgba64();
+            return (Pixel)(((quint32)c.red() * 11 + (quint32)c.green() * 16 + (quint32)c.blue() * 5) / 32);
+        }
+        static Pixel blend(Pixel under, QRgb color, int alpha) { return (Pixel)mix(under, pack(QColor::fromRgb(color)), alpha); }
+    };
+
+    struct RGBA64
+    {
+        typedef quint64 Pixel;
+        static constexpr QImage::Format format = QImage::Format_RGBA64;
+        static Pixel pack(const QColor &color) { return color.rgba64(); }
+        static Pixel blend(Pixel under, QRgb color, int alpha)
+        {
+            const QRgba64 top = QRgba64::fromRgba(qRed(color), qGreen(color), qBlue(color), alpha).premultiplied();
+            const QRgba64 bottom = QRgba64::fromRgba64(under).premultiplied();
+            const quint32 rest = 65535 - top.alpha();
+            auto channel = [rest](quint32 t, quint32 b)
+            { return (quint16)(t + (b * rest + 32767) / 65535); };
+            return QRgba64::fromRgba64(channel(top.red(), bottom.red()), channel(top.green(), bottom.green()),
+                                       channel(top.blue(), bottom.blue()), channel(top.alpha(), bottom.alpha()))
+                .unpremultiplied();
+        }
+    };
+
+    // Writes one packed color into an image of a known format
+    template <class Format>
+    class Writer
+    {
+    public:
+        typedef typename Format::Pixel Pixel;
+
+        Writer(QImage &img, const QColor &color)
+            : bits(img.bits()), stride(img.bytesPerLine()), pixel(Format::pack(color)), rgba(color.rgba()) {}
+
+        Pixel *row(int y) const { return reinterpret_cast<Pixel *>(bits + y * stride); }
+        const Pixel &value() const { return pixel; }
+        void setColor(const QColor &color)
+        {
+            pixel = Format::pack(color);
+            rgba = color.rgba();
+        }
+        void plot(int x, int y) const { row(y)[x] = pixel; }
+        void plot(QPoint point) const { plot(point.x(), point.y()); }
+
+        // Fills [x_start, x_end) on row y
+        void span(int y, int x_start, int x_end) const
+        {
+            Pixel *line = row(y);
+            std::fill(line + x_start, line + x_end, pixel);
+        }
+
+        // Lays the color over [x_start, x_end) on row y, coverage[i] scaling its
+        // alpha at x_start + i
+        void blend(int y, int x_start, int x_end, const uchar *coverage) const
+        {
+            Pixel *line = row(y);
+            const int opacity = qAlpha(rgba);
+            for (int x = x_start; x < x_end; x++)
+            {
+                const int alpha = (coverage[x - x_start] * opacity + 127) / 255;
+                if (alpha == 255)
+                    line[x] = pixel;
+                else if (alpha > 0)
+                    line[x] = Format::blend(line[x], rgba, alpha);
+            }
+        }
+
+    private:
+        uchar *bits;
+        qsizetype stride;
+        Pixel pixel;
+        QRgb rgba;
+    };
+
+    // Interleaved channel order of a drawable format, for code working per channel.
+    // Gray formats have one channel that red, green and blue all point to.
+    struct Layout
+    {
+        int channels;
+        int red, green, blue;
+        int alpha;          // -1 when there is none
+        bool wide;          // 16-bit channels
+        bool premultiplied;
+    };
+
+    inline bool layoutOf(QImage::Format format, Layout &layout)
+    {
+        const bool little = Q_BYTE_ORDER == Q_LITTLE_ENDIAN;
+        switch (format)
+        {
+        case QImage::Format_ARGB32:
+        case QImage::Format_RGB32:
+            layout = little ? Layout{4, 2, 1, 0, 3, false, false} : Layout{4, 1, 2, 3, 0, false, false};
+            return true;
+        case QImage::Format_ARGB32_Premultiplied:
+            layout = little ? Layout{4, 2, 1, 0, 3, false, true} : Layout{4, 1, 2, 3, 0, false, true};
+            return true;
+        case QImage::Format_RGB888:
+            layout = {3, 0, 1, 2, -1, false, false};
+            return true;
+        case QImage::Format_Grayscale8:
+            layout = {1, 0, 0, 0, -1, false, false};
+            return true;
+        case QImage::Format_Grayscale16:
+            layout = {1, 0, 0, 0, -1, true, false};
+            return true;
+        case QImage::Format_RGBA64:
+            layout = {4, 0, 1, 2, 3, true, false};
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Calls function with the policy matching format, returns false for formats without one
+    template <class Function>
+    bool dispatch(QImage::Format format, Function &&function)
+    {
+        switch (format)
+        {
+        case QImage::Format_ARGB32:
+            function(ARGB32());
+            return true;
+        case QImage::Format_RGB32:
+            function(RGB32());
+            return true;
+        case QImage::Format_ARGB32_Premultiplied:
+            function(ARGB32Premultiplied());
+            return true;
+        case QImage::Format_RGB888:
+            function(RGB888());
+            return true;
+        case QImage::Format_Grayscale8:
+            function(Grayscale8());
+            return true;
+        case QImage::Format_Grayscale16:
+            function(Grayscale16());
+            return true;
+        case QImage::Format_RGBA64:
+            function(RGBA64());
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    inline bool isSupported(QImage::Format format)
+    {
+        return dispatch(format, [](auto) {});
+    }
+
+    // Closest drawable format for a loaded image, without widening 8-bit scans
+    inline QImage::Format drawableFormat(const QImage &img)
+    {
+        if (isSupported(img.format()))
+            return img.format();
+
+        switch (img.format())
+        {
+        case QImage::Format_Mono:
+        case QImage::Format_MonoLSB:
+        case QImage::Format_Indexed8:
+            return img.allGray() && !img.hasAlphaChannel() ? QImage::Format_Grayscale8 : QImage::Format_ARGB32;
+        case QImage::Format_BGR888:
+            return QImage::Format_RGB888;
+        case QImage::Format_RGBX64:
+        case QImage::Format_RGBA64_Premultiplied:
+            return QImage::Format_RGBA64;
+        default:
+            return img.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+        }
+    }
+}
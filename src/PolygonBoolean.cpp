@@ -0,0 +1,391 @@
+#include "PolygonBoolean.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+namespace
+{
+    // Two's complement 128-bit integer, wide enough for every predicate below.
+    // Built from 32-bit halves since not every compiler has __int128.
+    struct Int128
+    {
+        qint64 high;
+        quint64 low;
+    };
+
+    Int128 multiply(qint64 a, qint64 b)
+    {
+        const bool negative = (a < 0) != (b < 0);
+        const quint64 x = a < 0 ? 0 - (quint64)a : (quint64)a, y = b < 0 ? 0 - (quint64)b : (quint64)b;
+        const quint64 x0 = x & 0xffffffff, x1 = x >> 32, y0 = y & 0xffffffff, y1 = y >> 32;
+        const quint64 p00 = x0 * y0, p01 = x0 * y1, p10 = x1 * y0, p11 = x1 * y1;
+        const quint64 middle = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+        quint64 low = (p00 & 0xffffffff) | (middle << 32);
+        quint64 high = p11 + (p01 >> 32) + (p10 >> 32) + (middle >> 32);
+        if (negative)
+        {
+            low = ~low + 1;
+            high = ~high + (low == 0);
+        }
+        return {(qint64)high, low};
+    }
+
+    int compare(const Int128 &a, const Int128 &b)
+    {
+        if (a.high != b.high)
+            return a.high < b.high ? -1 : 1;
+        if (a.low != b.low)
+            return a.low < b.low ? -1 : 1;
+        return 0;
+    }
+
+    // Sign of a * b - c * d
+    int compareProducts(qint64 a, qint64 b, qint64 c, qint64 d)
+    {
+        return compare(multiply(a, b), multiply(c, d));
+    }
+
+    // (x / d, y / d) with d > 0, the crossing of two edges on integer points
+    struct Point
+    {
+        qint64 x, y, d;
+    };
+
+    Point exact(QPoint p) { return {p.x(), p.y(), 1}; }
+
+    // Sweep order, by x and then by y
+    int comparePoints(const Point &p, const Point &q)
+    {
+        if (int c = compareProducts(p.x, q.d, q.x, p.d))
+            return c;
+        return compareProducts(p.y, q.d, q.y, p.d);
+    }
+
+    struct PointLess
+    {
+        bool operator()(const Point &p, const Point &q) const { return comparePoints(p, q) < 0; }
+    };
+
+    struct Edge
+    {
+        QPoint left, right; // in sweep order
+        int operand;        // 0 subject, 1 clip
+        int direction;      // +1 when the contour runs from left to right, -1 otherwise
+        // Start of the piece up to the next event on the edge, and the winding
+        // numbers of both operands below and above the piece
+        Point pieceStart;
+        int below[2], above[2];
+    };
+
+    // Sign of p against the line through edge, positive above it (to the left of a vertical edge)
+    int side(const Edge &edge, const Point &p)
+    {
+        const qint64 dx = edge.right.x() - edge.left.x(), dy = edge.right.y() - edge.left.y();
+        return compareProducts(dx, p.y - edge.left.y() * p.d, dy, p.x - edge.left.x() * p.d);
+    }
+
+    // The crossing of two edges, when it exists and is a single point
+    bool intersect(const Edge &a, const Edge &b, Point &crossing)
+    {
+        const qint64 rx = a.right.x() - a.left.x(), ry = a.right.y() - a.left.y();
+        const qint64 sx = b.right.x() - b.left.x(), sy = b.right.y() - b.left.y();
+        const qint64 qx = b.left.x() - a.left.x(), qy = b.left.y() - a.left.y();
+        qint64 denominator = rx * sy - ry * sx;
+        if (denominator == 0)
+            return false;
+        qint64 t = qx * sy - qy * sx, u = qx * ry - qy * rx;
+        if (denominator < 0)
+        {
+            denominator = -denominator;
+            t = -t;
+            u = -u;
+        }
+        if (t < 0 || t > denominator || u < 0 || u > denominator)
+            return false;
+        crossing = {a.left.x() * denominator + rx * t, a.left.y() * denominator + ry * t, denominator};
+        return true;
+    }
+
+    // Status order at the event being swept, bottom to top. Edges through the
+    // event order by where they leave it, every other edge lies above or below it.
+    struct StatusLess
+    {
+        typedef void is_transparent;
+
+        const std::vector<Edge> *edges;
+        const Point *event;
+
+        bool operator()(int a, int b) const
+        {
+            if (a == b)
+                return false;
+            const Edge &first = (*edges)[a], &second = (*edges)[b];
+            const int side_a = side(first, *event), side_b = side(second, *event);
+            if (side_a == 0 && side_b == 0)
+            {
+                const qint64 turn = (qint64)(first.right.x() - first.left.x()) * (second.right.y() - second.left.y()) -
+                                    (qint64)(first.right.y() - first.left.y()) * (second.right.x() - second.left.x());
+                return turn != 0 ? turn > 0 : a < b;
+            }
+            if (side_a == 0)
+                return side_b < 0;
+            if (side_b == 0)
+                return side_a > 0;
+            return a < b;
+        }
+        bool operator()(int a, const Point &p) const { return side((*edges)[a], p) > 0; }
+        bool operator()(const Point &p, int a) const { return side((*edges)[a], p) < 0; }
+    };
+
+    qint64 roundedDivision(qint64 numerator, qint64 denominator)
+    {
+        qint64 quotient = numerator / denominator, remainder = numerator % denominator;
+        if (remainder < 0)
+        {
+            quotient--;
+            remainder += denominator;
+        }
+        return 2 * remainder >= denominator ? quotient + 1 : quotient;
+    }
+
+    QPoint rounded(const Point &p)
+    {
+        if (p.d == 1)
+            return QPoint((int)p.x, (int)p.y);
+        return QPoint((int)roundedDivision(p.x, p.d), (int)roundedDivision(p.y, p.d));
+    }
+
+    class Sweep
+    {
+    public:
+        Sweep(PolygonBoolean::Operation operation, PolygonBoolean::FillRule rule) : operation(operation), rule(rule) {}
+
+        void add(const PolygonBoolean::Contours &contours, int operand);
+        PolygonBoolean::Contours run();
+
+    private:
+        PolygonBoolean::Operation operation;
+        PolygonBoolean::FillRule rule;
+        std::vector<Edge> edges;
+        // Boundary pieces of the result, directed with the inside on their left
+        std::vector<std::pair<QPoint, QPoint>> boundary;
+
+        bool filled(int winding) const { return rule == PolygonBoolean::EvenOdd ? (winding & 1) != 0 : winding != 0; }
+        bool inside(const int *winding) const;
+        void emitPiece(const Edge &edge, const Point &end);
+        PolygonBoolean::Contours link();
+    };
+
+    void Sweep::add(const PolygonBoolean::Contours &contours, int operand)
+    {
+        auto clamp = [](QPoint p)
+        {
+            return QPoint(std::clamp(p.x(), -PolygonBoolean::maxCoordinate, PolygonBoolean::maxCoordinate),
+                          std::clamp(p.y(), -PolygonBoolean::maxCoordinate, PolygonBoolean::maxCoordinate));
+        };
+        for (const QVector<QPoint> &contour : contours)
+        {
+            // Closed or not, the last point joins the first
+            for (int i = 0; i < contour.size(); i++)
+            {
+                const QPoint from = clamp(contour[i]), to = clamp(contour[(i + 1) % contour.size()]);
+                if (from == to)
+                    continue;
+                const bool forward = from.x() < to.x() || (from.x() == to.x() && from.y() < to.y());
+                Edge edge;
+                edge.left = forward ? from : to;
+                edge.right = forward ? to : from;
+                edge.operand = operand;
+                edge.direction = forward ? 1 : -1;
+                edges.push_back(edge);
+            }
+        }
+    }
+
+    bool Sweep::inside(const int *winding) const
+    {
+        const bool subject = filled(winding[0]), clip = filled(winding[1]);
+        switch (operation)
+        {
+        case PolygonBoolean::Union:
+            return subject || clip;
+        case PolygonBoolean::Intersection:
+            return subject && clip;
+        case PolygonBoolean::Difference:
+            return subject && !clip;
+        case PolygonBoolean::Xor:
+            return subject != clip;
+        }
+        return false;
+    }
+
+    void Sweep::emitPiece(const Edge &edge, const Point &end)
+    {
+        const bool below = inside(edge.below), above = inside(edge.above);
+        if (below == above)
+            return;
+        const QPoint from = rounded(edge.pieceStart), to = rounded(end);
+        if (from == to)
+            return;
+        // Left to right keeps the area above on the left
+        if (above)
+            boundary.push_back({from, to});
+        else
+            boundary.push_back({to, from});
+    }
+
+    PolygonBoolean::Contours Sweep::run()
+    {
+        std::map<Point, std::vector<int>, PointLess> events;
+        for (int i = 0; i < (int)edges.size(); i++)
+        {
+            events[exact(edges[i].left)].push_back(i);
+            events[exact(edges[i].right)];
+        }
+
+        Point event = {0, 0, 1};
+        std::set<int, StatusLess> status(StatusLess{&edges, &event});
+        std::vector<int> passing;
+
+        // A crossing right of the event joins the queue
+        auto check = [&](int a, int b)
+        {
+            Point crossing;
+            if (intersect(edges[a], edges[b], crossing) && comparePoints(crossing, event) > 0)
+                events[crossing];
+        };
+
+        while (!events.empty())
+        {
+            auto next = events.begin();
+            event = next->first;
+            const std::vector<int> starting = std::move(next->second);
+            events.erase(next);
+
+            // The edges through the event end their pieces here
+            auto range = status.equal_range(event);
+            passing.assign(range.first, range.second);
+            for (int e : passing)
+                emitPiece(edges[e], event);
+            status.erase(range.first, range.second);
+
+            // Reinserted, those that go on take their order right of the event
+            for (int e : passing)
+            {
+                if (comparePoints(exact(edges[e].right), event) != 0)
+                {
+                    edges[e].pieceStart = event;
+                    status.insert(e);
+                }
+            }
+            for (int e : starting)
+            {
+                edges[e].pieceStart = event;
+                status.insert(e);
+            }
+
+            range = status.equal_range(event);
+            int winding[2] = {0, 0};
+            if (range.first != status.begin())
+            {
+                const Edge &below = edges[*std::prev(range.first)];
+                winding[0] = below.above[0];
+                winding[1] = below.above[1];
+            }
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                Edge &edge = edges[*it];
+                edge.below[0] = winding[0];
+                edge.below[1] = winding[1];
+                winding[edge.operand] += edge.direction;
+                edge.above[0] = winding[0];
+                edge.above[1] = winding[1];
+            }
+
+            if (range.first == range.second)
+            {
+                if (range.first != status.begin() && range.first != status.end())
+                    check(*std::prev(range.first), *range.first);
+            }
+            else
+            {
+                if (range.first != status.begin())
+                    check(*std::prev(range.first), *range.first);
+                if (range.second != status.end())
+                    check(*std::prev(range.second), *range.second);
+            }
+        }
+        return link();
+    }
+
+    // Joins the boundary pieces end to start into closed contours
+    PolygonBoolean::Contours Sweep::link()
+    {
+        auto pointLess = [](QPoint a, QPoint b)
+        {
+            return a.x() < b.x() || (a.x() == b.x() && a.y() < b.y());
+        };
+        std::sort(boundary.begin(), boundary.end(), [&](const std::pair<QPoint, QPoint> &a, const std::pair<QPoint, QPoint> &b)
+                  { return pointLess(a.first, b.first); });
+        std::vector<bool> used(boundary.size(), false);
+        // Unused pieces starting at p, the first of them when there are several
+        auto startingAt = [&](QPoint p) -> int
+        {
+            auto it = std::lower_bound(boundary.begin(), boundary.end(), p, [&](const std::pair<QPoint, QPoint> &piece, QPoint q)
+                                       { return pointLess(piece.first, q); });
+            for (; it != boundary.end() && it->first == p; ++it)
+            {
+                if (!used[it - boundary.begin()])
+                    return (int)(it - boundary.begin());
+            }
+            return -1;
+        };
+
+        PolygonBoolean::Contours contours;
+        for (int first = 0; first < (int)boundary.size(); first++)
+        {
+            if (used[first])
+                continue;
+            QVector<QPoint> contour = {boundary[first].first};
+            for (int piece = first; piece >= 0; piece = startingAt(boundary[piece].second))
+            {
+                used[piece] = true;
+                const QPoint to = boundary[piece].second;
+                // Collinear points add nothing
+                if (contour.size() >= 2)
+                {
+                    const QPoint a = contour[contour.size() - 2], b = contour.back();
+                    if ((qint64)(b.x() - a.x()) * (to.y() - b.y()) == (qint64)(b.y() - a.y()) * (to.x() - b.x()))
+                        contour.removeLast();
+                }
+                contour.append(to);
+                if (to == contour.first())
+                    break;
+            }
+            if (contour.back() != contour.first())
+                contour.append(contour.first());
+            if (contour.size() >= 4)
+                contours.append(contour);
+        }
+        return contours;
+    }
+}
+
+namespace PolygonBoolean
+{
+    Contours combine(const Contours &subject, const Contours &clip, Operation operation, FillRule rule)
+    {
+        Sweep sweep(operation, rule);
+        sweep.add(subject, 0);
+        sweep.add(clip, 1);
+        return sweep.run();
+    }
+
+    Contours resolve(const QVector<QPoint> &polygon, FillRule rule)
+    {
+        Sweep sweep(Union, rule);
+        sweep.add({polygon}, 0);
+        return sweep.run();
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <QPoint>
+#include <QVector>
+
+#include <algorithm>
+
+// Boolean operations between polygons and resolution of self-intersections.
+// A Bentley-Ottmann sweep visits the edge ends and crossings in order, which
+// takes O((n + k) log n) for n edges with k crossings. Its predicates are
+// exact: crossings are rational points, compared in 128-bit integers. The same
+// pass gives each piece of edge between two events the winding numbers of both
+// operands below and above it. The pieces where the result's inside changes
+// form its boundary, and their ends are rounded to the integer grid at the end.
+// That rounding is not snap rounding, it moves crossings by up to half a pixel
+// and can make pieces passing that close to each other touch or cross.
+namespace PolygonBoolean
+{
+    enum Operation
+    {
+        Union,
+        Intersection,
+        Difference,
+        Xor
+    };
+    enum FillRule
+    {
+        EvenOdd,
+        NonZero
+    };
+
+    // Closed contours (last point == first point), as polygons are everywhere in
+    // ViewerWidget. Holes are contours of their own and the even-odd rule over
+    // all contours covers the result, whether or not rounding made them cross.
+    typedef QVector<QVector<QPoint>> Contours;
+
+    // The predicates stay exact for coordinates within +-maxCoordinate, points beyond are clamped
+    const int maxCoordinate = 1 << 16;
+
+    Contours combine(const Contours &subject, const Contours &clip, Operation operation, FillRule rule = EvenOdd);
+    // The region polygon covers under rule, as contours of its boundary
+    Contours resolve(const QVector<QPoint> &polygon, FillRule rule = EvenOdd);
+
+    // Keeps the resolution of the last polygon until its shape changes. The
+    // sweep rounds on a grid that moves with the points, so a polygon that was
+    // only moved gets the kept contours moved the same way, in place.
+    class Cache
+    {
+    public:
+        const Contours &contours(const QVector<QPoint> &polygon)
+        {
+            const QPoint offset = polygon.isEmpty() || points.isEmpty() ? QPoint() : polygon[0] - points[0];
+            bool moved = polygon.size() == points.size();
+            for (int i = 0; moved && i < polygon.size(); i++)
+                moved = polygon[i] - offset == points[i];
+            if (!moved)
+            {
+                points.resize(polygon.size());
+                std::copy(polygon.cbegin(), polygon.cend(), points.begin());
+                resolved = resolve(polygon);
+                shifted = resolved;
+                shift = QPoint();
+            }
+            else if (offset != shift)
+            {
+                for (int c = 0; c < resolved.size(); c++)
+                {
+                    const QVector<QPoint> &from = resolved[c];
+                    QVector<QPoint> &to = shifted[c];
+                    for (int i = 0; i < from.size(); i++)
+                        to[i] = from[i] + offset;
+                }
+                shift = offset;
+            }
+            return shifted;
+        }
+
+    private:
+        QVector<QPoint> points;
+        Contours resolved, shifted; // shifted is resolved moved by shift
+        QPoint shift;
+    };
+}
@@ -0,0 +1,379 @@
+#include "PolylineSet.h"
+
+#include <QFile>
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string>
+
+namespace
+{
+    struct Field
+    {
+        const char *begin, *end;
+
+        bool isEmpty() const { return begin == end; }
+        std::string lower() const
+        {
+            std::string text(begin, end);
+            std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c)
+                           { return (char)std::tolower(c); });
+            return text;
+        }
+    };
+
+    const int maxFields = 16;
+
+    bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    // Fields separated by , ; or tab, or by runs of spaces in lines without those
+    int splitFields(const char *begin, const char *end, Field *fields)
+    {
+        const bool delimited = std::find_if(begin, end, [](char c)
+                                            { return c == ',' || c == ';' || c == '\t'; }) != end;
+        int count = 0;
+        const char *p = begin;
+        while (p < end && count < maxFields)
+        {
+            while (p < end && (*p == ' ' || (!delimited && isSpace(*p))))
+                p++;
+            const char *start = p;
+            if (delimited)
+                while (p < end && *p != ',' && *p != ';' && *p != '\t')
+                    p++;
+            else
+                while (p < end && !isSpace(*p))
+                    p++;
+            const char *stop = p;
+            while (stop > start && isSpace(stop[-1]))
+                stop--;
+            fields[count++] = {start, stop};
+            if (delimited && p < end)
+                p++;
+        }
+        return count;
+    }
+
+    // Locale independent, unlike strtod once the application has set the locale
+    bool parseNumber(const Field &field, double &value)
+    {
+        const char *begin = field.begin;
+        if (begin < field.end && *begin == '+')
+            begin++;
+        const std::from_chars_result result = std::from_chars(begin, field.end, value);
+        return result.ec == std::errc() && result.ptr == field.end && begin != field.end;
+    }
+
+    double segmentDistanceSquared(double px, double py, double ax, double ay, double bx, double by)
+    {
+        const double dx = bx - ax, dy = by - ay, length = dx * dx + dy * dy;
+        const double t = length > 0 ? std::min(std::max(((px - ax) * dx + (py - ay) * dy) / length, 0.), 1.) : 0.;
+        const double ex = ax + t * dx - px, ey = ay + t * dy - py;
+        return ex * ex + ey * ey;
+    }
+
+    // Douglas-Peucker with an explicit stack, a track of millions of vertices
+    // would overflow the call stack. errors[i] becomes the tolerance at which
+    // vertex i is dropped, never more than the error of the split above it.
+    void rankVertices(const double *x, const double *y, qint64 first, qint64 last, float *errors)
+    {
+        struct Range
+        {
+            qint64 first, last;
+            double limit;
+        };
+        const double infinity = std::numeric_limits<double>::infinity();
+        errors[first] = errors[last] = infinity;
+
+        std::vector<Range> stack = {{first, last, infinity}};
+        while (!stack.empty())
+        {
+            const Range range = stack.back();
+            stack.pop_back();
+            if (range.last - range.first < 2)
+                continue;
+
+            qint64 farthest = range.first + 1;
+            double largest = -1;
+            for (qint64 i = range.first + 1; i < range.last; i++)
+            {
+                const double d = segmentDistanceSquared(x[i], y[i], x[range.first], y[range.first], x[range.last], y[range.last]);
+                if (d > largest)
+                {
+                    largest = d;
+                    farthest = i;
+                }
+            }
+            // Rounded before it limits the splits below, float ranks stay ordered
+            const float error = (float)std::min(std::sqrt(largest), range.limit);
+            errors[farthest] = error;
+            stack.push_back({range.first, farthest, error});
+            stack.push_back({farthest, range.last, error});
+        }
+    }
+}
+
+void PolylineSet::Bounds::add(double x, double y)
+{
+    if (isEmpty())
+    {
+        minX = maxX = x;
+        minY = maxY = y;
+        return;
+    }
+    minX = std::min(minX, x);
+    maxX = std::max(maxX, x);
+    minY = std::min(minY, y);
+    maxY = std::max(maxY, y);
+}
+
+void PolylineSet::clear()
+{
+    levels.clear();
+    pathX.clear();
+    pathY.clear();
+    ranks.clear();
+    blockRanks.clear();
+    extent = Bounds();
+    vertices = 0;
+    polylines = 0;
+}
+
+bool PolylineSet::load(const QString &file_name, QString &error, const Progress &progress)
+{
+    QFile file(file_name);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        error = file.errorString();
+        return false;
+    }
+
+    std::vector<double> x, y;
+    std::vector<qint64> starts = {0};
+    std::string track;
+    int x_column = 0, y_column = 1, track_column = -1;
+    bool header_checked = false;
+
+    // Polylines of a single vertex have nothing to draw
+    auto finishPolyline = [&]()
+    {
+        if ((qint64)x.size() - starts.back() < 2)
+        {
+            x.resize(starts.back());
+            y.resize(starts.back());
+        }
+        else
+            starts.push_back(x.size());
+    };
+
+    auto parseLine = [&](const char *begin, const char *end)
+    {
+        Field fields[maxFields];
+        const int count = splitFields(begin, end, fields);
+        if (count == 0 || fields[0].isEmpty() || *fields[0].begin == '#')
+        {
+            finishPolyline();
+            return;
+        }
+
+        if (!header_checked)
+        {
+            header_checked = true;
+            double value;
+            if (!parseNumber(fields[0], value))
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    const std::string name = fields[i].lower();
+                    if (name == "x" || name == "lon" || name == "lng" || name == "longitude")
+                        x_column = i;
+                    else if (name == "y" || name == "lat" || name == "latitude")
+                        y_column = i;
+                    else if (name == "id" || name == "track" || name == "segment")
+                        track_column = i;
+                }
+                return;
+            }
+        }
+
+        double vx, vy;
+        if (std::max(x_column, y_column) >= count || !parseNumber(fields[x_column], vx) || !parseNumber(fields[y_column], vy) ||
+            !std::isfinite(vx) || !std::isfinite(vy))
+        {
+            finishPolyline();
+            return;
+        }
+        if (track_column >= 0 && track_column < count)
+        {
+            const Field &id = fields[track_column];
+            if (track.size() != (size_t)(id.end - id.begin) || !std::equal(id.begin, id.end, track.begin()))
+            {
+                finishPolyline();
+                track.assign(id.begin, id.end);
+            }
+        }
+        x.push_back(vx);
+        y.push_back(vy);
+    };
+
+    // A block at a time, the part line at the end of a block moves to the front of the next
+    const qint64 block_size = 1 << 20;
+    std::vector<char> buffer;
+    size_t kept = 0;
+    for (;;)
+    {
+        buffer.resize(kept + block_size);
+        const qint64 read = file.read(buffer.data() + kept, block_size);
+        if (read < 0)
+        {
+            error = file.errorString();
+            return false;
+        }
+
+        const char *data = buffer.data();
+        const size_t filled = kept + read;
+        size_t line = 0;
+        while (const char *newline = static_cast<const char *>(std::memchr(data + line, '\n', filled - line)))
+        {
+            parseLine(data + line, newline);
+            line = newline - data + 1;
+        }
+        if (read == 0)
+        {
+            if (line < filled)
+                parseLine(data + line, data + filled);
+            break;
+        }
+        kept = filled - line;
+        std::memmove(buffer.data(), data + line, kept);
+
+        if (progress && !progress(file.pos(), file.size()))
+        {
+            error = "The import was cancelled.";
+            return false;
+        }
+    }
+    finishPolyline();
+
+    if (x.empty())
+    {
+        error = "The file holds no polylines.";
+        return false;
+    }
+    buildLevels(x, y, starts);
+    return true;
+}
+
+void PolylineSet::buildLevels(std::vector<double> &x, std::vector<double> &y, const std::vector<qint64> &starts)
+{
+    clear();
+    polylines = (int)starts.size() - 1;
+    vertices = x.size();
+    for (size_t i = 0; i < x.size(); i++)
+        extent.add(x[i], y[i]);
+
+    std::vector<float> errors(x.size());
+    for (int p = 0; p < polylines; p++)
+        rankVertices(x.data(), y.data(), starts[p], starts[p + 1] - 1, errors.data());
+    // Collinear vertices rank 0 and are left out of every level
+    const qint64 finest = std::count_if(errors.begin(), errors.end(), [](float error)
+                                        { return error > 0; });
+
+    // Separators go in from the back, each vertex moves once and nothing is copied
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const float infinity = std::numeric_limits<float>::infinity();
+    const size_t size = x.size() + polylines - 1;
+    x.resize(size);
+    y.resize(size);
+    errors.resize(size);
+    for (int p = polylines - 1; p > 0; p--)
+    {
+        const qint64 shift = p;
+        for (qint64 i = starts[p + 1] - 1; i >= starts[p]; i--)
+        {
+            x[i + shift] = x[i];
+            y[i + shift] = y[i];
+            errors[i + shift] = errors[i];
+        }
+        x[starts[p] + shift - 1] = nan;
+        y[starts[p] + shift - 1] = nan;
+        errors[starts[p] + shift - 1] = infinity;
+    }
+    pathX = std::move(x);
+    pathY = std::move(y);
+    ranks = std::move(errors);
+    blockRanks.assign((size + blockSize - 1) / blockSize, 0.f);
+    for (size_t i = 0; i < size; i++)
+        blockRanks[i / blockSize] = std::max(blockRanks[i / blockSize], ranks[i]);
+
+    const double diagonal = std::hypot(extent.width(), extent.height());
+    double tolerance = diagonal > 0 ? diagonal / 16 : 0;
+    for (int step = 0; step < 64; step++, tolerance /= 2)
+    {
+        Level level;
+        level.tolerance = tolerance;
+        level.vertices = 0;
+        for (qint64 i = nextVertex(level, 0); i < (qint64)size; i = nextVertex(level, i + 1))
+            level.vertices++;
+
+        // The same vertices as the level before are just as good at the smaller tolerance
+        if (!levels.empty() && levels.back().vertices == level.vertices)
+        {
+            levels.back().tolerance = tolerance;
+        }
+        else
+        {
+            levels.push_back(level);
+        }
+
+        if (level.vertices == finest + polylines - 1 || tolerance == 0)
+            break;
+    }
+
+    // Bounds once the tolerances are final, a level that absorbed finer ones keeps the same vertices
+    for (Level &level : levels)
+    {
+        level.chunks.assign((size + chunkSize - 1) / chunkSize, Bounds());
+        qint64 previous = -1;
+        for (qint64 i = nextVertex(level, 0); i < (qint64)size; i = nextVertex(level, i + 1))
+        {
+            if (std::isnan(pathX[i]))
+            {
+                previous = -1;
+                continue;
+            }
+            level.chunks[i / chunkSize].add(pathX[i], pathY[i]);
+            if (previous >= 0 && previous / chunkSize != i / chunkSize)
+                level.chunks[previous / chunkSize].add(pathX[i], pathY[i]);
+            previous = i;
+        }
+    }
+}
+
+qint64 PolylineSet::nextVertex(const Level &level, qint64 index) const
+{
+    const qint64 size = pathSize();
+    while (index < size)
+    {
+        if (index % blockSize == 0 && blockRanks[index / blockSize] <= level.tolerance)
+            index += blockSize;
+        else if (ranks[index] > level.tolerance)
+            return index;
+        else
+            index++;
+    }
+    return size;
+}
+
+int PolylineSet::levelFor(double max_error) const
+{
+    for (int i = 0; i < (int)levels.size(); i++)
+    {
+        if (levels[i].tolerance <= max_error)
+            return i;
+    }
+    return (int)levels.size() - 1;
+}
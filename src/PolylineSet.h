@@ -0,0 +1,83 @@
+#pragma once
+#include <QString>
+
+#include <functional>
+#include <vector>
+
+// Polylines imported from large text files, with Douglas-Peucker levels of detail.
+// Files are parsed a block at a time, one vertex per line as "x y" or as CSV.
+// CSV headers name the x (x, lon, lng, longitude), y (y, lat, latitude) and
+// track (id, track, segment) columns, otherwise x and y are the first two
+// fields. A blank or non-numeric line, or a new track id, starts a new polyline.
+//
+// Douglas-Peucker ranks every vertex once by the error its removal would
+// cause, clamped to its parent's so that coarser levels are subsets of finer
+// ones. The vertices are stored once with their rank, a level is only a
+// tolerance, halving from level to level, and keeps the vertices ranked above
+// it. Blocks of blockSize vertices know their largest rank, so a coarse level
+// steps over what it drops a block at a time. Every level bounds its vertices
+// in each run of chunkSize, so drawing skips what is off screen.
+class PolylineSet
+{
+public:
+    static const int chunkSize = 256;
+    static const int blockSize = 16;
+
+    struct Bounds
+    {
+        double minX = 0, minY = 0, maxX = -1, maxY = -1;
+
+        bool isEmpty() const { return maxX < minX; }
+        double width() const { return maxX - minX; }
+        double height() const { return maxY - minY; }
+        void add(double x, double y);
+        bool intersects(const Bounds &other) const
+        {
+            return minX <= other.maxX && other.minX <= maxX && minY <= other.maxY && other.minY <= maxY;
+        }
+    };
+
+    struct Level
+    {
+        double tolerance; // largest distance of a dropped vertex from the kept polyline
+        qint64 vertices;  // kept, separators included
+        // chunks[i] bounds the kept vertices from i * chunkSize up to (i + 1) * chunkSize
+        // and the kept vertex after them, where the last segment of the run ends
+        std::vector<Bounds> chunks;
+    };
+
+    // progress(bytes_read, file_size) may return false to cancel the import
+    typedef std::function<bool(qint64, qint64)> Progress;
+
+    bool load(const QString &file_name, QString &error, const Progress &progress = Progress());
+    void clear();
+
+    bool isEmpty() const { return levels.empty(); }
+    qint64 vertexCount() const { return vertices; }
+    int polylineCount() const { return polylines; }
+    const Bounds &bounds() const { return extent; }
+
+    int levelCount() const { return (int)levels.size(); }
+    const Level &level(int index) const { return levels[index]; }
+
+    // Vertices of all polylines in order, shared by the levels.
+    // A NaN x separates one polyline from the next and is kept by every level.
+    qint64 pathSize() const { return (qint64)pathX.size(); }
+    double x(qint64 index) const { return pathX[index]; }
+    double y(qint64 index) const { return pathY[index]; }
+    // The first vertex at or after index that level keeps, pathSize() when there is none
+    qint64 nextVertex(const Level &level, qint64 index) const;
+    // Coarsest level whose dropped vertices lie within max_error of it
+    int levelFor(double max_error) const;
+
+private:
+    std::vector<Level> levels;
+    std::vector<double> pathX, pathY;
+    std::vector<float> ranks;      // per vertex, the tolerance at which it is dropped
+    std::vector<float> blockRanks; // per blockSize vertices, the largest of their ranks
+    Bounds extent;
+    qint64 vertices = 0;
+    int polylines = 0;
+
+    void buildLevels(std::vector<double> &x, std::vector<double> &y, const std::vector<qint64> &starts);
+};
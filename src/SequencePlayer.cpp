@@ -0,0 +1,260 @@
+#include "SequencePlayer.h"
+#include "PixelFormat.h"
+
+#include <QCollator>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QRegularExpression>
+
+#include <algorithm>
+#include <climits>
+
+SequencePlayer::SequencePlayer(int capacity) : ring(std::max(capacity, 2))
+{
+    // One core stays with the GUI thread, which shows the frames
+    pool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+    timer.setTimerType(Qt::PreciseTimer);
+    QObject::connect(&timer, &QTimer::timeout, [this]()
+                     { tick(); });
+}
+
+SequencePlayer::~SequencePlayer()
+{
+    close();
+}
+
+QStringList SequencePlayer::listFrames(const QString &source)
+{
+    QStringList filters;
+    for (const QByteArray &format : QImageReader::supportedImageFormats())
+        filters << "*." + QString::fromLatin1(format);
+
+    QFileInfo info(source);
+    QStringList frames;
+    if (info.isDir())
+    {
+        QDir dir(source);
+        QStringList names = dir.entryList(filters, QDir::Files);
+        QCollator collator;
+        collator.setNumericMode(true);
+        std::sort(names.begin(), names.end(), collator);
+        for (const QString &name : names)
+            frames << dir.filePath(name);
+        return frames;
+    }
+
+    // The frame number is a run of #, a printf conversion, or the last digits of a file name
+    static const QRegularExpression hashes("#+"), conversion("%0?\\d*d"), digits("\\d+(?!.*\\d)");
+    const QString name = info.fileName();
+    QRegularExpressionMatch match = hashes.match(name);
+    if (!match.hasMatch())
+        match = conversion.match(name);
+    if (!match.hasMatch() && info.isFile())
+        match = digits.match(name);
+    if (!match.hasMatch())
+        return frames;
+
+    const QRegularExpression numbered("^" + QRegularExpression::escape(name.left(match.capturedStart())) + "(\\d+)" +
+                                      QRegularExpression::escape(name.mid(match.capturedEnd())) + "$");
+    QVector<QPair<qint64, QString>> found;
+    const QDir dir = info.dir();
+    for (const QString &candidate : dir.entryList(QDir::Files))
+    {
+        QRegularExpressionMatch frame = numbered.match(candidate);
+        if (frame.hasMatch())
+            found.push_back({frame.captured(1).toLongLong(), candidate});
+    }
+    std::sort(found.begin(), found.end());
+    for (const auto &frame : found)
+        frames << dir.filePath(frame.second);
+    return frames;
+}
+
+bool SequencePlayer::open(const QString &source)
+{
+    close();
+    files = listFrames(source);
+    if (files.isEmpty())
+        return false;
+    seek(0);
+    return true;
+}
+
+void SequencePlayer::close()
+{
+    timer.stop();
+    horizon = INT_MAX;
+    pool.clear();
+    pool.waitForDone();
+
+    files.clear();
+    for (Slot &slot : ring)
+        slot = Slot();
+    current = -1;
+    seekTarget = -1;
+    horizon = 0;
+}
+
+void SequencePlayer::setFrameRate(double frame_rate)
+{
+    if (frame_rate <= 0)
+        return;
+    fps = frame_rate;
+    // Half a frame period, so a frame is never shown more than half a period late
+    timer.setInterval(std::max(1, (int)(500 / fps)));
+    startFrame = expected;
+    clock.restart();
+}
+
+void SequencePlayer::play()
+{
+    if (files.isEmpty())
+        return;
+    if (current >= files.size() - 1)
+        seek(0);
+
+    {
+        QMutexLocker locker(&mutex);
+        counters = Stats();
+        decodeNanoseconds = 0;
+    }
+    startFrame = expected;
+    clock.start();
+    playClock.start();
+    setFrameRate(fps);
+    timer.start();
+}
+
+void SequencePlayer::pause()
+{
+    timer.stop();
+}
+
+void SequencePlayer::seek(int frame)
+{
+    if (files.isEmpty())
+        return;
+    frame = std::min(std::max(frame, 0), (int)files.size() - 1);
+
+    startFrame = frame;
+    expected = frame;
+    seekTarget = frame;
+    clock.restart();
+    horizon = frame;
+    requestAhead(frame);
+    present(frame);
+}
+
+SequencePlayer::Stats SequencePlayer::stats() const
+{
+    QMutexLocker locker(&mutex);
+    Stats stats = counters;
+    if (stats.decoded > 0)
+        stats.decodeMs = decodeNanoseconds / 1e6 / stats.decoded;
+    const qint64 elapsed = playClock.isValid() ? playClock.elapsed() : 0;
+    if (elapsed > 0)
+        stats.decodeFps = stats.decoded * 1000. / elapsed;
+    return stats;
+}
+
+void SequencePlayer::tick()
+{
+    int due = startFrame + (int)(clock.elapsed() * fps / 1000);
+    if (due >= files.size())
+    {
+        // The last frame is waited for before playback stops
+        due = files.size() - 1;
+        if (current == due)
+        {
+            timer.stop();
+            return;
+        }
+    }
+    horizon = due;
+    if (due != current)
+        present(due);
+    // A shown frame's slot is empty again, asking for it would decode it twice
+    requestAhead(current == due ? due + 1 : due);
+}
+
+bool SequencePlayer::present(int frame)
+{
+    QImage image;
+    {
+        QMutexLocker locker(&mutex);
+        Slot &slot = ring[frame % ring.size()];
+        if (slot.frame != frame || !slot.ready)
+            return false;
+        // Moved out, so the viewer owns the only reference and can draw on it in place
+        image = std::move(slot.image);
+        slot = Slot();
+        if (frame > expected)
+            counters.dropped += frame - expected;
+        // A file that failed to decode counts as dropped, the previous frame stays
+        if (image.isNull())
+            counters.dropped++;
+        else
+            counters.presented++;
+    }
+
+    expected = frame + 1;
+    current = frame;
+    int waited = frame;
+    seekTarget.compare_exchange_strong(waited, -1);
+    if (presenter && !image.isNull())
+        presenter(frame, std::move(image));
+    return true;
+}
+
+void SequencePlayer::requestAhead(int first)
+{
+    QMutexLocker locker(&mutex);
+    const int last = std::min(first + (int)ring.size(), (int)files.size());
+    for (int frame = first; frame < last; frame++)
+    {
+        Slot &slot = ring[frame % ring.size()];
+        if (slot.frame == frame)
+            continue;
+        // An older frame in the slot is either shown or too late by now
+        slot = Slot();
+        slot.frame = frame;
+        const QString file_name = files[frame];
+        pool.start([this, frame, file_name]()
+                   { decode(frame, file_name); });
+    }
+}
+
+void SequencePlayer::decode(int frame, QString file_name)
+{
+    if (frame < horizon.load())
+        return;
+
+    QElapsedTimer decode_timer;
+    decode_timer.start();
+    QImageReader reader(file_name);
+    QImage image = reader.read();
+    // Converted here rather than on the GUI thread
+    const QImage::Format format = PixelFormat::drawableFormat(image);
+    if (!image.isNull() && image.format() != format)
+        image = image.convertToFormat(format);
+    const qint64 elapsed = decode_timer.nsecsElapsed();
+
+    QMutexLocker locker(&mutex);
+    Slot &slot = ring[frame % ring.size()];
+    if (slot.frame != frame)
+        return;
+    slot.image = image;
+    slot.ready = true;
+    counters.decoded++;
+    decodeNanoseconds += elapsed;
+
+    // A paused seek waits for its frame, playing picks it up on the next tick
+    if (frame == seekTarget)
+        QMetaObject::invokeMethod(
+            &timer, [this, frame]()
+            {
+                if (frame == seekTarget && !timer.isActive())
+                    present(frame); },
+            Qt::QueuedConnection);
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <QImage>
+#include <QMutex>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// Plays a sequence of image files at a target frame rate.
+// Frames are decoded ahead on a thread pool into a ring of slots, the frame
+// shown follows the clock, and a frame whose time passed before its decode
+// finished is dropped instead of holding playback back.
+class SequencePlayer
+{
+public:
+    struct Stats
+    {
+        int decoded = 0;       // frames decoded since play()
+        int presented = 0;
+        int dropped = 0;       // frames skipped because they were not decoded in time
+        double decodeFps = 0;  // decoded frames per second of playback
+        double decodeMs = 0;   // mean decode time of a frame on one worker
+    };
+
+    explicit SequencePlayer(int capacity = 16);
+    ~SequencePlayer();
+
+    // A directory, a pattern with #### or %04d for the frame number, or one file
+    // of a numbered sequence, which stands for its numbered siblings
+    bool open(const QString &source);
+    void close();
+    static QStringList listFrames(const QString &source);
+    int frameCount() const { return files.size(); }
+    int currentFrame() const { return current; }
+    QString fileName(int frame) const { return files.value(frame); }
+
+    // Receives each frame to show on the GUI thread, the image is not shared with the ring
+    void setPresenter(const std::function<void(int frame, QImage image)> &function) { presenter = function; }
+
+    void setFrameRate(double frame_rate);
+    double frameRate() const { return fps; }
+    void play();
+    void pause();
+    bool isPlaying() const { return timer.isActive(); }
+    // Shows frame once it is decoded, playback goes on from there
+    void seek(int frame);
+
+    Stats stats() const;
+
+private:
+    struct Slot
+    {
+        int frame = -1;
+        bool ready = false;
+        QImage image;
+    };
+
+    QStringList files;
+    std::vector<Slot> ring; // frame f lives in ring[f % ring.size()]
+    mutable QMutex mutex;
+    QThreadPool pool;
+    std::function<void(int, QImage)> presenter;
+
+    QTimer timer;
+    QElapsedTimer clock, playClock;
+    double fps = 24;
+    int startFrame = 0; // frame due when clock started
+    int expected = 0;   // next frame in order, frames before a later one shown are dropped
+    int current = -1;   // last frame shown
+    std::atomic<int> seekTarget{-1}; // frame a seek waits for
+    std::atomic<int> horizon{0}; // decodes of earlier frames are skipped
+
+    Stats counters;
+    qint64 decodeNanoseconds = 0;
+
+    void tick();
+    bool present(int frame);
+    void requestAhead(int first);
+    void decode(int frame, QString file_name);
+};
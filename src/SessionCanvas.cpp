@@ -0,0 +1,209 @@
+#include "SessionCanvas.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // Writes the mapped pages overlapping [begin, begin + length) to the file
+    void syncPages(uchar *begin, qint64 length)
+    {
+#ifdef Q_OS_WIN
+        FlushViewOfFile(begin, length);
+#else
+        static const quintptr page = sysconf(_SC_PAGESIZE);
+        uchar *aligned = begin - (quintptr)begin % page;
+        msync(aligned, length + (begin - aligned), MS_SYNC);
+#endif
+    }
+}
+
+bool SessionCanvas::create(const QString &file_name, QSize size, QImage::Format format)
+{
+    close();
+    // Rows padded to 32 bits, as QImage lays them out
+    const int bytes_per_line = (QImage::toPixelFormat(format).bitsPerPixel() * size.width() + 31) / 32 * 4;
+    if (size.isEmpty())
+    {
+        error = "The canvas is empty.";
+        return false;
+    }
+    file.setFileName(file_name);
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !map(file_name, pixelOffset + (qint64)bytes_per_line * size.height()))
+    {
+        error = file.errorString();
+        file.close();
+        return false;
+    }
+
+    Header *created = new (mapping) Header;
+    created->magic = magicNumber;
+    created->version = formatVersion;
+    created->width = size.width();
+    created->height = size.height();
+    created->bytesPerLine = bytes_per_line;
+    created->format = format;
+    syncPages(mapping, pixelOffset);
+    header = created;
+    startFlusher();
+    error.clear();
+    return true;
+}
+
+bool SessionCanvas::open(const QString &file_name)
+{
+    close();
+    file.setFileName(file_name);
+    if (!file.open(QIODevice::ReadWrite))
+    {
+        error = file.errorString();
+        return false;
+    }
+    if (file.size() < pixelOffset || !map(file_name, file.size()) || !validate())
+    {
+        if (error.isEmpty())
+            error = QString("%1 is not a canvas session.").arg(file_name);
+        if (mapping)
+            file.unmap(mapping);
+        mapping = nullptr;
+        file.close();
+        return false;
+    }
+    header = reinterpret_cast<Header *>(mapping);
+    startFlusher();
+    error.clear();
+    return true;
+}
+
+bool SessionCanvas::replace(const QString &file_name, const QImage &image)
+{
+    const QString replacement = file_name + ".new";
+    if (!create(replacement, image.size(), image.format()))
+        return false;
+    QImage pixels = this->image();
+    const qsizetype bytes = std::min(pixels.bytesPerLine(), image.bytesPerLine());
+    for (int y = 0; y < pixels.height(); y++)
+        memcpy(pixels.scanLine(y), image.constScanLine(y), bytes);
+    // Written out by the flusher's last pass
+    markDirty(0, pixels.height() - 1);
+    close();
+
+    if ((QFile::exists(file_name) && !QFile::remove(file_name)) || !QFile::rename(replacement, file_name))
+    {
+        error = QString("Unable to replace %1 with %2.").arg(file_name).arg(replacement);
+        return false;
+    }
+    return open(file_name);
+}
+
+bool SessionCanvas::map(const QString &file_name, qint64 size)
+{
+    error.clear();
+    if (file.size() != size && !file.resize(size))
+        return false;
+    mapping = file.map(0, size);
+    if (!mapping)
+        error = QString("Unable to map %1. %2").arg(file_name).arg(file.errorString());
+    return mapping != nullptr;
+}
+
+bool SessionCanvas::validate()
+{
+    static_assert(sizeof(Header) <= pixelOffset, "the header overlaps the pixels");
+
+    const Header *candidate = reinterpret_cast<const Header *>(mapping);
+    return candidate->magic == magicNumber && candidate->version == formatVersion &&
+           candidate->width > 0 && candidate->height > 0 &&
+           candidate->bytesPerLine >= (QImage::toPixelFormat((QImage::Format)candidate->format).bitsPerPixel() * candidate->width + 7) / 8 &&
+           pixelOffset + (qint64)candidate->bytesPerLine * candidate->height <= file.size();
+}
+
+void SessionCanvas::close()
+{
+    if (!header)
+        return;
+    // The flusher's last pass leaves nothing dirty
+    stopFlusher();
+    header = nullptr;
+    file.unmap(mapping);
+    mapping = nullptr;
+    file.close();
+}
+
+QImage SessionCanvas::image()
+{
+    if (!header)
+        return QImage();
+    return QImage(mapping + pixelOffset, header->width, header->height, header->bytesPerLine, (QImage::Format)header->format);
+}
+
+void SessionCanvas::markDirty(int first_row, int last_row)
+{
+    if (!header)
+        return;
+    QMutexLocker lock(&mutex);
+    const bool clean = dirtyLast < 0;
+    dirtyFirst = std::min(dirtyFirst, first_row);
+    dirtyLast = std::max(dirtyLast, last_row);
+    if (clean)
+        wake.wakeOne();
+}
+
+void SessionCanvas::flushRows(int first_row, int last_row)
+{
+    first_row = std::max(first_row, 0);
+    last_row = std::min(last_row, header->height - 1);
+    if (first_row > last_row)
+        return;
+    syncPages(mapping + pixelOffset + (qint64)first_row * header->bytesPerLine, (qint64)(last_row - first_row + 1) * header->bytesPerLine);
+}
+
+void SessionCanvas::startFlusher()
+{
+    stopping = false;
+    dirtyFirst = INT_MAX;
+    dirtyLast = -1;
+    flusher = QThread::create([this]()
+                              {
+        QMutexLocker lock(&mutex);
+        for (;;)
+        {
+            while (dirtyLast < 0 && !stopping)
+                wake.wait(&mutex);
+            // Rows dirtied in the meantime join this pass
+            if (!stopping)
+                wake.wait(&mutex, flushInterval);
+            const int first = dirtyFirst, last = dirtyLast;
+            dirtyFirst = INT_MAX;
+            dirtyLast = -1;
+            lock.unlock();
+            if (last >= 0)
+                flushRows(first, last);
+            lock.relock();
+            if (stopping && dirtyLast < 0)
+                return;
+        } });
+    flusher->start();
+}
+
+void SessionCanvas::stopFlusher()
+{
+    if (!flusher)
+        return;
+    {
+        QMutexLocker lock(&mutex);
+        stopping = true;
+        wake.wakeOne();
+    }
+    flusher->wait();
+    delete flusher;
+    flusher = nullptr;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <QFile>
+#include <QImage>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <climits>
+
+// Image pixels in a memory-mapped session file, so a crash loses no work and a
+// restart reopens the canvas without decoding anything.
+// The file starts with a Header, the rows follow at pixelOffset as they lie in
+// a QImage. Edits land in the mapped pages, the flusher thread writes the rows
+// marked dirty to disk at most every flushInterval milliseconds, a whole stroke
+// in one pass and never on the GUI thread.
+class SessionCanvas
+{
+public:
+    struct Header
+    {
+        quint32 magic;
+        quint32 version;
+        qint32 width, height;
+        qint32 bytesPerLine;
+        qint32 format; // QImage::Format
+    };
+    static const quint32 magicNumber = 0x53535649; // "IVSS"
+    static const quint32 formatVersion = 1;
+    static const int pixelOffset = 64;
+    static const int flushInterval = 1000;
+
+    ~SessionCanvas() { close(); }
+
+    // Creates the file for an image of size and format, replacing what it held
+    bool create(const QString &file_name, QSize size, QImage::Format format);
+    // Maps an existing session file, whose header says what the image is
+    bool open(const QString &file_name);
+    // Writes image to file_name.new, which replaces file_name once complete, and
+    // maps the result. A failure on the way leaves file_name as it was, closed.
+    bool replace(const QString &file_name, const QImage &image);
+    // Writes out the dirty rows and unmaps the file, which stays on disk
+    void close();
+    bool isOpen() const { return header != nullptr; }
+    QString fileName() const { return file.fileName(); }
+    QString errorString() const { return error; }
+
+    // The pixels in place, valid until close()
+    QImage image();
+    const uchar *pixels() const { return mapping ? mapping + pixelOffset : nullptr; }
+
+    // Rows first to last changed, they reach the disk on the flusher's next pass
+    void markDirty(int first_row, int last_row);
+
+private:
+    QFile file;
+    uchar *mapping = nullptr;
+    Header *header = nullptr;
+    QString error;
+
+    QMutex mutex;
+    QWaitCondition wake;
+    int dirtyFirst = INT_MAX, dirtyLast = -1;
+    bool stopping = false;
+    QThread *flusher = nullptr;
+
+    bool map(const QString &file_name, qint64 size);
+    bool validate();
+    void flushRows(int first_row, int last_row);
+    void startFlusher();
+    void stopFlusher();
+};
@@ -0,0 +1,183 @@
+#include "SharedCanvas.h"
+
+#include <new>
+
+bool SharedCanvas::create(const QString &key, QSize size, QImage::Format format)
+{
+    close();
+    memory.setKey(key);
+    if (memory.attach())
+        return open(key);
+
+    // Rows padded to 32 bits, as QImage lays them out
+    const int bytes_per_line = (QImage::toPixelFormat(format).bitsPerPixel() * size.width() + 31) / 32 * 4;
+    if (size.isEmpty() || !memory.create(pixelOffset + (qsizetype)bytes_per_line * size.height()))
+    {
+        error = memory.errorString();
+        return false;
+    }
+
+    memory.lock();
+    Header *created = new (memory.data()) Header;
+    created->magic = magicNumber;
+    created->version = formatVersion;
+    created->width = size.width();
+    created->height = size.height();
+    created->bytesPerLine = bytes_per_line;
+    created->format = format;
+    created->sequence.store(0, std::memory_order_release);
+    memory.unlock();
+    if (!open(key))
+        return false;
+    creator = true;
+    return true;
+}
+
+bool SharedCanvas::attach(const QString &key)
+{
+    close();
+    memory.setKey(key);
+    if (!memory.attach())
+    {
+        error = memory.errorString();
+        return false;
+    }
+    return open(key);
+}
+
+bool SharedCanvas::open(const QString &key)
+{
+    static_assert(sizeof(Header) <= pixelOffset, "the header overlaps the pixels");
+
+    const Header *candidate = static_cast<const Header *>(memory.constData());
+    if (memory.size() < pixelOffset || candidate->magic != magicNumber || candidate->version != formatVersion ||
+        candidate->width <= 0 || candidate->height <= 0 ||
+        pixelOffset + (qint64)candidate->bytesPerLine * candidate->height > memory.size())
+    {
+        error = QString("Shared memory %1 does not hold a canvas.").arg(key);
+        memory.detach();
+        return false;
+    }
+
+    header = static_cast<Header *>(memory.data());
+    changedSemaphore = std::make_unique<QSystemSemaphore>(key + ".changed", 0, QSystemSemaphore::Open);
+    error.clear();
+    return true;
+}
+
+void SharedCanvas::close()
+{
+    endWrite(true);
+    stopWatching();
+    changedSemaphore.reset();
+    header = nullptr;
+    creator = false;
+    if (memory.isAttached())
+        memory.detach();
+}
+
+QImage SharedCanvas::image()
+{
+    if (!header)
+        return QImage();
+    return QImage(static_cast<uchar *>(memory.data()) + pixelOffset, header->width, header->height,
+                  header->bytesPerLine, (QImage::Format)header->format);
+}
+
+void SharedCanvas::beginWrite()
+{
+    if (!header || writing)
+        return;
+    memory.lock();
+    writing = true;
+    header->sequence.fetch_add(1, std::memory_order_relaxed);
+    // The odd value is visible before any pixel changes
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void SharedCanvas::endWrite(bool changed)
+{
+    if (!writing)
+        return;
+    if (changed)
+        header->sequence.fetch_add(1, std::memory_order_release);
+    else
+        header->sequence.fetch_sub(1, std::memory_order_release);
+    writing = false;
+    memory.unlock();
+}
+
+quint64 SharedCanvas::beginRead() const
+{
+    if (!header)
+        return 0;
+    // Our own write would never end
+    Q_ASSERT(!writing);
+    for (;;)
+    {
+        const quint64 sequence = header->sequence.load(std::memory_order_acquire);
+        if (!(sequence & 1))
+            return sequence;
+        QThread::yieldCurrentThread();
+    }
+}
+
+bool SharedCanvas::endRead(quint64 sequence) const
+{
+    if (!header)
+        return false;
+    // The reads are complete before the sequence is checked again
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return header->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+quint64 SharedCanvas::read(QImage &copy)
+{
+    if (!header)
+        return 0;
+    const QImage pixels = image();
+    for (;;)
+    {
+        const quint64 sequence = beginRead();
+        copy = pixels.copy();
+        if (endRead(sequence))
+            return sequence;
+    }
+}
+
+void SharedCanvas::watch(QObject *context, const std::function<void()> &changed)
+{
+    stopWatching();
+    if (!header)
+        return;
+
+    stopping = false;
+    pending = false;
+    QSystemSemaphore *semaphore = changedSemaphore.get();
+    watcher = QThread::create([this, semaphore, context, changed]()
+                              {
+        while (semaphore->acquire() && !stopping.load())
+        {
+            if (pending.exchange(true))
+                continue;
+            QMetaObject::invokeMethod(
+                context, [this, changed]()
+                {
+                    pending = false;
+                    changed(); },
+                Qt::QueuedConnection);
+        } });
+    watcher->start();
+}
+
+void SharedCanvas::stopWatching()
+{
+    if (!watcher)
+        return;
+    // Wakes the watcher, which finds it is stopping
+    stopping = true;
+    changedSemaphore->release();
+    watcher->wait();
+    delete watcher;
+    watcher = nullptr;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <QImage>
+#include <QSharedMemory>
+#include <QSystemSemaphore>
+#include <QThread>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// Image pixels in a shared memory segment, for processes drawing into the canvas
+// or reading its frames without copies.
+// The segment starts with a Header, the rows follow at pixelOffset. The sequence
+// counter is a seqlock: writers hold the segment's lock and keep the sequence odd
+// while they change the pixels. Readers use image() in place between beginRead()
+// and endRead(), which tells whether a writer got in meanwhile, read() is the
+// copying form. A producer that changed the pixels also releases the system semaphore
+// "<key>.changed", the watcher thread wakes on it and calls back on the GUI
+// thread, nothing polls.
+class SharedCanvas
+{
+public:
+    struct Header
+    {
+        quint32 magic;
+        quint32 version;
+        qint32 width, height;
+        qint32 bytesPerLine;
+        qint32 format; // QImage::Format
+        std::atomic<quint64> sequence;
+    };
+    static const quint32 magicNumber = 0x43535649; // "IVSC"
+    static const quint32 formatVersion = 2; // 2: the sequence is a seqlock
+    static const int pixelOffset = 64;
+
+    ~SharedCanvas() { close(); }
+
+    // Creates a segment for an image of size and format, or attaches to an
+    // existing one, whose header then says what the image is
+    bool create(const QString &key, QSize size, QImage::Format format);
+    bool attach(const QString &key);
+    void close();
+    bool isOpen() const { return header != nullptr; }
+    // False when create() found the segment and attached to it
+    bool isCreator() const { return creator; }
+    QString key() const { return memory.key(); }
+    QString errorString() const { return error; }
+
+    // The pixels in place, valid until close()
+    QImage image();
+
+    quint64 sequence() const { return header ? header->sequence.load(std::memory_order_acquire) : 0; }
+
+    // Brackets changes of the pixels, one writer at a time. A writer that changed
+    // nothing puts the sequence back, readers then see no new frame.
+    void beginWrite();
+    void endWrite(bool changed);
+    bool isWriting() const { return writing; }
+
+    // Waits until no writer is active and returns the even sequence of the frame in
+    // image(). Whatever was read of it is a finished frame if endRead(sequence) is
+    // true, otherwise read it again.
+    quint64 beginRead() const;
+    bool endRead(quint64 sequence) const;
+    // Copies a consistent frame, returns its sequence or 0 when closed
+    quint64 read(QImage &copy);
+
+    // changed runs on context's thread after producers signal changes, a burst
+    // of signals arriving before it ran is delivered once
+    void watch(QObject *context, const std::function<void()> &changed);
+
+private:
+    QSharedMemory memory;
+    Header *header = nullptr;
+    bool creator = false;
+    bool writing = false;
+    QString error;
+
+    std::unique_ptr<QSystemSemaphore> changedSemaphore;
+    QThread *watcher = nullptr;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> pending{false};
+
+    bool open(const QString &key);
+    void stopWatching();
+};
@@ -0,0 +1,269 @@
+#include "SummedArea.h"
+#include "Parallel.h"
+
+#include <algorithm>
+
+namespace
+{
+    using PixelFormat::Layout;
+
+    // Values of count pixels for every plane, plane p at values[p * stride]
+    template <class T>
+    void samples(const T *pixels, int count, const Layout &layout, SummedArea::Planes planes, quint64 *values, int stride)
+    {
+        const int channels = layout.channels;
+        if (planes == SummedArea::Channels)
+        {
+            for (int c = 0; c < channels; c++)
+            {
+                quint64 *out = values + c * stride;
+                for (int i = 0; i < count; i++)
+                    out[i] = pixels[i * channels + c];
+            }
+            return;
+        }
+
+        const quint64 max = sizeof(T) == 1 ? 255 : 65535;
+        for (int i = 0; i < count; i++)
+        {
+            const T *p = pixels + i * channels;
+            const quint64 r = p[layout.red], g = p[layout.green], b = p[layout.blue];
+            const quint64 alpha = layout.alpha < 0 ? max : p[layout.alpha];
+            // Premultiplied pixels are measured over white, as the blank background shows them
+            const quint64 luminance = (r * 11 + g * 16 + b * 5) / 32 + (layout.premultiplied ? max - alpha : 0);
+            // Premultiplied white is as bright as its alpha
+            const quint64 white = layout.premultiplied ? alpha : max;
+            values[i] = luminance;
+            values[stride + i] = luminance * luminance;
+            values[2 * stride + i] = r == white && g == white && b == white ? 0 : alpha;
+        }
+    }
+}
+
+bool SummedArea::build(const QImage &img, Planes planes)
+{
+    clear();
+    if (img.isNull() || !PixelFormat::layoutOf(img.format(), layout))
+        return false;
+
+    source = img.format();
+    kind = planes;
+    planeCount = planes == Channels ? layout.channels : 3;
+    width = img.width();
+    height = img.height();
+    tilesX = (width + tileSize - 1) / tileSize;
+    tilesY = (height + tileSize - 1) / tileSize;
+
+    // A 64 x 64 tile of 8-bit squares fits in 32 bits, 16-bit channels need 64
+    if (layout.wide)
+        wideLocal.assign((size_t)planeCount * width * height, 0);
+    else
+        local.assign((size_t)planeCount * width * height, 0);
+    rowTotals.assign((size_t)planeCount * height * (tilesX + 1), 0);
+    columnTotals.assign((size_t)planeCount * (tilesY + 1) * width, 0);
+    grid.assign((size_t)planeCount * (tilesY + 1) * (tilesX + 1), 0);
+    stale.assign((size_t)tilesX * tilesY, 1);
+    anyStale = true;
+    refresh(img);
+    return true;
+}
+
+void SummedArea::invalidate(const QRect &area)
+{
+    const QRect r = area.normalized() & QRect(0, 0, width, height);
+    if (isNull() || r.isEmpty())
+        return;
+    for (int ty = r.top() / tileSize; ty <= r.bottom() / tileSize; ty++)
+    {
+        for (int tx = r.left() / tileSize; tx <= r.right() / tileSize; tx++)
+            stale[(size_t)ty * tilesX + tx] = 1;
+    }
+    anyStale = true;
+}
+
+void SummedArea::refresh(const QImage &img)
+{
+    if (isNull())
+        return;
+    if (img.size() != size() || img.format() != source)
+    {
+        build(img, kind);
+        return;
+    }
+    if (!anyStale)
+        return;
+
+    std::vector<int> tiles;
+    std::vector<char> bands(tilesY, 0), columns(tilesX, 0);
+    for (int tile = 0; tile < tilesX * tilesY; tile++)
+    {
+        if (!stale[tile])
+            continue;
+        tiles.push_back(tile);
+        bands[tile / tilesX] = 1;
+        columns[tile % tilesX] = 1;
+    }
+
+    // Tiles only read their own pixels and write their own sums
+    const uchar *bits = img.constBits();
+    const qsizetype stride = img.bytesPerLine();
+    Parallel::forRows(0, (int)tiles.size(), [&](int first, int last)
+                      {
+        std::vector<quint64> values((size_t)planeCount * tileSize);
+        for (int i = first; i < last; i++)
+        {
+            if (layout.wide)
+                sumTile<quint16>(bits, stride, tiles[i], values.data(), wideLocal.data());
+            else
+                sumTile<uchar>(bits, stride, tiles[i], values.data(), local.data());
+        } }, 1);
+
+    // Totals across the tiles to the left, for the rows of every band drawn on
+    Parallel::forRows(0, tilesY, [&](int first, int last)
+                      {
+        for (int ty = first; ty < last; ty++)
+        {
+            if (!bands[ty])
+                continue;
+            for (int p = 0; p < planeCount; p++)
+            {
+                for (int y = ty * tileSize; y < std::min(height, (ty + 1) * tileSize); y++)
+                {
+                    quint64 *totals = rowTotals.data() + ((size_t)p * height + y) * (tilesX + 1);
+                    for (int tx = 0; tx < tilesX; tx++)
+                        totals[tx + 1] = totals[tx] + localSum(p, std::min(width, (tx + 1) * tileSize) - 1, y);
+                }
+            }
+        } }, 1);
+
+    // Totals across the tiles above, for the columns of every tile column drawn on
+    Parallel::forRows(0, tilesX, [&](int first, int last)
+                      {
+        for (int tx = first; tx < last; tx++)
+        {
+            if (!columns[tx])
+                continue;
+            const int x0 = tx * tileSize, x1 = std::min(width, x0 + tileSize);
+            for (int p = 0; p < planeCount; p++)
+            {
+                for (int ty = 0; ty < tilesY; ty++)
+                {
+                    const int bottom = std::min(height, (ty + 1) * tileSize) - 1;
+                    const quint64 *above = columnTotals.data() + ((size_t)p * (tilesY + 1) + ty) * width;
+                    quint64 *totals = columnTotals.data() + ((size_t)p * (tilesY + 1) + ty + 1) * width;
+                    for (int x = x0; x < x1; x++)
+                        totals[x] = above[x] + localSum(p, x, bottom);
+                }
+            }
+        } }, 1);
+
+    // Whole tiles above and to the left, a few thousand at most
+    for (int p = 0; p < planeCount; p++)
+    {
+        quint64 *g = grid.data() + (size_t)p * (tilesY + 1) * (tilesX + 1);
+        for (int ty = 0; ty < tilesY; ty++)
+        {
+            const int bottom = std::min(height, (ty + 1) * tileSize) - 1;
+            const quint64 *above = g + (size_t)ty * (tilesX + 1);
+            quint64 *row = g + (size_t)(ty + 1) * (tilesX + 1);
+            quint64 run = 0;
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                run += localSum(p, std::min(width, (tx + 1) * tileSize) - 1, bottom);
+                row[tx + 1] = above[tx + 1] + run;
+            }
+        }
+    }
+
+    std::fill(stale.begin(), stale.end(), 0);
+    anyStale = false;
+}
+
+template <class T, class Sum>
+void SummedArea::sumTile(const uchar *bits, qsizetype stride, int tile, quint64 *values, Sum *sums)
+{
+    const int x0 = tile % tilesX * tileSize, y0 = tile / tilesX * tileSize;
+    const int w = std::min(tileSize, width - x0), h = std::min(tileSize, height - y0);
+    const size_t plane_pixels = (size_t)width * height;
+    for (int y = y0; y < y0 + h; y++)
+    {
+        samples(reinterpret_cast<const T *>(bits + y * stride) + x0 * layout.channels, w, layout, kind, values, tileSize);
+        for (int p = 0; p < planeCount; p++)
+        {
+            const quint64 *v = values + p * tileSize;
+            Sum *out = sums + p * plane_pixels + (size_t)y * width + x0;
+            Sum run = 0;
+            if (y == y0)
+            {
+                for (int x = 0; x < w; x++)
+                    out[x] = run += v[x];
+            }
+            else
+            {
+                const Sum *above = out - width;
+                for (int x = 0; x < w; x++)
+                    out[x] = above[x] + (run += v[x]);
+            }
+        }
+    }
+}
+
+void SummedArea::clear()
+{
+    planeCount = 0;
+    width = height = tilesX = tilesY = 0;
+    source = QImage::Format_Invalid;
+    local.clear();
+    wideLocal.clear();
+    rowTotals.clear();
+    columnTotals.clear();
+    grid.clear();
+    stale.clear();
+    anyStale = false;
+}
+
+quint64 SummedArea::corner(int plane, int x, int y) const
+{
+    if (x < 0 || y < 0)
+        return 0;
+    const int tx = x / tileSize, ty = y / tileSize;
+    return grid[((size_t)plane * (tilesY + 1) + ty) * (tilesX + 1) + tx] +
+           rowTotals[((size_t)plane * height + y) * (tilesX + 1) + tx] +
+           columnTotals[((size_t)plane * (tilesY + 1) + ty) * width + x] +
+           localSum(plane, x, y);
+}
+
+quint64 SummedArea::sum(int plane, const QRect &rect) const
+{
+    const QRect r = rect.normalized() & QRect(0, 0, width, height);
+    if (r.isEmpty())
+        return 0;
+    // Unsigned wrap-around cancels out, the result is never negative
+    return corner(plane, r.right(), r.bottom()) - corner(plane, r.left() - 1, r.bottom()) -
+           corner(plane, r.right(), r.top() - 1) + corner(plane, r.left() - 1, r.top() - 1);
+}
+
+double SummedArea::mean(int plane, const QRect &rect) const
+{
+    const QRect r = rect.normalized() & QRect(0, 0, width, height);
+    if (r.isEmpty())
+        return 0;
+    return (double)sum(plane, r) / ((qint64)r.width() * r.height());
+}
+
+SummedArea::Region SummedArea::region(const QRect &rect) const
+{
+    Region region;
+    const QRect r = rect.normalized() & QRect(0, 0, width, height);
+    if (kind != Statistics || r.isEmpty())
+        return region;
+
+    region.pixels = (qint64)r.width() * r.height();
+    const double pixels = (double)region.pixels;
+    const double max = layout.wide ? 65535 : 255, scale = max / 255;
+    const double mean = sum(Luminance, r) / pixels;
+    region.mean = mean / scale;
+    region.variance = std::max(sum(LuminanceSquared, r) / pixels - mean * mean, 0.) / (scale * scale);
+    region.coverage = sum(Coverage, r) / (pixels * max);
+    return region;
+}
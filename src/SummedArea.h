@@ -0,0 +1,87 @@
+#pragma once
+#include <QImage>
+#include <QRect>
+#include <QSize>
+
+#include <vector>
+
+#include "PixelFormat.h"
+
+// Integral image of a canvas in 64-bit accumulators, split over square tiles.
+// Every tile holds the prefix sums of its own pixels. Totals running across the
+// tiles to the left are kept per pixel row, across the tiles above per pixel
+// column, and across the tiles above and to the left per tile. A rectangle's
+// sum is four corners of four lookups each, whatever its size, and drawing
+// only recomputes the tiles drawn on and the totals running through them.
+class SummedArea
+{
+public:
+    static const int tileSize = 64;
+
+    // Channels sums each interleaved channel. Statistics sums luminance, its square
+    // and coverage, the alpha of every pixel that is not white paper.
+    enum Planes
+    {
+        Channels,
+        Statistics
+    };
+    enum StatisticsPlane
+    {
+        Luminance,
+        LuminanceSquared,
+        Coverage
+    };
+
+    // Luminance mean and variance on a 0 to 255 scale, coverage from 0 to 1
+    struct Region
+    {
+        qint64 pixels = 0;
+        double mean = 0, variance = 0, coverage = 0;
+    };
+
+    // Returns false for formats without a rasterizer
+    bool build(const QImage &img, Planes planes);
+    // Marks the tiles under area stale, refresh sums them again from img.
+    // A different size or format rebuilds everything.
+    void invalidate(const QRect &area);
+    void refresh(const QImage &img);
+    void clear();
+
+    bool isNull() const { return planeCount == 0; }
+    QSize size() const { return QSize(width, height); }
+    int planes() const { return planeCount; }
+
+    // Queries see the pixels as of the last build or refresh.
+    // The rectangle is clipped to the image.
+    quint64 sum(int plane, const QRect &rect) const;
+    double mean(int plane, const QRect &rect) const;
+    // Of a Statistics table
+    Region region(const QRect &rect) const;
+
+private:
+    PixelFormat::Layout layout = {};
+    QImage::Format source = QImage::Format_Invalid;
+    Planes kind = Channels;
+    int planeCount = 0;
+    int width = 0, height = 0;
+    int tilesX = 0, tilesY = 0;
+
+    // Per plane: local[y][x] within its tile, rowTotals[y][tile_x] and
+    // columnTotals[tile_y][x] of the whole tiles before it, grid[tile_y][tile_x].
+    // The sums within a tile are 32-bit for 8-bit formats, wideLocal for 16-bit ones.
+    std::vector<quint32> local;
+    std::vector<quint64> wideLocal, rowTotals, columnTotals, grid;
+    std::vector<char> stale;
+    bool anyStale = false;
+
+    // Sum over [0, x] x [0, y], 0 left of or above the image
+    quint64 corner(int plane, int x, int y) const;
+    quint64 localSum(int plane, int x, int y) const
+    {
+        const size_t i = ((size_t)plane * height + y) * width + x;
+        return layout.wide ? wideLocal[i] : local[i];
+    }
+
+    template <class T, class Sum>
+    void sumTile(const uchar *bits, qsizetype stride, int tile, quint64 *values, Sum *sums);
+};
@@ -0,0 +1,92 @@
+#include "Triangulation.h"
+
+#include <vector>
+
+namespace
+{
+    // > 0 when o, a, b turn counterclockwise in y-up coordinates
+    qint64 cross(QPoint o, QPoint a, QPoint b)
+    {
+        return (qint64)(a.x() - o.x()) * (b.y() - o.y()) - (qint64)(a.y() - o.y()) * (b.x() - o.x());
+    }
+}
+
+QVector<int> Triangulation::triangulate(const QVector<QPoint> &polygon)
+{
+    QVector<int> triangles;
+    std::vector<int> links;
+    triangulate(polygon, triangles, links);
+    return triangles;
+}
+
+void Triangulation::triangulate(const QVector<QPoint> &polygon, QVector<int> &triangles, std::vector<int> &links)
+{
+    triangles.clear();
+    int n = polygon.size();
+    if (n > 1 && polygon[0] == polygon[n - 1])
+        n--;
+    if (n < 3)
+        return;
+
+    qint64 area = 0;
+    for (int i = 0; i < n; i++)
+        area += cross(QPoint(0, 0), polygon[i], polygon[(i + 1) % n]);
+    if (area == 0)
+        return;
+    const int orientation = area > 0 ? 1 : -1;
+
+    // Remaining vertices as a doubly linked ring
+    links.resize(2 * n);
+    int *prev = links.data(), *next = prev + n;
+    for (int i = 0; i < n; i++)
+    {
+        prev[i] = (i + n - 1) % n;
+        next[i] = (i + 1) % n;
+    }
+    auto turn = [&](int i)
+    { return cross(polygon[prev[i]], polygon[i], polygon[next[i]]) * orientation; };
+
+    // Convex, and no reflex vertex inside or on the triangle. A convex vertex
+    // can only be inside an ear if a reflex one is too.
+    auto isEar = [&](int i)
+    {
+        if (turn(i) <= 0)
+            return false;
+        const QPoint a = polygon[prev[i]], b = polygon[i], c = polygon[next[i]];
+        for (int j = next[next[i]]; j != prev[i]; j = next[j])
+        {
+            const QPoint p = polygon[j];
+            if (p == a || p == b || p == c || turn(j) > 0)
+                continue;
+            if (cross(a, b, p) * orientation >= 0 && cross(b, c, p) * orientation >= 0 && cross(c, a, p) * orientation >= 0)
+                return false;
+        }
+        return true;
+    };
+
+    triangles.reserve(3 * (n - 2));
+    int remaining = n, i = 0, stalled = 0;
+    while (remaining > 3)
+    {
+        // Collinear and repeated vertices go without a triangle. A full turn
+        // without an ear only happens on self-intersecting input, clip anyway.
+        const bool degenerate = turn(i) == 0;
+        if (degenerate || stalled >= remaining || isEar(i))
+        {
+            if (!degenerate)
+                triangles << prev[i] << i << next[i];
+            next[prev[i]] = next[i];
+            prev[next[i]] = prev[i];
+            remaining--;
+            i = prev[i];
+            stalled = 0;
+        }
+        else
+        {
+            i = next[i];
+            stalled++;
+        }
+    }
+    if (turn(i) != 0)
+        triangles << prev[i] << i << next[i];
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <QPoint>
+#include <QVector>
+
+#include <algorithm>
+#include <vector>
+
+// Ear clipping of simple polygons into triangles.
+// Triangles are index triples into the polygon, wound like the polygon.
+// Collinear and repeated vertices are dropped, self-intersecting input still
+// terminates but may cover differently than the even-odd scanline fill.
+namespace Triangulation
+{
+    // Closed polygons (last point == first point) are accepted
+    QVector<int> triangulate(const QVector<QPoint> &polygon);
+    // Same into triangles, reusing its capacity and that of the scratch links
+    void triangulate(const QVector<QPoint> &polygon, QVector<int> &triangles, std::vector<int> &links);
+
+    // Keeps the triangles of the last polygon until its points change
+    class Cache
+    {
+    public:
+        const QVector<int> &triangles(const QVector<QPoint> &polygon)
+        {
+            if (polygon != points)
+            {
+                // Copied, not shared, or the next edit of the polygon would have to detach it
+                points.resize(polygon.size());
+                std::copy(polygon.cbegin(), polygon.cend(), points.begin());
+                triangulate(polygon, indices, links);
+            }
+            return indices;
+        }
+
+    private:
+        QVector<QPoint> points;
+        QVector<int> indices;
+        std::vector<int> links;
+    };
+}
@@ -1,5 +1,19 @@
 #include "ViewerWidget.h"
 
+namespace
+{
+    QRect contourBounds(const PolygonBoolean::Contours &contours)
+    {
+        QRect bounds;
+        for (const QVector<QPoint> &contour : contours)
+        {
+            for (const QPoint &point : contour)
+                bounds |= QRect(point, point);
+        }
+        return bounds;
+    }
+}
+
 ViewerWidget::ViewerWidget(QSize imgSize, QWidget *parent)
     : QWidget(parent)
 {
@@ -7,17 +21,16 @@ ViewerWidget::ViewerWidget(QSize imgSize, QWidget *parent)
     setMouseTracking(true);
     if (imgSize != QSize(0, 0))
     {
-        img = new QImage(imgSize, QImage::Format_ARGB32);
-        img->fill(Qt::white);
+        layers.reset(imgSize);
+        bindLayer(0);
         resizeWidget(img->size());
-        setPainter();
-        setDataPtr();
+        resetClipRegion();
     }
 }
 ViewerWidget::~ViewerWidget()
 {
+    flushSession();
     delete painter;
-    delete img;
 }
 void ViewerWidget::resizeWidget(QSize size)
 {
@@ -29,23 +42,53 @@ void ViewerWidget::resizeWidget(QSize size)
 // Image functions
 bool ViewerWidget::setImage(const QImage &inputImg)
 {
-    if (img != nullptr)
-    {
-        delete painter;
-        delete img;
-    }
-    img = new QImage(inputImg);
-    if (!img)
+    // Draw on the loaded pixels directly, converting only formats without a rasterizer
+    QImage::Format format = PixelFormat::drawableFormat(inputImg);
+    QImage background = inputImg.format() == format ? inputImg : inputImg.convertToFormat(format);
+    if (background.isNull())
     {
         return false;
     }
-    resizeWidget(img->size());
-    setPainter();
-    setDataPtr();
-    update();
+    unshareCanvas();
+    delete painter;
+    painter = nullptr;
+    layers.reset(background);
+    bindLayer(0);
+    documentResized();
 
     return true;
 }
+void ViewerWidget::showFrame(QImage frame)
+{
+    if (isEmpty() || frame.size() != layers.size())
+    {
+        setImage(frame);
+        return;
+    }
+    unshareCanvas();
+    if (sessionCanvas.isOpen() && frame.format() == layers.image(0).format())
+    {
+        // Into the mapped pixels, the session holds the frame on screen
+        QImage &background = layers.image(0);
+        const qsizetype bytes = std::min(frame.bytesPerLine(), background.bytesPerLine());
+        for (int y = 0; y < frame.height(); y++)
+            memcpy(background.scanLine(y), frame.constScanLine(y), bytes);
+        layers.changed(0, background.rect());
+        if (activeLayer == 0)
+            regionTable.invalidate(background.rect());
+        sessionDirty = background.rect();
+        update();
+        return;
+    }
+    delete painter;
+    painter = nullptr;
+    layers.setImage(0, frame);
+    // The layer holds the only reference then, so binding it does not copy the pixels
+    frame = QImage();
+    bindLayer(activeLayer);
+    moveSession();
+    update();
+}
 bool ViewerWidget::isEmpty()
 {
     if (img == nullptr)
@@ -60,57 +103,312 @@ bool ViewerWidget::isEmpty()
     return false;
 }
 
-bool ViewerWidget::isPolygonInside(QVector<QPoint> polygon)
+bool ViewerWidget::changeSize(int width, int height, ImageTransform::Filter filter)
 {
-    for (int i = 0; i < polygon.size(); i++)
+    QSize newSize(width, height);
+
+    if (newSize.isEmpty())
     {
-        if (isInside(polygon[i]))
-        {
-            return true;
-        }
+        return false;
     }
-    return false;
+    if (!isEmpty() && !layers.isBlank())
+    {
+        return mapLayers([&](const QImage &image)
+                         { return ImageTransform::resized(image, newSize, filter); });
+    }
+
+    // Nothing drawn yet, so there are no pixels to resample
+    unshareCanvas();
+    delete painter;
+    painter = nullptr;
+    const bool kept = !isEmpty() && layers.resizeBlank(newSize);
+    if (!kept)
+        layers.reset(newSize);
+    bindLayer(kept ? activeLayer : 0);
+    documentResized();
+    return true;
+}
+bool ViewerWidget::transformImage(const QTransform &transform, ImageTransform::Filter filter)
+{
+    if (isEmpty())
+    {
+        return false;
+    }
+    return mapLayers([&](const QImage &image)
+                     { return ImageTransform::transformed(image, transform, filter); });
+}
+bool ViewerWidget::flipImage(bool horizontal, bool vertical)
+{
+    if (isEmpty())
+    {
+        return false;
+    }
+    return mapLayers([&](const QImage &image)
+                     {
+        QImage flipped = image;
+        return ImageTransform::flip(flipped, horizontal, vertical) ? flipped : QImage(); });
+}
+bool ViewerWidget::mapLayers(const std::function<QImage(const QImage &)> &function)
+{
+    // The painter is bound to the active image, which is about to be replaced
+    unshareCanvas();
+    delete painter;
+    painter = nullptr;
+    const bool mapped = layers.map(function);
+    bindLayer(activeLayer);
+    if (mapped)
+        documentResized();
+    return mapped;
+}
+void ViewerWidget::documentResized()
+{
+    overlayDirty = QRect();
+    moveSession();
+    resizeWidget(img->size());
+    resetClipRegion();
+    update();
 }
 
-bool ViewerWidget::changeSize(int width, int height)
+// Layers
+void ViewerWidget::bindLayer(int index)
 {
-    QSize newSize(width, height);
+    delete painter;
+    activeLayer = index;
+    img = &layers.image(index);
+    canvas = img;
+    regionTable.clear();
+    setPainter();
+    setDataPtr();
+}
+void ViewerWidget::setActiveLayer(int index)
+{
+    if (index >= 0 && index < layers.count() && index != activeLayer)
+        bindLayer(index);
+}
+int ViewerWidget::addLayer(const QString &name)
+{
+    delete painter;
+    painter = nullptr;
+    bindLayer(layers.insertLayer(activeLayer, name));
+    return activeLayer;
+}
+void ViewerWidget::removeLayer(int index)
+{
+    if (layers.count() <= 1 || index < 0 || index >= layers.count())
+        return;
+    delete painter;
+    painter = nullptr;
+    layers.removeLayer(index);
+    bindLayer(std::min(activeLayer > index ? activeLayer - 1 : activeLayer, layers.count() - 1));
+    // Without the bottom layer the one above it goes into the session
+    moveSession();
+    update();
+}
+void ViewerWidget::setLayerVisible(int index, bool visible)
+{
+    layers.setVisible(index, visible);
+    update();
+}
+void ViewerWidget::setLayerOpacity(int index, double opacity)
+{
+    layers.setOpacity(index, opacity);
+    update();
+}
+void ViewerWidget::setLayerBlend(int index, LayerStack::Blend blend)
+{
+    layers.setBlend(index, blend);
+    update();
+}
+ViewerWidget::ImageWrite::ImageWrite(ViewerWidget *widget)
+    : widget(widget), holding(widget->activeLayer == 0 && !widget->previewing && widget->sharedCanvas.isOpen() && !widget->sharedCanvas.isWriting())
+{
+    if (holding)
+        widget->sharedCanvas.beginWrite();
+}
+ViewerWidget::ImageWrite::~ImageWrite()
+{
+    if (!holding)
+        return;
+    // Nothing drawn puts the sequence back, readers see no new frame
+    widget->sharedCanvas.endWrite(widget->sharedDirty);
+    widget->sharedDirty = false;
+}
+
+void ViewerWidget::imageChanged(const QRect &area)
+{
+    const QRect changed = area.isNull() ? img->rect() : area;
+    layers.changed(activeLayer, changed);
+    regionTable.invalidate(changed);
+    backgroundChanged(changed);
+    update(changed);
+}
 
-    if (newSize != QSize(0, 0))
+// Shared canvas
+bool ViewerWidget::shareCanvas(const QString &key)
+{
+    if (isEmpty())
+        return false;
+    unshareCanvas();
+    closeSession();
+
+    // The segment holds every pixel anyway, the paper goes into it
+    layers.settlePaper(0);
+    const QImage &background = layers.image(0);
+    if (!sharedCanvas.create(key, background.size(), background.format()))
+        return false;
+    QImage shared = sharedCanvas.image();
+    if (!PixelFormat::isSupported(shared.format()))
     {
-        if (img != nullptr)
-        {
-            delete painter;
-            delete img;
-        }
+        sharedCanvas.close();
+        return false;
+    }
 
-        img = new QImage(newSize, QImage::Format_ARGB32);
-        if (!img)
-        {
-            return false;
-        }
-        img->fill(Qt::white);
-        resizeWidget(img->size());
-        setPainter();
-        setDataPtr();
+    delete painter;
+    painter = nullptr;
+    sharedCanvas.beginWrite();
+    if (sharedCanvas.isCreator())
+    {
+        // The one copy, from now on the background is drawn in place
+        const qsizetype bytes = std::min(shared.bytesPerLine(), background.bytesPerLine());
+        for (int y = 0; y < shared.height(); y++)
+            memcpy(shared.scanLine(y), background.constScanLine(y), bytes);
+    }
+    if (layers.setImage(0, shared))
+    {
+        bindLayer(activeLayer);
         update();
     }
+    else
+    {
+        layers.reset(shared);
+        bindLayer(0);
+        documentResized();
+    }
+    sharedCanvas.endWrite(true);
+    sharedDirty = false;
+
+    // Producers signal finished changes, the tiles over the background are recomposed
+    sharedCanvas.watch(this, [this]()
+                       {
+        if (!sharedCanvas.isOpen())
+            return;
+        layers.changed(0, QRect(QPoint(0, 0), layers.size()));
+        if (activeLayer == 0)
+            regionTable.invalidate(QRect(QPoint(0, 0), layers.size()));
+        update(); });
+    return true;
+}
+void ViewerWidget::unshareCanvas()
+{
+    if (!sharedCanvas.isOpen())
+        return;
+    // Back to private pixels before the segment goes away
+    delete painter;
+    painter = nullptr;
+    layers.setImage(0, layers.image(0).copy());
+    bindLayer(activeLayer);
+    sharedCanvas.close();
+    sharedDirty = false;
+}
+
+// Session file
+bool ViewerWidget::openSession(const QString &file_name)
+{
+    unshareCanvas();
+    closeSession();
+    if (!QFile::exists(file_name))
+        return !isEmpty() && mapSession(file_name);
 
+    // Left by an earlier run, its pixels are the document
+    if (!sessionCanvas.open(file_name))
+        return false;
+    QImage session = sessionCanvas.image();
+    if (!PixelFormat::isSupported(session.format()))
+    {
+        sessionCanvas.close();
+        return false;
+    }
+    delete painter;
+    painter = nullptr;
+    if (layers.setImage(0, session))
+    {
+        bindLayer(activeLayer);
+        update();
+    }
+    else
+    {
+        layers.reset(session);
+        bindLayer(0);
+        documentResized();
+    }
     return true;
 }
+bool ViewerWidget::mapSession(const QString &file_name)
+{
+    layers.settlePaper(0);
+    const QImage &background = layers.image(0);
+    if (!sessionCanvas.create(file_name, background.size(), background.format()))
+        return false;
+    QImage session = sessionCanvas.image();
 
-void ViewerWidget::setPixel(int x, int y, uchar r, uchar g, uchar b, uchar a)
+    // The one copy, from now on the background is drawn in place
+    const qsizetype bytes = std::min(session.bytesPerLine(), background.bytesPerLine());
+    for (int y = 0; y < session.height(); y++)
+        memcpy(session.scanLine(y), background.constScanLine(y), bytes);
+    delete painter;
+    painter = nullptr;
+    layers.setImage(0, session);
+    bindLayer(activeLayer);
+    sessionDirty = session.rect();
+    update();
+    return true;
+}
+void ViewerWidget::moveSession()
+{
+    // Still drawn in place when the background was not replaced
+    if (!sessionCanvas.isOpen() || layers.image(0).constBits() == sessionCanvas.pixels())
+        return;
+    // Resized into a new file that replaces the old one once complete, so a full
+    // disk never destroys the last good session
+    const QString file_name = sessionCanvas.fileName();
+    sessionCanvas.close();
+    sessionDirty = QRect();
+    layers.settlePaper(0);
+    if (!sessionCanvas.replace(file_name, layers.image(0)))
+    {
+        emit sessionLost(sessionCanvas.errorString());
+        return;
+    }
+    delete painter;
+    painter = nullptr;
+    layers.setImage(0, sessionCanvas.image());
+    bindLayer(activeLayer);
+    update();
+}
+void ViewerWidget::flushSession()
+{
+    if (sessionDirty.isEmpty())
+        return;
+    sessionCanvas.markDirty(sessionDirty.top(), sessionDirty.bottom());
+    sessionDirty = QRect();
+}
+void ViewerWidget::closeSession()
 {
-    r = r > 255 ? 255 : (r < 0 ? 0 : r);
-    g = g > 255 ? 255 : (g < 0 ? 0 : g);
-    b = b > 255 ? 255 : (b < 0 ? 0 : b);
-    a = a > 255 ? 255 : (a < 0 ? 0 : a);
+    if (!sessionCanvas.isOpen())
+        return;
+    // Back to private pixels before the file is unmapped
+    flushSession();
+    delete painter;
+    painter = nullptr;
+    if (layers.image(0).constBits() == sessionCanvas.pixels())
+        layers.setImage(0, layers.image(0).copy());
+    bindLayer(activeLayer);
+    sessionCanvas.close();
+}
 
-    size_t startbyte = y * img->bytesPerLine() + x * 4;
-    data[startbyte] = b;
-    data[startbyte + 1] = g;
-    data[startbyte + 2] = r;
-    data[startbyte + 3] = a;
+void ViewerWidget::setPixel(int x, int y, uchar r, uchar g, uchar b, uchar a)
+{
+    setPixel(x, y, QColor(r, g, b, a));
 }
 void ViewerWidget::setPixel(int x, int y, double valR, double valG, double valB, double valA)
 {
@@ -119,35 +417,133 @@ void ViewerWidget::setPixel(int x, int y, double valR, double valG, double valB,
     valB = valB > 1 ? 1 : (valB < 0 ? 0 : valB);
     valA = valA > 1 ? 1 : (valA < 0 ? 0 : valA);
 
-    size_t startbyte = y * img->bytesPerLine() + x * 4;
-    data[startbyte] = static_cast<uchar>(255 * valB);
-    data[startbyte + 1] = static_cast<uchar>(255 * valG);
-    data[startbyte + 2] = static_cast<uchar>(255 * valR);
-    data[startbyte + 3] = static_cast<uchar>(255 * valA);
+    setPixel(x, y, QColor(255 * valR, 255 * valG, 255 * valB, 255 * valA));
 }
 void ViewerWidget::setPixel(int x, int y, const QColor &color)
 {
+    ImageWrite write(this);
     if (color.isValid())
     {
-        size_t startbyte = y * img->bytesPerLine() + x * 4;
-
-        data[startbyte] = color.blue();
-        data[startbyte + 1] = color.green();
-        data[startbyte + 2] = color.red();
-        data[startbyte + 3] = color.alpha();
+        PixelFormat::dispatch(canvas->format(), [&](auto format)
+                              { PixelFormat::Writer<decltype(format)>(*canvas, color).plot(x, y); });
+        touch(QRect(x, y, 1, 1));
     }
 }
+void ViewerWidget::setPixels(const QPoint *points, int count, const QColor &color)
+{
+    ImageWrite write(this);
+    if (!color.isValid())
+        return;
+
+    QRect painted;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          {
+        PixelFormat::Writer<decltype(format)> writer(*canvas, color);
+        for (int i = 0; i < count; i++)
+        {
+            if (!clipper.isInside(points[i]))
+                continue;
+            writer.plot(points[i]);
+            painted |= QRect(points[i], points[i]);
+        } });
+    touch(painted);
+}
+void ViewerWidget::drawSpan(int y, int x_start, int x_end, QColor color)
+{
+    ImageWrite write(this);
+    if (x_start > x_end)
+        std::swap(x_start, x_end);
+    if (!clipper.clipSpan(y, x_start, x_end))
+        return;
+
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          { PixelFormat::Writer<decltype(format)>(*canvas, color).span(y, x_start, x_end); });
+    touch(QRect(x_start, y, x_end - x_start, 1));
+}
+
+FloodFill::Stats ViewerWidget::floodFill(QPoint seed, QColor color, int tolerance, bool eight_connected)
+{
+    ImageWrite write(this);
+    FloodFill::Stats stats;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          { stats = FloodFill::fill(PixelFormat::Writer<decltype(format)>(*canvas, color), clipper, seed, tolerance, eight_connected); });
+    touch(stats.bounds);
+    return stats;
+}
 
 //// DRAWING ////
 
 void ViewerWidget::drawAll(QColor color, unsigned int algType)
 {
+    ImageWrite write(this);
+    frameArena.reset();
+    const qint64 allocations = FrameArena::heapAllocations();
+    frameStats.paintedPixels = frameStats.culledPixels = 0;
+    frameStats.culledObjects = 0;
+    coverOcclusion();
+    frameStats.occludedTiles = occlusion.tileCount();
+
+    // Objects still being drawn live in the overlay until they are finished
+    cullDepth = PolylineDepth;
+    drawPolylines(color, algType);
+    cullDepth = ShapeDepth;
+    if (!shapeContours.isEmpty() && occlusion.hides(contourBounds(shapeContours), ShapeDepth))
+        frameStats.culledObjects++;
+    else
+        drawShape(color, algType);
+    cullDepth = LineDepth;
     drawLine(color, algType);
-    drawPolygon(color, algType);
+    cullDepth = PolygonDepth;
+    if (!drawPolygonActivated)
+        drawPolygon(color, algType);
+    cullDepth = TopDepth;
     drawCircle(color);
-    drawHermit(color);
-    drawBezier(color);
-    drawCoons(color);
+    if (!drawHermitActivated)
+        drawHermit(color);
+    if (!drawBezierActivated)
+        drawBezier(color);
+    if (!drawCoonsActivated)
+        drawCoons(color);
+    drawLabels();
+
+    frameStats.allocations = allocations < 0 ? -1 : FrameArena::heapAllocations() - allocations;
+    frameStats.arenaBlocks = frameArena.blocksAdded();
+    frameStats.scratchBytes = frameArena.peak();
+}
+void ViewerWidget::coverOcclusion()
+{
+    // Same spans as the fills, clipped the same way
+    const bool polygon_filled = !drawPolygonActivated && polygonPoints.size() > 2 && isPolygonInside(polygonPoints);
+    if (!polygon_filled && shapeContours.isEmpty())
+    {
+        occlusion.clear();
+        return;
+    }
+    occlusion.reset(clipper.bounds());
+    auto cover = [this](int depth)
+    {
+        return [this, depth](int y, int x_start, int x_end)
+        {
+            if (x_start > x_end)
+                std::swap(x_start, x_end);
+            if (clipper.clipSpan(y, x_start, x_end))
+                occlusion.cover(y, x_start, x_end, depth);
+        };
+    };
+
+    if (polygon_filled && halfSpaceFill)
+    {
+        const QVector<int> &triangles = polygonTriangulation.triangles(polygonPoints);
+        for (int i = 0; i + 2 < triangles.size(); i += 3)
+            HalfSpace::triangle(polygonPoints[triangles[i]], polygonPoints[triangles[i + 1]], polygonPoints[triangles[i + 2]], clipper.bounds(), cover(PolygonDepth));
+    }
+    else if (polygon_filled)
+    {
+        scanPolygon(polygonResolution.contours(clipPolygon(polygonPoints)), cover(PolygonDepth));
+    }
+    // A shape hidden whole adds nothing the polygon does not cover already
+    if (!shapeContours.isEmpty() && !occlusion.hides(contourBounds(shapeContours), ShapeDepth))
+        scanPolygon(shapeContours, cover(ShapeDepth));
 }
 
 // Draw Line functions
@@ -162,20 +558,24 @@ void ViewerWidget::drawLine(QColor color, int algType)
 }
 void ViewerWidget::drawLine(QPoint start, QPoint end, QColor color, int algType)
 {
+    ImageWrite write(this);
     if (start == end)
     {
         return;
     }
-    if (!isInside(start) && !isInside(end))
+    if (!clipper.clipLine(start, end))
     {
         return;
     }
-    if (!isInside(start) || !isInside(end))
+    const QRect box = QRect(start, end).normalized();
+    const int length = std::max(box.width(), box.height());
+    if (occlusion.hides(box, cullDepth))
     {
-        QPoint tmp_start = start;
-        QPoint tmp_end = end;
-        clipLine(tmp_start, tmp_end, start, end);
+        frameStats.culledPixels += length;
+        frameStats.culledObjects++;
+        return;
     }
+    frameStats.paintedPixels += length;
     if (algType == 0)
     {
         DDA(start, end, color);
@@ -185,10 +585,246 @@ void ViewerWidget::drawLine(QPoint start, QPoint end, QColor color, int algType)
         Bresenhamm(start, end, color);
     }
 
-    update();
+    touch(QRect(start, end).normalized());
+}
+
+int ViewerWidget::drawLines(const SegmentBatch &batch, QColor color, int algType)
+{
+    ImageWrite write(this);
+    // Classified a chunk at a time, so the scratch stays small for any batch
+    const int chunk = 1024;
+    FrameArena::Scope scope(frameArena);
+    unsigned char *start_codes = frameArena.allocate<unsigned char>(chunk);
+    unsigned char *end_codes = frameArena.allocate<unsigned char>(chunk);
+
+    int drawn = 0;
+    QRect painted;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          {
+        PixelFormat::Writer<decltype(format)> writer(*canvas, color);
+        QRgb current = color.rgba();
+        for (int first = 0; first < batch.count; first += chunk)
+        {
+            const int n = std::min(chunk, batch.count - first);
+            clipper.outcodes(batch.x0 + first, batch.y0 + first, n, start_codes);
+            clipper.outcodes(batch.x1 + first, batch.y1 + first, n, end_codes);
+            for (int i = 0; i < n; i++)
+            {
+                // Both ends beyond the same edge
+                if (start_codes[i] & end_codes[i])
+                    continue;
+                const int k = first + i;
+                QPoint start(batch.x0[k], batch.y0[k]), end(batch.x1[k], batch.y1[k]);
+                if (start == end)
+                    continue;
+                // Segments inside a rectangular region are drawn as they are
+                if (((start_codes[i] | end_codes[i]) != Clipper::Inside || !clipper.isRectangular()) && !clipper.clipLine(start, end))
+                    continue;
+
+                // Segments under filled objects in front are left out
+                const QRect box = QRect(start, end).normalized();
+                const int length = std::max(box.width(), box.height());
+                if (occlusion.hides(box, cullDepth))
+                {
+                    frameStats.culledPixels += length;
+                    frameStats.culledObjects++;
+                    continue;
+                }
+
+                if (batch.colors && batch.colors[k] != current)
+                {
+                    current = batch.colors[k];
+                    writer.setColor(QColor::fromRgba(current));
+                }
+                if (algType == 0)
+                    DDA(start, end, writer);
+                else
+                    Bresenhamm(start, end, writer);
+                painted |= box;
+                frameStats.paintedPixels += length;
+                drawn++;
+            }
+        } });
+    touch(painted);
+    return drawn;
+}
+bool ViewerWidget::importPolylines(const QString &file_name, QString &error, const PolylineSet::Progress &progress)
+{
+    PolylineSet imported;
+    if (!imported.load(file_name, error, progress))
+        return false;
+    polylines = std::move(imported);
+    fitPolylines();
+    drawAll();
+    return true;
+}
+void ViewerWidget::fitPolylines()
+{
+    if (polylines.isEmpty())
+        return;
+    // Same scale on both axes, with a margin of 5% around the data
+    const QRect clip = clipper.bounds();
+    const double margin = 0.05 * std::min(clip.width(), clip.height());
+    const QRectF area = QRectF(clip).adjusted(margin, margin, -margin, -margin);
+    const PolylineSet::Bounds &bounds = polylines.bounds();
+    const double scale_x = bounds.width() > 0 ? area.width() / bounds.width() : DBL_MAX;
+    const double scale_y = bounds.height() > 0 ? area.height() / bounds.height() : DBL_MAX;
+    double scale = std::min(scale_x, scale_y);
+    if (scale == DBL_MAX)
+        scale = 1;
+    polylineScale = QPointF(scale, -scale);
+    polylineOffset = area.center() - QPointF((bounds.minX + bounds.maxX) / 2 * scale, -(bounds.minY + bounds.maxY) / 2 * scale);
+}
+void ViewerWidget::drawPolylines(QColor color, int algType)
+{
+    if (polylines.isEmpty())
+        return;
+
+    // Dropped vertices lie within a pixel of what is drawn
+    const double pixels_per_unit = std::max(std::abs(polylineScale.x()), std::abs(polylineScale.y()));
+    polylineLevel = polylines.levelFor(1 / pixels_per_unit);
+    const PolylineSet::Level &level = polylines.level(polylineLevel);
+
+    const QRect clip = clipper.bounds();
+    PolylineSet::Bounds visible;
+    visible.add((clip.left() - polylineOffset.x()) / polylineScale.x(), (clip.top() - polylineOffset.y()) / polylineScale.y());
+    visible.add((clip.right() + 1 - polylineOffset.x()) / polylineScale.x(), (clip.bottom() + 1 - polylineOffset.y()) / polylineScale.y());
+
+    // Segments are handed to drawLines in batches. Ends further than limit off
+    // the image are clipped to it in floating point first, so the integer
+    // coordinates cannot overflow and the visible part keeps its direction.
+    const int capacity = 4096;
+    const double limit = 1 << 20;
+    FrameArena::Scope scope(frameArena);
+    int *x0 = frameArena.allocate<int>(capacity), *y0 = frameArena.allocate<int>(capacity);
+    int *x1 = frameArena.allocate<int>(capacity), *y1 = frameArena.allocate<int>(capacity);
+    SegmentBatch batch;
+    batch.x0 = x0;
+    batch.y0 = y0;
+    batch.x1 = x1;
+    batch.y1 = y1;
+
+    auto addSegment = [&](double ax, double ay, double bx, double by)
+    {
+        if (std::max(std::max(std::abs(ax), std::abs(ay)), std::max(std::abs(bx), std::abs(by))) > limit)
+        {
+            double t0 = 0, t1 = 1;
+            const double p[4] = {ax - bx, bx - ax, ay - by, by - ay};
+            const double q[4] = {ax + limit, limit - ax, ay + limit, limit - ay};
+            for (int i = 0; i < 4; i++)
+            {
+                if (p[i] == 0)
+                {
+                    if (q[i] < 0)
+                        return;
+                    continue;
+                }
+                const double t = q[i] / p[i];
+                if (p[i] < 0)
+                    t0 = std::max(t0, t);
+                else
+                    t1 = std::min(t1, t);
+            }
+            if (t0 > t1)
+                return;
+            const double dx = bx - ax, dy = by - ay;
+            bx = ax + t1 * dx;
+            by = ay + t1 * dy;
+            ax += t0 * dx;
+            ay += t0 * dy;
+        }
+        x0[batch.count] = std::lround(ax);
+        y0[batch.count] = std::lround(ay);
+        x1[batch.count] = std::lround(bx);
+        y1[batch.count] = std::lround(by);
+        if (++batch.count == capacity)
+        {
+            drawLines(batch, color, algType);
+            batch.count = 0;
+        }
+    };
+
+    const qint64 count = polylines.pathSize();
+    for (size_t chunk = 0; chunk < level.chunks.size(); chunk++)
+    {
+        if (level.chunks[chunk].isEmpty() || !level.chunks[chunk].intersects(visible))
+            continue;
+        const qint64 first = (qint64)chunk * PolylineSet::chunkSize;
+        const qint64 end = std::min(first + PolylineSet::chunkSize, count);
+        // Vertices falling on the pixel of the one before add nothing. The run
+        // ends with the first kept vertex past it, where its last segment ends.
+        double px = 0, py = 0;
+        bool started = false;
+        for (qint64 i = polylines.nextVertex(level, first); i < count; i = polylines.nextVertex(level, i + 1))
+        {
+            if (std::isnan(polylines.x(i)))
+            {
+                started = false;
+            }
+            else
+            {
+                const double x = polylines.x(i) * polylineScale.x() + polylineOffset.x();
+                const double y = polylines.y(i) * polylineScale.y() + polylineOffset.y();
+                if (!started || std::floor(x + 0.5) != std::floor(px + 0.5) || std::floor(y + 0.5) != std::floor(py + 0.5))
+                {
+                    if (started)
+                        addSegment(px, py, x, y);
+                    px = x;
+                    py = y;
+                    started = true;
+                }
+            }
+            if (i >= end)
+                break;
+        }
+    }
+    if (batch.count > 0)
+        drawLines(batch, color, algType);
+}
+int ViewerWidget::drawPoints(const PointBatch &batch, QColor color)
+{
+    ImageWrite write(this);
+    const int chunk = 1024;
+    FrameArena::Scope scope(frameArena);
+    unsigned char *codes = frameArena.allocate<unsigned char>(chunk);
+
+    int drawn = 0;
+    QRect painted;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          {
+        PixelFormat::Writer<decltype(format)> writer(*canvas, color);
+        QRgb current = color.rgba();
+        for (int first = 0; first < batch.count; first += chunk)
+        {
+            const int n = std::min(chunk, batch.count - first);
+            clipper.outcodes(batch.x + first, batch.y + first, n, codes);
+            for (int i = 0; i < n; i++)
+            {
+                const int k = first + i;
+                if (codes[i] != Clipper::Inside || (!clipper.isRectangular() && !clipper.isInside(batch.x[k], batch.y[k])))
+                    continue;
+
+                if (batch.colors && batch.colors[k] != current)
+                {
+                    current = batch.colors[k];
+                    writer.setColor(QColor::fromRgba(current));
+                }
+                writer.plot(batch.x[k], batch.y[k]);
+                painted |= QRect(batch.x[k], batch.y[k], 1, 1);
+                drawn++;
+            }
+        } });
+    touch(painted);
+    return drawn;
 }
 
 void ViewerWidget::DDA(QPoint start, QPoint end, QColor color)
+{
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          { DDA(start, end, PixelFormat::Writer<decltype(format)>(*canvas, color)); });
+}
+template <class Format>
+void ViewerWidget::DDA(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer)
 {
     int d_x = end.x() - start.x();
     int d_y = end.y() - start.y();
@@ -203,29 +839,30 @@ void ViewerWidget::DDA(QPoint start, QPoint end, QColor color)
     {
         if (start.x() < end.x())
         {
-            DDA_x(start, end, color, m);
+            DDA_x(start, end, writer, m);
         }
         else
         {
-            DDA_x(end, start, color, m);
+            DDA_x(end, start, writer, m);
         }
     }
     else
     {
         if (start.y() < end.y())
         {
-            DDA_y(start, end, color, 1 / m);
+            DDA_y(start, end, writer, 1 / m);
         }
         else
         {
-            DDA_y(end, start, color, 1 / m);
+            DDA_y(end, start, writer, 1 / m);
         }
     }
 }
-void ViewerWidget::DDA_x(QPoint start, QPoint end, QColor color, double m)
+template <class Format>
+void ViewerWidget::DDA_x(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double m)
 {
 
-    setPixel(start.x(), start.y(), color);
+    writer.plot(start.x(), start.y());
 
     int x;
     double y = start.y();
@@ -234,13 +871,14 @@ void ViewerWidget::DDA_x(QPoint start, QPoint end, QColor color, double m)
     {
         y += m;
 
-        setPixel(x, (int)(y + 0.5), color);
+        writer.plot(x, (int)(y + 0.5));
     }
 }
-void ViewerWidget::DDA_y(QPoint start, QPoint end, QColor color, double w)
+template <class Format>
+void ViewerWidget::DDA_y(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double w)
 {
 
-    setPixel(start.x(), start.y(), color);
+    writer.plot(start.x(), start.y());
 
     int y;
     double x = start.x();
@@ -248,11 +886,17 @@ void ViewerWidget::DDA_y(QPoint start, QPoint end, QColor color, double w)
     for (y = start.y(); y < end.y(); y++)
     {
         x += w;
-        setPixel((int)(x + 0.5), y, color);
+        writer.plot((int)(x + 0.5), y);
     }
 }
 
 void ViewerWidget::Bresenhamm(QPoint start, QPoint end, QColor color)
+{
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          { Bresenhamm(start, end, PixelFormat::Writer<decltype(format)>(*canvas, color)); });
+}
+template <class Format>
+void ViewerWidget::Bresenhamm(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer)
 {
     int d_x = end.x() - start.x();
     int d_y = end.y() - start.y();
@@ -267,26 +911,27 @@ void ViewerWidget::Bresenhamm(QPoint start, QPoint end, QColor color)
     {
         if (start.x() < end.x())
         {
-            Bresenhamm_x(start, end, color, m);
+            Bresenhamm_x(start, end, writer, m);
         }
         else
         {
-            Bresenhamm_x(end, start, color, m);
+            Bresenhamm_x(end, start, writer, m);
         }
     }
     else
     {
         if (start.y() < end.y())
         {
-            Bresenhamm_y(start, end, color, m);
+            Bresenhamm_y(start, end, writer, m);
         }
         else
         {
-            Bresenhamm_y(end, start, color, m);
+            Bresenhamm_y(end, start, writer, m);
         }
     }
 }
-void ViewerWidget::Bresenhamm_x(QPoint start, QPoint end, QColor color, double m)
+template <class Format>
+void ViewerWidget::Bresenhamm_x(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double m)
 {
     if (m > 0)
     {
@@ -297,7 +942,7 @@ void ViewerWidget::Bresenhamm_x(QPoint start, QPoint end, QColor color, double m
         int x = start.x();
         int y = start.y();
 
-        setPixel(x, y, color);
+        writer.plot(x, y);
 
         for (; x < end.x(); x++)
         {
@@ -310,7 +955,7 @@ void ViewerWidget::Bresenhamm_x(QPoint start, QPoint end, QColor color, double m
             {
                 p += k1;
             }
-            setPixel(x, y, color);
+            writer.plot(x, y);
         }
     }
     else
@@ -322,7 +967,7 @@ void ViewerWidget::Bresenhamm_x(QPoint start, QPoint end, QColor color, double m
         int x = start.x();
         int y = start.y();
 
-        setPixel(x, y, color);
+        writer.plot(x, y);
 
         for (; x < end.x(); x++)
         {
@@ -335,11 +980,12 @@ void ViewerWidget::Bresenhamm_x(QPoint start, QPoint end, QColor color, double m
             {
                 p += k1;
             }
-            setPixel(x, y, color);
+            writer.plot(x, y);
         }
     }
 }
-void ViewerWidget::Bresenhamm_y(QPoint start, QPoint end, QColor color, double m)
+template <class Format>
+void ViewerWidget::Bresenhamm_y(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double m)
 {
     if (m > 0)
     {
@@ -350,7 +996,7 @@ void ViewerWidget::Bresenhamm_y(QPoint start, QPoint end, QColor color, double m
         int x = start.x();
         int y = start.y();
 
-        setPixel(x, y, color);
+        writer.plot(x, y);
 
         for (; y < end.y(); y++)
         {
@@ -363,7 +1009,7 @@ void ViewerWidget::Bresenhamm_y(QPoint start, QPoint end, QColor color, double m
             {
                 p += k1;
             }
-            setPixel(x, y, color);
+            writer.plot(x, y);
         }
     }
     else
@@ -375,7 +1021,7 @@ void ViewerWidget::Bresenhamm_y(QPoint start, QPoint end, QColor color, double m
         int x = start.x();
         int y = start.y();
 
-        setPixel(x, y, color);
+        writer.plot(x, y);
 
         for (; y < end.y(); y++)
         {
@@ -388,7 +1034,7 @@ void ViewerWidget::Bresenhamm_y(QPoint start, QPoint end, QColor color, double m
             {
                 p += k1;
             }
-            setPixel(x, y, color);
+            writer.plot(x, y);
         }
     }
 }
@@ -398,9 +1044,10 @@ void ViewerWidget::startPolygonDraw(QColor color, int algType)
 {
     globalColor = color;
     rastAlg = algType;
-    clear();
     setDrawPolygonActivated(true);
     polygonPoints.clear();
+    clear();
+    drawAll();
 }
 void ViewerWidget::endPolygonDraw()
 {
@@ -419,7 +1066,7 @@ void ViewerWidget::endPolygonDraw()
 void ViewerWidget::addPolygonPoint(QPoint point)
 {
     polygonPoints.push_back(point);
-    drawPolygon(globalColor, rastAlg);
+    updatePreview();
 }
 void ViewerWidget::drawPolygon(QColor color, int algType)
 {
@@ -431,42 +1078,301 @@ void ViewerWidget::drawPolygon(QColor color, int algType)
 
     if (polygonPoints.size() == 2)
     {
-        QPoint start = polygonPoints[0], end = polygonPoints[1];
-        clipLine(polygonPoints[0], polygonPoints[1], start, end);
-        drawLine(start, end, color, algType);
+        drawLine(polygonPoints[0], polygonPoints[1], color, algType);
         return;
     }
-    QVector<QPoint> clippedPolygon;
-
-    if (!drawPolygonActivated)
-    {
-        clippedPolygon = clipPolygon(polygonPoints);
-    }
-    else
-    {
-        clippedPolygon = polygonPoints;
-    }
+    const QVector<QPoint> &clippedPolygon = drawPolygonActivated ? polygonPoints : clipPolygon(polygonPoints);
     if (clippedPolygon.size() < 1)
         return;
 
-    if (!drawPolygonActivated)
+    if (!drawPolygonActivated && halfSpaceFill)
     {
-        fillPolygon(clippedPolygon, color);
+        FrameArena::Scope scope(frameArena);
+        // Triangulated unclipped, so the cache survives changes of the clip region
+        const QVector<int> &triangles = polygonTriangulation.triangles(polygonPoints);
+        if (fillType == PaintSource::Gouraud)
+            fillTriangles(polygonPoints, triangles, vertexColors(polygonPoints, color));
+        else
+            fillTriangles(polygonPoints, triangles, polygonFill(polygonPoints, color));
+    }
+    else if (!drawPolygonActivated)
+    {
+        fillPolygon(clippedPolygon, polygonFill(polygonPoints, color));
     }
     for (int i = 0; i < clippedPolygon.size() - 1; i++)
     {
         drawLine(clippedPolygon[i], clippedPolygon[i + 1], color, algType);
     }
 }
-void ViewerWidget::fillPolygon(QVector<QPoint> points, QColor color)
+void ViewerWidget::setFillStyle(PaintSource::Type type, QColor end_color, const QImage &texture)
+{
+    fillType = type;
+    fillEndColor = end_color;
+    // Kept in the canvas format, so texturing copies pixels without converting them
+    fillTexture = texture.isNull() || isEmpty() ? texture : texture.convertToFormat(img->format());
+}
+PaintSource ViewerWidget::polygonFill(const QPoint *polygon, int count, QColor color)
+{
+    QRect bounds;
+    for (int i = 0; i < count; i++)
+        bounds |= QRect(polygon[i], polygon[i]);
+    QPointF center = QRectF(bounds).center();
+    // Edited in place, the stops keep their storage from frame to frame
+    QGradientStops &stops = fillStops;
+    stops[0].second = color;
+    stops[1].second = fillEndColor;
+
+    switch (fillType)
+    {
+    case PaintSource::LinearGradient:
+        return PaintSource::linear(bounds.topLeft(), bounds.bottomRight(), stops);
+    case PaintSource::RadialGradient:
+        return PaintSource::radial(center, std::max(bounds.width(), bounds.height()) / 2., stops);
+    case PaintSource::ConicGradient:
+        return PaintSource::conic(center, 0, stops);
+    case PaintSource::Texture:
+    {
+        if (fillTexture.isNull())
+            break;
+        FrameArena::Scope scope(frameArena);
+        QPointF *uvs = frameArena.allocate<QPointF>(count);
+        for (int i = 0; i < count; i++)
+        {
+            uvs[i] = QPointF((double)(polygon[i].x() - bounds.left()) / std::max(bounds.width() - 1, 1),
+                             (double)(polygon[i].y() - bounds.top()) / std::max(bounds.height() - 1, 1));
+        }
+        return PaintSource::texture(fillTexture, polygon, uvs, count);
+    }
+    case PaintSource::Gouraud:
+    {
+        FrameArena::Scope scope(frameArena);
+        return PaintSource::gouraud(polygon, vertexColors(polygon, count, color), count);
+    }
+    default:
+        break;
+    }
+    return PaintSource(color);
+}
+
+const QColor *ViewerWidget::vertexColors(const QPoint *polygon, int count, QColor color)
+{
+    // Ramped from color to the end color around the outline, a closing point repeats the first
+    int n = count;
+    if (n > 1 && polygon[0] == polygon[n - 1])
+        n--;
+
+    QColor *colors = frameArena.allocate<QColor>(count);
+    std::fill(colors, colors + count, color);
+    for (int i = 1; i < n; i++)
+    {
+        const double t = (double)i / (n - 1);
+        auto mix = [t](int from, int to)
+        { return (int)(from + (to - from) * t + 0.5); };
+        colors[i] = QColor(mix(color.red(), fillEndColor.red()), mix(color.green(), fillEndColor.green()),
+                           mix(color.blue(), fillEndColor.blue()), mix(color.alpha(), fillEndColor.alpha()));
+    }
+    return colors;
+}
+
+template <class Scan>
+void ViewerWidget::paintSpans(const PaintSource &source, Scan &&scan)
+{
+    ImageWrite write(this);
+    QRect painted;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          {
+        PaintSource::Painter<decltype(format)> painter(*canvas, source);
+        scan([&](int y, int x_start, int x_end)
+             {
+            if (x_start > x_end)
+                std::swap(x_start, x_end);
+            if (clipper.clipSpan(y, x_start, x_end))
+            {
+                // Tiles painted over by filled objects in front are skipped
+                const int visible = occlusion.visibleSpans(y, x_start, x_end, cullDepth, [&](int from, int to)
+                                                           { painter.span(y, from, to); });
+                frameStats.paintedPixels += visible;
+                frameStats.culledPixels += x_end - x_start - visible;
+                painted |= QRect(x_start, y, x_end - x_start, 1);
+            } }); });
+    touch(painted);
+}
+void ViewerWidget::fillPolygon(const QVector<QPoint> &points, const PaintSource &source)
+{
+    paintSpans(source, [&](const SpanFunction &span)
+               { scanPolygon(polygonResolution.contours(points), span); });
+}
+void ViewerWidget::fillTriangle(const QVector<QPoint> &points, const PaintSource &source)
+{
+    if (points.size() != 4)
+        throw std::runtime_error("fillTriangle called with points.size() != 4");
+
+    paintSpans(source, [&](const SpanFunction &span)
+               { scanTriangle(points[0], points[1], points[2], span); });
+}
+void ViewerWidget::fillTriangles(const QVector<QPoint> &points, const QVector<int> &triangles, const PaintSource &source)
+{
+    ImageWrite write(this);
+    QRect painted;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          {
+        PaintSource::Painter<decltype(format)> painter(*canvas, source);
+        for (int i = 0; i + 2 < triangles.size(); i += 3)
+        {
+            HalfSpace::triangle(points[triangles[i]], points[triangles[i + 1]], points[triangles[i + 2]], clipper.bounds(), [&](int y, int x_start, int x_end)
+                                {
+                if (clipper.clipSpan(y, x_start, x_end))
+                {
+                    painter.span(y, x_start, x_end);
+                    painted |= QRect(x_start, y, x_end - x_start, 1);
+                    frameStats.paintedPixels += x_end - x_start;
+                } });
+        } });
+    touch(painted);
+}
+void ViewerWidget::fillTriangles(const QVector<QPoint> &points, const QVector<int> &triangles, const QColor *colors)
+{
+    ImageWrite write(this);
+    QRect painted;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          {
+        for (int i = 0; i + 2 < triangles.size(); i += 3)
+        {
+            const QPoint a = points[triangles[i]], b = points[triangles[i + 1]], c = points[triangles[i + 2]];
+            const QPoint corners[3] = {a, b, c};
+            const QColor shades[3] = {colors[triangles[i]], colors[triangles[i + 1]], colors[triangles[i + 2]]};
+            const PaintSource shade = PaintSource::gouraud(corners, shades, 3);
+            PaintSource::Painter<decltype(format)> painter(*canvas, shade);
+            HalfSpace::triangle(a, b, c, clipper.bounds(), [&](int y, int x_start, int x_end)
+                                {
+                if (clipper.clipSpan(y, x_start, x_end))
+                {
+                    painter.span(y, x_start, x_end);
+                    painted |= QRect(x_start, y, x_end - x_start, 1);
+                    frameStats.paintedPixels += x_end - x_start;
+                } });
+        } });
+    touch(painted);
+}
+bool ViewerWidget::combinePolygon(PolygonBoolean::Operation operation)
+{
+    if (drawPolygonActivated || polygonPoints.size() < 4)
+        return false;
+    if (shapeContours.isEmpty())
+        shapeContours = PolygonBoolean::resolve(polygonPoints);
+    else
+        shapeContours = PolygonBoolean::combine(shapeContours, {polygonPoints}, operation);
+    polygonPoints.clear();
+    clear();
+    drawAll();
+    return true;
+}
+void ViewerWidget::drawShape(QColor color, int algType)
+{
+    if (shapeContours.isEmpty())
+        return;
+
+    QRect bounds;
+    int sides = 0;
+    for (const QVector<QPoint> &contour : shapeContours)
+    {
+        for (const QPoint &point : contour)
+            bounds |= QRect(point, point);
+        sides += contour.size() - 1;
+    }
+    // Gradients and textures span the whole shape
+    const QPoint box[] = {bounds.topLeft(), bounds.topRight(), bounds.bottomRight(), bounds.bottomLeft(), bounds.topLeft()};
+    paintSpans(polygonFill(box, 5, color), [&](const SpanFunction &span)
+               { scanPolygon(shapeContours, span); });
+
+    FrameArena::Scope scope(frameArena);
+    int *x0 = frameArena.allocate<int>(sides), *y0 = frameArena.allocate<int>(sides);
+    int *x1 = frameArena.allocate<int>(sides), *y1 = frameArena.allocate<int>(sides);
+    SegmentBatch batch;
+    batch.x0 = x0;
+    batch.y0 = y0;
+    batch.x1 = x1;
+    batch.y1 = y1;
+    for (const QVector<QPoint> &contour : shapeContours)
+    {
+        for (int i = 0; i + 1 < contour.size(); i++)
+        {
+            x0[batch.count] = contour[i].x();
+            y0[batch.count] = contour[i].y();
+            x1[batch.count] = contour[i + 1].x();
+            y1[batch.count] = contour[i + 1].y();
+            batch.count++;
+        }
+    }
+    drawLines(batch, color, algType);
+}
+void ViewerWidget::addLabel(QPoint anchor, const QString &text, QColor color)
+{
+    Label label;
+    label.anchor = anchor;
+    label.color = color;
+    label.text = text;
+    label.run = glyphAtlas.layout(glyphAtlas.face(labelFont), text);
+    if (label.run.glyphs.isEmpty())
+        return;
+    labels.append(label);
+    drawLabels(labels.size() - 1);
+}
+void ViewerWidget::drawLabels(int first)
 {
-    if (points.size() < 4)
+    ImageWrite write(this);
+    if (first >= labels.size())
         return;
-    if (points.size() == 4)
+
+    const QRect clip = clipper.bounds();
+    QRect painted;
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          {
+        PixelFormat::Writer<decltype(format)> writer(*canvas, labels[first].color);
+        for (int i = first; i < labels.size(); i++)
+        {
+            const Label &label = labels[i];
+            if (!clip.intersects(label.run.bounds.translated(label.anchor)))
+                continue;
+            const QImage &atlas = glyphAtlas.coverage(label.run.face);
+            writer.setColor(label.color);
+            for (const GlyphAtlas::Glyph &glyph : label.run.glyphs)
+            {
+                const QRect target(label.anchor + glyph.offset, glyph.source.size());
+                const QRect visible = target & clip;
+                if (visible.isEmpty())
+                    continue;
+                for (int y = visible.top(); y <= visible.bottom(); y++)
+                {
+                    int x_start = target.left(), x_end = target.right() + 1;
+                    if (!clipper.clipSpan(y, x_start, x_end))
+                        continue;
+                    const uchar *coverage = atlas.constScanLine(glyph.source.top() + y - target.top()) + glyph.source.left() + (x_start - target.left());
+                    writer.blend(y, x_start, x_end, coverage);
+                }
+                painted |= visible;
+            }
+        } });
+    touch(painted);
+}
+SummedArea::Region ViewerWidget::regionStatistics(const QRect &rect)
+{
+    if (regionTable.isNull())
+        regionTable.build(*img, SummedArea::Statistics);
+    else
+        regionTable.refresh(*img);
+    return regionTable.region(rect);
+}
+void ViewerWidget::scanPolygon(const PolygonBoolean::Contours &contours, const SpanFunction &span)
+{
+    if (contours.size() == 1 && contours[0].size() == 4)
     {
-        fillTriangle(points, color);
+        scanTriangle(contours[0][0], contours[0][1], contours[0][2], span);
         return;
     }
+    int sides = 0;
+    for (const QVector<QPoint> &points : contours)
+        sides += std::max((int)points.size() - 1, 0);
 
     struct Edge
     {
@@ -477,47 +1383,49 @@ void ViewerWidget::fillPolygon(QVector<QPoint> points, QColor color)
         double w;
     };
 
+    // Edge table and active edges (ZAH) hold at most one entry per side
+    FrameArena::Scope scope(frameArena);
+    ArenaArray<Edge> edges(frameArena, sides);
+
     // Define sides
-    QVector<Edge> edges;
-    for (int i = 0; i < points.size() - 1; i++)
+    for (const QVector<QPoint> &points : contours)
     {
-        QPoint start = points[i], end = points[i + 1];
+        for (int i = 0; i < points.size() - 1; i++)
+        {
+            QPoint start = points[i], end = points[i + 1];
 
-        // Remove horizontal lines
-        if (start.y() == end.y())
-            continue;
+            // Remove horizontal lines
+            if (start.y() == end.y())
+                continue;
 
-        // Orientate the edge
-        if (start.y() > end.y())
-        {
-            QPoint temp = start;
-            start = end;
-            end = temp;
-        }
+            // Orientate the edge
+            if (start.y() > end.y())
+            {
+                QPoint temp = start;
+                start = end;
+                end = temp;
+            }
 
-        double m = (double)(end.y() - start.y()) / (double)(end.x() - start.x());
+            double m = (double)(end.y() - start.y()) / (double)(end.x() - start.x());
 
-        end.setY(end.y() - 1);
+            end.setY(end.y() - 1);
 
-        Edge edge;
-        edge.start = start;
-        edge.end = end;
-        edge.dy = end.y() - start.y();
-        edge.x = (double)start.x();
-        edge.w = 1 / m;
-        edges.push_back(edge);
+            Edge edge;
+            edge.start = start;
+            edge.end = end;
+            edge.dy = end.y() - start.y();
+            edge.x = (double)start.x();
+            edge.w = 1 / m;
+            edges.push_back(edge);
+        }
     }
+    if (edges.isEmpty())
+        return;
 
     // Sort by y
-    std::sort(edges.begin(), edges.end(), [](Edge e1, Edge e2)
+    std::sort(edges.begin(), edges.end(), [](const Edge &e1, const Edge &e2)
               { return e1.start.y() < e2.start.y(); });
 
-    // qDebug() << "After sort\n";
-    // for (int i = 0; i < edges.size(); i++)
-    // {
-    //     qDebug() << "Edge " << i << ": start: (" << edges[i].start.x() << ", " << edges[i].start.y() << "), end:(" << edges[i].end.x() << ", " << edges[i].end.y() << "), dy: " << edges[i].dy << ", x: " << edges[i].x << ", w: " << edges[i].w << "\n";
-    // }
-
     int y_min = edges[0].start.y();
     int y_max = y_min;
     for (int i = 0; i < edges.size(); i++)
@@ -528,74 +1436,46 @@ void ViewerWidget::fillPolygon(QVector<QPoint> points, QColor color)
         }
     }
 
-    QVector<QList<Edge>> TH;
-    TH.resize(y_max - y_min + 1);
-    for (int i = 0; i < edges.size(); i++)
+    // Edges join the active list in the order of their first row
+    ArenaArray<Edge> ZAH(frameArena, edges.size());
+    int next = 0;
+    for (int y = y_min; y <= y_max; y++)
     {
-        qDebug() << "Edge " << i << ": start: (" << edges[i].start.x() << ", " << edges[i].start.y() << "), end:(" << edges[i].end.x() << ", " << edges[i].end.y() << "), dy: " << edges[i].dy << ", x: " << edges[i].x << ", w: " << edges[i].w << "\n";
-        qDebug() << "TH size: " << TH.size() << "\n";
-        TH[edges[i].start.y() - y_min].push_back(edges[i]);
-    }
-
-    QVector<Edge> ZAH;
-    double y = y_min;
-    for (int i = 0; i < TH.size(); i++)
-    {
-        if (TH[i].size() != 0)
+        while (next < edges.size() && edges[next].start.y() == y)
         {
-            for (int j = 0; j < TH[i].size(); j++)
-            {
-                ZAH.push_back(TH[i][j]);
-            }
+            ZAH.push_back(edges[next++]);
         }
-        std::sort(ZAH.begin(), ZAH.end(), [](Edge e1, Edge e2)
+        std::sort(ZAH.begin(), ZAH.end(), [](const Edge &e1, const Edge &e2)
                   { return e1.x < e2.x; });
 
         if (ZAH.size() % 2 != 0)
-        {
-            qDebug() << "ZAH size at i = " << i << ": " << ZAH.size() << "\n";
-            for (int i = 0; i < ZAH.size(); i++)
-            {
-                qDebug() << "Edge " << i << ": start: (" << ZAH[i].start.x() << ", " << ZAH[i].start.y() << "), end:(" << ZAH[i].end.x() << ", " << ZAH[i].end.y() << "), dy: " << ZAH[i].dy << ", x: " << ZAH[i].x << ", w: " << ZAH[i].w << "\n";
-            }
-            qDebug() << "ZAH";
             throw std::runtime_error("ZAH size is not even");
-        }
 
         for (int j = 0; j < ZAH.size(); j += 2)
         {
             if (ZAH[j].x != ZAH[j + 1].x)
             {
-                drawLine(QPoint(ZAH[j].x + 0.5, y), QPoint(ZAH[j + 1].x + 0.5, y), color, 0);
-                // drawLine(QPoint(ZAH[j].x, y), QPoint(ZAH[j + 1].x + 1, y), color, 0);
+                span(y, ZAH[j].x + 0.5, (int)(ZAH[j + 1].x + 0.5) + 1);
             }
         }
 
+        // Finished edges leave, the rest step to the next row
+        int kept = 0;
         for (int j = 0; j < ZAH.size(); j++)
         {
             if (ZAH[j].dy == 0)
-            {
-                ZAH.remove(j);
-                j--;
-            }
-            else
-            {
-                ZAH[j].x += ZAH[j].w;
-                ZAH[j].dy--;
-            }
+                continue;
+            ZAH[j].x += ZAH[j].w;
+            ZAH[j].dy--;
+            ZAH[kept++] = ZAH[j];
         }
-
-        y++;
+        ZAH.resize(kept);
     }
 }
-void ViewerWidget::fillTriangle(QVector<QPoint> points, QColor color)
+void ViewerWidget::scanTriangle(QPoint a, QPoint b, QPoint c, const SpanFunction &span)
 {
-    if (points.size() != 4)
-        throw std::runtime_error("fillTriangle called with points.size() != 4");
-
-    points.pop_back();
-
-    std::sort(points.begin(), points.end(), [](QPoint a, QPoint b)
+    QPoint points[3] = {a, b, c};
+    std::sort(points, points + 3, [](QPoint a, QPoint b)
               { 
         if (a.y() == b.y())
             return a.x() < b.x();
@@ -641,13 +1521,13 @@ void ViewerWidget::fillTriangle(QVector<QPoint> points, QColor color)
 
         if (points[1].x() < p.x())
         {
-            fillTriangle({points[0], points[1], p, points[0]}, color);
-            fillTriangle({points[1], p, points[2], points[1]}, color);
+            scanTriangle(points[0], points[1], p, span);
+            scanTriangle(points[1], p, points[2], span);
         }
         else
         {
-            fillTriangle({points[0], p, points[1], points[0]}, color);
-            fillTriangle({p, points[1], points[2], p}, color);
+            scanTriangle(points[0], p, points[1], span);
+            scanTriangle(p, points[1], points[2], span);
         }
         return;
     }
@@ -658,7 +1538,7 @@ void ViewerWidget::fillTriangle(QVector<QPoint> points, QColor color)
     {
         if (x1 != x2)
         {
-            drawLine(QPoint(x1 + 0.5, y), QPoint(x2 + 0.5, y), color, 0);
+            span(y, x1 + 0.5, (int)(x2 + 0.5) + 1);
         }
         x1 += e1.w;
         x2 += e2.w;
@@ -672,11 +1552,26 @@ void ViewerWidget::drawCircle(QColor color)
     if (circlePoints.size() != 2)
         return;
 
+    double radius = sqrt(pow(circlePoints[0].x() - circlePoints[1].x(), 2) + pow(circlePoints[0].y() - circlePoints[1].y(), 2));
+    drawCircle(circlePoints[0], radius, color);
+}
+void ViewerWidget::drawCircle(QPoint center, double radius, QColor color)
+{
+    ImageWrite write(this);
+    PixelFormat::dispatch(canvas->format(), [&](auto format)
+                          { drawCircle(center, radius, PixelFormat::Writer<decltype(format)>(*canvas, color)); });
+
+    const int extent = radius + 1;
+    touch(QRect(center - QPoint(extent, extent), center + QPoint(extent, extent)));
+}
+template <class Format>
+void ViewerWidget::drawCircle(QPoint center, double radius, const PixelFormat::Writer<Format> &writer)
+{
     auto draw_all_octagons = [=](QPoint point)
     {
-        point = point - circlePoints[0];
+        point = point - center;
 
-        QVector<QPoint> octagons = {
+        const QPoint octagons[8] = {
             point,
             QPoint(point.x(), -point.y()),
             QPoint(-point.x(), point.y()),
@@ -685,21 +1580,20 @@ void ViewerWidget::drawCircle(QColor color)
             QPoint(point.y(), -point.x()),
             QPoint(-point.y(), point.x()),
             QPoint(-point.y(), -point.x())};
-        for (auto octagon : octagons)
+        for (const QPoint &octagon : octagons)
         {
-            if (isInside(octagon + circlePoints[0]))
-                setPixel(octagon + circlePoints[0], color);
+            if (isInside(octagon + center))
+                writer.plot(octagon + center);
         }
     };
 
-    double radius = sqrt(pow(circlePoints[0].x() - circlePoints[1].x(), 2) + pow(circlePoints[0].y() - circlePoints[1].y(), 2));
     double p = 1 - radius;
     int x = 0, y = radius;
     int double_x = 3, double_y = 2 * radius - 2;
 
     while (x <= y)
     {
-        draw_all_octagons(QPoint(x, y) + circlePoints[0]);
+        draw_all_octagons(QPoint(x, y) + center);
 
         if (p > 0)
         {
@@ -711,8 +1605,6 @@ void ViewerWidget::drawCircle(QColor color)
         x++;
         double_x += 2;
     }
-
-    update();
 }
 
 // Draw Hermit
@@ -765,19 +1657,20 @@ void ViewerWidget::drawBezier(QColor color)
         drawLine(bezierPoints[i - 1], bezierPoints[i], QColor(Qt::red), rastAlg);
     }
 
-    QVector<QPoint> points = bezierPoints;
+    // de Casteljau in place over a copy of the control points
+    FrameArena::Scope scope(frameArena);
+    QPoint *points = frameArena.allocate<QPoint>(bezierPoints.size());
     double dt = 1. / (10 * bezierPoints.size());
-    QPoint Q_0 = points[0];
+    QPoint Q_0 = bezierPoints[0];
     for (double t = dt; t < 1; t += dt)
     {
-        points = bezierPoints;
-        while (points.size() > 1)
+        std::copy(bezierPoints.cbegin(), bezierPoints.cend(), points);
+        for (int n = bezierPoints.size(); n > 1; n--)
         {
-            for (int i = 1; i < points.size(); i++)
+            for (int i = 1; i < n; i++)
             {
                 points[i - 1] = (points[i - 1] * (1 - t) + points[i] * t);
             }
-            points.pop_back();
         }
         drawLine(Q_0, points[0], color, rastAlg);
         Q_0 = points[0];
@@ -856,6 +1749,13 @@ void ViewerWidget::translateObjects(QPoint new_location)
             translatePoint(polygonPoints[i], offset);
         }
     }
+    for (QVector<QPoint> &contour : shapeContours)
+    {
+        for (QPoint &point : contour)
+            translatePoint(point, offset);
+    }
+    for (Label &label : labels)
+        translatePoint(label.anchor, offset);
     if (circlePoints.size() > 0)
     {
         for (int i = 0; i < circlePoints.size(); i++)
@@ -884,6 +1784,7 @@ void ViewerWidget::translateObjects(QPoint new_location)
             translatePoint(coonsPoints[i], offset);
         }
     }
+    polylineOffset += offset;
     translateOrigin = new_location;
 
     drawAll();
@@ -914,6 +1815,15 @@ void ViewerWidget::scaleObjects(double scale_x, double scale_y)
             scalePoint(polygonPoints[i], center, scale_x, scale_y);
         }
     }
+    if (!shapeContours.isEmpty())
+    {
+        const QPoint center = shapeContours[0][0];
+        for (QVector<QPoint> &contour : shapeContours)
+        {
+            for (QPoint &point : contour)
+                scalePoint(point, center, scale_x, scale_y);
+        }
+    }
     if (linePoints.size() == 2)
     {
         scalePoint(linePoints[1], linePoints[0], scale_x, scale_y);
@@ -937,6 +1847,14 @@ void ViewerWidget::scaleObjects(double scale_x, double scale_y)
             scalePoint(coonsPoints[i], coonsPoints[0], scale_x, scale_y);
         }
     }
+    if (!polylines.isEmpty())
+    {
+        // About the middle of the image, where the view was fitted
+        const QPointF center(img->width() / 2., img->height() / 2.);
+        const QPointF offset = polylineOffset - center;
+        polylineOffset = center + QPointF(offset.x() * scale_x, offset.y() * scale_y);
+        polylineScale = QPointF(polylineScale.x() * scale_x, polylineScale.y() * scale_y);
+    }
     drawAll();
 }
 
@@ -970,6 +1888,15 @@ void ViewerWidget::rotateObjects(double angle, bool isDegrees, bool isClockwise)
             rotatePoint(polygonPoints[i], polygonPoints[0], angle, isDegrees, isClockwise);
         }
     }
+    if (!shapeContours.isEmpty())
+    {
+        const QPoint center = shapeContours[0][0];
+        for (QVector<QPoint> &contour : shapeContours)
+        {
+            for (QPoint &point : contour)
+                rotatePoint(point, center, angle, isDegrees, isClockwise);
+        }
+    }
     if (bezierPoints.size() >= 2)
     {
         for (int i = 1; i < bezierPoints.size(); i++)
@@ -1049,153 +1976,196 @@ void ViewerWidget::symmetryPolygon(unsigned int edge_index)
 
 //// Clipping ////
 
-// Cyrus-Beck
-void ViewerWidget::clipLine(QPoint start, QPoint end, QPoint &clip_start, QPoint &clip_end)
+void ViewerWidget::resetClipRegion()
+{
+    setClipRect(QRect(10, 10, img->width() - 20, img->height() - 20));
+}
+void ViewerWidget::setClipRect(QRect rect)
+{
+    clipper.setRect(rect & img->rect());
+    setClipGuardBand(clipGuardBand);
+}
+void ViewerWidget::setClipPolygon(const QVector<QPoint> &polygon)
+{
+    Clipper imageClip;
+    imageClip.setRect(img->rect());
+    clipper.setConvexPolygon(imageClip.clipPolygon(polygon));
+    setClipGuardBand(clipGuardBand);
+}
+void ViewerWidget::setClipGuardBand(int margin)
 {
-    if (!isInside(start) && !isInside(end))
+    // The guard band never reaches past the image, so unclipped primitives stay writable
+    clipGuardBand = margin;
+    if (margin > 0)
+        clipper.setGuardBand(clipper.bounds().adjusted(-margin, -margin, margin, margin) & img->rect());
+    else
+        clipper.setGuardBand(QRect());
+}
+
+bool ViewerWidget::clipLine(QPoint start, QPoint end, QPoint &clip_start, QPoint &clip_end)
+{
+    clip_start = start;
+    clip_end = end;
+    if (!clipper.clipLine(clip_start, clip_end))
     {
         clip_start = QPoint(0, 0);
         clip_end = QPoint(0, 0);
-        return;
-    }
-    if (isInside(start) && isInside(end))
-    {
-        clip_start = start;
-        clip_end = end;
-        return;
+        return false;
     }
+    return true;
+}
 
-    double tl = 0, tu = 1;
-    QPoint d = end - start;
-
-    QVector<QPoint> E = {QPoint(10, 10), QPoint(10, height() - 10), QPoint(width() - 10, height() - 10), QPoint(width() - 10, 10)};
+void ViewerWidget::delete_objects()
+{
+    linePoints.clear();
+    polygonPoints.clear();
+    shapeContours.clear();
+    labels.clear();
+    circlePoints.clear();
+    hermitData.clear();
+    bezierPoints.clear();
+    coonsPoints.clear();
+    polylines.clear();
+    polylineLevel = -1;
+    update();
+    updatePreview();
+}
 
-    for (int i = 0; i < 4; i++)
+void ViewerWidget::clear()
+{
+    ImageWrite write(this);
+    // Only the active layer, the bottom one turns white and the others transparent
+    // Tiles nobody drew on are blank already, the region table keeps their sums
+    QRect cleared;
+    for (const QRect &tile : layers.clear(activeLayer))
     {
-        QPoint n = E[(i + 1) % 4] - E[i];
-        n = QPoint(n.y(), -n.x());
-        QPoint w = start - E[i];
-        double dn = QPoint::dotProduct(n, d);
-        double wn = QPoint::dotProduct(n, w);
-        if (dn != 0)
-        {
-            double t = -wn / dn;
-            if (dn > 0 && t <= 1)
-            {
-                if (tl < t)
-                    tl = t;
-            }
-            else if (dn < 0 && 0 <= t)
-            {
-                if (tu > t)
-                    tu = t;
-            }
-        }
+        regionTable.invalidate(tile);
+        cleared |= tile;
     }
+    backgroundChanged(cleared);
+    update(cleared);
+}
+
+//// Overlay ////
 
-    if (tl == 0 && tu == 1)
+void ViewerWidget::touch(const QRect &area)
+{
+    if (previewing)
     {
-        clip_start = start;
-        clip_end = end;
+        overlayDirty |= area & overlay.rect();
     }
-    else if (tl < tu)
+    else
     {
-        clip_start = start + d * tl;
-        clip_end = start + d * tu;
+        layers.changed(activeLayer, area);
+        regionTable.invalidate(area);
+        backgroundChanged(area);
+        update(area);
     }
-    // printf("clip_start: %d %d", clip_start.x(), clip_start.y());
-    // printf("clip_end: %d %d", clip_end.x(), clip_end.y());
 }
-
-// Sutherland-Hodgman
-QVector<QPoint> ViewerWidget::clipPolygonLeftSide(QVector<QPoint> polygon, int x_min)
+void ViewerWidget::setPreviewCursor(QPoint cursor)
+{
+    previewCursor = cursor;
+    previewCursorValid = true;
+    if (isDrawingObject())
+        updatePreview();
+}
+void ViewerWidget::hidePreviewCursor()
 {
-    if (polygon.size() == 0)
-        return polygon;
-    polygon.removeLast();
-    QVector<QPoint> result;
-    QPoint S = polygon[polygon.size() - 1];
+    previewCursorValid = false;
+    updatePreview();
+}
+void ViewerWidget::updatePreview()
+{
+    if (isEmpty() || (!isDrawingObject() && overlayDirty.isEmpty()))
+        return;
 
-    for (int i = 0; i < polygon.size(); i++)
+    if (overlay.size() != img->size())
     {
-        if (polygon[i].x() >= x_min)
-        {
-            if (S.x() >= x_min)
-            {
-                result.push_back(polygon[i]);
-            }
-            else
-            {
-                QPoint P = QPoint(x_min,
-                                  S.y() + (x_min - S.x()) * (polygon[i].y() - S.y()) / (polygon[i].x() - S.x()));
-                result.push_back(P);
-                result.push_back(polygon[i]);
-            }
-        }
-        else
-        {
-            if (S.x() >= x_min)
-            {
-                QPoint P = QPoint(x_min,
-                                  S.y() + (x_min - S.x()) * (polygon[i].y() - S.y()) / (polygon[i].x() - S.x()));
-                result.push_back(P);
-            }
-        }
-        S = polygon[i];
+        overlay = QImage(img->size(), QImage::Format_ARGB32_Premultiplied);
+        overlay.fill(Qt::transparent);
+        overlayDirty = QRect();
     }
-    result.push_back(result[0]);
-    return result;
-}
-QVector<QPoint> ViewerWidget::clipPolygon(QVector<QPoint> polygon)
-{
-    if (!isPolygonInside(polygon))
-        return QVector<QPoint>();
 
-    QVector<QPoint> E = {QPoint(10, 10), QPoint(width() - 10, 10), QPoint(width() - 10, height() - 10), QPoint(10, height() - 10)};
+    // Only what the last preview drew is cleared, the rest of the overlay is transparent
+    const QRect previous = overlayDirty;
+    for (int y = previous.top(); y <= previous.bottom(); y++)
+    {
+        quint32 *line = reinterpret_cast<quint32 *>(overlay.scanLine(y));
+        std::fill(line + previous.left(), line + previous.right() + 1, 0);
+    }
+    overlayDirty = QRect();
 
-    QVector<QPoint> result = polygon;
+    canvas = &overlay;
+    previewing = true;
+    drawPreview();
+    previewing = false;
+    canvas = img;
 
-    for (int i = 0; i < 4; i++)
-    {
-        if (result.size() == 0)
-            return QVector<QPoint>();
+    update(previous | overlayDirty);
+}
+void ViewerWidget::drawPreview()
+{
+    const bool cursor = previewCursorValid;
 
-        result = clipPolygonLeftSide(result, E[i].x());
+    if (drawLineActivated && linePoints.size() == 1 && cursor)
+        drawLine(linePoints[0], previewCursor, globalColor, rastAlg);
 
-        for (int i = 0; i < result.size(); i++)
-        {
-            result[i] = QPoint(result[i].y(), -result[i].x());
-        }
-        for (int i = 0; i < E.size(); i++)
+    if (drawPolygonActivated && !polygonPoints.isEmpty())
+    {
+        for (int i = 1; i < polygonPoints.size(); i++)
+            drawLine(polygonPoints[i - 1], polygonPoints[i], globalColor, rastAlg);
+        if (cursor)
         {
-            E[i] = QPoint(E[i].y(), -E[i].x());
+            drawLine(polygonPoints.last(), previewCursor, globalColor, rastAlg);
+            if (polygonPoints.size() > 1)
+                drawLine(previewCursor, polygonPoints[0], globalColor, rastAlg);
         }
     }
 
-    return clipPolygonLeftSide(result, E[0].x());
-}
-
-void ViewerWidget::delete_objects()
-{
-    linePoints.clear();
-    polygonPoints.clear();
-    circlePoints.clear();
-    hermitData.clear();
-    bezierPoints.clear();
-    coonsPoints.clear();
-    update();
-}
+    if (drawCircleActivated && circlePoints.size() == 1 && cursor)
+    {
+        QPoint radius = previewCursor - circlePoints[0];
+        drawCircle(circlePoints[0], sqrt(pow(radius.x(), 2) + pow(radius.y(), 2)), globalColor);
+    }
 
-void ViewerWidget::clear()
-{
-    img->fill(Qt::white);
-    update();
+    // Curves are drawn as if the cursor were their next point
+    if (drawHermitActivated)
+    {
+        if (cursor)
+            addHermitPoint(previewCursor, QPoint(0, 150));
+        drawHermit(globalColor);
+        if (cursor)
+            hermitData.pop_back();
+    }
+    if (drawBezierActivated)
+    {
+        if (cursor)
+            bezierPoints.push_back(previewCursor);
+        drawBezier(globalColor);
+        if (cursor)
+            bezierPoints.pop_back();
+    }
+    if (drawCoonsActivated)
+    {
+        if (cursor)
+            coonsPoints.push_back(previewCursor);
+        drawCoons(globalColor);
+        if (cursor)
+            coonsPoints.pop_back();
+    }
 }
 
 // Slots
 void ViewerWidget::paintEvent(QPaintEvent *event)
 {
+    flushSession();
+
     QPainter painter(this);
     QRect area = event->rect();
-    painter.drawImage(area, *img, area);
+    layers.paint(painter, area);
+
+    // The overlay is transparent outside its dirty rectangle
+    QRect preview = area & overlayDirty;
+    if (!preview.isEmpty())
+        painter.drawImage(preview, overlay, preview);
 }
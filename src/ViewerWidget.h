@@ -2,13 +2,36 @@
 #include <QtWidgets>
 
 #include <float.h>
+#include <functional>
+
+#include "Clipper.h"
+#include "FloodFill.h"
+#include "FrameArena.h"
+#include "GlyphAtlas.h"
+#include "HalfSpace.h"
+#include "PaintSource.h"
+#include "ImageTransform.h"
+#include "LayerStack.h"
+#include "OcclusionMask.h"
+#include "PixelFormat.h"
+#include "PolygonBoolean.h"
+#include "PolylineSet.h"
+#include "SessionCanvas.h"
+#include "SharedCanvas.h"
+#include "SummedArea.h"
+#include "Triangulation.h"
 
 class ViewerWidget : public QWidget
 {
     Q_OBJECT
 private:
     QSize areaSize = QSize(0, 0);
+    // The document, img is the active layer's image
+    LayerStack layers;
+    int activeLayer = 0;
     QImage *img = nullptr;
+    // Where the rasterizers draw, the image unless a preview renders into the overlay
+    QImage *canvas = nullptr;
     QPainter *painter = nullptr;
     uchar *data = nullptr;
 
@@ -36,7 +59,144 @@ private:
     bool isTranslating = false;
     QPoint translateOrigin = QPoint(0, 0);
 
+    Clipper clipper;
+    int clipGuardBand = 0;
+    void resetClipRegion();
+
+    void bindLayer(int index);
+
+    // Background layer pixels in shared memory. The GUI thread holds the write side
+    // only while an ImageWrite is alive, that is while it rasterizes into them.
+    SharedCanvas sharedCanvas;
+    bool sharedDirty = false;
+    bool mapLayers(const std::function<QImage(const QImage &)> &function);
+    void documentResized();
+
+    // Background layer pixels mapped from a session file, the rows changed since
+    // the last repaint are handed to its flusher
+    SessionCanvas sessionCanvas;
+    QRect sessionDirty;
+    bool mapSession(const QString &file_name);
+    // After the background was replaced, emits sessionLost when the file can not follow
+    void moveSession();
+    void flushSession();
+
+    void backgroundChanged(const QRect &area)
+    {
+        if (activeLayer != 0)
+            return;
+        sharedDirty = true;
+        sessionDirty |= area;
+    }
+
+    PaintSource::Type fillType = PaintSource::Solid;
+    QColor fillEndColor = Qt::white;
+    QImage fillTexture;
+    QGradientStops fillStops = {QGradientStop(0, Qt::blue), QGradientStop(1, Qt::white)};
+
+    // Scratch of the drawing functions, released by the scope that allocated it
+    FrameArena frameArena;
+
+    // Objects being drawn and their rubber bands to the cursor, composited over the
+    // image in paintEvent. Previews clear and repaint only the overlay's dirty rectangle.
+    QImage overlay;
+    QRect overlayDirty;
+    QPoint previewCursor;
+    bool previewCursorValid = false;
+    bool previewing = false;
+    void touch(const QRect &area);
+    void drawPreview();
+
+    // Scan conversion hands unclipped rows to span(y, x_start, x_end), x_end exclusive.
+    // Both rounded edge pixels of a row are filled, as drawLine did.
+    // Refers to the caller's callable without copying it, so scanning never allocates
+    class SpanFunction
+    {
+    public:
+        template <class Function, class = std::enable_if_t<!std::is_same<std::decay_t<Function>, SpanFunction>::value>>
+        SpanFunction(Function &&function)
+            : object((void *)&function), call([](void *object, int y, int x_start, int x_end)
+                                             { (*static_cast<std::remove_reference_t<Function> *>(object))(y, x_start, x_end); }) {}
+        void operator()(int y, int x_start, int x_end) const { call(object, y, x_start, x_end); }
+
+    private:
+        void *object;
+        void (*call)(void *, int, int, int);
+    };
+    // Contours are filled by the even-odd rule, as one region
+    void scanPolygon(const PolygonBoolean::Contours &contours, const SpanFunction &span);
+    void scanTriangle(QPoint a, QPoint b, QPoint c, const SpanFunction &span);
+    template <class Scan>
+    void paintSpans(const PaintSource &source, Scan &&scan);
+
+    // Polygons are triangulated once per change of their points and the
+    // triangles filled by half-space blocks instead of scanlines
+    bool halfSpaceFill = false;
+    Triangulation::Cache polygonTriangulation;
+    // Scanlines fill the polygon's self-intersections resolved into simple contours
+    PolygonBoolean::Cache polygonResolution;
+
+    // Region built from finished polygons by Boolean operations, it moves with the other objects
+    PolygonBoolean::Contours shapeContours;
+
+    // Stacking order of drawAll, back to front. Fills overwrite every pixel they
+    // cover, so the tiles under a filled object are left out of those behind it.
+    // Objects drawn outside drawAll are on top of everything.
+    enum Depth
+    {
+        PolylineDepth,
+        ShapeDepth,
+        LineDepth,
+        PolygonDepth,
+        TopDepth
+    };
+    OcclusionMask occlusion;
+    int cullDepth = TopDepth;
+    // Front to back pass over the filled objects
+    void coverOcclusion();
+
+    // Text labels are laid out once, redraws blit their glyphs from the atlas
+    struct Label
+    {
+        QPoint anchor; // left end of the baseline
+        QColor color;
+        QString text;
+        GlyphAtlas::Run run;
+    };
+    QVector<Label> labels;
+    GlyphAtlas glyphAtlas;
+    QFont labelFont;
+
+    // Integral image of the active layer, built by the first region query. Drawing
+    // marks its tiles stale and the next query sums only those again.
+    SummedArea regionTable;
+
+    // Imported polylines keep their own coordinates, pixel = coordinate * polylineScale
+    // + polylineOffset. Moving and scaling the objects changes the mapping, and every
+    // redraw picks the coarsest level of detail that is within a pixel of the data.
+    PolylineSet polylines;
+    QPointF polylineScale = QPointF(1, -1); // negative y, the data's y axis points up
+    QPointF polylineOffset;
+    int polylineLevel = -1; // level of the last redraw
+
 public:
+    // Measured over the last drawAll
+    struct FrameStats
+    {
+        qint64 allocations = -1; // calls of operator new, -1 unless counted
+        int arenaBlocks = 0;     // heap blocks the frame arena had to add
+        size_t scratchBytes = 0; // peak use of the frame arena
+        quint64 paintedPixels = 0; // by fills and lines, overdraw is this over the canvas area
+        quint64 culledPixels = 0;  // of spans and lines hidden under filled objects in front
+        int culledObjects = 0;     // objects and segments left out whole
+        int occludedTiles = 0;     // painted over by filled objects
+    };
+
+private:
+    FrameStats frameStats;
+
+public:
+
     ViewerWidget(QSize imgSize, QWidget *parent = Q_NULLPTR);
     ~ViewerWidget();
     void resizeWidget(QSize size);
@@ -46,34 +206,137 @@ public:
 
     // Image functions
     bool setImage(const QImage &inputImg);
+    // A frame of a sequence replaces the background layer, layers above it stay
+    void showFrame(QImage frame);
     QImage *getImage() { return img; };
     bool isEmpty();
-    bool changeSize(int width, int height);
+    // Raster transforms resample the pixels, the vector objects stay where they are
+    bool changeSize(int width, int height, ImageTransform::Filter filter = ImageTransform::Bilinear);
+    bool transformImage(const QTransform &transform, ImageTransform::Filter filter);
+    bool flipImage(bool horizontal, bool vertical);
+
+    // Layers, numbered bottom up. Drawing, filters and clear() work on the active one.
+    const LayerStack &getLayers() { return layers; }
+    int getActiveLayer() { return activeLayer; }
+    void setActiveLayer(int index);
+    int addLayer(const QString &name);
+    void removeLayer(int index);
+    void setLayerVisible(int index, bool visible);
+    void setLayerOpacity(int index, double opacity);
+    void setLayerBlend(int index, LayerStack::Blend blend);
+    QImage flattenedImage() { return layers.flattened(); }
+    // Pixels of the active layer were changed through getImage(), a null area means all of them
+    void imageChanged(const QRect &area = QRect());
+    // Held while pixels of the active layer change. On a shared background it holds
+    // the segment's write side, readers see the changes when the outermost one ends.
+    // Drawing functions take their own, edits through getImage() take one around
+    // the edit and its imageChanged().
+    class ImageWrite
+    {
+    public:
+        explicit ImageWrite(ViewerWidget *widget);
+        ~ImageWrite();
+        ImageWrite(const ImageWrite &) = delete;
+        ImageWrite &operator=(const ImageWrite &) = delete;
+
+    private:
+        ViewerWidget *widget;
+        bool holding;
+    };
+    // A blank background is transparent over white paper that takes no memory.
+    // Edits that read or rewrite every pixel through getImage() lay it in first.
+    void settlePaper()
+    {
+        if (!isEmpty() && layers.layer(activeLayer).paper)
+        {
+            layers.settlePaper(activeLayer);
+            regionTable.invalidate(img->rect());
+        }
+    }
+
+    // Shared canvas, the background layer lives in shared memory under key. An
+    // existing segment is attached to and its pixels become the background,
+    // otherwise one is created holding the current background. Loading an image
+    // or changing the document size ends the sharing.
+    bool shareCanvas(const QString &key);
+    void unshareCanvas();
+    bool isCanvasShared() { return sharedCanvas.isOpen(); }
+    const SharedCanvas &getSharedCanvas() { return sharedCanvas; }
+
+    // Session file, the background layer lives in a memory-mapped file written
+    // back as it changes. An existing session file is reopened and its pixels
+    // become the background, otherwise one is created holding the current
+    // background. Loading an image or resizing rewrites the session at the new
+    // size, sharing the canvas ends it.
+    bool openSession(const QString &file_name);
+    void closeSession();
+    bool isSessionOpen() { return sessionCanvas.isOpen(); }
+    const SessionCanvas &getSessionCanvas() { return sessionCanvas; }
 
     void setPixel(int x, int y, uchar r, uchar g, uchar b, uchar a = 255);
     void setPixel(int x, int y, double valR, double valG, double valB, double valA = 1.);
     void setPixel(int x, int y, const QColor &color);
     void setPixel(QPoint point, const QColor &color) { setPixel(point.x(), point.y(), color); }
-    bool isInside(int x, int y) { return (x >= 10 && y >= 10 && x < img->width() - 10 && y < img->height() - 10) ? true : false; }
-    bool isInside(QPoint point) { return isInside(point.x(), point.y()); }
-    bool isPolygonInside(QVector<QPoint> polygon);
+    // Plots the points inside the clip region and marks them changed once, for many pixels
+    // instead of a setPixel each
+    void setPixels(const QPoint *points, int count, const QColor &color);
+    void setPixels(const QVector<QPoint> &points, const QColor &color) { setPixels(points.constData(), points.size(), color); }
+    bool isInside(int x, int y) { return clipper.isInside(x, y); }
+    bool isInside(QPoint point) { return clipper.isInside(point); }
+    bool isPolygonInside(const QVector<QPoint> &polygon) { return !clipper.rejects(polygon); }
 
     //// Drawing ////
 
     void drawAll() { drawAll(globalColor, rastAlg); }
     void drawAll(QColor color, unsigned int algType);
+    const FrameStats &getFrameStats() { return frameStats; }
 
     // Line
     void drawLine(QColor color, int algType);
     void drawLine(QPoint start, QPoint end, QColor color, int algType);
 
+    // Primitive batches in structure-of-arrays layout. Segment i runs from
+    // (x0[i], y0[i]) to (x1[i], y1[i]), colors is null or holds one color per item.
+    struct SegmentBatch
+    {
+        const int *x0 = nullptr, *y0 = nullptr, *x1 = nullptr, *y1 = nullptr;
+        const QRgb *colors = nullptr;
+        int count = 0;
+    };
+    struct PointBatch
+    {
+        const int *x = nullptr, *y = nullptr;
+        const QRgb *colors = nullptr;
+        int count = 0;
+    };
+    // Outcodes are computed for chunks of 1024 items into frame arena scratch,
+    // items entirely off the clip region are culled, and the survivors go straight
+    // to the line kernel with a single update of their union. Returns the number
+    // of items drawn.
+    int drawLines(const SegmentBatch &batch, QColor color, int algType);
+    int drawPoints(const PointBatch &batch, QColor color);
+
     void DDA(QPoint start, QPoint end, QColor color);
-    void DDA_x(QPoint start, QPoint end, QColor color, double m);
-    void DDA_y(QPoint start, QPoint end, QColor color, double w);
+    template <class Format>
+    void DDA(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer);
+    template <class Format>
+    void DDA_x(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double m);
+    template <class Format>
+    void DDA_y(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double w);
 
     void Bresenhamm(QPoint start, QPoint end, QColor color);
-    void Bresenhamm_x(QPoint start, QPoint end, QColor color, double m);
-    void Bresenhamm_y(QPoint start, QPoint end, QColor color, double m);
+    template <class Format>
+    void Bresenhamm(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer);
+    template <class Format>
+    void Bresenhamm_x(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double m);
+    template <class Format>
+    void Bresenhamm_y(QPoint start, QPoint end, const PixelFormat::Writer<Format> &writer, double m);
+
+    // Horizontal span [x_start, x_end) on row y, clipped to the clip region
+    void drawSpan(int y, int x_start, int x_end, QColor color);
+
+    // Fills the region around seed whose colors are within tolerance of the seed pixel
+    FloodFill::Stats floodFill(QPoint seed, QColor color, int tolerance, bool eight_connected);
 
     void setLineBegin(QPoint begin) { linePoints.push_back(begin); }
     QPoint getLineBegin() { return linePoints.at(0); }
@@ -91,8 +354,51 @@ public:
     void endPolygonDraw();
     void drawPolygon() { drawPolygon(globalColor, rastAlg); }
     void drawPolygon(QColor color, int algType);
-    void fillPolygon(QVector<QPoint> points, QColor color);
-    void fillTriangle(QVector<QPoint> points, QColor color);
+    void fillPolygon(const QVector<QPoint> &points, QColor color) { fillPolygon(points, PaintSource(color)); }
+    void fillPolygon(const QVector<QPoint> &points, const PaintSource &source);
+    void fillTriangle(const QVector<QPoint> &points, QColor color) { fillTriangle(points, PaintSource(color)); }
+    void fillTriangle(const QVector<QPoint> &points, const PaintSource &source);
+
+    // Polygon fill style, gradients run from color to end_color and gradients and
+    // textures are laid over the polygon's bounding box
+    void setFillStyle(PaintSource::Type type, QColor end_color, const QImage &texture = QImage());
+    PaintSource::Type getFillType() { return fillType; }
+    QColor getFillEndColor() { return fillEndColor; }
+    PaintSource polygonFill(const QVector<QPoint> &polygon, QColor color) { return polygonFill(polygon.constData(), polygon.size(), color); }
+    PaintSource polygonFill(const QPoint *polygon, int count, QColor color);
+    // One color per point in the frame arena, valid until the caller's scope ends
+    const QColor *vertexColors(const QVector<QPoint> &polygon, QColor color) { return vertexColors(polygon.constData(), polygon.size(), color); }
+    const QColor *vertexColors(const QPoint *polygon, int count, QColor color);
+
+    // Triangles are index triples into points, filled by the half-space rasterizer
+    void setHalfSpaceFill(bool enabled) { halfSpaceFill = enabled; }
+    void fillTriangles(const QVector<QPoint> &points, const QVector<int> &triangles, const PaintSource &source);
+    void fillTriangles(const QVector<QPoint> &points, const QVector<int> &triangles, const QColor *colors);
+
+    // Combines the shape with the finished polygon, which it then replaces. The
+    // first polygon becomes the shape whatever the operation.
+    bool combinePolygon(PolygonBoolean::Operation operation);
+    const PolygonBoolean::Contours &getShape() { return shapeContours; }
+    void drawShape(QColor color, int algType);
+
+    // Text labels in the label font, anchored at the left end of their baseline
+    void setLabelFont(const QFont &font) { labelFont = font; }
+    QFont getLabelFont() { return labelFont; }
+    void addLabel(QPoint anchor, const QString &text, QColor color);
+    int getLabelCount() { return labels.size(); }
+    const GlyphAtlas &getGlyphAtlas() { return glyphAtlas; }
+    // Labels from first on
+    void drawLabels(int first = 0);
+
+    // Luminance mean, variance and coverage of the active layer inside rect
+    SummedArea::Region regionStatistics(const QRect &rect);
+
+    // Imported polylines, fitted to the clip region
+    bool importPolylines(const QString &file_name, QString &error, const PolylineSet::Progress &progress = PolylineSet::Progress());
+    const PolylineSet &getPolylines() { return polylines; }
+    int getPolylineLevel() { return polylineLevel; }
+    void fitPolylines();
+    void drawPolylines(QColor color, int algType);
 
     // Circle
     void setDrawCircleActivated(bool state) { drawCircleActivated = state; }
@@ -100,6 +406,9 @@ public:
     void setCircleCenter(QPoint center) { circlePoints.push_back(center); }
     void setCirclePoint(QPoint point) { circlePoints.push_back(point); }
     void drawCircle(QColor color);
+    void drawCircle(QPoint center, double radius, QColor color);
+    template <class Format>
+    void drawCircle(QPoint center, double radius, const PixelFormat::Writer<Format> &writer);
 
     // Hermit
     void setDrawHermitActivated(bool state) { drawHermitActivated = state; }
@@ -109,7 +418,7 @@ public:
         QVector<QPoint> t = {point, tangent};
         hermitData.push_back(t);
     }
-    QVector<QVector<QPoint>> getHermitData() { return hermitData; }
+    const QVector<QVector<QPoint>> &getHermitData() { return hermitData; }
     void editHermitPointTangent(unsigned int index, QPoint new_tangent)
     {
         if (hermitData.size() > index)
@@ -161,12 +470,16 @@ public:
 
     //// Clipping ////
 
-    // Cyrus-Beck
-    void clipLine(QPoint start, QPoint end, QPoint &clip_start, QPoint &clip_end);
+    void setClipRect(QRect rect);
+    void setClipPolygon(const QVector<QPoint> &polygon);
+    void setClipGuardBand(int margin);
+    const Clipper &getClipper() { return clipper; }
+
+    // Liang-Barsky / Cyrus-Beck
+    bool clipLine(QPoint start, QPoint end, QPoint &clip_start, QPoint &clip_end);
 
     // Sutherland-Hodgman
-    QVector<QPoint> clipPolygonLeftSide(QVector<QPoint> polygon, int x_min);
-    QVector<QPoint> clipPolygon(QVector<QPoint> polygon);
+    const QVector<QPoint> &clipPolygon(const QVector<QPoint> &polygon) { return clipper.clipPolygon(polygon); }
 
     // Get/Set functions
     uchar *getData() { return data; }
@@ -178,9 +491,20 @@ public:
 
     bool getIsTranslating() { return isTranslating; }
 
+    // Overlay
+    bool isDrawingObject() { return drawLineActivated || drawPolygonActivated || drawCircleActivated || drawHermitActivated || drawBezierActivated || drawCoonsActivated; }
+    void setPreviewCursor(QPoint cursor);
+    void hidePreviewCursor();
+    void updatePreview();
+
     void delete_objects();
     void clear();
 
+signals:
+    // The session file could not take the resized background, the session is closed
+    // and the file holds the last state it could
+    void sessionLost(QString error);
+
 public slots:
     void paintEvent(QPaintEvent *event) Q_DECL_OVERRIDE;
 };
@@ -1,4 +1,5 @@
 #include "ImageViewer.h"
+#include "ImageCompare.h"
 #include <QtWidgets/QApplication>
 
 int main(int argc, char *argv[])
@@ -9,7 +10,99 @@ int main(int argc, char *argv[])
 	QCoreApplication::setApplicationName("ImageViewer");
 
 	QApplication a(argc, argv);
+
+	// With --replay the recording runs once and the latencies go to stdout,
+	// so it can run headless with -platform offscreen
+	QCommandLineParser parser;
+	parser.addHelpOption();
+	QCommandLineOption replay("replay", "Replay an input recording, print the event latencies and exit.", "file");
+	QCommandLineOption fast("fast", "Replay without the recorded pauses.");
+	QCommandLineOption share("share", "Share the canvas in shared memory under key.", "key");
+	parser.addOption(replay);
+	parser.addOption(fast);
+	parser.addOption(share);
+
+	// With --compare the metrics go to stdout and the exit code says whether
+	// the thresholds passed, for batch regression checks against golden images
+	QCommandLineOption compare("compare", "Compare the image argument with reference, print the metrics and exit.", "reference");
+	QCommandLineOption heatmap("heatmap", "Save the difference heat map of --compare to file.", "file");
+	QCommandLineOption gain("gain", "Gain of the heat map, 8 by default.", "factor", "8");
+	QCommandLineOption min_psnr("min-psnr", "Fail --compare below this PSNR over all channels.", "dB");
+	QCommandLineOption min_ssim("min-ssim", "Fail --compare below this SSIM.", "value");
+	parser.addOptions({compare, heatmap, gain, min_psnr, min_ssim});
+	parser.addPositionalArgument("image", "Image to compare with the --compare reference.");
+	parser.process(a);
+
+	if (parser.isSet(compare))
+	{
+		const QStringList images = parser.positionalArguments();
+		if (images.size() != 1)
+		{
+			QTextStream(stderr) << "--compare needs one image to compare with the reference\n";
+			return 2;
+		}
+		// A mistyped threshold must not turn into 0 and pass every image
+		bool numbers_valid = true;
+		auto number = [&](const QCommandLineOption &option)
+		{
+			bool ok = false;
+			const double value = parser.value(option).toDouble(&ok);
+			if (!ok)
+			{
+				QTextStream(stderr) << "--" << option.names().first() << " needs a number, not " << parser.value(option) << "\n";
+				numbers_valid = false;
+			}
+			return value;
+		};
+		const double gain_factor = number(gain);
+		const double psnr_threshold = parser.isSet(min_psnr) ? number(min_psnr) : 0;
+		const double ssim_threshold = parser.isSet(min_ssim) ? number(min_ssim) : 0;
+		if (!numbers_valid)
+		{
+			return 2;
+		}
+		QImage reference(parser.value(compare)), image(images[0]);
+		ImageCompare::Metrics metrics;
+		if (!ImageCompare::compare(image, reference, metrics))
+		{
+			QTextStream(stderr) << "Unable to compare " << images[0] << " with " << parser.value(compare) << "\n";
+			return 2;
+		}
+		QTextStream(stdout) << ImageCompare::report(metrics);
+		if (parser.isSet(heatmap) && !ImageCompare::differenceMap(image, reference, gain_factor).save(parser.value(heatmap)))
+		{
+			QTextStream(stderr) << "Unable to save the heat map to " << parser.value(heatmap) << "\n";
+			return 2;
+		}
+		bool passed = true;
+		if (parser.isSet(min_psnr) && metrics.psnrAll < psnr_threshold)
+		{
+			passed = false;
+		}
+		if (parser.isSet(min_ssim) && !(metrics.ssim >= ssim_threshold))
+		{
+			passed = false;
+		}
+		QTextStream(stdout) << (passed ? "PASS" : "FAIL") << "\n";
+		return passed ? 0 : 1;
+	}
+
 	ImageViewer w;
 	w.show();
+	if (parser.isSet(share) && !w.shareCanvas(parser.value(share)))
+	{
+		QTextStream(stderr) << "Unable to share the canvas as " << parser.value(share) << "\n";
+	}
+	if (parser.isSet(replay))
+	{
+		QString report;
+		if (!w.replayInput(parser.value(replay), !parser.isSet(fast), report))
+		{
+			QTextStream(stderr) << "Unable to read input recording " << parser.value(replay) << "\n";
+			return 1;
+		}
+		QTextStream(stdout) << report;
+		return 0;
+	}
 	return a.exec();
 }
\ No newline at end of file